@@ -13,6 +13,7 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
@@ -26,11 +27,13 @@
 #include <sys/mman.h>
 #include <sys/interrupt.h>
 #include <sys/file.h>
+#include <sys/time.h>
 #include <posix/utils.h>
 
 #include <phoenix/arch/imx6ull.h>
 
 #include "sdma-api.h"
+#include "ocram.h"
 
 #if 0
 #define COL_RED     "\033[1;31m"
@@ -63,6 +66,16 @@
 
 #define MAIN_THD_PRIO           (2)
 
+#define BENCH_THD_PRIO          (4)
+#define BENCH_THD_STACK         (4096)
+
+/* Memory to memory copy service */
+#define SDMA_COPY_CHANNEL       (NUM_OF_SDMA_CHANNELS - 1)
+#define SDMA_COPY_BD_CNT        (256)
+#define SDMA_COPY_PRIORITY      (SDMA_CHANNEL_PRIORITY_MIN)
+#define SDMA_COPY_TIMEOUT_US    (1000*1000)
+#define SDMA_COPY_MIN           (64) /* Shorter ranges are copied by the CPU */
+
 /* Buffer Descriptor Commands for Bootload scripts */
 #define SDMA_CMD_C0_SET_DM                      (0x1)
 #define SDMA_CMD_C0_GET_DM                      (0x2)
@@ -136,15 +149,19 @@ typedef struct {
 
 	handle_t intr_cond;
 	unsigned intr_cnt;
+	unsigned intr_read_cnt; /* Value of intr_cnt reported by the last read */
 	unsigned missed_intr_cnt;
 
 	unsigned read_cnt;
+
+	unsigned open_cnt;
 } sdma_channel_t;
 
 struct driver_common_s
 {
 	char worker_thd_stack[NUM_OF_WORKER_THREADS][WORKER_THD_STACK] __attribute__ ((aligned(8)));
 	char stats_thd_stack[STATS_THD_STACK] __attribute__ ((aligned(8)));
+	char bench_thd_stack[BENCH_THD_STACK] __attribute__ ((aligned(8)));
 
 	uint32_t port;
 
@@ -163,7 +180,7 @@ struct driver_common_s
 	handle_t intr_cond;
 	handle_t lock;
 
-	addr_t ocram_next;
+	ocram_t ocram;
 
 	int stats_period_s;
 	int use_syslog;
@@ -174,6 +191,16 @@ struct driver_common_s
 	const char *dump_dir;
 
 	uint32_t active_mask;
+
+	struct {
+		int channel; /* 0 - service disabled */
+		handle_t lock; /* Serializes batches */
+
+		unsigned batch_cnt;
+		unsigned fail_cnt;
+		unsigned long long dma_bytes;
+		unsigned long long cpu_bytes;
+	} copy;
 } common;
 
 static void log_printf(int lvl, const char* fmt, ...)
@@ -283,20 +310,7 @@ static int sdma_context_dump(uint8_t channel_id, sdma_context_t *context)
 }
 
 #define OCRAM_BASE              (0x900000)
-#define OCRAM_END               (0x920000)
-
-addr_t sdma_ocram_alloc(size_t size)
-{
-	unsigned n = (size + SIZE_PAGE - 1)/SIZE_PAGE;
-	addr_t paddr = 0;
-
-	if (common.ocram_next + n*SIZE_PAGE <= OCRAM_END) {
-		paddr = common.ocram_next;
-		common.ocram_next += n*SIZE_PAGE;
-	}
-
-	return paddr;
-}
+#define OCRAM_SIZE              (0x20000)
 
 void *sdma_alloc_uncached(size_t size, addr_t *paddr, int ocram)
 {
@@ -306,14 +320,17 @@ void *sdma_alloc_uncached(size_t size, addr_t *paddr, int ocram)
 
 	if (ocram) {
 		oid = OID_PHYSMEM;
-		_paddr = sdma_ocram_alloc(n*SIZE_PAGE);
+		_paddr = ocram_alloc(&common.ocram, n*SIZE_PAGE, OCRAM_NO_OWNER);
 		if (!_paddr)
 			return NULL;
 	}
 
 	void *vaddr = mmap(NULL, n*SIZE_PAGE, PROT_READ | PROT_WRITE, MAP_UNCACHED, oid, _paddr);
-	if (vaddr == MAP_FAILED)
+	if (vaddr == MAP_FAILED) {
+		if (ocram)
+			ocram_free(&common.ocram, _paddr, OCRAM_NO_OWNER);
 		return NULL;
+	}
 
 	if (!ocram)
 		_paddr = va2pa(vaddr);
@@ -375,12 +392,14 @@ static int sdma_intr(unsigned int intr, void *arg)
 			/* Check if channel is active and it's interrupt flag is set */
 			if (_INTR & (1 << i) && cmn->channel[i].active) {
 
-				/* Set BD_DONE in all buffer descriptors */
+				/* Set BD_DONE in all buffer descriptors (unless client manages them) */
 				sdma_buffer_desc_t *current = cmn->channel[i].bd;
-				do {
-					if (!(current->flags & SDMA_BD_DONE))
-						current->flags |= SDMA_BD_DONE;
-				} while (!((current++)->flags & SDMA_BD_WRAP));
+				if (cmn->channel[i].auto_bd_done) {
+					do {
+						if (!(current->flags & SDMA_BD_DONE))
+							current->flags |= SDMA_BD_DONE;
+					} while (!((current++)->flags & SDMA_BD_WRAP));
+				}
 
 				/* Increase interrupt count to notify dispatcher that interrupt for
 				 * this channel occurred */
@@ -417,7 +436,10 @@ static int sdma_init_structs(void)
 	return 0;
 
 fail:
-	if (common.ccb != NULL) sdma_free_uncached(common.ccb, sizeof(sdma_channel_ctrl_t) * NUM_OF_SDMA_CHANNELS);
+	if (common.ccb != NULL) {
+		sdma_free_uncached(common.ccb, sizeof(sdma_channel_ctrl_t) * NUM_OF_SDMA_CHANNELS);
+		ocram_free(&common.ocram, common.ccb_paddr, OCRAM_NO_OWNER);
+	}
 	if (common.channel[0].bd != NULL) sdma_free_uncached(common.channel[0].bd, sizeof(sdma_buffer_desc_t));
 	if (common.tmp != NULL) sdma_free_uncached(common.tmp, SIZE_PAGE);
 
@@ -578,6 +600,8 @@ static int sdma_channel_configure(uint8_t channel_id, sdma_channel_config_t *cfg
 
 	sdma_set_channel_priority(channel_id, cfg->priority);
 
+	common.channel[channel_id].auto_bd_done = !(cfg->flags & SDMA_CHANNEL_MANUAL_BD_DONE);
+
 	if ((res = sdma_set_bd_array(channel_id, cfg->bd_paddr, cfg->bd_cnt)) < 0) {
 		log_error("failed to set buffer descriptor array (%d)", res);
 		return -1;
@@ -586,11 +610,206 @@ static int sdma_channel_configure(uint8_t channel_id, sdma_channel_config_t *cfg
 	return 0;
 }
 
+static int sdma_copy_init(void)
+{
+	int res, channel = common.copy.channel;
+	sdma_context_t context;
+	sdma_buffer_desc_t *bd;
+
+	if (!channel)
+		return 0;
+
+	if (mutexCreate(&common.copy.lock) != EOK)
+		return -ENOMEM;
+
+	bd = sdma_alloc_uncached(SDMA_COPY_BD_CNT * sizeof(sdma_buffer_desc_t), &common.channel[channel].bd_paddr, 0);
+	if (bd == NULL)
+		return -ENOMEM;
+
+	memset(bd, 0, SDMA_COPY_BD_CNT * sizeof(sdma_buffer_desc_t));
+	bd[SDMA_COPY_BD_CNT - 1].flags = SDMA_BD_WRAP;
+
+	common.channel[channel].bd = bd;
+	common.channel[channel].auto_bd_done = 0;
+
+	common.ccb[channel].base_bd = common.channel[channel].bd_paddr;
+	common.ccb[channel].current_bd = common.channel[channel].bd_paddr;
+
+	/* Triggered by the host only */
+	common.regs->DSPOVR |= 1 << channel;
+	common.regs->EVTOVR |= 1 << channel;
+	common.regs->HOSTOVR &= ~(1 << channel);
+
+	sdma_set_channel_priority(channel, SDMA_COPY_PRIORITY);
+
+	sdma_context_init(&context);
+	sdma_context_set_pc(&context, sdma_script__ap_2_ap);
+
+	if ((res = sdma_context_load(channel, &context)) < 0)
+		return res;
+
+	log_info("memcpy service on ch#%d", channel);
+
+	return 0;
+}
+
+/* Copies physical ranges using a temporary uncached mapping */
+static int sdma_copy_cpu(addr_t dst, addr_t src, size_t len)
+{
+	addr_t dst_offs = dst & (SIZE_PAGE - 1), src_offs = src & (SIZE_PAGE - 1);
+	size_t dst_size = (dst_offs + len + SIZE_PAGE - 1) & ~(SIZE_PAGE - 1);
+	size_t src_size = (src_offs + len + SIZE_PAGE - 1) & ~(SIZE_PAGE - 1);
+	void *d, *s;
+
+	if (!len)
+		return EOK;
+
+	d = mmap(NULL, dst_size, PROT_READ | PROT_WRITE, MAP_UNCACHED, OID_PHYSMEM, dst - dst_offs);
+	if (d == MAP_FAILED)
+		return -ENOMEM;
+
+	s = mmap(NULL, src_size, PROT_READ, MAP_UNCACHED, OID_PHYSMEM, src - src_offs);
+	if (s == MAP_FAILED) {
+		munmap(d, dst_size);
+		return -ENOMEM;
+	}
+
+	memcpy((char *)d + dst_offs, (char *)s + src_offs, len);
+
+	munmap(s, src_size);
+	munmap(d, dst_size);
+
+	common.copy.cpu_bytes += len;
+
+	return EOK;
+}
+
+/* Runs cnt buffer descriptors from the beginning of the ring and waits for the interrupt */
+static int sdma_copy_run(unsigned cnt)
+{
+	int channel = common.copy.channel, res = EOK;
+	sdma_buffer_desc_t *bd = common.channel[channel].bd;
+	unsigned i, intr_cnt;
+
+	/* One interrupt at the end of the chain */
+	bd[cnt - 1].flags &= ~SDMA_BD_CONT;
+	bd[cnt - 1].flags |= SDMA_BD_INTR | SDMA_BD_LAST | SDMA_BD_WRAP;
+
+	common.ccb[channel].current_bd = common.channel[channel].bd_paddr;
+
+	mutexLock(common.lock);
+
+	intr_cnt = common.channel[channel].intr_cnt;
+	sdma_enable_channel(channel);
+
+	while (common.channel[channel].intr_cnt == intr_cnt) {
+		if (condWait(common.channel[channel].intr_cond, common.lock, SDMA_COPY_TIMEOUT_US) == -ETIME &&
+			common.channel[channel].intr_cnt == intr_cnt) {
+			/* Stop the channel before the ring is reused */
+			common.regs->STOP_STAT = 1 << channel;
+			res = -ETIME;
+			break;
+		}
+	}
+
+	mutexUnlock(common.lock);
+
+	for (i = 0; i < cnt; i++) {
+		if (res == EOK && (bd[i].flags & (SDMA_BD_DONE | SDMA_BD_ERR)))
+			res = -EIO;
+		else if (res == EOK)
+			common.copy.dma_bytes += bd[i].count;
+
+		/* Restore the ring end */
+		bd[i].flags = (i == SDMA_COPY_BD_CNT - 1) ? SDMA_BD_WRAP : 0;
+	}
+
+	return res;
+}
+
+/* Copies a batch of physical ranges, the caller gets a single completion */
+static int sdma_copy(const sdma_memcpy_sg_t *sg, unsigned n)
+{
+	sdma_buffer_desc_t *bd;
+	addr_t dst, src;
+	size_t len, head, tail, chunk;
+	unsigned i, cnt = 0;
+	int res = EOK;
+
+	for (i = 0; i < n; i++) {
+		if (sg[i].dst + sg[i].len < sg[i].dst || sg[i].src + sg[i].len < sg[i].src)
+			return -EINVAL;
+	}
+
+	mutexLock(common.copy.lock);
+
+	common.copy.batch_cnt++;
+
+	for (i = 0; i < n && res == EOK; i++) {
+		dst = sg[i].dst;
+		src = sg[i].src;
+		len = sg[i].len;
+
+		/* The engine moves words, short and differently aligned ranges are left to the CPU */
+		if (len < SDMA_COPY_MIN || ((dst ^ src) & 3)) {
+			res = sdma_copy_cpu(dst, src, len);
+			continue;
+		}
+
+		head = -src & 3;
+		tail = (len - head) & 3;
+
+		if ((res = sdma_copy_cpu(dst, src, head)) < 0 || (res = sdma_copy_cpu(dst + len - tail, src + len - tail, tail)) < 0)
+			break;
+
+		dst += head;
+		src += head;
+		len -= head + tail;
+
+		while (len) {
+			chunk = (len > SDMA_BD_COUNT_MAX) ? SDMA_BD_COUNT_MAX : len;
+
+			bd = &common.channel[common.copy.channel].bd[cnt++];
+			bd->count = chunk;
+			bd->command = SDMA_CMD_MODE_32_BIT;
+			bd->buffer_addr = src;
+			bd->ext_buffer_addr = dst;
+			bd->flags = SDMA_BD_DONE | SDMA_BD_EXTD | SDMA_BD_CONT;
+
+			dst += chunk;
+			src += chunk;
+			len -= chunk;
+
+			/* Batch doesn't fit the ring, run it in parts */
+			if (cnt == SDMA_COPY_BD_CNT) {
+				if ((res = sdma_copy_run(cnt)) < 0)
+					break;
+				cnt = 0;
+			}
+		}
+	}
+
+	if (res == EOK && cnt)
+		res = sdma_copy_run(cnt);
+
+	if (res < 0) {
+		common.copy.fail_cnt++;
+
+		/* Don't leave half prepared descriptors behind */
+		for (i = 0; i < cnt; i++)
+			common.channel[common.copy.channel].bd[i].flags = (i == SDMA_COPY_BD_CNT - 1) ? SDMA_BD_WRAP : 0;
+	}
+
+	mutexUnlock(common.copy.lock);
+
+	return res;
+}
+
 static int dev_init(void)
 {
 	int i, res;
 	oid_t dev;
-	char filename[10];
+	char filename[12];
 
 	res = portCreate(&common.port);
 	if (res != EOK) {
@@ -602,7 +821,11 @@ static int dev_init(void)
 	 * scripts etc. */
 	for (i = 1; i < NUM_OF_SDMA_CHANNELS; i++) {
 
-		res = snprintf(filename, sizeof(filename), "sdma/ch%02u", (unsigned)i);
+		/* Channel owned by the memcpy service */
+		if (i == common.copy.channel)
+			res = snprintf(filename, sizeof(filename), "sdma/memcpy");
+		else
+			res = snprintf(filename, sizeof(filename), "sdma/ch%02u", (unsigned)i);
 
 		dev.port = common.port;
 		dev.id = i;
@@ -620,21 +843,43 @@ static int dev_init(void)
 	return 0;
 }
 
-static int dev_open(oid_t *oid, int flags)
+static int oid_to_channel(oid_t *oid)
 {
-	return EOK;
+	return oid->id;
 }
 
-static int dev_close(oid_t *oid, int flags)
+static int dev_open(oid_t *oid, int flags)
 {
-	/* TODO: unmap buffer descriptor array and buffers */
+	int channel = oid_to_channel(oid);
+
+	if (channel <= 0 || channel >= NUM_OF_SDMA_CHANNELS)
+		return -EINVAL;
+
+	mutexLock(common.lock);
+	common.channel[channel].open_cnt++;
+	mutexUnlock(common.lock);
 
 	return EOK;
 }
 
-static int oid_to_channel(oid_t *oid)
+static int dev_close(oid_t *oid, int flags)
 {
-	return oid->id;
+	int channel = oid_to_channel(oid), cnt;
+
+	if (channel <= 0 || channel >= NUM_OF_SDMA_CHANNELS)
+		return -EINVAL;
+
+	mutexLock(common.lock);
+
+	if (common.channel[channel].open_cnt > 0 && --common.channel[channel].open_cnt == 0) {
+		/* Last user is gone, OCRAM allocated through this channel is no longer referenced */
+		if ((cnt = ocram_release(&common.ocram, channel)) > 0)
+			log_debug("ch#%d closed, released %d OCRAM blocks", channel, cnt);
+	}
+
+	mutexUnlock(common.lock);
+
+	return EOK;
 }
 
 static int dev_read(oid_t *oid, void *data, size_t size)
@@ -643,9 +888,13 @@ static int dev_read(oid_t *oid, void *data, size_t size)
 	unsigned intr_cnt;
 
 	mutexLock(common.lock);
-	condWait(common.channel[channel].intr_cond, common.lock, 0);
+
+	/* Don't lose interrupts which occurred since the last read */
+	while (common.channel[channel].intr_cnt == common.channel[channel].intr_read_cnt)
+		condWait(common.channel[channel].intr_cond, common.lock, 0);
 
 	intr_cnt = common.channel[channel].intr_cnt;
+	common.channel[channel].intr_read_cnt = intr_cnt;
 
 	mutexUnlock(common.lock);
 
@@ -674,6 +923,12 @@ static int dev_ctl(msg_t *msg)
 		return -EIO;
 	}
 
+	/* Only batches are accepted on the memcpy channel and only there */
+	if ((common.copy.channel && channel == common.copy.channel) != (dev_ctl.type == sdma_dev_ctl__memcpy)) {
+		log_error("dev_ctl: request type %d not supported on channel %d", dev_ctl.type, channel);
+		return -EPERM;
+	}
+
 	switch (dev_ctl.type) {
 		case sdma_dev_ctl__channel_cfg:
 			if ((res = sdma_channel_configure(channel, &dev_ctl.cfg)) < 0) {
@@ -720,10 +975,24 @@ static int dev_ctl(msg_t *msg)
 			return EOK;
 
 		case sdma_dev_ctl__ocram_alloc:
-			dev_ctl.alloc.paddr = sdma_ocram_alloc(dev_ctl.alloc.size);
+			dev_ctl.alloc.paddr = ocram_alloc(&common.ocram, dev_ctl.alloc.size, channel);
 			memcpy(msg->o.raw, &dev_ctl, sizeof(sdma_dev_ctl_t));
 			return EOK;
 
+		case sdma_dev_ctl__ocram_free:
+			if ((res = ocram_free(&common.ocram, dev_ctl.alloc.paddr, channel)) < 0)
+				log_error("dev_ctl: can't free OCRAM block 0x%x for channel %d (%d)", dev_ctl.alloc.paddr, channel, res);
+			return res;
+
+		case sdma_dev_ctl__memcpy:
+			if (msg->i.size % sizeof(sdma_memcpy_sg_t) || msg->i.size / sizeof(sdma_memcpy_sg_t) > SDMA_MEMCPY_SG_MAX) {
+				log_error("dev_ctl: invalid memcpy batch size");
+				return -EINVAL;
+			}
+
+			/* Called without common.lock, the interrupt is waited for */
+			return sdma_copy(msg->i.data, msg->i.size / sizeof(sdma_memcpy_sg_t));
+
 		default:
 			log_error("dev_ctl: unknown type (%d)", dev_ctl.type);
 			return -ENOSYS;
@@ -736,6 +1005,7 @@ static void worker_thread(void *arg)
 {
 	msg_t msg;
 	unsigned rid;
+	sdma_dev_ctl_type_t type;
 
 	(void)arg;
 
@@ -761,6 +1031,13 @@ static void worker_thread(void *arg)
 				break;
 
 			case mtDevCtl:
+				/* Memcpy batches sleep until completion and take common.lock themselves */
+				memcpy(&type, msg.o.raw, sizeof(type));
+				if (type == sdma_dev_ctl__memcpy) {
+					msg.o.io.err = dev_ctl(&msg);
+					break;
+				}
+
 				mutexLock(common.lock);
 				msg.o.io.err = dev_ctl(&msg);
 				mutexUnlock(common.lock);
@@ -771,10 +1048,21 @@ static void worker_thread(void *arg)
 	}
 }
 
+static void ocram_log_stats(const char *name, ocram_stats_t *stats)
+{
+	size_t free = stats->size - stats->used;
+
+	log_info("%s stats: %u/%u bytes used (peak %u); %u free blocks, largest %u (%u%% fragmentation); "
+		"%u allocs; %u frees; %u failed", name, stats->used, stats->size, stats->peak, stats->free_blocks,
+		stats->largest_free, free ? (unsigned)(100 - (100 * stats->largest_free) / free) : 0,
+		stats->alloc_cnt, stats->free_cnt, stats->fail_cnt);
+}
+
 static void stats_thread(void *arg)
 {
 	int i;
 	unsigned intr_cnt, read_cnt, missed_cnt;
+	ocram_stats_t ocram_stats;
 
 	while (1) {
 
@@ -791,18 +1079,181 @@ static void stats_thread(void *arg)
 
 			log_info("ch#%u stats: %u interrupts; %u missed; %u reads", i, intr_cnt, missed_cnt, read_cnt);
 		}
+
+		if (common.copy.channel) {
+			log_info("memcpy stats: %u batches; %u failed; %llu bytes by SDMA; %llu bytes by CPU", common.copy.batch_cnt,
+				common.copy.fail_cnt, common.copy.dma_bytes, common.copy.cpu_bytes);
+		}
+
+		mutexLock(common.lock);
+		ocram_get_stats(&common.ocram, &ocram_stats);
+		mutexUnlock(common.lock);
+
+		ocram_log_stats("OCRAM", &ocram_stats);
+	}
+}
+
+/* Allocation churn on a scratch allocator covering the same region as OCRAM */
+static void ocram_bench(unsigned iterations)
+{
+	static ocram_t o;
+	ocram_stats_t stats;
+	addr_t live[64];
+	time_t start, end;
+	unsigned i, slot, seed = 1;
+	size_t size;
+
+	ocram_init(&o, OCRAM_BASE, OCRAM_SIZE);
+	memset(live, 0, sizeof(live));
+
+	gettime(&start, NULL);
+
+	for (i = 0; i < iterations; i++) {
+		seed = seed * 1103515245 + 12345;
+		slot = (seed >> 16) % (sizeof(live) / sizeof(live[0]));
+
+		if (live[slot]) {
+			ocram_free(&o, live[slot], 0);
+			live[slot] = 0;
+			continue;
+		}
+
+		/* Mostly BD rings and contexts, occasionally whole pages */
+		seed = seed * 1103515245 + 12345;
+		size = ((seed >> 16) & 7) ? 16 + ((seed >> 8) % 1024) : SIZE_PAGE;
+
+		live[slot] = ocram_alloc(&o, size, 0);
+	}
+
+	gettime(&end, NULL);
+
+	log_info("OCRAM bench: %u operations in %u us (%u ns per alloc/free)", iterations, (unsigned)(end - start),
+		(unsigned)(((end - start) * 1000) / iterations));
+	ocram_get_stats(&o, &stats);
+	ocram_log_stats("OCRAM bench", &stats);
+}
+
+#define COPY_BENCH_MAX          (1024 * 1024)
+#define COPY_BENCH_TOTAL        (16 * 1024 * 1024) /* Bytes copied per size and method */
+
+/* Splits a copy between virtually contiguous buffers into physical ranges */
+static unsigned copy_bench_sg(sdma_memcpy_sg_t *sg, char *dst, char *src, size_t len)
+{
+	unsigned n = 0;
+	size_t offs, chunk;
+	addr_t pd, ps;
+
+	for (offs = 0; offs < len; offs += chunk) {
+		chunk = (len - offs > SIZE_PAGE) ? SIZE_PAGE : len - offs;
+		pd = va2pa(dst + offs);
+		ps = va2pa(src + offs);
+
+		if (n && sg[n - 1].dst + sg[n - 1].len == pd && sg[n - 1].src + sg[n - 1].len == ps) {
+			sg[n - 1].len += chunk;
+			continue;
+		}
+
+		sg[n].dst = pd;
+		sg[n].src = ps;
+		sg[n].len = chunk;
+		n++;
+	}
+
+	return n;
+}
+
+static unsigned copy_bench_rate(size_t size, unsigned reps, time_t us)
+{
+	return us ? (unsigned)(((unsigned long long)size * reps) / us) : 0;
+}
+
+/* Compares the memcpy service (without message passing) with CPU copies across sizes */
+static void copy_bench(void *arg)
+{
+	static sdma_memcpy_sg_t sg[COPY_BENCH_MAX / SIZE_PAGE];
+	static const size_t sizes[] = { 64, 256, 1024, 4096, 16 * 1024, 64 * 1024, 256 * 1024, COPY_BENCH_MAX };
+	char *src, *dst, *csrc, *cdst;
+	time_t start, dma_us, unc_us, cpu_us;
+	unsigned i, j, n, reps;
+	int res = EOK;
+
+	(void)arg;
+
+	src = sdma_alloc_uncached(COPY_BENCH_MAX, NULL, 0);
+	dst = sdma_alloc_uncached(COPY_BENCH_MAX, NULL, 0);
+	csrc = malloc(COPY_BENCH_MAX);
+	cdst = malloc(COPY_BENCH_MAX);
+
+	if (src == NULL || dst == NULL || csrc == NULL || cdst == NULL) {
+		log_error("memcpy bench: out of memory");
+		goto out;
+	}
+
+	for (i = 0; i < COPY_BENCH_MAX; i++)
+		src[i] = csrc[i] = (char)(i * 7 + (i >> 8));
+
+	log_info("memcpy bench: size [B], SDMA, CPU uncached, CPU cached [MB/s]");
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]) && res == EOK; i++) {
+		reps = COPY_BENCH_TOTAL / sizes[i];
+		n = copy_bench_sg(sg, dst, src, sizes[i]);
+		memset(dst, 0, sizes[i]);
+
+		gettime(&start, NULL);
+		for (j = 0; j < reps && res == EOK; j++)
+			res = sdma_copy(sg, n);
+		gettime(&dma_us, NULL);
+		dma_us -= start;
+
+		if (res < 0) {
+			log_error("memcpy bench: SDMA copy of %u bytes failed (%d)", (unsigned)sizes[i], res);
+			break;
+		}
+
+		if (memcmp(dst, src, sizes[i]) != 0) {
+			log_error("memcpy bench: SDMA copy of %u bytes corrupted", (unsigned)sizes[i]);
+			break;
+		}
+
+		gettime(&start, NULL);
+		for (j = 0; j < reps; j++)
+			memcpy(dst, src, sizes[i]);
+		gettime(&unc_us, NULL);
+		unc_us -= start;
+
+		gettime(&start, NULL);
+		for (j = 0; j < reps; j++)
+			memcpy(cdst, csrc, sizes[i]);
+		gettime(&cpu_us, NULL);
+		cpu_us -= start;
+
+		log_info("memcpy bench: %7u %6u %6u %6u", (unsigned)sizes[i], copy_bench_rate(sizes[i], reps, dma_us),
+			copy_bench_rate(sizes[i], reps, unc_us), copy_bench_rate(sizes[i], reps, cpu_us));
 	}
+
+out:
+	free(cdst);
+	free(csrc);
+	if (dst != NULL)
+		sdma_free_uncached(dst, COPY_BENCH_MAX);
+	if (src != NULL)
+		sdma_free_uncached(src, COPY_BENCH_MAX);
+
+	endthread();
 }
 
 static int init(void)
 {
 	int res, i;
 
-	common.ocram_next = OCRAM_BASE;
-
 	if (common.use_syslog)
 		openlog("sdma-driver", LOG_NDELAY, LOG_DAEMON);
 
+	if (ocram_init(&common.ocram, OCRAM_BASE, OCRAM_SIZE) < 0) {
+		log_error("failed to initialize OCRAM allocator");
+		return -1;
+	}
+
 	if (mutexCreate(&common.lock) != EOK) {
 		log_error("failed to create mutex");
 		return -1;
@@ -815,8 +1266,10 @@ static int init(void)
 
 	for (i = 0; i < NUM_OF_SDMA_CHANNELS; i++) {
 		common.channel[i].intr_cnt = 0;
+		common.channel[i].intr_read_cnt = 0;
 		common.channel[i].read_cnt = 0;
 		common.channel[i].missed_intr_cnt = 0;
+		common.channel[i].open_cnt = 0;
 		if (condCreate(&common.channel[i].intr_cond) != EOK) {
 			log_error("failed to create conditional variable for channel %d", i);
 			return -1;
@@ -828,6 +1281,11 @@ static int init(void)
 		return res;
 	}
 
+	if ((res = sdma_copy_init()) < 0) {
+		log_error("memcpy service initialization failed (%d)", res);
+		return res;
+	}
+
 	if ((res = dev_init()) < 0) {
 		log_error("device initialization failed (%d)", res);
 		return res;
@@ -1004,7 +1462,7 @@ static void dump_debug_info(void)
 
 int main(int argc, char *argv[])
 {
-	int res, display_usage = 0;
+	int res, display_usage = 0, bench_iterations = 0, copy_bench_run = 0;
 	oid_t root;
 
 	priority(MAIN_THD_PRIO);
@@ -1015,8 +1473,9 @@ int main(int argc, char *argv[])
 	common.active_mask = 0;
 	common.dump_dir = "/var/run";
 	common.broken = 0;
+	common.copy.channel = SDMA_COPY_CHANNEL;
 
-	while ((res = getopt(argc, argv, "S:sd:")) >= 0) {
+	while ((res = getopt(argc, argv, "S:sd:B:m:M")) >= 0) {
 		switch (res) {
 		case 'S':
 			common.stats_period_s = (int)strtol(optarg, NULL, 0);
@@ -1027,20 +1486,42 @@ int main(int argc, char *argv[])
 		case 'd':
 			common.dump_dir = optarg;
 			break;
+		case 'B':
+			bench_iterations = (int)strtol(optarg, NULL, 0);
+			break;
+		case 'm':
+			common.copy.channel = (int)strtol(optarg, NULL, 0);
+			if (common.copy.channel < 0 || common.copy.channel >= NUM_OF_SDMA_CHANNELS)
+				display_usage = 1;
+			break;
+		case 'M':
+			copy_bench_run = 1;
+			break;
 		default:
 			display_usage = 1;
 			break;
 		}
 	}
 
+	if (copy_bench_run && !common.copy.channel)
+		display_usage = 1;
+
 	if (display_usage) {
-		printf("Usage: sdma-driver [-s] [-S period] [-d path]\n\r");
+		printf("Usage: sdma-driver [-s] [-S period] [-d path] [-B iterations] [-m channel] [-M]\n\r");
 		printf("    -S period    Print stats with given period (in seconds)\n\r");
 		printf("    -s           Output logs to syslog instead of stdout\n\r");
 		printf("    -d path      Set directory for debug info dump (default: %s)\n\r", common.dump_dir);
+		printf("    -B iterations  Run OCRAM allocator benchmark and exit\n\r");
+		printf("    -m channel   Channel of the memcpy service, 0 disables it (default: %d)\n\r", SDMA_COPY_CHANNEL);
+		printf("    -M           Run memcpy benchmark after initialization\n\r");
 		return 1;
 	}
 
+	if (bench_iterations > 0) {
+		ocram_bench(bench_iterations);
+		return 0;
+	}
+
 	/* Wait for the filesystem */
 	while (lookup("/", NULL, &root) < 0)
 		usleep(10000);
@@ -1048,6 +1529,10 @@ int main(int argc, char *argv[])
 	if (init())
 		return -EIO;
 
+	/* Completions are dispatched by this thread */
+	if (copy_bench_run)
+		beginthread(copy_bench, BENCH_THD_PRIO, common.bench_thd_stack, BENCH_THD_STACK, NULL);
+
 	unsigned i, intr_cnt[NUM_OF_SDMA_CHANNELS], cnt;
 	memset(intr_cnt, 0, sizeof(intr_cnt));
 
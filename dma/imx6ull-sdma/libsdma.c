@@ -14,6 +14,7 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include <sys/msg.h>
 #include <sys/mman.h>
@@ -55,15 +56,24 @@ int sdma_open(sdma_t *s, const char *dev_name)
 	if ((fd = open(dev_name, O_RDWR)) < 0)
 		return -2;
 
-	if ((res = lookup(dev_name, NULL, &s->oid)) < 0)
+	if ((res = lookup(dev_name, NULL, &s->oid)) < 0) {
+		close(fd);
 		return -3;
+	}
+
+	s->fd = fd;
 
 	return 0;
 }
 
 int sdma_close(sdma_t *s)
 {
-	/* TODO: Implement sdma_channel_close */
+	if (s == NULL || s->fd < 0)
+		return -1;
+
+	/* Closing the last descriptor releases OCRAM allocated through this channel */
+	close(s->fd);
+	s->fd = -1;
 
 	return 0;
 }
@@ -184,6 +194,20 @@ addr_t sdma_ocram_alloc(sdma_t *s, size_t size)
 	return dev_ctl.alloc.paddr;
 }
 
+int sdma_ocram_free(sdma_t *s, addr_t paddr)
+{
+	sdma_dev_ctl_t dev_ctl;
+
+	if (s == NULL)
+		return -1;
+
+	dev_ctl.oid = s->oid;
+	dev_ctl.type = sdma_dev_ctl__ocram_free;
+	dev_ctl.alloc.paddr = paddr;
+
+	return sdma_dev_ctl(s, &dev_ctl, NULL, 0);
+}
+
 
 void *sdma_alloc_uncached(sdma_t *s, size_t size, addr_t *paddr, int ocram)
 {
@@ -218,3 +242,110 @@ int sdma_free_uncached(void *vaddr, size_t size)
 
 	return munmap(vaddr, n*SIZE_PAGE);
 }
+
+
+int sdma_memcpy_sg(sdma_t *s, const sdma_memcpy_sg_t *sg, unsigned int cnt)
+{
+	int res;
+	msg_t msg;
+	sdma_dev_ctl_t dev_ctl;
+
+	if (s == NULL || (sg == NULL && cnt) || cnt > SDMA_MEMCPY_SG_MAX)
+		return -1;
+
+	if (!cnt)
+		return 0;
+
+	dev_ctl.oid = s->oid;
+	dev_ctl.type = sdma_dev_ctl__memcpy;
+
+	msg.type = mtDevCtl;
+
+	msg.i.data = (void *)sg;
+	msg.i.size = cnt * sizeof(sdma_memcpy_sg_t);
+	msg.o.data = NULL;
+	msg.o.size = 0;
+	memcpy(msg.o.raw, &dev_ctl, sizeof(sdma_dev_ctl_t));
+
+	if ((res = msgSend(s->oid.port, &msg)) < 0) {
+		fprintf(stderr, "msgSend failed (%d)\n\r", res);
+		return -1;
+	} else if (msg.o.io.err != EOK) {
+		fprintf(stderr, "memcpy failed (%d)\n\r", msg.o.io.err);
+		return -2;
+	}
+
+	return 0;
+}
+
+
+/* Copies shorter than this are faster on the CPU than a round trip to the driver */
+#define SDMA_MEMCPY_CPU_MAX     (512)
+
+/* Ranges sent to the driver at once by sdma_memcpy() */
+#define SDMA_MEMCPY_SG_BATCH    (32)
+
+static addr_t sdma_va2pa(uintptr_t va)
+{
+	return va2pa((void *)(va & ~(SIZE_PAGE - 1))) + (va & (SIZE_PAGE - 1));
+}
+
+int sdma_memcpy(sdma_t *s, void *dst, const void *src, size_t len)
+{
+	sdma_memcpy_sg_t sg[SDMA_MEMCPY_SG_BATCH];
+	uintptr_t d = (uintptr_t)dst, sa = (uintptr_t)src;
+	size_t head, tail, chunk;
+	addr_t pd, ps;
+	unsigned int n = 0;
+	int res;
+
+	/* The engine moves words, differently aligned buffers are copied by the CPU */
+	if (len < SDMA_MEMCPY_CPU_MAX || ((d ^ sa) & 3)) {
+		memcpy(dst, src, len);
+		return 0;
+	}
+
+	head = -d & 3;
+	memcpy(dst, src, head);
+	d += head;
+	sa += head;
+	len -= head;
+
+	tail = len & 3;
+	memcpy((void *)(d + len - tail), (const void *)(sa + len - tail), tail);
+	len -= tail;
+
+	while (len) {
+		/* Buffers are only virtually contiguous */
+		chunk = SIZE_PAGE - (d & (SIZE_PAGE - 1));
+		if (chunk > SIZE_PAGE - (sa & (SIZE_PAGE - 1)))
+			chunk = SIZE_PAGE - (sa & (SIZE_PAGE - 1));
+		if (chunk > len)
+			chunk = len;
+
+		pd = sdma_va2pa(d);
+		ps = sdma_va2pa(sa);
+
+		if (n && sg[n - 1].dst + sg[n - 1].len == pd && sg[n - 1].src + sg[n - 1].len == ps) {
+			sg[n - 1].len += chunk;
+		}
+		else {
+			if (n == SDMA_MEMCPY_SG_BATCH) {
+				if ((res = sdma_memcpy_sg(s, sg, n)) < 0)
+					return res;
+				n = 0;
+			}
+
+			sg[n].dst = pd;
+			sg[n].src = ps;
+			sg[n].len = chunk;
+			n++;
+		}
+
+		d += chunk;
+		sa += chunk;
+		len -= chunk;
+	}
+
+	return sdma_memcpy_sg(s, sg, n);
+}
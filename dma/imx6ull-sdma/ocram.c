@@ -0,0 +1,194 @@
+/*
+ * Phoenix-RTOS
+ *
+ * i.MX 6ULL SDMA OCRAM allocator
+ *
+ * Copyright 2018 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "ocram.h"
+
+#define OCRAM_NIL               (0xffff)
+
+/* Block head state */
+#define OCRAM_STATE_FREE        (1 << 7)
+#define OCRAM_STATE_USED        (1 << 6)
+#define OCRAM_STATE_ORDER_MASK  (0x3f)
+
+
+static void ocram_push(ocram_t *o, unsigned blk, unsigned order)
+{
+	o->state[blk] = OCRAM_STATE_FREE | order;
+	o->prev[blk] = OCRAM_NIL;
+	o->next[blk] = o->free[order];
+
+	if (o->free[order] != OCRAM_NIL)
+		o->prev[o->free[order]] = blk;
+
+	o->free[order] = blk;
+}
+
+
+static void ocram_unlink(ocram_t *o, unsigned blk, unsigned order)
+{
+	if (o->prev[blk] != OCRAM_NIL)
+		o->next[o->prev[blk]] = o->next[blk];
+	else
+		o->free[order] = o->next[blk];
+
+	if (o->next[blk] != OCRAM_NIL)
+		o->prev[o->next[blk]] = o->prev[blk];
+
+	o->state[blk] = 0;
+}
+
+
+int ocram_init(ocram_t *o, addr_t base, size_t size)
+{
+	unsigned order;
+
+	memset(o, 0, sizeof(*o));
+
+	for (order = 0; (OCRAM_MIN_BLOCK << order) < size; order++)
+		;
+
+	if ((OCRAM_MIN_BLOCK << order) != size || order >= OCRAM_MAX_ORDERS || (base & (size - 1)))
+		return -EINVAL;
+
+	o->base = base;
+	o->size = size;
+	o->orders = order + 1;
+
+	memset(o->free, 0xff, sizeof(o->free));
+	memset(o->owner, OCRAM_NO_OWNER, sizeof(o->owner));
+	ocram_push(o, 0, order);
+
+	return EOK;
+}
+
+
+addr_t ocram_alloc(ocram_t *o, size_t size, int owner)
+{
+	unsigned order, k, blk;
+
+	for (order = 0; order < o->orders && (OCRAM_MIN_BLOCK << order) < size; order++)
+		;
+
+	for (k = order; k < o->orders && o->free[k] == OCRAM_NIL; k++)
+		;
+
+	if (!size || k >= o->orders) {
+		o->fail_cnt++;
+		return 0;
+	}
+
+	blk = o->free[k];
+	ocram_unlink(o, blk, k);
+
+	/* Split, upper halves go back to the free lists */
+	while (k > order) {
+		k--;
+		ocram_push(o, blk + (1 << k), k);
+	}
+
+	o->state[blk] = OCRAM_STATE_USED | order;
+	o->owner[blk] = owner;
+
+	o->used += OCRAM_MIN_BLOCK << order;
+	if (o->used > o->peak)
+		o->peak = o->used;
+	o->alloc_cnt++;
+
+	return o->base + (blk << OCRAM_MIN_SHIFT);
+}
+
+
+static void ocram_put(ocram_t *o, unsigned blk)
+{
+	unsigned order = o->state[blk] & OCRAM_STATE_ORDER_MASK, buddy;
+
+	o->used -= OCRAM_MIN_BLOCK << order;
+	o->owner[blk] = OCRAM_NO_OWNER;
+	o->free_cnt++;
+
+	/* Coalesce with free buddies */
+	while (order + 1 < o->orders) {
+		buddy = blk ^ (1 << order);
+
+		if (o->state[buddy] != (OCRAM_STATE_FREE | order))
+			break;
+
+		ocram_unlink(o, buddy, order);
+		o->state[blk] = 0;
+		blk &= ~(1 << order);
+		order++;
+	}
+
+	ocram_push(o, blk, order);
+}
+
+
+int ocram_free(ocram_t *o, addr_t paddr, int owner)
+{
+	unsigned blk;
+
+	if (paddr < o->base || paddr >= o->base + o->size || (paddr & (OCRAM_MIN_BLOCK - 1)))
+		return -EINVAL;
+
+	blk = (paddr - o->base) >> OCRAM_MIN_SHIFT;
+
+	if (!(o->state[blk] & OCRAM_STATE_USED))
+		return -EINVAL;
+
+	if (owner != OCRAM_NO_OWNER && o->owner[blk] != owner)
+		return -EPERM;
+
+	ocram_put(o, blk);
+
+	return EOK;
+}
+
+
+int ocram_release(ocram_t *o, int owner)
+{
+	unsigned blk;
+	int cnt = 0;
+
+	for (blk = 0; blk < (o->size >> OCRAM_MIN_SHIFT); blk++) {
+		if ((o->state[blk] & OCRAM_STATE_USED) && o->owner[blk] == owner) {
+			ocram_put(o, blk);
+			cnt++;
+		}
+	}
+
+	return cnt;
+}
+
+
+void ocram_get_stats(ocram_t *o, ocram_stats_t *stats)
+{
+	unsigned order, blk;
+
+	memset(stats, 0, sizeof(*stats));
+
+	for (order = 0; order < o->orders; order++) {
+		for (blk = o->free[order]; blk != OCRAM_NIL; blk = o->next[blk]) {
+			stats->free_blocks++;
+			stats->largest_free = OCRAM_MIN_BLOCK << order;
+		}
+	}
+
+	stats->size = o->size;
+	stats->used = o->used;
+	stats->peak = o->peak;
+	stats->alloc_cnt = o->alloc_cnt;
+	stats->free_cnt = o->free_cnt;
+	stats->fail_cnt = o->fail_cnt;
+}
@@ -0,0 +1,70 @@
+/*
+ * Phoenix-RTOS
+ *
+ * i.MX 6ULL SDMA OCRAM allocator
+ *
+ * Copyright 2018 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef IMX6ULL_SDMA_OCRAM_H
+#define IMX6ULL_SDMA_OCRAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Buddy allocator, blocks of order k have (OCRAM_MIN_BLOCK << k) bytes and are naturally aligned */
+#define OCRAM_MIN_SHIFT         (6)
+#define OCRAM_MIN_BLOCK         (1 << OCRAM_MIN_SHIFT)
+#define OCRAM_MAX_ORDERS        (12)
+#define OCRAM_MAX_BLOCKS        (1 << (OCRAM_MAX_ORDERS - 1))
+
+#define OCRAM_NO_OWNER          (-1)
+
+typedef struct {
+	addr_t base;
+	size_t size;
+	unsigned orders;
+
+	uint16_t free[OCRAM_MAX_ORDERS];
+	uint16_t next[OCRAM_MAX_BLOCKS];
+	uint16_t prev[OCRAM_MAX_BLOCKS];
+	uint8_t state[OCRAM_MAX_BLOCKS];
+	int8_t owner[OCRAM_MAX_BLOCKS];
+
+	size_t used;
+	size_t peak;
+	unsigned alloc_cnt;
+	unsigned free_cnt;
+	unsigned fail_cnt;
+} ocram_t;
+
+typedef struct {
+	size_t size;
+	size_t used;
+	size_t peak;
+	size_t largest_free;
+	unsigned free_blocks;
+	unsigned alloc_cnt;
+	unsigned free_cnt;
+	unsigned fail_cnt;
+} ocram_stats_t;
+
+/* size has to be a power of 2 multiple of OCRAM_MIN_BLOCK, base aligned to size */
+int ocram_init(ocram_t *o, addr_t base, size_t size);
+
+/* Returns 0 if there is no free block large enough */
+addr_t ocram_alloc(ocram_t *o, size_t size, int owner);
+
+int ocram_free(ocram_t *o, addr_t paddr, int owner);
+
+/* Frees all blocks allocated by owner, returns number of freed blocks */
+int ocram_release(ocram_t *o, int owner);
+
+void ocram_get_stats(ocram_t *o, ocram_stats_t *stats);
+
+#endif /* IMX6ULL_SDMA_OCRAM_H */
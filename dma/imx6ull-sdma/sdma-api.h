@@ -24,6 +24,10 @@
 #define SDMA_BD_INTR                            (1 << 3) /* Interrupt */
 #define SDMA_BD_ERR                             (1 << 4) /* Error */
 #define SDMA_BD_LAST                            (1 << 5) /* Last Buffer Descriptor */
+#define SDMA_BD_EXTD                            (1 << 7) /* Extended Buffer Descriptor (ext_buffer_addr used) */
+
+/* Maximum byte count of a single buffer descriptor */
+#define SDMA_BD_COUNT_MAX                       (0xfffc)
 
 /* Buffer Descriptor Commands for scripts supporting various data sizes */
 #define SDMA_CMD_MODE_32_BIT                    (0b00)
@@ -104,12 +108,16 @@ typedef enum {
 	sdma_trig__host,
 } sdma_trig_t;
 
+/* Channel configuration flags */
+#define SDMA_CHANNEL_MANUAL_BD_DONE             (1 << 0) /* Don't return buffer descriptors to SDMA on interrupt */
+
 typedef struct {
 	addr_t bd_paddr; /* Physical address of buffer descriptor array */
 	unsigned bd_cnt;
 	sdma_trig_t trig;
 	unsigned event;
 	unsigned priority;
+	unsigned flags;
 } sdma_channel_config_t;
 
 typedef enum {
@@ -120,9 +128,21 @@ typedef enum {
 	sdma_dev_ctl__context_set,
 	sdma_dev_ctl__enable,
 	sdma_dev_ctl__trigger,
-	sdma_dev_ctl__ocram_alloc
+	sdma_dev_ctl__ocram_alloc,
+	sdma_dev_ctl__ocram_free,
+	sdma_dev_ctl__memcpy
 } sdma_dev_ctl_type_t;
 
+/* Memory to memory copy of physical ranges (ranges of a batch must not overlap) */
+typedef struct {
+	addr_t dst;
+	addr_t src;
+	size_t len;
+} sdma_memcpy_sg_t;
+
+/* Maximum number of ranges in a single memcpy batch */
+#define SDMA_MEMCPY_SG_MAX                      (256)
+
 typedef struct {
 	sdma_dev_ctl_type_t type;
 	oid_t oid;
@@ -18,6 +18,7 @@
 
 typedef struct {
 	oid_t oid;
+	int fd;
 } sdma_t;
 
 int sdma_open(sdma_t *s, const char *dev_name);
@@ -37,7 +38,18 @@ int sdma_trigger(sdma_t *s);
 /* cnt - number of interrupts for this channel registered up until this point */
 int sdma_wait_for_intr(sdma_t *s, uint32_t *cnt);
 
+/* OCRAM blocks are naturally aligned to their (power of 2) size and released on last channel close */
+addr_t sdma_ocram_alloc(sdma_t *s, size_t size);
+int sdma_ocram_free(sdma_t *s, addr_t paddr);
+
 void *sdma_alloc_uncached(sdma_t *s, size_t size, addr_t *paddr, int ocram);
 int sdma_free_uncached(void *vaddr, size_t size);
 
+/* Copies a batch of physical ranges through the memcpy service (s opened on /dev/sdma/memcpy),
+ * returns after the whole batch completed. Ranges have to be coherent with the SDMA (not cached) */
+int sdma_memcpy_sg(sdma_t *s, const sdma_memcpy_sg_t *sg, unsigned int cnt);
+
+/* Copies between uncached buffers (e.g. from sdma_alloc_uncached), short copies are done by the CPU */
+int sdma_memcpy(sdma_t *s, void *dst, const void *src, size_t len);
+
 #endif /* IMX6ULL_SDMA_LIB_H */
@@ -16,6 +16,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <sys/stat.h>
 #include <sys/msg.h>
 #include <sys/threads.h>
@@ -23,32 +25,471 @@
 #include <sys/msg.h>
 #include <sys/file.h>
 #include <sys/platform.h>
+#include <sys/interrupt.h>
+#include <sys/time.h>
 #include <posix/utils.h>
 #include <phoenix/arch/imx6ull.h>
 
 #include "imx6ull-gpio.h"
 
 
-enum { gpio1 = 0, gpio2, gpio3, gpio4, gpio5, dir1, dir2, dir3, dir4, dir5 };
+enum { gpio1 = 0, gpio2, gpio3, gpio4, gpio5, dir1, dir2, dir3, dir4, dir5, irq1, irq2, irq3, irq4, irq5 };
 
 
 enum { dr = 0, gdir, psr, icr1, icr2, imr, isr, edge };
 
 
+enum { gpt_cr = 0, gpt_pr, gpt_sr, gpt_ir, gpt_ocr1, gpt_ocr2, gpt_ocr3, gpt_icr1, gpt_icr2, gpt_cnt };
+
+
+#define GPIO_RAW_SIZE     64  /* Interrupt snapshots waiting for bank thread */
+#define GPIO_QUEUE_SIZE   256 /* Events waiting for client read */
+#define GPIO_CLIENTS      8
+#define GPIO_IRQ_PRIO     2
+#define GPIO_IRQ_STACK    2048
+
+
+typedef struct {
+	uint32_t isr;
+	uint32_t psr;
+	uint32_t cnt; /* GPT2 counter (us) when the interrupt was taken */
+} gpioraw_t;
+
+
+typedef struct {
+	unsigned int pid;
+	int bank;
+	unsigned int refs;
+	uint32_t mask;
+
+	gpioevent_t queue[GPIO_QUEUE_SIZE];
+	unsigned int head;
+	unsigned int tail;
+	unsigned int overflow;
+
+	/* Blocking read waiting for events */
+	int pending;
+	msg_t msg;
+	unsigned int rid;
+} gpioclient_t;
+
+
 struct {
 	struct {
 		volatile uint32_t *base;
 		id_t port;
 		id_t dir;
+		id_t irq;
 		handle_t lock;
+
+		handle_t cond;
+		handle_t inth[2];
+
+		/* Written by interrupt handler only */
+		gpioraw_t raw[GPIO_RAW_SIZE];
+		volatile unsigned int rawhead;
+		volatile unsigned int rawlost;
+		unsigned int rawtail;
+
+		/* IMR is always written as enabled & ~masked, enabled is owned by the bank lock holder,
+		 * masked (level pins waiting for a read) is set by interrupt handler and cleared atomically */
+		uint32_t enabled;
+		volatile uint32_t masked;
+		volatile unsigned int imrseq;
+
+		uint32_t level;
+		uint8_t mode[32];
+		uint32_t debounce[32];
+		time_t last[32];
+
+		char stack[GPIO_IRQ_STACK] __attribute__((aligned(8)));
 	} gpio[5];
 
+	gpioclient_t clients[GPIO_CLIENTS];
+
+	/* Free running 1 MHz counter, interrupt handler can't read the system time */
+	volatile uint32_t *gpt;
+
 	uint32_t port;
 } common;
 
 
 static const addr_t paddr[] = { 0x0209c000, 0x020a0000, 0x020a4000, 0x020a8000, 0x020ac000 };
 static const int clocks[] = { pctl_clk_gpio1, pctl_clk_gpio2, pctl_clk_gpio3, pctl_clk_gpio4, pctl_clk_gpio5 };
+static const addr_t gpt_paddr = 0x020e8000;
+
+/* Combined interrupts for pins 0-15 and 16-31 of each bank */
+static const unsigned int irqs[] = { 32 + 66, 32 + 68, 32 + 70, 32 + 72, 32 + 74 };
+
+
+static int gpio_irqHandler(unsigned int n, void *arg)
+{
+	int b = (int)arg;
+	volatile uint32_t *base = common.gpio[b].base;
+	uint32_t pending, cnt = *(common.gpt + gpt_cnt);
+	unsigned int head;
+
+	if (!(pending = *(base + isr) & *(base + imr)))
+		return -1;
+
+	*(base + isr) = pending;
+
+	/* Pins masked already were re-enabled by a stale IMR write, they don't carry new events */
+	pending &= ~common.gpio[b].masked;
+
+	/* Level interrupts stay masked until client reads the event */
+	common.gpio[b].masked |= pending & common.gpio[b].level;
+	common.gpio[b].imrseq++;
+	*(base + imr) = common.gpio[b].enabled & ~common.gpio[b].masked;
+
+	if (!pending)
+		return -1;
+
+	head = common.gpio[b].rawhead;
+
+	if (head - common.gpio[b].rawtail < GPIO_RAW_SIZE) {
+		common.gpio[b].raw[head % GPIO_RAW_SIZE].isr = pending;
+		common.gpio[b].raw[head % GPIO_RAW_SIZE].psr = *(base + psr);
+		common.gpio[b].raw[head % GPIO_RAW_SIZE].cnt = cnt;
+		common.gpio[b].rawhead = head + 1;
+	}
+	else {
+		common.gpio[b].rawlost++;
+	}
+
+	return common.gpio[b].cond;
+}
+
+
+/* Writes IMR, called with bank lock held - rewrites it if interrupt handler ran in the meantime */
+static void gpio_imrUpdate(int b)
+{
+	unsigned int seq;
+
+	do {
+		seq = common.gpio[b].imrseq;
+		*(common.gpio[b].base + imr) = common.gpio[b].enabled & ~common.gpio[b].masked;
+	} while (seq != common.gpio[b].imrseq);
+}
+
+
+static gpioclient_t *gpio_clientFind(unsigned int pid, int b)
+{
+	int i;
+
+	for (i = 0; i < GPIO_CLIENTS; ++i) {
+		if (common.clients[i].refs && common.clients[i].pid == pid && common.clients[i].bank == b)
+			return &common.clients[i];
+	}
+
+	return NULL;
+}
+
+
+static int gpio_clientOpen(unsigned int pid, int b)
+{
+	gpioclient_t *c;
+	int i;
+
+	mutexLock(common.gpio[b].lock);
+
+	if ((c = gpio_clientFind(pid, b)) != NULL) {
+		c->refs++;
+		mutexUnlock(common.gpio[b].lock);
+		return EOK;
+	}
+
+	mutexUnlock(common.gpio[b].lock);
+
+	/* Free slots are claimed with all bank locks held, so lookups under a single bank lock stay consistent */
+	for (i = 0; i < sizeof(common.gpio) / sizeof(common.gpio[0]); ++i)
+		mutexLock(common.gpio[i].lock);
+
+	for (i = 0; i < GPIO_CLIENTS; ++i) {
+		if (!common.clients[i].refs)
+			break;
+	}
+
+	if (i < GPIO_CLIENTS) {
+		c = &common.clients[i];
+		c->pid = pid;
+		c->bank = b;
+		c->refs = 1;
+		c->mask = 0;
+		c->head = c->tail = 0;
+		c->overflow = 0;
+		c->pending = 0;
+	}
+
+	for (i = 0; i < sizeof(common.gpio) / sizeof(common.gpio[0]); ++i)
+		mutexUnlock(common.gpio[i].lock);
+
+	return c != NULL ? EOK : -ENFILE;
+}
+
+
+static void gpio_clientRespond(gpioclient_t *c, int err)
+{
+	c->pending = 0;
+	c->msg.o.io.err = err;
+	msgRespond(common.port, &c->msg, c->rid);
+}
+
+
+static int gpio_clientClose(unsigned int pid, int b)
+{
+	gpioclient_t *c;
+	uint32_t used = 0;
+	int i;
+
+	mutexLock(common.gpio[b].lock);
+
+	if ((c = gpio_clientFind(pid, b)) != NULL && !--c->refs) {
+		if (c->pending)
+			gpio_clientRespond(c, 0);
+		c->mask = 0;
+
+		/* Mask pins nobody subscribes to anymore */
+		for (i = 0; i < GPIO_CLIENTS; ++i) {
+			if (common.clients[i].refs && common.clients[i].bank == b)
+				used |= common.clients[i].mask;
+		}
+
+		common.gpio[b].enabled &= used;
+		gpio_imrUpdate(b);
+	}
+
+	mutexUnlock(common.gpio[b].lock);
+
+	return EOK;
+}
+
+
+/* Moves queued events to the reader's buffer, called with bank lock held */
+static int gpio_clientRead(gpioclient_t *c, void *data, size_t size)
+{
+	gpioevent_t *ev = data;
+	uint32_t rearm = 0;
+	size_t n;
+
+	for (n = 0; n < size / sizeof(gpioevent_t) && c->tail != c->head; ++n, ++c->tail) {
+		memcpy(&ev[n], &c->queue[c->tail % GPIO_QUEUE_SIZE], sizeof(gpioevent_t));
+		rearm |= 1 << ev[n].pin;
+	}
+
+	if (rearm & common.gpio[c->bank].masked) {
+		__atomic_and_fetch(&common.gpio[c->bank].masked, ~rearm, __ATOMIC_RELAXED);
+		gpio_imrUpdate(c->bank);
+	}
+
+	return n * sizeof(gpioevent_t);
+}
+
+
+/* Returns 1 if the response is deferred until events arrive */
+int gpioreadevents(msg_t *msg, unsigned int rid)
+{
+	int b = msg->i.io.oid.id - irq1, deferred = 0;
+	gpioclient_t *c;
+
+	if (msg->o.data == NULL || msg->o.size < sizeof(gpioevent_t)) {
+		msg->o.io.err = -EINVAL;
+		return 0;
+	}
+
+	mutexLock(common.gpio[b].lock);
+
+	if ((c = gpio_clientFind(msg->pid, b)) == NULL) {
+		msg->o.io.err = -EBADF;
+	}
+	else if (c->tail != c->head) {
+		msg->o.io.err = gpio_clientRead(c, msg->o.data, msg->o.size);
+	}
+	else if ((msg->i.io.mode & O_NONBLOCK) || c->pending) {
+		msg->o.io.err = -EAGAIN;
+	}
+	else {
+		memcpy(&c->msg, msg, sizeof(msg_t));
+		c->rid = rid;
+		c->pending = 1;
+		deferred = 1;
+	}
+
+	mutexUnlock(common.gpio[b].lock);
+
+	return deferred;
+}
+
+
+int gpiosetirq(unsigned int pid, int d, gpioirq_t *cfg)
+{
+	int b = d - irq1, pin;
+	volatile uint32_t *base = common.gpio[b].base;
+	gpioclient_t *c;
+	uint32_t t, others = 0, mask;
+	int i;
+
+	if (cfg->mode > gpio_irq_both)
+		return -EINVAL;
+
+	mutexLock(common.gpio[b].lock);
+
+	if ((c = gpio_clientFind(pid, b)) == NULL) {
+		mutexUnlock(common.gpio[b].lock);
+		return -EBADF;
+	}
+
+	for (i = 0; i < GPIO_CLIENTS; ++i) {
+		if (common.clients[i].refs && common.clients[i].bank == b && &common.clients[i] != c)
+			others |= common.clients[i].mask;
+	}
+
+	/* Pins subscribed by other clients can only be joined with the same configuration */
+	if (cfg->mode != gpio_irq_none) {
+		for (pin = 0; pin < 32; ++pin) {
+			if ((cfg->mask & others & (1 << pin)) &&
+					(common.gpio[b].mode[pin] != cfg->mode || common.gpio[b].debounce[pin] != cfg->debounce)) {
+				mutexUnlock(common.gpio[b].lock);
+				return -EBUSY;
+			}
+		}
+	}
+
+	if (cfg->mode == gpio_irq_none)
+		c->mask &= ~cfg->mask;
+	else
+		c->mask |= cfg->mask;
+
+	/* Configuration of pins shared with other clients stays as it is */
+	mask = cfg->mask & ~others;
+
+	common.gpio[b].enabled &= ~mask;
+	__atomic_and_fetch(&common.gpio[b].masked, ~mask, __ATOMIC_RELAXED);
+	gpio_imrUpdate(b);
+
+	for (pin = 0; pin < 32; ++pin) {
+		if (!(mask & (1 << pin)))
+			continue;
+
+		common.gpio[b].mode[pin] = cfg->mode;
+		common.gpio[b].debounce[pin] = cfg->debounce;
+		common.gpio[b].last[pin] = 0;
+
+		if (cfg->mode == gpio_irq_none)
+			continue;
+
+		if (cfg->mode == gpio_irq_both) {
+			*(base + edge) |= 1 << pin;
+		}
+		else {
+			*(base + edge) &= ~(1 << pin);
+			t = *(base + icr1 + (pin >> 4)) & ~(3 << ((pin & 0xf) << 1));
+			*(base + icr1 + (pin >> 4)) = t | ((cfg->mode - gpio_irq_low) << ((pin & 0xf) << 1));
+		}
+	}
+
+	common.gpio[b].level &= ~mask;
+	if (cfg->mode == gpio_irq_low || cfg->mode == gpio_irq_high)
+		common.gpio[b].level |= mask;
+
+	if (cfg->mode != gpio_irq_none && mask) {
+		*(base + isr) = mask;
+		common.gpio[b].enabled |= mask;
+		gpio_imrUpdate(b);
+	}
+
+	mutexUnlock(common.gpio[b].lock);
+
+	return EOK;
+}
+
+
+/* Queues events of interrupt snapshot for subscribed clients, called with bank lock held.
+ * Snapshot counter is converted to system time using the current time and counter value */
+static void gpio_dispatch(int b, gpioraw_t *raw, time_t now, uint32_t cnt)
+{
+	gpioevent_t ev;
+	gpioclient_t *c;
+	time_t ts = now - (uint32_t)(cnt - raw->cnt);
+	int pin, i;
+
+	for (pin = 0; pin < 32; ++pin) {
+		if (!(raw->isr & (1 << pin)))
+			continue;
+
+		/* Level interrupts are already throttled by client reads */
+		if (common.gpio[b].debounce[pin] && common.gpio[b].last[pin] && !(common.gpio[b].level & (1 << pin)) &&
+				ts - common.gpio[b].last[pin] < common.gpio[b].debounce[pin])
+			continue;
+
+		common.gpio[b].last[pin] = ts;
+
+		ev.pin = pin;
+		ev.timestamp = ts;
+
+		switch (common.gpio[b].mode[pin]) {
+			case gpio_irq_low:
+			case gpio_irq_falling:
+				ev.edge = 0;
+				break;
+
+			case gpio_irq_high:
+			case gpio_irq_rising:
+				ev.edge = 1;
+				break;
+
+			default:
+				ev.edge = (raw->psr >> pin) & 1;
+				break;
+		}
+
+		for (i = 0; i < GPIO_CLIENTS; ++i) {
+			c = &common.clients[i];
+
+			if (!c->refs || c->bank != b || !(c->mask & (1 << pin)))
+				continue;
+
+			if (c->head - c->tail < GPIO_QUEUE_SIZE)
+				memcpy(&c->queue[c->head++ % GPIO_QUEUE_SIZE], &ev, sizeof(ev));
+			else
+				c->overflow++;
+		}
+	}
+}
+
+
+static void gpio_irqthr(void *arg)
+{
+	int b = (int)arg, i;
+	gpioclient_t *c;
+	time_t now;
+	uint32_t cnt;
+	unsigned int head;
+
+	mutexLock(common.gpio[b].lock);
+
+	for (;;) {
+		while (common.gpio[b].rawtail == common.gpio[b].rawhead)
+			condWait(common.gpio[b].cond, common.gpio[b].lock, 0);
+
+		/* Snapshots taken after reading the counter are left for the next pass */
+		head = common.gpio[b].rawhead;
+		cnt = *(common.gpt + gpt_cnt);
+		gettime(&now, NULL);
+
+		while (common.gpio[b].rawtail != head) {
+			gpio_dispatch(b, &common.gpio[b].raw[common.gpio[b].rawtail % GPIO_RAW_SIZE], now, cnt);
+			common.gpio[b].rawtail++;
+		}
+
+		for (i = 0; i < GPIO_CLIENTS; ++i) {
+			c = &common.clients[i];
+
+			if (c->refs && c->bank == b && c->pending && c->tail != c->head)
+				gpio_clientRespond(c, gpio_clientRead(c, c->msg.o.data, c->msg.o.size));
+		}
+	}
+}
 
 
 int init(void)
@@ -65,6 +506,35 @@ int init(void)
 		}
 	}
 
+	if ((common.gpt = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_DEVICE | MAP_UNCACHED, OID_PHYSMEM, gpt_paddr)) == MAP_FAILED) {
+		printf("gpiodrv: Could not map gpt2 paddr %p\n", (void*) gpt_paddr);
+		return -1;
+	}
+
+	pctl.action = pctl_set;
+	pctl.type = pctl_devclock;
+	pctl.devclock.state = 3;
+	pctl.devclock.dev = pctl_clk_gpt2_bus;
+
+	if (platformctl(&pctl) != EOK) {
+		printf("gpiodrv: Could not enable clock for gpt2\n");
+		return -1;
+	}
+
+	pctl.devclock.dev = pctl_clk_gpt2_serial;
+
+	if (platformctl(&pctl) != EOK) {
+		printf("gpiodrv: Could not enable clock for gpt2\n");
+		return -1;
+	}
+
+	/* Free run mode clocked from 24 MHz oscillator divided down to 1 MHz */
+	*(common.gpt + gpt_cr) = 0;
+	*(common.gpt + gpt_ir) = 0;
+	*(common.gpt + gpt_pr) = 24 - 1;
+	*(common.gpt + gpt_cr) = (1 << 10) | (1 << 9) | (5 << 6) | (1 << 1);
+	*(common.gpt + gpt_cr) |= 1;
+
 	if (portCreate(&common.port) != EOK) {
 		printf("gpiodrv: Could not create port\n");
 		return -1;
@@ -96,6 +566,18 @@ int init(void)
 
 		common.gpio[i].dir = dev.id;
 
+		sprintf(devpath, "gpio%d/irq", i + 1);
+
+		dev.port = common.port;
+		dev.id = irq1 + i;
+
+		if ((err = create_dev(&dev, devpath)) != EOK) {
+			printf("gpiodrv: Could not create irq file #%d (err %d)\n", i + 1, err);
+			return - 1;
+		}
+
+		common.gpio[i].irq = dev.id;
+
 		pctl.action = pctl_set;
 		pctl.type = pctl_devclock;
 		pctl.devclock.state = 3;
@@ -110,6 +592,20 @@ int init(void)
 			printf("gpiodrv: Could not create mutex for gpio%d\n", i + 1);
 			return -1;
 		}
+
+		if (condCreate(&common.gpio[i].cond) < 0) {
+			printf("gpiodrv: Could not create cond for gpio%d\n", i + 1);
+			return -1;
+		}
+
+		/* All pins masked until configured through irq file */
+		*(common.gpio[i].base + imr) = 0;
+		*(common.gpio[i].base + isr) = 0xffffffff;
+
+		interrupt(irqs[i], gpio_irqHandler, (void *)i, common.gpio[i].cond, &common.gpio[i].inth[0]);
+		interrupt(irqs[i] + 1, gpio_irqHandler, (void *)i, common.gpio[i].cond, &common.gpio[i].inth[1]);
+
+		beginthread(gpio_irqthr, GPIO_IRQ_PRIO, common.gpio[i].stack, sizeof(common.gpio[i].stack), (void *)i);
 	}
 
 	return 0;
@@ -180,6 +676,8 @@ void thread(void *arg)
 	unsigned int rid;
 	int d;
 	uint32_t val, mask;
+	gpioirq_t irqcfg;
+	gpioclient_t *c;
 
 	while (1) {
 		if (msgRecv(common.port, &msg, &rid) < 0)
@@ -189,12 +687,42 @@ void thread(void *arg)
 
 		switch (msg.type) {
 			case mtOpen:
+				d = msg.i.openclose.oid.id;
+				msg.o.io.err = d < gpio1 || d > irq5 ? -ENOENT : EOK;
+
+				if (d >= irq1 && d <= irq5)
+					msg.o.io.err = gpio_clientOpen(msg.pid, d - irq1);
+				break;
+
 			case mtClose:
-				msg.o.io.err = msg.i.openclose.oid.id < gpio1 || msg.i.openclose.oid.id > dir5 ? -ENOENT : EOK;
+				d = msg.i.openclose.oid.id;
+				msg.o.io.err = d < gpio1 || d > irq5 ? -ENOENT : EOK;
+
+				if (d >= irq1 && d <= irq5)
+					msg.o.io.err = gpio_clientClose(msg.pid, d - irq1);
+				break;
+
+			case mtGetAttr:
+				d = msg.i.attr.oid.id;
+
+				if (msg.i.attr.type != atPollStatus || d < irq1 || d > irq5) {
+					msg.o.attr.val = -EINVAL;
+					break;
+				}
+
+				mutexLock(common.gpio[d - irq1].lock);
+				c = gpio_clientFind(msg.pid, d - irq1);
+				msg.o.attr.val = POLLOUT | ((c != NULL && c->tail != c->head) ? POLLIN : 0);
+				mutexUnlock(common.gpio[d - irq1].lock);
 				break;
 
 			case mtRead:
-				if (msg.o.data != NULL && msg.o.size >= sizeof(uint32_t)) {
+				if (msg.i.io.oid.id >= irq1 && msg.i.io.oid.id <= irq5) {
+					/* Blocking read is responded to by bank thread */
+					if (gpioreadevents(&msg, rid))
+						continue;
+				}
+				else if (msg.o.data != NULL && msg.o.size >= sizeof(uint32_t)) {
 					d = msg.i.io.oid.id;
 
 					if (d >= gpio1 && d <= gpio5) {
@@ -212,7 +740,15 @@ void thread(void *arg)
 				break;
 
 			case mtWrite:
-				if (msg.i.data != NULL && msg.i.size >= sizeof(uint32_t)) {
+				if (msg.i.io.oid.id >= irq1 && msg.i.io.oid.id <= irq5) {
+					if (msg.i.data != NULL && msg.i.size >= sizeof(gpioirq_t)) {
+						memcpy(&irqcfg, msg.i.data, sizeof(gpioirq_t));
+
+						if ((msg.o.io.err = gpiosetirq(msg.pid, msg.i.io.oid.id, &irqcfg)) == EOK)
+							msg.o.io.err = sizeof(gpioirq_t);
+					}
+				}
+				else if (msg.i.data != NULL && msg.i.size >= sizeof(uint32_t)) {
 					memcpy(&val, msg.i.data, sizeof(uint32_t));
 
 					if (msg.i.size >= sizeof(uint32_t) << 1)
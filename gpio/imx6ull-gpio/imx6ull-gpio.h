@@ -22,4 +22,23 @@ typedef union {
 	} __attribute__((packed)) w;
 } gpiodata_t;
 
+
+/* Interrupt modes, written to irq file in gpioirq_t */
+enum { gpio_irq_none = 0, gpio_irq_low, gpio_irq_high, gpio_irq_rising, gpio_irq_falling, gpio_irq_both };
+
+
+typedef struct {
+	unsigned int mask;
+	unsigned int mode;
+	unsigned int debounce; /* Minimal time between events on a pin (us), 0 disables debouncing */
+} __attribute__((packed)) gpioirq_t;
+
+
+/* Records read from irq file */
+typedef struct {
+	unsigned int pin;
+	unsigned int edge; /* 1 - rising edge/high level, 0 - falling edge/low level */
+	unsigned long long timestamp; /* us */
+} __attribute__((packed)) gpioevent_t;
+
 #endif
@@ -64,6 +64,72 @@
 #define UART_CONSOLE 1
 #endif
 
+/* UART eDMA channels (0 - 31), -1 - FIFO serviced by the CPU, always the case on SoCs without eDMA support (RT1170) */
+
+#ifndef UART1_DMA_RXCH
+#define UART1_DMA_RXCH -1
+#endif
+
+#ifndef UART1_DMA_TXCH
+#define UART1_DMA_TXCH -1
+#endif
+
+#ifndef UART2_DMA_RXCH
+#define UART2_DMA_RXCH -1
+#endif
+
+#ifndef UART2_DMA_TXCH
+#define UART2_DMA_TXCH -1
+#endif
+
+#ifndef UART3_DMA_RXCH
+#define UART3_DMA_RXCH -1
+#endif
+
+#ifndef UART3_DMA_TXCH
+#define UART3_DMA_TXCH -1
+#endif
+
+#ifndef UART4_DMA_RXCH
+#define UART4_DMA_RXCH -1
+#endif
+
+#ifndef UART4_DMA_TXCH
+#define UART4_DMA_TXCH -1
+#endif
+
+#ifndef UART5_DMA_RXCH
+#define UART5_DMA_RXCH -1
+#endif
+
+#ifndef UART5_DMA_TXCH
+#define UART5_DMA_TXCH -1
+#endif
+
+#ifndef UART6_DMA_RXCH
+#define UART6_DMA_RXCH -1
+#endif
+
+#ifndef UART6_DMA_TXCH
+#define UART6_DMA_TXCH -1
+#endif
+
+#ifndef UART7_DMA_RXCH
+#define UART7_DMA_RXCH -1
+#endif
+
+#ifndef UART7_DMA_TXCH
+#define UART7_DMA_TXCH -1
+#endif
+
+#ifndef UART8_DMA_RXCH
+#define UART8_DMA_RXCH -1
+#endif
+
+#ifndef UART8_DMA_TXCH
+#define UART8_DMA_TXCH -1
+#endif
+
 /* SPI */
 
 #ifndef SPI1
@@ -82,6 +148,40 @@
 #define SPI4 0
 #endif
 
+/* SPI eDMA channels (0 - 31), -1 - transfers limited to a single frame serviced by the CPU, always the case on SoCs without eDMA support (RT1170) */
+
+#ifndef SPI1_DMA_RXCH
+#define SPI1_DMA_RXCH 17
+#endif
+
+#ifndef SPI1_DMA_TXCH
+#define SPI1_DMA_TXCH 16
+#endif
+
+#ifndef SPI2_DMA_RXCH
+#define SPI2_DMA_RXCH 19
+#endif
+
+#ifndef SPI2_DMA_TXCH
+#define SPI2_DMA_TXCH 18
+#endif
+
+#ifndef SPI3_DMA_RXCH
+#define SPI3_DMA_RXCH 21
+#endif
+
+#ifndef SPI3_DMA_TXCH
+#define SPI3_DMA_TXCH 20
+#endif
+
+#ifndef SPI4_DMA_RXCH
+#define SPI4_DMA_RXCH 23
+#endif
+
+#ifndef SPI4_DMA_TXCH
+#define SPI4_DMA_TXCH 22
+#endif
+
 /* I2C */
 
 #ifndef I2C1
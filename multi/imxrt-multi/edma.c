@@ -0,0 +1,143 @@
+/*
+ * Phoenix-RTOS
+ *
+ * i.MX RT eDMA driver
+ *
+ * Copyright 2019 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+
+#include <errno.h>
+#include <stdint.h>
+#include <sys/interrupt.h>
+#include <sys/platform.h>
+
+#include "common.h"
+#include "edma.h"
+
+
+#ifdef EDMA_BASE
+
+
+struct {
+	volatile uint32_t *base;
+	volatile uint32_t *mux;
+} edma_common;
+
+
+/* 32-bit registers (word offsets) */
+enum { cr = 0, es, erq = 3, eei = 5, intr = 9, err = 11, hrs = 13 };
+
+
+/* 8-bit registers (byte offsets) */
+enum { ceei = 0x18, seei, cerq, serq, cdne, ssrt, cerr, cint };
+
+
+static inline void edma_writeb(unsigned int reg, uint8_t val)
+{
+	*((volatile uint8_t *)edma_common.base + reg) = val;
+}
+
+
+int edma_configureChannel(int channel, int source, int (*handler)(unsigned int, void *), void *arg, handle_t cond,
+	handle_t *inth)
+{
+	if (channel < 0 || channel >= EDMA_CHANNELS || source < 0)
+		return -EINVAL;
+
+	edma_disableRequest(channel);
+
+	*(edma_common.mux + channel) = 0;
+	common_dataBarrier();
+	*(edma_common.mux + channel) = (1u << 31) | source;
+
+	if (handler != NULL)
+		return interrupt(EDMA_IRQ + (channel & 0xf), handler, arg, cond, inth);
+
+	return EOK;
+}
+
+
+volatile edma_tcd_t *edma_getTcd(int channel)
+{
+	return (volatile edma_tcd_t *)(edma_common.base + (0x1000 + 0x20 * channel) / sizeof(uint32_t));
+}
+
+
+void edma_loadTcd(int channel, const edma_tcd_t *tcd)
+{
+	volatile edma_tcd_t *t = edma_getTcd(channel);
+
+	t->csr = 0;
+	t->saddr = tcd->saddr;
+	t->soff = tcd->soff;
+	t->attr = tcd->attr;
+	t->nbytes = tcd->nbytes;
+	t->slast = tcd->slast;
+	t->daddr = tcd->daddr;
+	t->doff = tcd->doff;
+	t->citer = tcd->citer;
+	t->dlast_sga = tcd->dlast_sga;
+	t->biter = tcd->biter;
+	common_dataBarrier();
+	t->csr = tcd->csr;
+}
+
+
+void edma_enableRequest(int channel)
+{
+	common_dataBarrier();
+	edma_writeb(serq, channel);
+}
+
+
+void edma_disableRequest(int channel)
+{
+	edma_writeb(cerq, channel);
+	common_dataBarrier();
+}
+
+
+int edma_clearIntr(int channel)
+{
+	if (!(*(edma_common.base + intr) & (1u << channel)))
+		return 0;
+
+	edma_writeb(cint, channel);
+
+	return 1;
+}
+
+
+int edma_clearError(int channel)
+{
+	if (!(*(edma_common.base + err) & (1u << channel)))
+		return 0;
+
+	edma_writeb(cerr, channel);
+
+	return 1;
+}
+
+
+int edma_init(void)
+{
+	edma_common.base = EDMA_BASE;
+	edma_common.mux = DMAMUX_BASE;
+
+	if (edma_common.base == NULL)
+		return -ENODEV;
+
+	common_setClock(EDMA_CLK, clk_state_run);
+
+	/* Fixed priority arbitration, channel n has priority n after reset. Errors don't halt other channels */
+	*(edma_common.base + cr) &= ~((1 << 4) | (1 << 2));
+
+	return EOK;
+}
+
+#endif
@@ -0,0 +1,86 @@
+/*
+ * Phoenix-RTOS
+ *
+ * i.MX RT eDMA driver
+ *
+ * Copyright 2019 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+
+#ifndef _EDMA_H_
+#define _EDMA_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+
+#define EDMA_CHANNELS 32
+
+/* Maximum major loop count (channel linking is not used) */
+#define EDMA_MAX_ITER 0x7fff
+
+
+/* Transfer Control Descriptor */
+typedef struct {
+	volatile uint32_t saddr;
+	volatile uint16_t soff;
+	volatile uint16_t attr;
+	volatile uint32_t nbytes;
+	volatile uint32_t slast;
+	volatile uint32_t daddr;
+	volatile uint16_t doff;
+	volatile uint16_t citer;
+	volatile uint32_t dlast_sga;
+	volatile uint16_t csr;
+	volatile uint16_t biter;
+} edma_tcd_t;
+
+
+enum { edma_size8 = 0, edma_size16, edma_size32 };
+
+
+#define EDMA_ATTR(ssize, dsize) (((ssize) << 8) | (dsize))
+
+
+/* TCD control and status bits */
+enum { EDMA_CSR_START = 1 << 0, EDMA_CSR_INTMAJOR = 1 << 1, EDMA_CSR_INTHALF = 1 << 2, EDMA_CSR_DREQ = 1 << 3,
+	EDMA_CSR_ESG = 1 << 4, EDMA_CSR_ACTIVE = 1 << 6, EDMA_CSR_DONE = 1 << 7 };
+
+
+/* Routes request source (DMAMUX) to the channel. If handler is set it is registered on the channel's
+ * interrupt line, which is shared by channels n and n + 16 */
+int edma_configureChannel(int channel, int source, int (*handler)(unsigned int, void *), void *arg, handle_t cond,
+	handle_t *inth);
+
+
+volatile edma_tcd_t *edma_getTcd(int channel);
+
+
+/* Loads TCD into the channel. With EDMA_CSR_ESG set, dlast_sga points to the next TCD of a chain,
+ * which has to be 32-byte aligned */
+void edma_loadTcd(int channel, const edma_tcd_t *tcd);
+
+
+void edma_enableRequest(int channel);
+
+
+void edma_disableRequest(int channel);
+
+
+/* Returns 1 if channel's interrupt flag was set and clears it */
+int edma_clearIntr(int channel);
+
+
+/* Returns 1 if channel's error flag was set and clears it */
+int edma_clearError(int channel);
+
+
+/* Defined only if the SoC header defines EDMA_BASE */
+int edma_init(void);
+
+
+#endif
@@ -11,10 +11,17 @@
  * %LICENSE%
  */
 
+#include <sys/interrupt.h>
+#include <sys/threads.h>
+#include <sys/list.h>
 #include <sys/msg.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
 
 #include "common.h"
 #include "gpio.h"
+#include "i2c.h"
 
 #define I2C1_POS 0
 #define I2C2_POS (I2C1_POS + I2C1)
@@ -23,6 +30,21 @@
 
 #define I2C_CNT (I2C1 + I2C2 + I2C3 + I2C4)
 
+/* Transfer without bus progress within I2C_TIMEOUT is aborted (in us) */
+#define I2C_TIMEOUT 100000
+
+/* Transactions which lost arbitration are reissued I2C_RETRIES times */
+#define I2C_RETRIES 3
+
+#define I2C_MAX_MSGS 32
+
+/* Single receive command reads up to 256 bytes */
+#define I2C_MAX_RXCMD 256
+
+/* High speed mode master code, sent at fast mode rate */
+#define I2C_HS_MASTERCODE 0x08
+
+
 static const int i2cConfig[] = { I2C1, I2C2, I2C3, I2C4 };
 
 
@@ -34,15 +56,569 @@ enum { veridr = 0, paramr, mcr = 4, msr, mier, mder, mscfgr0, mscfgr1, mscfgr2,
 	scfgr1 = 73, scfgr2, samr = 80, sasr = 84, star, stdr= 88, srdr= 92 };
 
 
-int i2c_handleMsg(msg_t *msg, int dev)
+/* Master status and interrupt enable bits */
+enum { I2C_MSR_TDF = 1 << 0, I2C_MSR_RDF = 1 << 1, I2C_MSR_EPF = 1 << 8, I2C_MSR_SDF = 1 << 9,
+	I2C_MSR_NDF = 1 << 10, I2C_MSR_ALF = 1 << 11, I2C_MSR_FEF = 1 << 12, I2C_MSR_PLTF = 1 << 13,
+	I2C_MSR_DMF = 1 << 14, I2C_MSR_MBF = 1 << 24, I2C_MSR_BBF = 1 << 25 };
+
+
+#define I2C_MSR_ERR (I2C_MSR_NDF | I2C_MSR_ALF | I2C_MSR_FEF | I2C_MSR_PLTF)
+#define I2C_MSR_W1C (0x7f << 8)
+
+
+/* Transmit FIFO commands */
+enum { i2c_cmd_tx = 0, i2c_cmd_rx, i2c_cmd_stop, i2c_cmd_rxDiscard, i2c_cmd_start, i2c_cmd_startNack,
+	i2c_cmd_startHs, i2c_cmd_startHsNack };
+
+
+/* Request waiting for the bus thread, it's responded once served */
+typedef struct _i2c_req_t {
+	struct _i2c_req_t *next, *prev;
+
+	msg_t msg;
+	unsigned int rid;
+} i2c_req_t;
+
+
+typedef struct {
+	char stack[1024] __attribute__ ((aligned(8)));
+
+	volatile uint32_t *base;
+
+	handle_t lock;
+	handle_t qcond;
+	handle_t irqLock;
+	handle_t cond;
+	handle_t inth;
+	volatile int ready;
+
+	unsigned int txFifo;
+	unsigned int rxFifo;
+	unsigned int speed;
+
+	/* Requests are served by the bus thread in arrival order, server threads don't wait for the bus */
+	i2c_req_t *queue;
+
+	/* Transaction in progress, commands are generated as the transmit FIFO drains */
+	const i2c_msg_t *msgs;
+	unsigned int cnt;
+	unsigned int msg;
+	unsigned int pos;
+	int started;
+	int hs;
+	const uint8_t *tx;
+	uint8_t *rx;
+	size_t rxLeft;
+} i2c_bus_t;
+
+
+i2c_bus_t i2c_common[I2C_CNT];
+
+
+static int i2c_irqHandler(unsigned int n, void *arg)
+{
+	i2c_bus_t *bus = (i2c_bus_t *)arg;
+
+	*(bus->base + mier) = 0;
+	bus->ready = 1;
+
+	return 0;
+}
+
+
+/* Returns MCCR value for the highest rate not exceeding the given one or 0 if it can't be reached with the prescaler */
+static uint32_t i2c_clkCfg(unsigned int rate, unsigned int prescale, int standard)
+{
+	unsigned int cycles, latency, hi, lo;
+
+	/* SCL period is (CLKHI + CLKLO + 2 + SCL_LATENCY) prescaled cycles, rounded up to stay below the rate */
+	cycles = (I2C_CLK + (rate << prescale) - 1) / (rate << prescale);
+	latency = 2 >> prescale;
+
+	if (cycles < 2 + latency + 4)
+		cycles = 2 + latency + 4;
+
+	cycles -= 2 + latency;
+
+	/* Standard mode needs longer high period, others run with 1:2 duty */
+	hi = standard ? cycles / 2 : cycles / 3;
+	lo = cycles - hi;
+
+	if (hi > 63 || lo > 63)
+		return 0;
+
+	return ((hi / 2) << 24) | (hi << 16) | (hi << 8) | lo;
+}
+
+
+static int i2c_setSpeed(i2c_bus_t *bus, unsigned int speed)
+{
+	static const unsigned int rates[] = { 100000, 400000, 1000000, 3400000 };
+	uint32_t ccr0 = 0, ccr1 = 0;
+	unsigned int prescale;
+
+	if (speed >= sizeof(rates) / sizeof(rates[0]))
+		return -EINVAL;
+
+	/* High speed transfers start with the master code at fast mode rate */
+	for (prescale = 0; prescale < 8; ++prescale) {
+		if ((ccr0 = i2c_clkCfg(rates[(speed == i2c_speed_high) ? i2c_speed_fast : speed], prescale, speed == i2c_speed_standard)) != 0)
+			break;
+	}
+
+	if (ccr0 == 0)
+		return -EINVAL;
+
+	if (speed == i2c_speed_high)
+		ccr1 = i2c_clkCfg(rates[speed], prescale, 0);
+
+	*(bus->base + mcr) &= ~1;
+	*(bus->base + mscfgr1) = (*(bus->base + mscfgr1) & ~0x7) | prescale;
+	*(bus->base + mccr0) = ccr0;
+	*(bus->base + mccr1) = ccr1;
+	*(bus->base + mcr) |= 1;
+
+	bus->speed = speed;
+
+	return EOK;
+}
+
+
+static void i2c_drain(i2c_bus_t *bus)
+{
+	uint32_t data;
+
+	while (bus->rxLeft) {
+		data = *(bus->base + mrdr);
+
+		/* RXEMPTY */
+		if (data & (1 << 14))
+			break;
+
+		*bus->rx++ = data & 0xff;
+		bus->rxLeft--;
+	}
+}
+
+
+static void i2c_fill(i2c_bus_t *bus)
+{
+	const i2c_msg_t *m;
+	uint32_t cmd;
+	unsigned int n;
+
+	while (bus->msg < bus->cnt && (*(bus->base + mfsr) & 0x7) < bus->txFifo) {
+		m = &bus->msgs[bus->msg];
+
+		if (!bus->started) {
+			if (bus->speed == i2c_speed_high && !bus->hs) {
+				cmd = (i2c_cmd_startNack << 8) | I2C_HS_MASTERCODE;
+				bus->hs = 1;
+			}
+			else {
+				cmd = (((bus->speed == i2c_speed_high) ? i2c_cmd_startHs : i2c_cmd_start) << 8) |
+					(m->addr << 1) | ((m->flags & i2c_msg_read) ? 1 : 0);
+				bus->started = 1;
+			}
+		}
+		else if (bus->pos < m->len) {
+			if (m->flags & i2c_msg_read) {
+				n = m->len - bus->pos;
+				if (n > I2C_MAX_RXCMD)
+					n = I2C_MAX_RXCMD;
+				cmd = (i2c_cmd_rx << 8) | (n - 1);
+			}
+			else {
+				n = 1;
+				cmd = (i2c_cmd_tx << 8) | *bus->tx++;
+			}
+
+			bus->pos += n;
+		}
+		else {
+			/* Next message starts with a repeated START, the last one ends with STOP */
+			bus->msg++;
+			bus->pos = 0;
+			bus->started = 0;
+
+			if (bus->msg < bus->cnt)
+				continue;
+
+			cmd = i2c_cmd_stop << 8;
+		}
+
+		*(bus->base + mtdr) = cmd;
+	}
+}
+
+
+/* Aborts transaction without resetting the bus: FIFOs are flushed and STOP is sent if the master owns the bus */
+static int i2c_abort(i2c_bus_t *bus, uint32_t status)
+{
+	volatile uint32_t *base = bus->base;
+	int i;
+
+	*(base + mier) = 0;
+	*(base + mcr) |= (1 << 9) | (1 << 8);
+	*(base + msr) = I2C_MSR_W1C;
+
+	if (!(status & I2C_MSR_ALF) && (*(base + msr) & I2C_MSR_MBF)) {
+		*(base + mtdr) = i2c_cmd_stop << 8;
+
+		for (i = 0; i < I2C_TIMEOUT / 1000 && (*(base + msr) & I2C_MSR_MBF); ++i)
+			usleep(1000);
+
+		*(base + msr) = I2C_MSR_W1C;
+	}
+
+	if (status & I2C_MSR_ALF)
+		return -EAGAIN;
+
+	if (status & I2C_MSR_NDF)
+		return -ENXIO;
+
+	if (status & I2C_MSR_FEF)
+		return -EIO;
+
+	return -ETIMEDOUT;
+}
+
+
+static int i2c_run(i2c_bus_t *bus, const i2c_msg_t *msgs, unsigned int cnt, const uint8_t *tx, uint8_t *rx, size_t rxLen)
+{
+	volatile uint32_t *base = bus->base;
+	uint32_t status, ier;
+	unsigned int rxWater;
+	int err = EOK;
+
+	bus->msgs = msgs;
+	bus->cnt = cnt;
+	bus->msg = 0;
+	bus->pos = 0;
+	bus->started = 0;
+	bus->hs = 0;
+	bus->tx = tx;
+	bus->rx = rx;
+	bus->rxLeft = rxLen;
+
+	*(base + msr) = I2C_MSR_W1C;
+
+	mutexLock(bus->irqLock);
+
+	for (;;) {
+		status = *(base + msr);
+		i2c_drain(bus);
+
+		if (status & I2C_MSR_ERR) {
+			err = i2c_abort(bus, status);
+			break;
+		}
+
+		i2c_fill(bus);
+
+		if (bus->msg == bus->cnt && !bus->rxLeft && (status & I2C_MSR_SDF))
+			break;
+
+		/* Wake up on half empty transmit FIFO, half full receive FIFO or STOP */
+		rxWater = (bus->rxLeft < bus->rxFifo / 2) ? bus->rxLeft : bus->rxFifo / 2;
+		*(base + mfcr) = ((rxWater ? rxWater - 1 : 0) << 16) | (bus->txFifo / 2 - 1);
+
+		ier = I2C_MSR_ERR | I2C_MSR_SDF;
+		if (bus->msg < bus->cnt)
+			ier |= I2C_MSR_TDF;
+		if (bus->rxLeft)
+			ier |= I2C_MSR_RDF;
+
+		bus->ready = 0;
+		*(base + mier) = ier;
+
+		while (!bus->ready) {
+			if (condWait(bus->cond, bus->irqLock, I2C_TIMEOUT) < 0 && !bus->ready)
+				break;
+		}
+
+		if (!bus->ready) {
+			err = i2c_abort(bus, *(base + msr));
+			break;
+		}
+	}
+
+	mutexUnlock(bus->irqLock);
+
+	return err;
+}
+
+
+static int i2c_performTransfer(i2c_bus_t *bus, const i2c_msg_t *msgs, unsigned int cnt, const uint8_t *tx, uint8_t *rx, unsigned int *done)
+{
+	unsigned int first, last, retry;
+	size_t txLen, rxLen;
+	int i, err = EOK;
+
+	*done = 0;
+
+	for (first = 0; first < cnt && err == EOK; first = last + 1) {
+		txLen = 0;
+		rxLen = 0;
+
+		for (last = first; ; ++last) {
+			if (msgs[last].flags & i2c_msg_read)
+				rxLen += msgs[last].len;
+			else
+				txLen += msgs[last].len;
+
+			if ((msgs[last].flags & i2c_msg_stop) || last == cnt - 1)
+				break;
+		}
+
+		for (retry = 0; ; ++retry) {
+			err = i2c_run(bus, &msgs[first], last - first + 1, tx, rx, rxLen);
+
+			if (err != -EAGAIN || retry >= I2C_RETRIES)
+				break;
+
+			/* Arbitration lost, retry once the other master releases the bus */
+			for (i = 0; i < I2C_TIMEOUT / 1000 && (*(bus->base + msr) & I2C_MSR_BBF); ++i)
+				usleep(1000);
+		}
+
+		if (err == EOK) {
+			*done = last + 1;
+			tx += txLen;
+			rx += rxLen;
+		}
+	}
+
+	return err;
+}
+
+
+static int i2c_handleTransfer(i2c_bus_t *bus, msg_t *msg, unsigned int cnt, unsigned int *done)
+{
+	const i2c_msg_t *msgs = msg->i.data;
+	size_t txLen = 0, rxLen = 0;
+	unsigned int i;
+
+	if (cnt == 0 || cnt > I2C_MAX_MSGS || msgs == NULL || msg->i.size < cnt * sizeof(i2c_msg_t))
+		return -EINVAL;
+
+	for (i = 0; i < cnt; ++i) {
+		if (msgs[i].addr > 0x7f)
+			return -EINVAL;
+
+		if (msgs[i].flags & i2c_msg_read) {
+			/* Slave can't be addressed for reading without clocking a byte out of it */
+			if (msgs[i].len == 0)
+				return -EINVAL;
+			rxLen += msgs[i].len;
+		}
+		else {
+			txLen += msgs[i].len;
+		}
+	}
+
+	if (msg->i.size != cnt * sizeof(i2c_msg_t) + txLen || msg->o.size < rxLen || (rxLen && msg->o.data == NULL))
+		return -EINVAL;
+
+	return i2c_performTransfer(bus, msgs, cnt, (const uint8_t *)(msgs + cnt), msg->o.data, done);
+}
+
+
+static void i2c_handleDevCtl(i2c_bus_t *bus, msg_t *msg)
+{
+	multi_i_t *idevctl = (multi_i_t *)msg->i.raw;
+	multi_o_t *odevctl = (multi_o_t *)msg->o.raw;
+
+	odevctl->val = 0;
+
+	switch (idevctl->i2c.type) {
+		case i2c_config:
+			odevctl->err = i2c_setSpeed(bus, idevctl->i2c.config.speed);
+			break;
+
+		case i2c_transfer:
+			odevctl->err = i2c_handleTransfer(bus, msg, idevctl->i2c.transfer.cnt, &odevctl->val);
+			break;
+
+		default:
+			odevctl->err = -ENOSYS;
+			break;
+	}
+}
+
+
+static void i2c_thread(void *arg)
+{
+	i2c_bus_t *bus = (i2c_bus_t *)arg;
+	i2c_req_t *req;
+
+	for (;;) {
+		mutexLock(bus->lock);
+		while (bus->queue == NULL)
+			condWait(bus->qcond, bus->lock, 0);
+
+		req = bus->queue;
+		LIST_REMOVE(&bus->queue, req);
+		mutexUnlock(bus->lock);
+
+		i2c_handleDevCtl(bus, &req->msg);
+
+		msgRespond(multi_port, &req->msg, req->rid);
+		free(req);
+	}
+}
+
+
+/* Device control requests are queued to the bus thread, returns 1 if the message is responded by it */
+static int i2c_queueDevCtl(msg_t *msg, unsigned int rid, int dev)
+{
+	multi_o_t *odevctl = (multi_o_t *)msg->o.raw;
+	i2c_bus_t *bus;
+	i2c_req_t *req;
+
+	dev -= id_i2c1;
+	odevctl->val = 0;
+
+	if (!i2cConfig[dev]) {
+		odevctl->err = -EINVAL;
+		return 0;
+	}
+
+	if ((req = malloc(sizeof(*req))) == NULL) {
+		odevctl->err = -ENOMEM;
+		return 0;
+	}
+
+	req->msg = *msg;
+	req->rid = rid;
+
+	bus = &i2c_common[i2cPos[dev]];
+
+	mutexLock(bus->lock);
+	LIST_ADD(&bus->queue, req);
+	condSignal(bus->qcond);
+	mutexUnlock(bus->lock);
+
+	return 1;
+}
+
+
+int i2c_handleMsg(msg_t *msg, unsigned int rid, int dev)
+{
+	switch (msg->type) {
+		case mtGetAttr:
+		case mtOpen:
+		case mtClose:
+		case mtSetAttr:
+		case mtWrite:
+		case mtRead:
+			msg->o.io.err = EOK;
+			break;
+
+		case mtDevCtl:
+			return i2c_queueDevCtl(msg, rid, dev);
+	}
+
+	return 0;
+}
+
+
+static int i2c_muxVal(int mux)
+{
+	switch (mux) {
+		case pctl_mux_gpio_ad_b1_06 :
+		case pctl_mux_gpio_ad_b1_07 :
+		case pctl_mux_gpio_emc_12 :
+		case pctl_mux_gpio_emc_11 :
+			return 1;
+
+		case pctl_mux_gpio_sd_b1_04 :
+		case pctl_mux_gpio_sd_b1_05 :
+		case pctl_mux_gpio_b0_04 :
+		case pctl_mux_gpio_b0_05 :
+		case pctl_mux_gpio_emc_21 :
+		case pctl_mux_gpio_emc_22 :
+		case pctl_mux_gpio_sd_b0_00 :
+		case pctl_mux_gpio_sd_b0_01 :
+			return 2;
+
+		case pctl_mux_gpio_ad_b0_12 :
+		case pctl_mux_gpio_ad_b0_13 :
+			return 0;
+
+		default :
+			return 3;
+	}
+}
+
+
+static int i2c_getIsel(int mux, int *isel, int *val)
 {
-	return -1;
+	switch (mux) {
+		case pctl_mux_gpio_sd_b1_04 :  *isel = pctl_isel_lpi2c1_scl; *val = 0; break;
+		case pctl_mux_gpio_ad_b1_00 :  *isel = pctl_isel_lpi2c1_scl; *val = 1; break;
+		case pctl_mux_gpio_sd_b1_05 :  *isel = pctl_isel_lpi2c1_sda; *val = 0; break;
+		case pctl_mux_gpio_ad_b1_01 :  *isel = pctl_isel_lpi2c1_sda; *val = 1; break;
+		case pctl_mux_gpio_sd_b1_11 :  *isel = pctl_isel_lpi2c2_scl; *val = 0; break;
+		case pctl_mux_gpio_b0_04 :     *isel = pctl_isel_lpi2c2_scl; *val = 1; break;
+		case pctl_mux_gpio_sd_b1_10 :  *isel = pctl_isel_lpi2c2_sda; *val = 0; break;
+		case pctl_mux_gpio_b0_05 :     *isel = pctl_isel_lpi2c2_sda; *val = 1; break;
+		case pctl_mux_gpio_emc_22 :    *isel = pctl_isel_lpi2c3_scl; *val = 0; break;
+		case pctl_mux_gpio_sd_b0_00 :  *isel = pctl_isel_lpi2c3_scl; *val = 1; break;
+		case pctl_mux_gpio_ad_b1_07 :  *isel = pctl_isel_lpi2c3_scl; *val = 2; break;
+		case pctl_mux_gpio_emc_21 :    *isel = pctl_isel_lpi2c3_sda; *val = 0; break;
+		case pctl_mux_gpio_sd_b0_01 :  *isel = pctl_isel_lpi2c3_sda; *val = 1; break;
+		case pctl_mux_gpio_ad_b1_06 :  *isel = pctl_isel_lpi2c3_sda; *val = 2; break;
+		case pctl_mux_gpio_emc_12 :    *isel = pctl_isel_lpi2c4_scl; *val = 0; break;
+		case pctl_mux_gpio_ad_b0_12 :  *isel = pctl_isel_lpi2c4_scl; *val = 1; break;
+		case pctl_mux_gpio_emc_11 :    *isel = pctl_isel_lpi2c4_sda; *val = 0; break;
+		case pctl_mux_gpio_ad_b0_13 :  *isel = pctl_isel_lpi2c4_sda; *val = 1; break;
+		default: return -1;
+	}
+
+	return 0;
+}
+
+
+static void i2c_initPins(void)
+{
+	int i, isel, val;
+	static const struct {
+		int mux;
+		int pad;
+	} pins[] = {
+#if I2C1
+		{ PIN2MUX(I2C1_SCL_PIN), PIN2PAD(I2C1_SCL_PIN) }, { PIN2MUX(I2C1_SDA_PIN), PIN2PAD(I2C1_SDA_PIN) },
+#endif
+#if I2C2
+		{ PIN2MUX(I2C2_SCL_PIN), PIN2PAD(I2C2_SCL_PIN) }, { PIN2MUX(I2C2_SDA_PIN), PIN2PAD(I2C2_SDA_PIN) },
+#endif
+#if I2C3
+		{ PIN2MUX(I2C3_SCL_PIN), PIN2PAD(I2C3_SCL_PIN) }, { PIN2MUX(I2C3_SDA_PIN), PIN2PAD(I2C3_SDA_PIN) },
+#endif
+#if I2C4
+		{ PIN2MUX(I2C4_SCL_PIN), PIN2PAD(I2C4_SCL_PIN) }, { PIN2MUX(I2C4_SDA_PIN), PIN2PAD(I2C4_SDA_PIN) },
+#endif
+	};
+
+	for (i = 0; i < sizeof(pins) / sizeof(pins[0]); ++i) {
+		/* Open drain with 22k pull-up, input path forced for reading back the bus */
+		common_setMux(pins[i].mux, 1, i2c_muxVal(pins[i].mux));
+		common_setPad(pins[i].pad, 0, 3, 1, 1, 1, 2, 6, 0);
+
+		if (i2c_getIsel(pins[i].mux, &isel, &val) < 0)
+			continue;
+
+		common_setInput(isel, val);
+	}
 }
 
 
 int i2c_init(void)
 {
 	int i, dev;
+	i2c_bus_t *bus;
+	uint32_t param;
 	static const struct {
 		volatile uint32_t *base;
 		int clk;
@@ -54,10 +630,44 @@ int i2c_init(void)
 		{ I2C4_BASE, I2C4_CLK, I2C4_IRQ }
 	};
 
-	//i2c_initPins();
+	i2c_initPins();
+
 	for (i = 0, dev = 0; dev < sizeof(i2cConfig) / sizeof(i2cConfig[0]); ++dev) {
 		if (!i2cConfig[dev])
 			continue;
+
+		bus = &i2c_common[i++];
+
+		if (common_setClock(info[dev].clk, clk_state_run) < 0)
+			return -EFAULT;
+
+		if (mutexCreate(&bus->lock) != EOK || mutexCreate(&bus->irqLock) != EOK ||
+			condCreate(&bus->qcond) != EOK || condCreate(&bus->cond) != EOK)
+			return -ENOENT;
+
+		bus->base = info[dev].base;
+		bus->ready = 1;
+
+		/* Software reset, FIFOs sizes are implementation specific */
+		*(bus->base + mcr) = 1 << 1;
+		*(bus->base + mcr) = 0;
+
+		param = *(bus->base + paramr);
+		bus->txFifo = 1 << (param & 0xf);
+		bus->rxFifo = 1 << ((param >> 8) & 0xf);
+
+		/* Open drain 2-pin mode, stuck SCL or SDA is reported after the longest pin low timeout */
+		*(bus->base + mscfgr1) = 0;
+		*(bus->base + mscfgr2) = 0;
+		*(bus->base + mscfgr3) = 0xfff << 8;
+		*(bus->base + mier) = 0;
+
+		i2c_setSpeed(bus, i2c_speed_standard);
+
+		interrupt(info[dev].irq, i2c_irqHandler, bus, bus->cond, &bus->inth);
+
+		bus->queue = NULL;
+		beginthread(i2c_thread, 2, bus->stack, sizeof(bus->stack), bus);
 	}
 
 	return 0;
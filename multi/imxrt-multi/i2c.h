@@ -15,7 +15,8 @@
 #define _I2C_H_
 
 
-int i2c_handleMsg(msg_t *msg, int dev);
+/* Returns 1 if the message is queued and responded later by the driver */
+int i2c_handleMsg(msg_t *msg, unsigned int rid, int dev);
 
 
 int i2c_init(void);
@@ -29,6 +29,7 @@
 
 #include "common.h"
 
+#include "edma.h"
 #include "uart.h"
 #include "gpio.h"
 #include "spi.h"
@@ -47,7 +48,8 @@ struct {
 } common;
 
 
-static void multi_dispatchMsg(msg_t *msg)
+/* Returns 1 if the message is responded later by the driver */
+static int multi_dispatchMsg(msg_t *msg, unsigned int rid)
 {
 	id_t id;
 	multi_i_t *imsg;
@@ -79,12 +81,13 @@ static void multi_dispatchMsg(msg_t *msg)
 		case id_i2c2:
 		case id_i2c3:
 		case id_i2c4:
-			i2c_handleMsg(msg, id);
-			break;
+			return i2c_handleMsg(msg, rid, id);
 
 		default:
-			return;
+			break;
 	}
+
+	return 0;
 }
 
 
@@ -288,7 +291,8 @@ static void multi_thread(void *arg)
 			case mtGetAttr:
 			case mtSetAttr:
 			case mtDevCtl:
-				multi_dispatchMsg(&msg);
+				if (multi_dispatchMsg(&msg, rid) > 0)
+					continue;
 				break;
 
 			case mtOpen:
@@ -366,9 +370,13 @@ int main(void)
 	portCreate(&common.uart_port);
 	portCreate(&multi_port);
 
+#ifdef EDMA_BASE
+	edma_init();
+#endif
 	uart_init();
 	gpio_init();
 	spi_init();
+	i2c_init();
 
 	for (i = 0; i < UART_THREADS_NO; ++i)
 		beginthread(uart_thread, THREADS_PRIORITY, common.stack[i], STACKSZ, (void *)i);
@@ -15,6 +15,7 @@
 #define _IMXRT_MULTI_H_
 
 #include <stdlib.h>
+#include <sys/ioctl.h>
 
 /* IDs of special files OIDs */
 enum { id_console = 0, id_uart1, id_uart2, id_uart3, id_uart4, id_uart5, id_uart6, id_uart7, id_uart8,
@@ -46,6 +47,21 @@ typedef struct {
 
 
 
+/* UART */
+
+
+typedef struct {
+	unsigned int overrun;       /* receiver overruns (hardware FIFO or DMA buffer) */
+	unsigned int rxDma;         /* RX DMA buffer completions (idle line, half or full buffer) */
+	unsigned int txDma;         /* TX DMA transfer completions */
+} uart_stats_t;
+
+
+/* Per-port counters, requested with ioctl() on the uart device */
+#define UART_GETSTATS _IOR('u', 0x80, uart_stats_t)
+
+
+
 /* SPI */
 
 
@@ -56,7 +72,7 @@ enum { spi_mode_0 = 0, spi_mode_1, spi_mode_2, spi_mode_3 };
 
 
 typedef struct {
-	enum { spi_config = 0, spi_transaction } type;
+	enum { spi_config = 0, spi_transaction, spi_transfer } type;
 
 	union {
 		struct {
@@ -71,12 +87,60 @@ typedef struct {
 			unsigned int frameSize;
 			unsigned char cs;
 		} transaction;
+
+		/* Client buffers passed by reference (shared address space), tx or rx may be NULL.
+		 * Requires eDMA channels configured for the port */
+		struct {
+			const void *tx;
+			void *rx;
+			size_t len;
+			unsigned char cs;
+		} transfer;
 	};
 
 } spi_t;
 
 
 
+/* I2C */
+
+
+/* 100 kHz, 400 kHz, 1 MHz, 3.4 MHz */
+enum { i2c_speed_standard = 0, i2c_speed_fast, i2c_speed_fastplus, i2c_speed_high };
+
+
+/* Message flags: read from the slave, end the transaction with STOP (the last message always does) */
+enum { i2c_msg_read = 1 << 0, i2c_msg_stop = 1 << 1 };
+
+
+typedef struct {
+	unsigned short addr;        /* 7-bit slave address */
+	unsigned short flags;
+	unsigned int len;
+} i2c_msg_t;
+
+
+/*
+ * i2c_transfer - msg.i.data holds cnt messages followed by the data of write messages,
+ * data of read messages is returned in msg.o.data. Messages up to the STOP are issued with
+ * repeated STARTs, next transaction is queued behind it. Completed messages are returned in val.
+ */
+typedef struct {
+	enum { i2c_config = 0, i2c_transfer } type;
+
+	union {
+		struct {
+			unsigned int speed;
+		} config;
+
+		struct {
+			unsigned int cnt;
+		} transfer;
+	};
+} i2c_t;
+
+
+
 /* MULTI */
 
 
@@ -86,6 +150,7 @@ typedef struct _multi_i_t {
 	union {
 		gpio_t gpio;
 		spi_t spi;
+		i2c_t i2c;
 	};
 
 } multi_i_t;
@@ -47,6 +47,38 @@
 #define UART7_IRQ 26 + 16
 #define UART8_IRQ 27 + 16
 
+/* eDMA support, other SoCs service peripherals by the CPU */
+#define EDMA_BASE ((void *)0x400e8000)
+#define DMAMUX_BASE ((void *)0x400ec000)
+#define EDMA_CLK pctl_clk_dma
+#define EDMA_IRQ 0 + 16
+
+/* DMAMUX request sources */
+#define UART1_DMA_TXREQ 2
+#define UART1_DMA_RXREQ 3
+#define UART2_DMA_TXREQ 66
+#define UART2_DMA_RXREQ 67
+#define UART3_DMA_TXREQ 4
+#define UART3_DMA_RXREQ 5
+#define UART4_DMA_TXREQ 68
+#define UART4_DMA_RXREQ 69
+#define UART5_DMA_TXREQ 6
+#define UART5_DMA_RXREQ 7
+#define UART6_DMA_TXREQ 70
+#define UART6_DMA_RXREQ 71
+#define UART7_DMA_TXREQ 8
+#define UART7_DMA_RXREQ 9
+#define UART8_DMA_TXREQ 72
+#define UART8_DMA_RXREQ 73
+#define LPSPI1_DMA_RXREQ 13
+#define LPSPI1_DMA_TXREQ 14
+#define LPSPI2_DMA_RXREQ 77
+#define LPSPI2_DMA_TXREQ 78
+#define LPSPI3_DMA_RXREQ 15
+#define LPSPI3_DMA_TXREQ 16
+#define LPSPI4_DMA_RXREQ 79
+#define LPSPI4_DMA_TXREQ 80
+
 #define GPIO1_BASE ((void *)0x401b8000)
 #define GPIO2_BASE ((void *)0x401bc000)
 #define GPIO3_BASE ((void *)0x401c0000)
@@ -83,6 +115,9 @@
 #define I2C3_BASE ((void *)0x403f8000)
 #define I2C4_BASE ((void *)0x403fc000)
 
+/* LPI2C functional clock, pll3_sw_clk / 8 */
+#define I2C_CLK 60000000
+
 #define I2C1_CLK pctl_clk_lpi2c1
 #define I2C2_CLK pctl_clk_lpi2c2
 #define I2C3_CLK pctl_clk_lpi2c3
@@ -18,12 +18,14 @@
 #include <sys/msg.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
 
 
 #include "imxrt-multi.h"
 #include "common.h"
 #include "config.h"
 #include "spi.h"
+#include "edma.h"
 
 #define SPI1_POS 0
 #define SPI2_POS (SPI1_POS + SPI1)
@@ -36,11 +38,21 @@
 #define WORD_SIZE sizeof(uint32_t)
 #define MAX_FIFOSZ_BYTES 16 * WORD_SIZE
 
+/* Scatter-gather chain of a single eDMA round, completed with one interrupt */
+#define SPI_DMA_TCDS 8
+
+/* Completion is polled for channel errors every SPI_DMA_POLL (in us) */
+#define SPI_DMA_POLL 100000
+
 
 enum { spi_verid = 0, spi_param, spi_cr = 0x4, spi_sr, spi_ier, spi_der, spi_cfgr0, spi_cfgr1, spi_dmr0 = 0xc,
 	   spi_dmr1, spi_ccr = 0x10, spi_fcr = 0x16, spi_fsr, spi_tcr, spi_tdr, spi_rsr = 0x1c, spi_rdr };
 
 
+/* Transmit Command Register bits */
+enum { SPI_TCR_LSBF = 1 << 23, SPI_TCR_BYSW = 1 << 22, SPI_TCR_CONT = 1 << 21, SPI_TCR_CONTC = 1 << 20 };
+
+
 struct {
 	handle_t cond;
 	handle_t mutex;
@@ -52,6 +64,13 @@ struct {
 	volatile uint32_t *base;
 
 	uint32_t tcr;
+
+	int rxDma;
+	int txDma;
+	uint32_t dummy;
+	uint32_t sink;
+	edma_tcd_t rxTcds[SPI_DMA_TCDS] __attribute__((aligned(32)));
+	edma_tcd_t txTcds[SPI_DMA_TCDS] __attribute__((aligned(32)));
 } spi_common[SPI_CNT];
 
 
@@ -89,6 +108,21 @@ static int spi_irqHandler(unsigned int n, void *arg)
 }
 
 
+#ifdef EDMA_BASE
+static int spi_dmaIrqHandler(unsigned int n, void *arg)
+{
+	int spi = (int)arg;
+
+	if (!edma_clearIntr(spi_common[spi].rxDma))
+		return -1;
+
+	spi_common[spi].ready = 1;
+
+	return 0;
+}
+#endif
+
+
 static void spi_initTransmition(int spi)
 {
 	mutexLock(spi_common[spi].irqLock);
@@ -142,7 +176,160 @@ static void spi_rxBytes(int spi, uint8_t *rxBuff, int bytesNumber)
 }
 
 
-static int spi_performTranscation(int spi, unsigned char cs, const uint8_t *txBuff, uint8_t *rxBuff, int len)
+#ifdef EDMA_BASE
+/* Builds TCD chain moving frames of w bytes between buff and the data register.
+ * NULL buff - zeros are sent or received data is dropped */
+static void spi_dmaChain(int spi, edma_tcd_t *tcds, int rx, uint8_t *buff, size_t frames, size_t w)
+{
+	uint32_t mem, reg;
+	uint16_t iter;
+	int i;
+
+	reg = (uint32_t)(rx ? (spi_common[spi].base + spi_rdr) : (spi_common[spi].base + spi_tdr));
+
+	for (i = 0; frames != 0; ++i) {
+		iter = (frames > EDMA_MAX_ITER) ? EDMA_MAX_ITER : frames;
+		frames -= iter;
+
+		if (buff != NULL)
+			mem = (uint32_t)buff;
+		else
+			mem = rx ? (uint32_t)&spi_common[spi].sink : (uint32_t)&spi_common[spi].dummy;
+
+		tcds[i].saddr = rx ? reg : mem;
+		tcds[i].soff = (rx || buff == NULL) ? 0 : w;
+		tcds[i].daddr = rx ? mem : reg;
+		tcds[i].doff = (rx && buff != NULL) ? w : 0;
+		tcds[i].attr = (w == WORD_SIZE) ? EDMA_ATTR(edma_size32, edma_size32) : EDMA_ATTR(edma_size8, edma_size8);
+		tcds[i].nbytes = w;
+		tcds[i].slast = 0;
+		tcds[i].citer = iter;
+		tcds[i].biter = iter;
+
+		if (frames != 0) {
+			tcds[i].dlast_sga = (uint32_t)&tcds[i + 1];
+			tcds[i].csr = EDMA_CSR_ESG;
+		}
+		else {
+			tcds[i].dlast_sga = 0;
+			tcds[i].csr = EDMA_CSR_DREQ | (rx ? EDMA_CSR_INTMAJOR : 0);
+		}
+
+		if (buff != NULL)
+			buff += iter * w;
+	}
+}
+
+
+/* Runs one eDMA round, both chains end together with the RX completion interrupt */
+static int spi_dmaRound(int spi, const uint8_t *txBuff, uint8_t *rxBuff, size_t frames, size_t w)
+{
+	int err = EOK;
+
+	spi_dmaChain(spi, spi_common[spi].txTcds, 0, (uint8_t *)txBuff, frames, w);
+	spi_dmaChain(spi, spi_common[spi].rxTcds, 1, rxBuff, frames, w);
+
+	edma_loadTcd(spi_common[spi].rxDma, &spi_common[spi].rxTcds[0]);
+	edma_loadTcd(spi_common[spi].txDma, &spi_common[spi].txTcds[0]);
+
+	mutexLock(spi_common[spi].irqLock);
+	spi_common[spi].ready = 0;
+
+	edma_enableRequest(spi_common[spi].rxDma);
+	edma_enableRequest(spi_common[spi].txDma);
+
+	while (!spi_common[spi].ready) {
+		condWait(spi_common[spi].cond, spi_common[spi].irqLock, SPI_DMA_POLL);
+
+		if (edma_clearError(spi_common[spi].rxDma) | edma_clearError(spi_common[spi].txDma)) {
+			err = -EIO;
+			break;
+		}
+	}
+
+	mutexUnlock(spi_common[spi].irqLock);
+
+	edma_disableRequest(spi_common[spi].txDma);
+	edma_disableRequest(spi_common[spi].rxDma);
+
+	return err;
+}
+
+
+/*
+ * Whole transfer is a single continuous command, PCS stays asserted between the frames.
+ * Word aligned buffers are moved in 32-bit frames with bytes swapped into the wire order,
+ * the remaining bytes are sent in the last frame by the CPU.
+ */
+static int spi_dmaTransfer(int spi, unsigned char cs, const uint8_t *txBuff, uint8_t *rxBuff, size_t len)
+{
+	volatile uint32_t *base = spi_common[spi].base;
+	size_t w, frames, n, rem;
+	uint32_t tcr;
+	int err = EOK;
+
+	w = ((((uint32_t)txBuff | (uint32_t)rxBuff) & (WORD_SIZE - 1)) || len < WORD_SIZE) ? 1 : WORD_SIZE;
+	frames = len / w;
+	rem = len % w;
+
+	tcr = (spi_common[spi].tcr & ~(0x7ff | (3 << 24))) | ((cs & 0x3) << 24) | SPI_TCR_CONT;
+	if (w == WORD_SIZE && !(tcr & SPI_TCR_LSBF))
+		tcr |= SPI_TCR_BYSW;
+
+	spi_common[spi].dummy = 0;
+
+	/* TX requests while FIFO has room for half of its capacity */
+	*(base + spi_fcr) = (*(base + spi_fcr) & ~0xf) | 7;
+	*(base + spi_tcr) = tcr | (w * 8 - 1);
+	*(base + spi_der) = (1 << 1) | (1 << 0);
+
+	while (frames != 0 && err == EOK) {
+		n = (frames > SPI_DMA_TCDS * EDMA_MAX_ITER) ? SPI_DMA_TCDS * EDMA_MAX_ITER : frames;
+
+		err = spi_dmaRound(spi, txBuff, rxBuff, n, w);
+
+		frames -= n;
+		if (txBuff != NULL)
+			txBuff += n * w;
+		if (rxBuff != NULL)
+			rxBuff += n * w;
+	}
+
+	*(base + spi_der) = 0;
+	*(base + spi_fcr) &= ~0xf;
+
+	if (err == EOK && rem != 0) {
+		*(base + spi_tcr) = (tcr & ~SPI_TCR_BYSW) | SPI_TCR_CONTC | (rem * 8 - 1);
+
+		spi_txBytes(spi, (txBuff != NULL) ? txBuff : (const uint8_t *)&spi_common[spi].dummy, rem);
+
+		while (!((*(base + spi_fsr) >> 16) & 0x1f))
+			;
+
+		if (rxBuff != NULL)
+			spi_rxBytes(spi, rxBuff, rem);
+		else
+			(void)*(base + spi_rdr);
+	}
+
+	/* End of continuous transfer, PCS is negated */
+	*(base + spi_tcr) = tcr & ~SPI_TCR_CONT;
+
+	while (*(base + spi_sr) & (1 << 24))
+		;
+
+	if (err < 0) {
+		/* Flush FIFOs */
+		*(base + spi_cr) |= (1 << 9) | (1 << 8);
+		return err;
+	}
+
+	return len;
+}
+#endif
+
+
+static int spi_performTranscation(int spi, unsigned char cs, const uint8_t *txBuff, uint8_t *rxBuff, size_t len)
 {
 	int size = len;
 	int rxTotalBytes = 0;
@@ -152,11 +339,27 @@ static int spi_performTranscation(int spi, unsigned char cs, const uint8_t *txBu
 	if (!spiConfig[spi])
 		return -EINVAL;
 
-	if ((len * 8) > MAX_FRAME_SZ)
-		return -EINVAL;
+	if (len == 0)
+		return 0;
 
 	spi = spiPos[spi];
 
+#ifdef EDMA_BASE
+	if (spi_common[spi].rxDma >= 0 && (len > MAX_FIFOSZ_BYTES || txBuff == NULL || rxBuff == NULL)) {
+		if (len > INT_MAX)
+			return -EINVAL;
+
+		mutexLock(spi_common[spi].mutex);
+		rxTotalBytes = spi_dmaTransfer(spi, cs, txBuff, rxBuff, len);
+		mutexUnlock(spi_common[spi].mutex);
+
+		return rxTotalBytes;
+	}
+#endif
+
+	if ((len * 8) > MAX_FRAME_SZ || txBuff == NULL || rxBuff == NULL)
+		return -EINVAL;
+
 	mutexLock(spi_common[spi].mutex);
 
 	/* Initialize Transmit Command Register */
@@ -289,6 +492,10 @@ static void spi_handleDevCtl(msg_t *msg, int dev)
 			odevctl->err = spi_performTranscation(dev, idevctl->spi.transaction.cs, txBuff, rxBuff, idevctl->spi.transaction.frameSize);
 			break;
 
+		case spi_transfer:
+			odevctl->err = spi_performTranscation(dev, idevctl->spi.transfer.cs, idevctl->spi.transfer.tx, idevctl->spi.transfer.rx, idevctl->spi.transfer.len);
+			break;
+
 		default:
 			odevctl->err = -ENOSYS;
 			break;
@@ -504,6 +711,17 @@ int spi_init(void)
 		{ LPSPI3_BASE, LPSPI3_CLK, LPSPI3_IRQ },
 		{ LPSPI4_BASE, LPSPI4_CLK, LPSPI4_IRQ }
 	};
+#ifdef EDMA_BASE
+	static const struct {
+		int rxch, rxreq;
+		int txch, txreq;
+	} dma[] = {
+		{ SPI1_DMA_RXCH, LPSPI1_DMA_RXREQ, SPI1_DMA_TXCH, LPSPI1_DMA_TXREQ },
+		{ SPI2_DMA_RXCH, LPSPI2_DMA_RXREQ, SPI2_DMA_TXCH, LPSPI2_DMA_TXREQ },
+		{ SPI3_DMA_RXCH, LPSPI3_DMA_RXREQ, SPI3_DMA_TXCH, LPSPI3_DMA_TXREQ },
+		{ SPI4_DMA_RXCH, LPSPI4_DMA_RXREQ, SPI4_DMA_TXCH, LPSPI4_DMA_TXREQ }
+	};
+#endif
 
 	spi_initPins();
 
@@ -534,6 +752,19 @@ int spi_init(void)
 
 		interrupt(spi_common[i].irq, spi_irqHandler, (void *)i, spi_common[i].cond, &spi_common[i].inth);
 
+		/* Transfers exceeding the FIFO are moved by eDMA, TX channel runs without interrupts */
+		spi_common[i].rxDma = -1;
+		spi_common[i].txDma = -1;
+
+#ifdef EDMA_BASE
+		if (dma[spi].rxch >= 0 && dma[spi].txch >= 0 && dma[spi].rxch != dma[spi].txch &&
+			edma_configureChannel(dma[spi].rxch, dma[spi].rxreq, spi_dmaIrqHandler, (void *)i, spi_common[i].cond, NULL) == EOK &&
+			edma_configureChannel(dma[spi].txch, dma[spi].txreq, NULL, NULL, 0, NULL) == EOK) {
+			spi_common[i].rxDma = dma[spi].rxch;
+			spi_common[i].txDma = dma[spi].txch;
+		}
+#endif
+
 		/* Disable module */
 		*(spi_common[i].base + spi_cr) = 0;
 		++i;
@@ -0,0 +1,230 @@
+/*
+ * Phoenix-RTOS
+ *
+ * i.MX RT I2C driver's tests
+ *
+ * Copyright 2019 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <sys/msg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "../imxrt-multi.h"
+
+
+/* Slave with 8-bit register addressing (e.g. 24C02 EEPROM) and an address nobody responds to */
+#ifndef I2C_TEST_ADDR
+#define I2C_TEST_ADDR 0x50
+#endif
+
+#ifndef I2C_TEST_NOADDR
+#define I2C_TEST_NOADDR 0x0b
+#endif
+
+#define MAX_MSGS 4
+#define MAX_DATA 64
+
+
+struct {
+	i2c_msg_t msgs[MAX_MSGS];
+	uint8_t data[MAX_DATA];
+} __attribute__((packed)) test_req;
+
+
+struct {
+	uint8_t rx[MAX_DATA];
+} test_common;
+
+
+static oid_t test_getOid(void)
+{
+	oid_t dir;
+	while (lookup("/dev/i2c1", NULL, &dir) < 0)
+		usleep(9000);
+
+	return dir;
+}
+
+
+static int test_i2cConfig(oid_t dir, unsigned int speed)
+{
+	msg_t msg;
+	multi_i_t *idevctl = NULL;
+	multi_o_t *odevctl = NULL;
+
+	msg.type = mtDevCtl;
+	msg.i.data = NULL;
+	msg.i.size = 0;
+	msg.o.data = NULL;
+	msg.o.size = 0;
+
+	idevctl = (multi_i_t *)msg.i.raw;
+	idevctl->id = dir.id;
+	idevctl->i2c.type = i2c_config;
+	idevctl->i2c.config.speed = speed;
+
+	odevctl = (multi_o_t *)msg.o.raw;
+
+	if (msgSend(dir.port, &msg) < 0)
+		return -1;
+
+	return odevctl->err;
+}
+
+
+/* Sends cnt messages from test_req, returns error and number of completed messages */
+static int test_i2cTransfer(oid_t dir, unsigned int cnt, size_t txLen, size_t rxLen, unsigned int *done)
+{
+	msg_t msg;
+	multi_i_t *idevctl = NULL;
+	multi_o_t *odevctl = NULL;
+
+	/* Write data follows the messages */
+	memmove((uint8_t *)&test_req.msgs[cnt], test_req.data, txLen);
+
+	msg.type = mtDevCtl;
+	msg.i.data = &test_req;
+	msg.i.size = cnt * sizeof(i2c_msg_t) + txLen;
+	msg.o.data = test_common.rx;
+	msg.o.size = rxLen;
+
+	idevctl = (multi_i_t *)msg.i.raw;
+	idevctl->id = dir.id;
+	idevctl->i2c.type = i2c_transfer;
+	idevctl->i2c.transfer.cnt = cnt;
+
+	odevctl = (multi_o_t *)msg.o.raw;
+
+	if (msgSend(dir.port, &msg) < 0)
+		return -1;
+
+	*done = odevctl->val;
+
+	return odevctl->err;
+}
+
+
+static void test_setMsg(int i, unsigned short addr, unsigned short flags, unsigned int len)
+{
+	test_req.msgs[i].addr = addr;
+	test_req.msgs[i].flags = flags;
+	test_req.msgs[i].len = len;
+}
+
+
+int test_i2c_config(void)
+{
+	oid_t dir;
+	unsigned int speed;
+
+	dir = test_getOid();
+
+	for (speed = i2c_speed_standard; speed <= i2c_speed_high; ++speed) {
+		if (test_i2cConfig(dir, speed) != EOK)
+			return -EINVAL;
+	}
+
+	if (test_i2cConfig(dir, i2c_speed_high + 1) == EOK)
+		return -EINVAL;
+
+	return test_i2cConfig(dir, i2c_speed_fast);
+}
+
+
+int test_i2c_write_read(void)
+{
+	oid_t dir;
+	unsigned int done;
+	uint8_t first[8];
+
+	dir = test_getOid();
+	test_i2cConfig(dir, i2c_speed_fast);
+
+	/* Register address, repeated START, 8 bytes read */
+	test_setMsg(0, I2C_TEST_ADDR, 0, 1);
+	test_setMsg(1, I2C_TEST_ADDR, i2c_msg_read, sizeof(first));
+	test_req.data[0] = 0;
+
+	if (test_i2cTransfer(dir, 2, 1, sizeof(first), &done) != EOK || done != 2)
+		return -EINVAL;
+
+	memcpy(first, test_common.rx, sizeof(first));
+
+	/* Same registers read at 1 MHz */
+	test_i2cConfig(dir, i2c_speed_fastplus);
+	test_setMsg(0, I2C_TEST_ADDR, 0, 1);
+	test_setMsg(1, I2C_TEST_ADDR, i2c_msg_read, sizeof(first));
+	test_req.data[0] = 0;
+
+	if (test_i2cTransfer(dir, 2, 1, sizeof(first), &done) != EOK || done != 2)
+		return -EINVAL;
+
+	test_i2cConfig(dir, i2c_speed_fast);
+
+	return memcmp(first, test_common.rx, sizeof(first)) == 0 ? EOK : -EINVAL;
+}
+
+
+int test_i2c_nack_recovery(void)
+{
+	oid_t dir;
+	unsigned int done;
+
+	dir = test_getOid();
+	test_i2cConfig(dir, i2c_speed_fast);
+
+	test_setMsg(0, I2C_TEST_NOADDR, 0, 1);
+	test_req.data[0] = 0;
+
+	if (test_i2cTransfer(dir, 1, 1, 0, &done) != -ENXIO || done != 0)
+		return -EINVAL;
+
+	/* Bus is usable right after the NACK */
+	test_setMsg(0, I2C_TEST_ADDR, 0, 1);
+	test_setMsg(1, I2C_TEST_ADDR, i2c_msg_read, 4);
+	test_req.data[0] = 0;
+
+	if (test_i2cTransfer(dir, 2, 1, 4, &done) != EOK || done != 2)
+		return -EINVAL;
+
+	return EOK;
+}
+
+
+int test_i2c_queued(void)
+{
+	oid_t dir;
+	unsigned int done;
+
+	dir = test_getOid();
+	test_i2cConfig(dir, i2c_speed_fast);
+
+	/* Two transactions in one request, the second one fails */
+	test_setMsg(0, I2C_TEST_ADDR, 0, 1);
+	test_setMsg(1, I2C_TEST_ADDR, i2c_msg_read | i2c_msg_stop, 4);
+	test_setMsg(2, I2C_TEST_NOADDR, 0, 1);
+	test_req.data[0] = 0;
+	test_req.data[1] = 0;
+
+	if (test_i2cTransfer(dir, 3, 2, 4, &done) != -ENXIO || done != 2)
+		return -EINVAL;
+
+	/* Address probe followed by a register read */
+	test_setMsg(0, I2C_TEST_ADDR, i2c_msg_stop, 0);
+	test_setMsg(1, I2C_TEST_ADDR, 0, 1);
+	test_setMsg(2, I2C_TEST_ADDR, i2c_msg_read, 2);
+	test_req.data[0] = 0;
+
+	if (test_i2cTransfer(dir, 3, 1, 2, &done) != EOK || done != 3)
+		return -EINVAL;
+
+	return EOK;
+}
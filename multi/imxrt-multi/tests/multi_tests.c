@@ -20,6 +20,8 @@
 
 #define SPI_TESTS
 
+#define I2C_TESTS
+
 
 #define TEST_CATEGORY(category)                                         \
 	do {                                                                \
@@ -28,12 +30,21 @@
 	} while(0)
 
 
+/* Returned by tests which don't apply to the configuration */
+#define TEST_SKIPPED 1
+
+
 #define TEST_CASE(test)                                                                    \
 	do {                                                                                   \
-		if ((test) == EOK) {                                                               \
+		int res = (test);                                                                  \
+		if (res == EOK) {                                                                  \
 			printf("\nTEST CASE %d.%d : %-45s\t", categoryCounter, testCounter++, #test);  \
 			printf("\033[0;32m");                                                          \
 			printf("-- PASSED"); }                                                         \
+		else if (res == TEST_SKIPPED) {                                                    \
+			printf("\nTEST CASE %d.%d : %-45s\t", categoryCounter, testCounter++, #test);  \
+			printf("\033[0;33m");                                                          \
+			printf("-- SKIPPED"); }                                                        \
 		else {                                                                             \
 			printf("\033[1;31m");                                                          \
 			printf("\nTEST CASE %d.%d : %-45s\t", categoryCounter, testCounter++, #test);  \
@@ -57,6 +68,20 @@ extern int test_spi_transfer_partially_filled_fifo(void);
 
 extern int test_spi_multiple_transmission(void);
 
+extern int test_spi_transfer_large(void);
+
+extern int test_spi_transfer_by_reference(void);
+
+extern int test_spi_bench(void);
+
+extern int test_i2c_config(void);
+
+extern int test_i2c_write_read(void);
+
+extern int test_i2c_nack_recovery(void);
+
+extern int test_i2c_queued(void);
+
 
 int main(int argc, char **argv)
 {
@@ -69,6 +94,18 @@ int main(int argc, char **argv)
 	TEST_CASE(test_spi_transfer_partially_filled_fifo());
 	TEST_CASE(test_spi_transfer_overfilled_frame());
 	TEST_CASE(test_spi_multiple_transmission());
+	TEST_CASE(test_spi_transfer_large());
+	TEST_CASE(test_spi_transfer_by_reference());
+	TEST_CASE(test_spi_bench());
+#endif
+
+#ifdef I2C_TESTS
+	TEST_CATEGORY("I2C TESTS");
+
+	TEST_CASE(test_i2c_config());
+	TEST_CASE(test_i2c_write_read());
+	TEST_CASE(test_i2c_nack_recovery());
+	TEST_CASE(test_i2c_queued());
 #endif
 
 	return 0;
@@ -12,6 +12,7 @@
  */
 
 #include <sys/msg.h>
+#include <sys/threads.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -23,6 +24,12 @@
 
 #define MAX_BUFFER_SZ 0x204
 
+/* Transfers above the FIFO size are moved by eDMA, sizes are not limited by the frame size */
+#define DMA_BUFFER_SZ (0x40000 + 3)
+
+/* Returned by tests which require eDMA channels configured for the port */
+#define TEST_SKIPPED 1
+
 
 struct {
 	uint8_t tx[MAX_BUFFER_SZ];
@@ -40,7 +47,7 @@ static oid_t test_getOid(void)
 }
 
 
-static int test_spiConfig(oid_t dir)
+static int test_spiConfigDiv(oid_t dir, unsigned int sckDiv)
 {
 	msg_t msg;
 	multi_i_t *idevctl = NULL;
@@ -59,7 +66,7 @@ static int test_spiConfig(oid_t dir)
 	idevctl->spi.config.endian = spi_msb;
 	idevctl->spi.config.mode = spi_mode_0;
 	idevctl->spi.config.prescaler = 2;
-	idevctl->spi.config.sckDiv = 64;
+	idevctl->spi.config.sckDiv = sckDiv;
 
 	odevctl = (multi_o_t *)msg.o.raw;
 
@@ -73,6 +80,12 @@ static int test_spiConfig(oid_t dir)
 }
 
 
+static int test_spiConfig(oid_t dir)
+{
+	return test_spiConfigDiv(dir, 64);
+}
+
+
 static int test_spiTransmit(oid_t dir, uint8_t *tx, uint8_t *rx, int sz)
 {
 	msg_t msg;
@@ -103,6 +116,53 @@ static int test_spiTransmit(oid_t dir, uint8_t *tx, uint8_t *rx, int sz)
 }
 
 
+static int test_spiTransfer(oid_t dir, const void *tx, void *rx, size_t sz)
+{
+	msg_t msg;
+	multi_i_t *idevctl = NULL;
+	multi_o_t *odevctl = NULL;
+
+	msg.type = mtDevCtl;
+	msg.i.data = NULL;
+	msg.i.size = 0;
+	msg.o.data = NULL;
+	msg.o.size = 0;
+
+	idevctl = (multi_i_t *)msg.i.raw;
+	idevctl->id = dir.id;
+	idevctl->spi.type = spi_transfer;
+	idevctl->spi.transfer.tx = tx;
+	idevctl->spi.transfer.rx = rx;
+	idevctl->spi.transfer.len = sz;
+	idevctl->spi.transfer.cs = 0;
+
+	odevctl = (multi_o_t *)msg.o.raw;
+
+	if (msgSend(dir.port, &msg) < 0)
+		return -1;
+
+	return odevctl->err;
+}
+
+
+static void test_setPattern(uint8_t *buff, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < size; ++i)
+		buff[i] = (i * 7 + (i >> 8)) & 0xff;
+}
+
+
+/* Ports serviced by the CPU refuse transfers exceeding a single frame */
+static int test_spiDma(oid_t dir)
+{
+	memset(test_common.tx, 0, MAX_BUFFER_SZ);
+
+	return test_spiTransfer(dir, test_common.tx, test_common.rx, MAX_BUFFER_SZ) != -EINVAL;
+}
+
+
 static void test_setData(uint16_t size)
 {
 	int i;
@@ -148,16 +208,153 @@ int test_spi_transfer_overfilled_frame(void)
 	dir = test_getOid();
 	test_spiConfig(dir);
 
-	/* Transmit data in a loop - back (MOSI --> MISO) */
+	if (!test_spiDma(dir))
+		return TEST_SKIPPED;
+
+	test_setData(buffSz + 3);
+
+	/* Frame size limit doesn't apply to eDMA transfers */
 	rcvSize = test_spiTransmit(dir, test_common.tx, test_common.rx, buffSz);
 
-	if (rcvSize < 0)
+	if ((memcmp(test_common.tx, test_common.rx, buffSz) == 0) && (rcvSize == buffSz))
 		return EOK;
 	else
 		return -EINVAL;
 }
 
 
+int test_spi_transfer_large(void)
+{
+	oid_t dir;
+	int rcvSize, res = -EINVAL;
+	uint8_t *tx, *rx;
+
+	if ((tx = malloc(DMA_BUFFER_SZ)) == NULL)
+		return -ENOMEM;
+
+	if ((rx = malloc(DMA_BUFFER_SZ)) == NULL) {
+		free(tx);
+		return -ENOMEM;
+	}
+
+	dir = test_getOid();
+	test_spiConfigDiv(dir, 4);
+
+	if (!test_spiDma(dir)) {
+		free(rx);
+		free(tx);
+		return TEST_SKIPPED;
+	}
+
+	test_setPattern(tx, DMA_BUFFER_SZ);
+	memset(rx, 0, DMA_BUFFER_SZ);
+
+	/* Several eDMA rounds and a tail frame, unaligned buffers use byte frames */
+	rcvSize = test_spiTransmit(dir, tx, rx, DMA_BUFFER_SZ);
+	if ((memcmp(tx, rx, DMA_BUFFER_SZ) == 0) && (rcvSize == DMA_BUFFER_SZ)) {
+		memset(rx, 0, DMA_BUFFER_SZ);
+		rcvSize = test_spiTransmit(dir, tx + 1, rx + 1, DMA_BUFFER_SZ - 1);
+
+		if ((memcmp(tx + 1, rx + 1, DMA_BUFFER_SZ - 1) == 0) && (rcvSize == DMA_BUFFER_SZ - 1))
+			res = EOK;
+	}
+
+	free(rx);
+	free(tx);
+
+	return res;
+}
+
+
+int test_spi_transfer_by_reference(void)
+{
+	oid_t dir;
+	const size_t buffSz = MAX_BUFFER_SZ - 1;
+
+	dir = test_getOid();
+	test_spiConfig(dir);
+
+	if (!test_spiDma(dir))
+		return TEST_SKIPPED;
+
+	test_setPattern(test_common.tx, MAX_BUFFER_SZ);
+	memset(test_common.rx, 0, MAX_BUFFER_SZ);
+
+	if (test_spiTransfer(dir, test_common.tx, test_common.rx, MAX_BUFFER_SZ) != MAX_BUFFER_SZ)
+		return -EINVAL;
+
+	if (memcmp(test_common.tx, test_common.rx, MAX_BUFFER_SZ) != 0)
+		return -EINVAL;
+
+	/* Write only and read only transfers */
+	if (test_spiTransfer(dir, test_common.tx, NULL, buffSz) != buffSz)
+		return -EINVAL;
+
+	memset(test_common.rx, 0xff, MAX_BUFFER_SZ);
+	if (test_spiTransfer(dir, NULL, test_common.rx, 0x10) != 0x10)
+		return -EINVAL;
+
+	return test_common.rx[0] == 0 && test_common.rx[0xf] == 0 ? EOK : -EINVAL;
+}
+
+
+int test_spi_bench(void)
+{
+	static const unsigned int divs[] = { 64, 16, 4 };
+	static const size_t sizes[] = { 16, 64, 512, 4096, 65536, DMA_BUFFER_SZ - 3 };
+	time_t start, end;
+	oid_t dir;
+	uint8_t *tx, *rx;
+	int i, j, ret, res = EOK;
+
+	if ((tx = malloc(DMA_BUFFER_SZ)) == NULL)
+		return -ENOMEM;
+
+	if ((rx = malloc(DMA_BUFFER_SZ)) == NULL) {
+		free(tx);
+		return -ENOMEM;
+	}
+
+	dir = test_getOid();
+	test_spiConfig(dir);
+
+	if (!test_spiDma(dir)) {
+		free(rx);
+		free(tx);
+		return TEST_SKIPPED;
+	}
+
+	test_setPattern(tx, DMA_BUFFER_SZ);
+
+	printf("\n%8s %8s %10s %10s", "sckDiv", "size", "time [us]", "kB/s");
+
+	for (i = 0; i < sizeof(divs) / sizeof(divs[0]); ++i) {
+		test_spiConfigDiv(dir, divs[i]);
+
+		for (j = 0; j < sizeof(sizes) / sizeof(sizes[0]); ++j) {
+			gettime(&start, NULL);
+			ret = test_spiTransfer(dir, tx, rx, sizes[j]);
+			gettime(&end, NULL);
+
+			/* Data is verified outside of the measured time */
+			if (ret != sizes[j] || memcmp(tx, rx, sizes[j]) != 0)
+				res = -EINVAL;
+
+			end -= start;
+			printf("\n%8u %8u %10llu %10llu", divs[i], (unsigned int)sizes[j], (unsigned long long)end,
+				end ? (unsigned long long)sizes[j] * 1000000 / 1024 / end : 0);
+		}
+	}
+
+	test_spiConfig(dir);
+
+	free(rx);
+	free(tx);
+
+	return res;
+}
+
+
 int test_spi_transfer_middle_data_sz(void)
 {
 	oid_t dir;
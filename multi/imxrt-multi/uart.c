@@ -28,6 +28,7 @@
 #include <libtty.h>
 
 #include "common.h"
+#include "edma.h"
 #include "uart.h"
 
 
@@ -44,6 +45,12 @@
 
 #define BUFSIZE 256
 
+/* wake up the reader during long RX bursts at least every RX_WAKE_THRESHOLD chars */
+#define RX_WAKE_THRESHOLD (BUFSIZE / 4)
+
+/* RX DMA circular buffer, emptied on idle line and on every half of the buffer */
+#define DMA_RXBUFSIZE 1024
+
 
 typedef struct uart_s {
 	char stack[1024] __attribute__ ((aligned(8)));
@@ -59,6 +66,20 @@ typedef struct uart_s {
 	size_t rxFifoSz;
 	size_t txFifoSz;
 
+	/* eDMA mode, channels are -1 if the FIFO is serviced by the CPU */
+	int rxDma;
+	int txDma;
+	unsigned char *rxBuff;
+	size_t rxTail;                   /* next char in rxBuff to be passed to libtty */
+	volatile unsigned int rxEvents;  /* idle line and RX DMA interrupts */
+	volatile unsigned int rxHalves;  /* RX DMA interrupts (half and full buffer) */
+	unsigned int rxEventsSeen;
+	unsigned int rxHalvesSeen;
+	size_t txLen;                    /* chars of the TX buffer being sent by DMA */
+	volatile int txDone;
+
+	uart_stats_t stats;
+
 	libtty_common_t tty_common;
 } uart_t;
 
@@ -89,6 +110,55 @@ static int uart_handleIntr(unsigned int n, void *arg)
 }
 
 
+/* Clears given w1c flags leaving configuration bits of the status register intact */
+static inline void uart_clearStatus(uart_t *uart, uint32_t flags)
+{
+	*(uart->base + statr) = (*(uart->base + statr) & ~0xc01fc000) | flags;
+}
+
+
+#ifdef EDMA_BASE
+static int uart_handleDmaIntr(unsigned int n, void *arg)
+{
+	uart_t *uart = (uart_t *)arg;
+	uint32_t flags = *(uart->base + statr) & ((1 << 20) | (1 << 19));
+
+	/* Idle line or overrun */
+	if (!flags)
+		return -1;
+
+	uart_clearStatus(uart, flags);
+
+	if (flags & (1 << 19))
+		uart->stats.overrun++;
+
+	uart->rxEvents++;
+
+	return uart->cond;
+}
+
+
+static int uart_edmaIntr(unsigned int n, void *arg)
+{
+	uart_t *uart = (uart_t *)arg;
+	int ret = -1;
+
+	if (edma_clearIntr(uart->rxDma)) {
+		uart->rxHalves++;
+		uart->rxEvents++;
+		ret = uart->cond;
+	}
+
+	if (edma_clearIntr(uart->txDma)) {
+		uart->txDone = 1;
+		ret = uart->cond;
+	}
+
+	return ret;
+}
+#endif
+
+
 static inline int uart_getRXcount(uart_t *uart)
 {
 	return (*(uart->base + waterr) >> 24) & 0xff;
@@ -104,6 +174,8 @@ static inline int uart_getTXcount(uart_t *uart)
 static void uart_intrThread(void *arg)
 {
 	uart_t *uart = (uart_t *)arg;
+	unsigned char txbuf[16], rxbuf[16];
+	size_t i, n;
 
 	for (;;) {
 		/* wait for character or transmit data */
@@ -124,16 +196,155 @@ static void uart_intrThread(void *arg)
 		mutexUnlock(uart->lock);
 
 		/* RX */
-		while (uart_getRXcount(uart))
-			libtty_putchar(&uart->tty_common, *(uart->base + datar), NULL);
+		while ((n = uart_getRXcount(uart)) > 0) {
+			if (n > sizeof(rxbuf))
+				n = sizeof(rxbuf);
+
+			for (i = 0; i < n; ++i)
+				rxbuf[i] = *(uart->base + datar);
+
+			libtty_putchars(&uart->tty_common, rxbuf, n, NULL);
+		}
+		libtty_rx_commit(&uart->tty_common, NULL);
+
+		if (*(uart->base + statr) & (1 << 19)) {
+			uart_clearStatus(uart, 1 << 19);
+			uart->stats.overrun++;
+		}
 
 		/* TX */
-		while (libtty_txready(&uart->tty_common) && uart_getTXcount(uart) < uart->txFifoSz)
-			*(uart->base + datar) = libtty_getchar(&uart->tty_common, NULL);
+		while (libtty_txready(&uart->tty_common) && (n = uart->txFifoSz - uart_getTXcount(uart)) > 0) {
+			n = libtty_getchars(&uart->tty_common, txbuf, (n < sizeof(txbuf)) ? n : sizeof(txbuf), NULL);
+			for (i = 0; i < n; ++i)
+				*(uart->base + datar) = txbuf[i];
+		}
 	}
 }
 
 
+#ifdef EDMA_BASE
+/* Starts RX DMA going around rxBuff from its beginning, it never stops unless a transfer error occurs */
+static void uart_dmaRxStart(uart_t *uart)
+{
+	volatile edma_tcd_t *tcd = edma_getTcd(uart->rxDma);
+
+	tcd->saddr = (uint32_t)(uart->base + datar);
+	tcd->soff = 0;
+	tcd->attr = EDMA_ATTR(edma_size8, edma_size8);
+	tcd->nbytes = 1;
+	tcd->slast = 0;
+	tcd->daddr = (uint32_t)uart->rxBuff;
+	tcd->doff = 1;
+	tcd->citer = DMA_RXBUFSIZE;
+	tcd->biter = DMA_RXBUFSIZE;
+	tcd->dlast_sga = -DMA_RXBUFSIZE;
+	tcd->csr = EDMA_CSR_INTHALF | EDMA_CSR_INTMAJOR;
+
+	uart->rxTail = 0;
+	edma_enableRequest(uart->rxDma);
+}
+
+
+/* Current write position of the RX DMA in rxBuff */
+static inline size_t uart_dmaRxPos(uart_t *uart)
+{
+	return (DMA_RXBUFSIZE - (edma_getTcd(uart->rxDma)->citer & EDMA_MAX_ITER)) % DMA_RXBUFSIZE;
+}
+
+
+static void uart_dmaRx(uart_t *uart)
+{
+	unsigned int events = uart->rxEvents, halves = uart->rxHalves;
+	int err = edma_clearError(uart->rxDma);
+	size_t pos = uart_dmaRxPos(uart);
+
+	/* DMA went around the whole buffer since the last pass, the oldest chars were overwritten */
+	if (halves - uart->rxHalvesSeen > 2)
+		uart->stats.overrun++;
+
+	uart->stats.rxDma += events - uart->rxEventsSeen;
+	uart->rxEventsSeen = events;
+	uart->rxHalvesSeen = halves;
+
+	if (pos < uart->rxTail) {
+		libtty_putchars(&uart->tty_common, uart->rxBuff + uart->rxTail, DMA_RXBUFSIZE - uart->rxTail, NULL);
+		uart->rxTail = 0;
+	}
+
+	if (pos > uart->rxTail) {
+		libtty_putchars(&uart->tty_common, uart->rxBuff + uart->rxTail, pos - uart->rxTail, NULL);
+		uart->rxTail = pos;
+	}
+
+	libtty_rx_commit(&uart->tty_common, NULL);
+
+	/* Channel stopped on the error, thread is woken up by the FIFO overrun which follows */
+	if (err) {
+		uart->stats.overrun++;
+		edma_disableRequest(uart->rxDma);
+		uart_dmaRxStart(uart);
+	}
+}
+
+
+/* Sends chars directly from the libtty TX buffer */
+static void uart_dmaTx(uart_t *uart)
+{
+	volatile edma_tcd_t *tcd = edma_getTcd(uart->txDma);
+	const unsigned char *data;
+	size_t n;
+
+	if (uart->txLen) {
+		if (!uart->txDone)
+			return;
+
+		edma_clearError(uart->txDma);
+		libtty_tx_commit(&uart->tty_common, uart->txLen, NULL);
+		uart->stats.txDma++;
+		uart->txLen = 0;
+		uart->txDone = 0;
+	}
+
+	if ((n = libtty_tx_span(&uart->tty_common, &data)) == 0)
+		return;
+
+	if (n > EDMA_MAX_ITER)
+		n = EDMA_MAX_ITER;
+
+	tcd->saddr = (uint32_t)data;
+	tcd->soff = 1;
+	tcd->attr = EDMA_ATTR(edma_size8, edma_size8);
+	tcd->nbytes = 1;
+	tcd->slast = 0;
+	tcd->daddr = (uint32_t)(uart->base + datar);
+	tcd->doff = 0;
+	tcd->citer = n;
+	tcd->biter = n;
+	tcd->dlast_sga = 0;
+	tcd->csr = EDMA_CSR_INTMAJOR | EDMA_CSR_DREQ;
+
+	uart->txLen = n;
+	edma_enableRequest(uart->txDma);
+}
+
+
+static void uart_dmaThread(void *arg)
+{
+	uart_t *uart = (uart_t *)arg;
+
+	for (;;) {
+		mutexLock(uart->lock);
+		while (uart->rxEvents == uart->rxEventsSeen && !uart->txDone && (uart->txLen || !libtty_txready(&uart->tty_common)))
+			condWait(uart->cond, uart->lock, 0);
+		mutexUnlock(uart->lock);
+
+		uart_dmaRx(uart);
+		uart_dmaTx(uart);
+	}
+}
+#endif
+
+
 static void signal_txready(void *_uart)
 {
 	uart_t *uartptr = (uart_t *)_uart;
@@ -272,7 +483,13 @@ int uart_handleMsg(msg_t *msg, int dev)
 		case mtDevCtl:
 			in_data = ioctl_unpack(msg, &request, NULL);
 			pid = ioctl_getSenderPid(msg);
-			err = libtty_ioctl(&uart->tty_common, pid, request, in_data, &out_data);
+			if (request == UART_GETSTATS) {
+				out_data = &uart->stats;
+				err = EOK;
+			}
+			else {
+				err = libtty_ioctl(&uart->tty_common, pid, request, in_data, &out_data);
+			}
 			ioctl_setResponse(msg, request, err, out_data);
 			break;
 	}
@@ -405,6 +622,43 @@ static void uart_initPins(void)
 }
 
 
+#ifdef EDMA_BASE
+static int uart_dmaInit(uart_t *uart, int rxch, int rxreq, int txch, int txreq)
+{
+	uart->rxDma = -1;
+	uart->txDma = -1;
+
+	if (rxch < 0 || txch < 0 || rxreq < 0 || txreq < 0 || rxch >= EDMA_CHANNELS || txch >= EDMA_CHANNELS || rxch == txch)
+		return -1;
+
+	if ((uart->rxBuff = malloc(DMA_RXBUFSIZE)) == NULL)
+		return -1;
+
+	uart->rxDma = rxch;
+	uart->txDma = txch;
+
+	/* Both channels are handled by one handler, register it once if they share an interrupt line */
+	if (edma_configureChannel(rxch, rxreq, uart_edmaIntr, uart, uart->cond, NULL) < 0 ||
+		edma_configureChannel(txch, txreq, ((rxch ^ txch) & 0xf) ? uart_edmaIntr : NULL, uart, uart->cond, NULL) < 0) {
+		free(uart->rxBuff);
+		uart->rxDma = -1;
+		uart->txDma = -1;
+		return -1;
+	}
+
+	uart_dmaRxStart(uart);
+
+	/* Idle line after 2 idle chars counted from a stop bit, idle line and overrun interrupts */
+	*(uart->base + ctrlr) = (*(uart->base + ctrlr) & ~(7 << 8)) | (1 << 8) | (1 << 2) | (1 << 20) | (1 << 27);
+
+	/* RX and TX DMA requests */
+	*(uart->base + baudr) |= (1 << 21) | (1 << 23);
+
+	return 0;
+}
+#endif
+
+
 int uart_init(void)
 {
 	int i, dev;
@@ -426,6 +680,23 @@ int uart_init(void)
 		{ UART7_BASE, UART7_CLK, UART7_IRQ },
 		{ UART8_BASE, UART8_CLK, UART8_IRQ }
 	};
+#ifdef EDMA_BASE
+	static const struct {
+		int rxch;
+		int rxreq;
+		int txch;
+		int txreq;
+	} dma[] = {
+		{ UART1_DMA_RXCH, UART1_DMA_RXREQ, UART1_DMA_TXCH, UART1_DMA_TXREQ },
+		{ UART2_DMA_RXCH, UART2_DMA_RXREQ, UART2_DMA_TXCH, UART2_DMA_TXREQ },
+		{ UART3_DMA_RXCH, UART3_DMA_RXREQ, UART3_DMA_TXCH, UART3_DMA_TXREQ },
+		{ UART4_DMA_RXCH, UART4_DMA_RXREQ, UART4_DMA_TXCH, UART4_DMA_TXREQ },
+		{ UART5_DMA_RXCH, UART5_DMA_RXREQ, UART5_DMA_TXCH, UART5_DMA_TXREQ },
+		{ UART6_DMA_RXCH, UART6_DMA_RXREQ, UART6_DMA_TXCH, UART6_DMA_TXREQ },
+		{ UART7_DMA_RXCH, UART7_DMA_RXREQ, UART7_DMA_TXCH, UART7_DMA_TXREQ },
+		{ UART8_DMA_RXCH, UART8_DMA_RXREQ, UART8_DMA_TXCH, UART8_DMA_TXREQ }
+	};
+#endif
 
 	uart_initPins();
 
@@ -448,6 +719,8 @@ int uart_init(void)
 		if (libtty_init(&uart->tty_common, &callbacks, BUFSIZE) < 0)
 			return -1;
 
+		libtty_set_rx_batch(&uart->tty_common, RX_WAKE_THRESHOLD);
+
 		/* Wait for kernel to stop sending data over uart */
 		while (*(uart->base + waterr) & 0x700)
 			usleep(100);
@@ -486,6 +759,18 @@ int uart_init(void)
 		uart->rxFifoSz = fifoSzLut[*(uart->base) & 0x7];
 		uart->txFifoSz = fifoSzLut[(*(uart->base) >> 4) & 0x7];
 
+#ifdef EDMA_BASE
+		if (uart_dmaInit(uart, dma[dev].rxch, dma[dev].rxreq, dma[dev].txch, dma[dev].txreq) == 0) {
+			/* Enable TX and RX */
+			*(uart->base + ctrlr) |= (1 << 19) | (1 << 18);
+
+			interrupt(info[dev].irq, uart_handleDmaIntr, (void *)uart, uart->cond, NULL);
+
+			beginthread(uart_dmaThread, 2, &uart->stack, sizeof(uart->stack), uart);
+			continue;
+		}
+#endif
+
 		/* Enable receiver interrupt */
 		*(uart->base + ctrlr) |= 1 << 21;
 
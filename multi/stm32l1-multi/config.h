@@ -49,6 +49,19 @@
 #define SPI3 0
 #endif
 
+#ifndef SPI_DMA
+#define SPI_DMA 1
+#endif
+
+/* Shorter transfers are interrupt driven */
+#ifndef SPI_DMA_THRESHOLD
+#define SPI_DMA_THRESHOLD 16
+#endif
+
+#ifndef SPI_BENCH
+#define SPI_BENCH 0
+#endif
+
 #ifndef LCD
 #define LCD 1
 #endif
@@ -0,0 +1,156 @@
+/*
+ * Phoenix-RTOS
+ *
+ * STM32L1 DMA driver
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+
+#include <sys/threads.h>
+#include <sys/interrupt.h>
+#include <sys/pwman.h>
+#include <errno.h>
+
+#include "common.h"
+#include "rcc.h"
+#include "dma.h"
+
+
+#define DMA_CHANNELS 7
+
+
+struct {
+	volatile unsigned int *base;
+
+	struct {
+		volatile int done;
+
+		handle_t irqLock;
+		handle_t cond;
+		handle_t inth;
+	} channel[DMA_CHANNELS];
+} dma_common[2];
+
+
+static const int dma2pctl[] = { pctl_dma1, pctl_dma2 };
+
+
+static const int dmaChannels[] = { 7, 5 };
+
+
+/* DMA1 channels 1-7, DMA2 channels 1-5 */
+static const int dmaIrq[2][DMA_CHANNELS] = { { 11, 12, 13, 14, 15, 16, 17 }, { 50, 51, 52, 53, 54, -1, -1 } };
+
+
+enum { isr = 0, ifcr };
+
+
+/* Channel registers, channel x starts at word 2 + 5 * (x - 1) */
+enum { ccr = 0, cndtr, cpar, cmar };
+
+
+static inline volatile unsigned int *dma_channelBase(int dma, int channel)
+{
+	return dma_common[dma].base + 2 + 5 * (channel - 1);
+}
+
+
+static int dma_irqHandler(unsigned int n, void *arg)
+{
+	int dma = (int)arg >> 3, channel = (int)arg & 0x7;
+	unsigned int flags = (*(dma_common[dma].base + isr) >> (4 * (channel - 1))) & 0xf;
+
+	*(dma_common[dma].base + ifcr) = flags << (4 * (channel - 1));
+
+	/* Transfer complete or transfer error */
+	if (!(flags & ((1 << 1) | (1 << 3))))
+		return -1;
+
+	*(dma_channelBase(dma, channel) + ccr) &= ~1;
+	dma_common[dma].channel[channel - 1].done = (flags & (1 << 3)) ? -EIO : 1;
+
+	return 1;
+}
+
+
+int dma_configureChannel(int dma, int channel, int dir, int priority, volatile void *paddr, int msize, int psize, int irq)
+{
+	volatile unsigned int *chan;
+
+	if (dma < dma1 || dma > dma2 || channel < 1 || channel > dmaChannels[dma])
+		return -EINVAL;
+
+	rcc_devClk(dma2pctl[dma], 1);
+
+	chan = dma_channelBase(dma, channel);
+
+	*(chan + ccr) = 0;
+	*(chan + cpar) = (unsigned int)paddr;
+	*(chan + ccr) = ((priority & 0x3) << 12) | ((msize & 0x3) << 10) | ((psize & 0x3) << 8) |
+		((dir == dma_mem2per) << 4) | (irq ? ((1 << 3) | (1 << 1)) : 0);
+
+	if (irq && !dma_common[dma].channel[channel - 1].inth) {
+		mutexCreate(&dma_common[dma].channel[channel - 1].irqLock);
+		condCreate(&dma_common[dma].channel[channel - 1].cond);
+		interrupt(16 + dmaIrq[dma][channel - 1], dma_irqHandler, (void *)((dma << 3) | channel),
+			dma_common[dma].channel[channel - 1].cond, &dma_common[dma].channel[channel - 1].inth);
+	}
+
+	return EOK;
+}
+
+
+void dma_transfer(int dma, int channel, void *maddr, int minc, size_t len)
+{
+	volatile unsigned int *chan = dma_channelBase(dma, channel);
+	unsigned int t;
+
+	dma_common[dma].channel[channel - 1].done = 0;
+
+	*(chan + cmar) = (unsigned int)maddr;
+	*(chan + cndtr) = len;
+
+	t = *(chan + ccr) & ~(1 << 7);
+	dataBarier();
+	*(chan + ccr) = t | (!!minc << 7) | 1;
+}
+
+
+int dma_waitFinished(int dma, int channel, time_t timeout)
+{
+	int done;
+
+	mutexLock(dma_common[dma].channel[channel - 1].irqLock);
+	while (!(done = dma_common[dma].channel[channel - 1].done)) {
+		if (condWait(dma_common[dma].channel[channel - 1].cond, dma_common[dma].channel[channel - 1].irqLock, timeout) < 0 &&
+				!(done = dma_common[dma].channel[channel - 1].done)) {
+			done = -ETIMEDOUT;
+			break;
+		}
+	}
+	mutexUnlock(dma_common[dma].channel[channel - 1].irqLock);
+
+	if (done == -ETIMEDOUT)
+		dma_disableChannel(dma, channel);
+
+	return done < 0 ? done : EOK;
+}
+
+
+void dma_disableChannel(int dma, int channel)
+{
+	*(dma_channelBase(dma, channel) + ccr) &= ~1;
+	*(dma_common[dma].base + ifcr) = 0xf << (4 * (channel - 1));
+}
+
+
+void dma_init(void)
+{
+	dma_common[dma1].base = (void *)0x40026000;
+	dma_common[dma2].base = (void *)0x40026400;
+}
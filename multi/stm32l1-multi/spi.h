@@ -29,4 +29,8 @@ int spi_configure(int spi, char mode, char bdiv, int enable);
 void spi_init(void);
 
 
+/* Prints throughput and interrupts per transfer for both transfer modes, enabled with SPI_BENCH */
+void spi_bench(void);
+
+
 #endif
@@ -31,6 +31,7 @@
 #include "rcc.h"
 #include "rtc.h"
 #include "uart.h"
+#include "dma.h"
 #include "spi.h"
 #include "exti.h"
 
@@ -215,6 +216,7 @@ int main(void)
 	adc_init();
 	i2c_init();
 	flash_init();
+	dma_init();
 	spi_init();
 	exti_init();
 
@@ -223,6 +225,10 @@ int main(void)
 
 	uart_write(UART_CONSOLE + usart1 - 1, "multidrv: Started\n", 18);
 
+#if SPI_BENCH
+	spi_bench();
+#endif
+
 	for (i = 0; i < THREADS_NO - 1; ++i)
 		beginthread(thread, THREADS_PRIORITY, common.stack[i], STACKSZ, (void *)i);
 
@@ -53,6 +53,19 @@
 #define SPI3 0
 #endif
 
+#ifndef SPI_DMA
+#define SPI_DMA 1
+#endif
+
+/* Shorter transfers are interrupt driven */
+#ifndef SPI_DMA_THRESHOLD
+#define SPI_DMA_THRESHOLD 16
+#endif
+
+#ifndef SPI_BENCH
+#define SPI_BENCH 0
+#endif
+
 #ifndef FLASH_PROGRAM_1_ADDR
 #define FLASH_PROGRAM_1_ADDR 0x08000000
 #endif
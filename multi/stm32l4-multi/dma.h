@@ -0,0 +1,53 @@
+/*
+ * Phoenix-RTOS
+ *
+ * STM32L4 DMA driver
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+
+#ifndef _DMA_H_
+#define _DMA_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+
+enum { dma1 = 0, dma2 };
+
+
+enum { dma_per2mem = 0, dma_mem2per };
+
+
+enum { dma_size8 = 0, dma_size16, dma_size32 };
+
+
+enum { dma_priorityLow = 0, dma_priorityMedium, dma_priorityHigh, dma_priorityVeryHigh };
+
+
+/* Channels are numbered from 1, as in reference manual, reqmap selects request source (CSELR).
+ * If irq is set, transfer completion can be waited for */
+int dma_configureChannel(int dma, int channel, int dir, int priority, volatile void *paddr, int msize, int psize,
+	unsigned char reqmap, int irq);
+
+
+void dma_transfer(int dma, int channel, void *maddr, int minc, size_t len);
+
+
+/* Returns 0 on transfer complete, -EIO on transfer error, -ETIMEDOUT if not finished within timeout (in us),
+ * the channel is disabled then */
+int dma_waitFinished(int dma, int channel, time_t timeout);
+
+
+void dma_disableChannel(int dma, int channel);
+
+
+void dma_init(void);
+
+
+#endif
@@ -23,6 +23,7 @@
 #include "stm32-multi.h"
 #include "common.h"
 #include "rcc.h"
+#include "dma.h"
 #include "spi.h"
 
 
@@ -39,6 +40,13 @@ struct {
 	handle_t irqLock;
 	handle_t cond;
 	handle_t inth;
+
+	int dma;
+	size_t dmaThreshold;
+	unsigned char rxDummy;
+	unsigned char txDummy;
+
+	volatile unsigned int irqs;
 } spi_common[SPI1 + SPI2 + SPI3];
 
 
@@ -51,6 +59,15 @@ static const int spiConfig[] = { SPI1, SPI2, SPI3 };
 static const int spiPos[] = { SPI1_POS, SPI2_POS, SPI3_POS };
 
 
+/* RX and TX channel with request mapping (CSELR) */
+static const struct {
+	unsigned char dma;
+	unsigned char rxChannel;
+	unsigned char txChannel;
+	unsigned char reqmap;
+} spi2dma[] = { { dma1, 2, 3, 1 }, { dma1, 4, 5, 1 }, { dma2, 1, 2, 3 } };
+
+
 enum { cr1 = 0, cr2 = 2, sr = 4, dr = 6, crcpr = 8, rxcrcr = 10, txcrcr = 12 };
 
 
@@ -58,6 +75,7 @@ static int spi_irqHandler(unsigned int n, void *arg)
 {
 	*(spi_common[(int)arg].base + cr2) &= ~(1 << 7);
 	spi_common[(int)arg].ready = 1;
+	spi_common[(int)arg].irqs++;
 
 	return 1;
 }
@@ -84,48 +102,93 @@ static unsigned char _spi_readwrite(int spi, unsigned char txd)
 }
 
 
+/* Time (in us) allowed for a DMA transfer, enough for the slowest SPI clock */
+#define SPI_DMA_TIMEOUT(len) (10000 + (time_t)(len) * 128)
+
+
+static int _spi_dma(int spi, int pos, unsigned char *ibuff, unsigned char *obuff, size_t bufflen)
+{
+	int dma = spi2dma[spi].dma, rxch = spi2dma[spi].rxChannel, txch = spi2dma[spi].txChannel, err = EOK;
+	size_t chunk;
+
+	/* Let last byte of interrupt driven part finish and flush RX FIFO */
+	while (*(spi_common[pos].base + sr) & ((1 << 7) | (1 << 0)))
+		(void)*((volatile uint8_t *)(spi_common[pos].base + dr));
+
+	while (bufflen && err == EOK) {
+		chunk = min(bufflen, 0xffff);
+
+		/* Single completion interrupt from RX channel, it finishes last */
+		dma_transfer(dma, rxch, (ibuff != NULL) ? ibuff : &spi_common[pos].rxDummy, ibuff != NULL, chunk);
+		dma_transfer(dma, txch, (obuff != NULL) ? obuff : &spi_common[pos].txDummy, obuff != NULL, chunk);
+
+		*(spi_common[pos].base + cr2) |= (1 << 1) | (1 << 0);
+
+		err = dma_waitFinished(dma, rxch, SPI_DMA_TIMEOUT(chunk));
+		spi_common[pos].irqs++;
+
+		*(spi_common[pos].base + cr2) &= ~((1 << 1) | (1 << 0));
+		dma_disableChannel(dma, txch);
+		dma_disableChannel(dma, rxch);
+
+		if (ibuff != NULL)
+			ibuff += chunk;
+
+		if (obuff != NULL)
+			obuff += chunk;
+
+		bufflen -= chunk;
+	}
+
+	return err;
+}
+
+
 int spi_transaction(int spi, int dir, unsigned char cmd, unsigned int addr, unsigned char flags, unsigned char *ibuff, unsigned char *obuff, size_t bufflen)
 {
-	int i;
+	int i, pos, err = EOK;
 
 	if (spi < spi1 || spi > spi3 || !spiConfig[spi])
 		return -EINVAL;
 
-	spi = spiPos[spi];
+	pos = spiPos[spi];
 
-	mutexLock(spi_common[spi].mutex);
+	mutexLock(spi_common[pos].mutex);
 	keepidle(1);
 
 	if (flags & spi_cmd)
-		_spi_readwrite(spi, cmd);
+		_spi_readwrite(pos, cmd);
 
 	if (flags & spi_address) {
 		for (i = 0; i < 3; ++i) {
-			_spi_readwrite(spi, (addr >> 16) & 0xff);
+			_spi_readwrite(pos, (addr >> 16) & 0xff);
 			addr <<= 8;
 		}
 	}
 
 	if (flags & spi_dummy)
-		_spi_readwrite(spi, 0);
+		_spi_readwrite(pos, 0);
 
-	if (dir == spi_read) {
+	if (spi_common[pos].dma && bufflen >= spi_common[pos].dmaThreshold) {
+		err = _spi_dma(spi, pos, (dir == spi_write) ? NULL : ibuff, (dir == spi_read) ? NULL : obuff, bufflen);
+	}
+	else if (dir == spi_read) {
 		for (i = 0; i < bufflen; ++i)
-			ibuff[i] = _spi_readwrite(spi, 0);
+			ibuff[i] = _spi_readwrite(pos, 0);
 	}
 	else if (dir == spi_write) {
 		for (i = 0; i < bufflen; ++i)
-			_spi_readwrite(spi, obuff[i]);
+			_spi_readwrite(pos, obuff[i]);
 	}
 	else {
 		for (i = 0; i < bufflen; ++i)
-			ibuff[i] = _spi_readwrite(spi, obuff[i]);
+			ibuff[i] = _spi_readwrite(pos, obuff[i]);
 	}
 
 	keepidle(0);
-	mutexUnlock(spi_common[spi].mutex);
+	mutexUnlock(spi_common[pos].mutex);
 
-	return bufflen;
+	return (err < 0) ? err : bufflen;
 }
 
 
@@ -174,6 +237,11 @@ void spi_init(void)
 
 		spi_common[i].base = (void *)spiinfo[spi].base;
 		spi_common[i].ready = 1;
+		spi_common[i].dma = 0;
+		spi_common[i].dmaThreshold = SPI_DMA_THRESHOLD;
+		spi_common[i].rxDummy = 0;
+		spi_common[i].txDummy = 0;
+		spi_common[i].irqs = 0;
 
 		mutexCreate(&spi_common[i].mutex);
 		mutexCreate(&spi_common[i].irqLock);
@@ -191,6 +259,16 @@ void spi_init(void)
 		/* 8 bits, motorola frame format */
 		*(spi_common[i].base + cr2) = (0x7 << 8) | (1 << 2);
 
+#if SPI_DMA
+		/* RX FIFO threshold of 8 bits, required by 8-bit DMA reads */
+		*(spi_common[i].base + cr2) |= 1 << 12;
+
+		spi_common[i].dma = (dma_configureChannel(spi2dma[spi].dma, spi2dma[spi].rxChannel, dma_per2mem, dma_priorityHigh,
+			spi_common[i].base + dr, dma_size8, dma_size8, spi2dma[spi].reqmap, 1) == EOK) &&
+			(dma_configureChannel(spi2dma[spi].dma, spi2dma[spi].txChannel, dma_mem2per, dma_priorityMedium,
+			spi_common[i].base + dr, dma_size8, dma_size8, spi2dma[spi].reqmap, 0) == EOK);
+#endif
+
 		/* Enable SPI */
 		*(spi_common[i].base + cr1) |= 1 << 6;
 
@@ -199,3 +277,52 @@ void spi_init(void)
 		++i;
 	}
 }
+
+
+#if SPI_BENCH
+void spi_bench(void)
+{
+	static unsigned char buff[2][1024];
+	static const size_t sizes[] = { 4, 16, 64, 256, 1024 };
+	static const char *modes[] = { "irq", "dma" };
+	int spi, pos, mode, i, j, reps;
+	unsigned int irqs;
+	size_t size, thr;
+	time_t start, end;
+
+	for (spi = spi1; spi <= spi3; ++spi) {
+		if (!spiConfig[spi])
+			continue;
+
+		pos = spiPos[spi];
+		thr = spi_common[pos].dmaThreshold;
+
+		for (j = 0; j < sizeof(sizes) / sizeof(sizes[0]); ++j) {
+			size = sizes[j];
+			reps = 16384 / size;
+
+			for (mode = 0; mode < 2; ++mode) {
+				if (mode && !spi_common[pos].dma)
+					continue;
+
+				spi_common[pos].dmaThreshold = mode ? 0 : (size_t)-1;
+				irqs = spi_common[pos].irqs;
+
+				gettime(&start, NULL);
+				for (i = 0; i < reps; ++i)
+					spi_transaction(spi, spi_readwrite, 0, 0, 0, buff[0], buff[1], size);
+				gettime(&end, NULL);
+
+				end = max(end - start, 1);
+				irqs = spi_common[pos].irqs - irqs;
+
+				printf("spi%d bench: %4u B %s: %6u us/transfer, %6u kB/s, %4u irqs/transfer\n", spi + 1, size, modes[mode],
+					(unsigned int)(end / reps), (unsigned int)(((unsigned long long)size * reps * 1000000) / ((unsigned long long)end * 1024)),
+					irqs / reps);
+			}
+		}
+
+		spi_common[pos].dmaThreshold = thr;
+	}
+}
+#endif
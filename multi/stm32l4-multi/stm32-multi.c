@@ -30,6 +30,7 @@
 #include "rcc.h"
 #include "rtc.h"
 #include "uart.h"
+#include "dma.h"
 #include "spi.h"
 #include "exti.h"
 
@@ -202,6 +203,7 @@ int main(void)
 	rcc_init();
 	uart_init();
 	gpio_init();
+	dma_init();
 	spi_init();
 	adc_init();
 	rtc_init();
@@ -217,6 +219,10 @@ int main(void)
 
 	uart_write(UART_CONSOLE + usart1 - 1, "multidrv: Started\n", 18);
 
+#if SPI_BENCH
+	spi_bench();
+#endif
+
 	for (i = 0; i < THREADS_NO - 1; ++i)
 		beginthread(thread, THREADS_PRIORITY, common.stack[i], STACKSZ, (void *)i);
 
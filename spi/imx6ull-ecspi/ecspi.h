@@ -16,6 +16,7 @@
 #include <stdint.h>
 
 #include <sys/threads.h>
+#include <sys/time.h>
 #include <phoenix/arch/imx6ull.h>
 
 enum { ecspi1 = 1, ecspi2, ecspi3, ecspi4 };
@@ -37,6 +38,65 @@ typedef struct {
 } ecspi_ctx_t;
 
 
+/* Transfer queue priority levels, 0 is the highest */
+#define ECSPI_QUEUE_PRIOS 4
+
+
+typedef struct _ecspi_xfer_t ecspi_xfer_t;
+
+
+/* Called from the interrupt context - must not use syscalls, may submit transfers */
+typedef void ecspi_doneProc_t(ecspi_xfer_t *xfer);
+
+
+struct _ecspi_xfer_t {
+	ecspi_xfer_t *next;
+
+	uint8_t chan;         /* SS line */
+	uint8_t mode;         /* (CPOL, CPHA) */
+	uint8_t pre;          /* clock dividers as in ecspi_setClockDiv() */
+	uint8_t post;
+	uint8_t prio;
+
+	const uint8_t *out;
+	uint8_t *in;          /* NULL discards received data */
+	size_t len;           /* up to 256 bytes, one burst */
+
+	ecspi_doneProc_t *done;
+	void *arg;
+
+	volatile int status;  /* 1 while queued or in progress, 0 when completed */
+};
+
+
+typedef struct {
+	int dev_no;
+	handle_t inth;
+	handle_t cond;
+	handle_t lock;
+
+	ecspi_xfer_t *head[ECSPI_QUEUE_PRIOS];
+	ecspi_xfer_t *tail[ECSPI_QUEUE_PRIOS];
+	ecspi_xfer_t *volatile cur;
+	int in_handler;       /* set while done callbacks run, the bus is idle then */
+
+	unsigned int depth;
+	unsigned int depth_max;
+	uint32_t completed;
+	uint64_t busy_clk;    /* ECSPI root clock cycles with SCLK running */
+	time_t since;
+} ecspi_queue_t;
+
+
+typedef struct {
+	unsigned int depth;   /* transfers queued or in progress */
+	unsigned int depth_max;
+	uint32_t completed;
+	time_t busy;          /* bus busy time (us) */
+	time_t elapsed;       /* time (us) since ecspi_queueInit() or the last reset of the counters */
+} ecspi_queueStats_t;
+
+
 int ecspi_init(int dev_no, uint8_t chan_msk);
 int ecspi_registerContext(int dev_no, ecspi_ctx_t *ctx, handle_t cond);
 
@@ -54,6 +114,16 @@ int ecspi_exchangeAsync(ecspi_ctx_t *ctx, const uint8_t *out, size_t len);
 int ecspi_exchangePeriodically(ecspi_ctx_t *ctx, uint8_t *out, uint8_t *in, size_t len, unsigned int wait_states, ecspi_writerProc_t writer_proc);
 int ecspi_readFifo(ecspi_ctx_t *ctx, uint8_t *buf, size_t len);
 
+int ecspi_dmaInit(int dev_no, unsigned int sdma_channel);
+void *ecspi_dmaAlloc(int dev_no, size_t size);
+int ecspi_dmaFree(void *buf, size_t size);
+int ecspi_exchangeDma(int dev_no, const void *out, void *in, size_t len, uint8_t word_len);
+
+int ecspi_queueInit(int dev_no, ecspi_queue_t *q);
+int ecspi_queueSubmit(ecspi_queue_t *q, ecspi_xfer_t *xfer);
+int ecspi_queueWait(ecspi_queue_t *q, ecspi_xfer_t *xfer);
+void ecspi_queueStats(ecspi_queue_t *q, ecspi_queueStats_t *stats, int reset);
+
 addr_t ecspi_getTxFifoPAddr(int dev_no);
 addr_t ecspi_getRxFifoPAddr(int dev_no);
 
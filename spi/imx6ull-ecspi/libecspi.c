@@ -18,6 +18,8 @@
 
 #include <phoenix/arch/imx6ull.h>
 
+#include <sdma.h>
+
 #include "ecspi.h"
 
 
@@ -25,10 +27,27 @@
 #define BITS_2_BYTES_ROUND_UP(LEN) (((LEN) + 7) / 8)
 #define GET_BURST_IN_BYTES(ECSPI) (BITS_2_BYTES_ROUND_UP((*((ECSPI)->base + conreg) >> 20) + 1))
 
+/* RX and TX buffer descriptors share one uncached page with the scratch buffers used for NULL out/in */
+#define DMA_BD_CNT 64
+#define DMA_SCRATCH_SZ 1024
+#define DMA_ZERO_OFFS 2048
+#define DMA_SINK_OFFS (DMA_ZERO_OFFS + DMA_SCRATCH_SZ)
+#define DMA_PRIORITY 6
+
+/* ECSPI root clock used for the bus utilisation counters */
+#define ECSPI_CLK_MHZ 60
+
+/* FIFO words moved per DMA request, rounds are split so that it divides the word count */
+#define DMA_WML 32
+#define DMA_BD_MAX (SDMA_BD_COUNT_MAX & ~(DMA_WML * 4 - 1))
+
+/* Longest burst (4096 bits) in bytes, 32-bit DMA exchanges are chained from such bursts */
+#define DMA_BURST_MAX 512
+
 
 enum { rxdata = 0, txdata, conreg, configreg, intreg, dmareg, statreg, periodreg, testreg, msgdata = 16 };
 
-typedef enum { mode_sync_exchange, mode_async_write, mode_async_exchange, mode_async_periodical } ecspi_mode_t;
+typedef enum { mode_sync_exchange, mode_async_write, mode_async_exchange, mode_async_periodical, mode_dma_exchange, mode_queue } ecspi_mode_t;
 
 typedef struct {
 	volatile uint32_t *base;
@@ -38,6 +57,13 @@ typedef struct {
 	handle_t inth;
 	handle_t cond;
 	handle_t irqlock;
+
+	sdma_t rx_sdma;
+	sdma_t tx_sdma;
+	volatile sdma_buffer_desc_t *rx_bd;
+	volatile sdma_buffer_desc_t *tx_bd;
+	addr_t dma_paddr;
+	uint32_t dma_wm; /* watermark (in bytes) the channel contexts are set up with */
 } ecspi_t;
 
 typedef struct {
@@ -48,6 +74,7 @@ typedef struct {
 
 static const addr_t ecspi_addr[4] = { 0x2008000, 0x200C000, 0x2010000, 0x2014000 };
 static const unsigned int ecspi_intr_number[4] = { 63, 64, 65, 66 };
+static const unsigned int ecspi_sdma_event[4][2] = { { 3, 4 }, { 5, 6 }, { 7, 8 }, { 9, 10 } };
 
 ecspi_pctl_t ecspi_pctl_mux[4][7] = {
 	{ { pctl_mux_csi_d7,      3 }, { pctl_mux_csi_d6,     3 }, { pctl_mux_csi_d4,    3 }, { pctl_mux_csi_d5,     3 },
@@ -119,7 +146,7 @@ static int ecspi_irqHandlerAsync(unsigned int n, void *arg)
 	ecspi_ctx_t *ctx = arg;
 	ecspi_t *e = &ecspi[ctx->dev_no - 1];
 
-	if (e->mode == mode_sync_exchange) {
+	if (e->mode == mode_sync_exchange || e->mode == mode_dma_exchange || e->mode == mode_queue) {
 		return -1;
 	}
 
@@ -634,6 +661,513 @@ int ecspi_writeAsync(ecspi_ctx_t *ctx, const uint8_t *out, size_t len)
 }
 
 
+/* Takes the first transfer of the highest priority and starts it, hardware has to be idle */
+static void ecspi_queueStart(ecspi_queue_t *q)
+{
+	ecspi_t *e = &ecspi[q->dev_no - 1];
+	ecspi_xfer_t *x;
+	unsigned int p;
+
+	for (p = 0; p < ECSPI_QUEUE_PRIOS; ++p) {
+		if (q->head[p] != NULL)
+			break;
+	}
+
+	if (p == ECSPI_QUEUE_PRIOS) {
+		q->cur = NULL;
+		return;
+	}
+
+	x = q->head[p];
+	if ((q->head[p] = x->next) == NULL)
+		q->tail[p] = NULL;
+
+	q->cur = x;
+	e->mode = mode_queue;
+
+	/* Per transfer SS line, clock dividers and SPI mode, one burst */
+	*(e->base + conreg) = (*(e->base + conreg) & ~((0x03 << 18) | (0xFF << 8) | (1 << 3))) |
+		(x->chan << 18) | ((x->pre & 0x0F) << 12) | ((x->post & 0x0F) << 8);
+	*(e->base + configreg) = (*(e->base + configreg) & ~((0xF << 8) | (0x11 << x->chan))) |
+		((x->mode & 0x01) << x->chan) | (((x->mode >> 1) & 0x01) << (x->chan + 4));
+	ecspi_setBurst(q->dev_no, x->len * 8);
+
+	writeFifo(q->dev_no, x->out, x->len);
+
+	/* Clear Transfer Completed bit. */
+	*(e->base + statreg) |= (1 << 7);
+	/* Begin transmission. */
+	*(e->base + conreg) |= (1 << 2);
+}
+
+
+static int ecspi_irqHandlerQueue(unsigned int n, void *arg)
+{
+	(void) n;
+
+	ecspi_queue_t *q = arg;
+	ecspi_t *e = &ecspi[q->dev_no - 1];
+	ecspi_xfer_t *x = q->cur;
+	size_t words;
+
+	if (e->mode != mode_queue || x == NULL || !(*(e->base + statreg) & (1 << 7))) {
+		return -1;
+	}
+
+	/* Clear Transfer Completed bit. */
+	*(e->base + statreg) |= (1 << 7);
+
+	if (x->in != NULL) {
+		readFifo(q->dev_no, x->in, x->len);
+	}
+	else {
+		for (words = (x->len + 3) / 4; words > 0; words--)
+			(void)*(e->base + rxdata);
+	}
+
+	q->busy_clk += (uint64_t)x->len * 8 * ((x->pre & 0x0F) + 1) << (x->post & 0x0F);
+	q->completed++;
+	q->depth--;
+	q->cur = NULL;
+
+	x->status = 0;
+	if (x->done != NULL) {
+		q->in_handler = 1;
+		x->done(x);
+		q->in_handler = 0;
+	}
+
+	/* Next transfer is started right away - the done callback might have started one already */
+	if (q->cur == NULL)
+		ecspi_queueStart(q);
+
+	if (q->cur == NULL) {
+		/* Disable Transfer Completed interrupt. */
+		*(e->base + intreg) &= ~(1 << 7);
+	}
+
+	return 1;
+}
+
+
+int ecspi_queueInit(int dev_no, ecspi_queue_t *q)
+{
+	if (dev_no < 1 || dev_no > 4) {
+		return -1;
+	}
+
+	*q = (ecspi_queue_t) {
+		.dev_no = dev_no,
+	};
+
+	gettime(&q->since, NULL);
+
+	if (mutexCreate(&q->lock) < 0) {
+		return -2;
+	}
+
+	if (condCreate(&q->cond) < 0) {
+		resourceDestroy(q->lock);
+		return -2;
+	}
+
+	return interrupt(ecspi_intr_number[dev_no - 1], ecspi_irqHandlerQueue, (void *) q, q->cond, &q->inth);
+}
+
+
+int ecspi_queueSubmit(ecspi_queue_t *q, ecspi_xfer_t *xfer)
+{
+	ecspi_t *e;
+
+	if (q->dev_no < 1 || q->dev_no > 4) {
+		return -1;
+	}
+
+	if (xfer->len > (64 * 4) || xfer->len == 0 || xfer->out == NULL) {
+		return -2;
+	}
+
+	e = &ecspi[q->dev_no - 1];
+
+	if (xfer->chan > 3 || !(e->chan_msk & (1 << xfer->chan)) || xfer->mode > 3 || xfer->prio >= ECSPI_QUEUE_PRIOS) {
+		return -3;
+	}
+
+	xfer->next = NULL;
+	xfer->status = 1;
+
+	/* Interrupt handler doesn't run while Transfer Completed interrupt is disabled. */
+	*(e->base + intreg) &= ~(1 << 7);
+
+	if (q->tail[xfer->prio] != NULL)
+		q->tail[xfer->prio]->next = xfer;
+	else
+		q->head[xfer->prio] = xfer;
+	q->tail[xfer->prio] = xfer;
+
+	if (++q->depth > q->depth_max)
+		q->depth_max = q->depth;
+
+	if (q->cur == NULL) {
+		/* Wait until a transaction of other modes has completed - not needed in done callbacks, the bus is idle */
+		while (!q->in_handler && ((*(e->base + conreg) & (1 << 2)) || (*(e->base + testreg) & 0x7F) != 0)) {
+			;
+		}
+
+		ecspi_queueStart(q);
+	}
+
+	/* Enable Transfer Completed interrupt. */
+	*(e->base + intreg) |= (1 << 7);
+
+	return 0;
+}
+
+
+int ecspi_queueWait(ecspi_queue_t *q, ecspi_xfer_t *xfer)
+{
+	mutexLock(q->lock);
+	while (xfer->status > 0) {
+		condWait(q->cond, q->lock, 0);
+	}
+	mutexUnlock(q->lock);
+
+	return xfer->status;
+}
+
+
+void ecspi_queueStats(ecspi_queue_t *q, ecspi_queueStats_t *stats, int reset)
+{
+	ecspi_t *e = &ecspi[q->dev_no - 1];
+	uint32_t inten;
+	time_t now;
+
+	gettime(&now, NULL);
+
+	inten = *(e->base + intreg) & (1 << 7);
+	*(e->base + intreg) &= ~(1 << 7);
+
+	stats->depth = q->depth;
+	stats->depth_max = q->depth_max;
+	stats->completed = q->completed;
+	stats->busy = q->busy_clk / ECSPI_CLK_MHZ;
+	stats->elapsed = now - q->since;
+
+	if (reset) {
+		q->depth_max = q->depth;
+		q->completed = 0;
+		q->busy_clk = 0;
+		q->since = now;
+	}
+
+	*(e->base + intreg) |= inten;
+}
+
+
+static addr_t ecspi_va2pa(uintptr_t va)
+{
+	return va2pa((void *)(va & ~(_PAGE_SIZE - 1))) + (va & (_PAGE_SIZE - 1));
+}
+
+
+static int ecspi_dmaChannelInit(sdma_t *s, unsigned int channel, addr_t bd_paddr, unsigned int event)
+{
+	char dev_name[sizeof("/dev/sdma/chxx")];
+	sdma_channel_config_t cfg;
+
+	snprintf(dev_name, sizeof(dev_name), "/dev/sdma/ch%02u", channel);
+	if (sdma_open(s, dev_name) < 0)
+		return -1;
+
+	cfg.bd_paddr = bd_paddr;
+	cfg.bd_cnt = DMA_BD_CNT;
+	cfg.trig = sdma_trig__event;
+	cfg.event = event;
+	cfg.priority = DMA_PRIORITY;
+	cfg.flags = SDMA_CHANNEL_MANUAL_BD_DONE;
+
+	return sdma_channel_configure(s, &cfg);
+}
+
+
+static int ecspi_dmaContextSet(sdma_t *s, sdma_script_t script, unsigned int event, addr_t per_addr, uint32_t wm)
+{
+	sdma_context_t ctx;
+
+	sdma_context_init(&ctx);
+	sdma_context_set_pc(&ctx, script);
+	ctx.gr[0] = (event >= 32) ? (1 << (event - 32)) : 0; /* event mask */
+	ctx.gr[1] = (event < 32) ? (1 << event) : 0;
+	ctx.gr[6] = per_addr;
+	ctx.gr[7] = wm;
+
+	return sdma_context_set(s, &ctx);
+}
+
+
+/* Scripts move wm bytes per ECSPI DMA request, contexts are reloaded only when it changes */
+static int ecspi_dmaWatermark(int dev_no, uint32_t wm)
+{
+	ecspi_t *e = &ecspi[dev_no - 1];
+
+	if (e->dma_wm == wm)
+		return 0;
+
+	e->dma_wm = 0;
+
+	if (ecspi_dmaContextSet(&e->rx_sdma, sdma_script__shp_2_mcu, ecspi_sdma_event[dev_no - 1][0], ecspi_getRxFifoPAddr(dev_no), wm) < 0)
+		return -1;
+
+	if (ecspi_dmaContextSet(&e->tx_sdma, sdma_script__mcu_2_shp, ecspi_sdma_event[dev_no - 1][1], ecspi_getTxFifoPAddr(dev_no), wm) < 0)
+		return -1;
+
+	e->dma_wm = wm;
+
+	return 0;
+}
+
+
+/* Describes len bytes at va (or the scratch buffer if va is 0), returns number of BDs used */
+static unsigned int ecspi_dmaFillBd(volatile sdma_buffer_desc_t *bd, uintptr_t va, addr_t scratch, size_t len, uint8_t command, uint8_t last_flags)
+{
+	unsigned int i = 0;
+	size_t chunk;
+	addr_t pa;
+
+	while (len > 0) {
+		if (va == 0) {
+			pa = scratch;
+			chunk = (len > DMA_SCRATCH_SZ) ? DMA_SCRATCH_SZ : len;
+		}
+		else {
+			pa = ecspi_va2pa(va);
+			chunk = _PAGE_SIZE - (va & (_PAGE_SIZE - 1));
+			if (chunk > len)
+				chunk = len;
+		}
+
+		/* Merge physically contiguous pages */
+		if (va != 0 && i > 0 && bd[i - 1].buffer_addr + bd[i - 1].count == pa && bd[i - 1].count + chunk <= DMA_BD_MAX) {
+			bd[i - 1].count += chunk;
+		}
+		else {
+			bd[i].count = chunk;
+			bd[i].command = command;
+			bd[i].buffer_addr = pa;
+			bd[i].ext_buffer_addr = 0;
+			bd[i].flags = SDMA_BD_DONE | SDMA_BD_CONT;
+			i++;
+		}
+
+		if (va != 0)
+			va += chunk;
+		len -= chunk;
+	}
+
+	bd[i - 1].flags = SDMA_BD_DONE | SDMA_BD_WRAP | SDMA_BD_LAST | last_flags;
+
+	return i;
+}
+
+
+int ecspi_dmaInit(int dev_no, unsigned int sdma_channel)
+{
+	ecspi_t *e;
+	uint8_t *page;
+	addr_t paddr;
+	unsigned int i;
+
+	if (dev_no < 1 || dev_no > 4) {
+		return -1;
+	}
+
+	/* Channel 0 is the SDMA boot channel, 31 is the memcpy service channel unless moved with sdma driver -m option */
+	if (sdma_channel < 1 || sdma_channel > 30) {
+		return -2;
+	}
+
+	e = &ecspi[dev_no - 1];
+
+	if ((page = sdma_alloc_uncached(&e->rx_sdma, _PAGE_SIZE, &paddr, 0)) == NULL) {
+		return -3;
+	}
+
+	for (i = 0; i < 2 * DMA_SCRATCH_SZ; ++i) {
+		page[DMA_ZERO_OFFS + i] = 0;
+	}
+
+	/* ECSPI is on the shared peripheral bus - shp scripts are used */
+	if (ecspi_dmaChannelInit(&e->rx_sdma, sdma_channel, paddr, ecspi_sdma_event[dev_no - 1][0]) < 0) {
+		printf("ecspi: could not set up SDMA channel %u\n", sdma_channel);
+		sdma_free_uncached(page, _PAGE_SIZE);
+		return -3;
+	}
+
+	if (ecspi_dmaChannelInit(&e->tx_sdma, sdma_channel + 1, paddr + DMA_BD_CNT * sizeof(sdma_buffer_desc_t), ecspi_sdma_event[dev_no - 1][1]) < 0) {
+		printf("ecspi: could not set up SDMA channel %u\n", sdma_channel + 1);
+		sdma_close(&e->rx_sdma);
+		sdma_free_uncached(page, _PAGE_SIZE);
+		return -3;
+	}
+
+	if (ecspi_dmaWatermark(dev_no, DMA_WML) < 0) {
+		printf("ecspi: could not set up SDMA channels %u and %u\n", sdma_channel, sdma_channel + 1);
+		sdma_close(&e->tx_sdma);
+		sdma_close(&e->rx_sdma);
+		sdma_free_uncached(page, _PAGE_SIZE);
+		return -3;
+	}
+
+	e->dma_paddr = paddr;
+	e->tx_bd = (sdma_buffer_desc_t *)page + DMA_BD_CNT;
+	e->rx_bd = (sdma_buffer_desc_t *)page;
+
+	return 0;
+}
+
+
+void *ecspi_dmaAlloc(int dev_no, size_t size)
+{
+	if (dev_no < 1 || dev_no > 4 || ecspi[dev_no - 1].rx_bd == NULL) {
+		return NULL;
+	}
+
+	return sdma_alloc_uncached(&ecspi[dev_no - 1].rx_sdma, size, NULL, 0);
+}
+
+
+int ecspi_dmaFree(void *buf, size_t size)
+{
+	return sdma_free_uncached(buf, size);
+}
+
+
+int ecspi_exchangeDma(int dev_no, const void *out, void *in, size_t len, uint8_t word_len)
+{
+	static const uint8_t command[5] = { 0, SDMA_CMD_MODE_8_BIT, SDMA_CMD_MODE_16_BIT, 0, SDMA_CMD_MODE_32_BIT };
+	ecspi_t *e;
+	uintptr_t tx = (uintptr_t)out, rx = (uintptr_t)in;
+	size_t words, round, round_max, burst_left = 0;
+	unsigned int i, rx_cnt, tx_cnt, wml;
+	uint32_t cnt;
+	int res = 0;
+
+	if (dev_no < 1 || dev_no > 4) {
+		return -1;
+	}
+
+	if ((word_len != 1 && word_len != 2 && word_len != 4) || len == 0 || (len % word_len) != 0 || ((tx | rx) & (word_len - 1))) {
+		return -2;
+	}
+
+	e = &ecspi[dev_no - 1];
+
+	if (e->rx_bd == NULL) {
+		return -3;
+	}
+
+	/* Wait until the previous transaction has completed. */
+	while ((*(e->base + conreg) & (1 << 2)) || (*(e->base + testreg) & 0x7F) != 0) {
+		;
+	}
+
+	e->mode = mode_dma_exchange;
+
+	/* Discard words left by other modes. */
+	while (*(e->base + statreg) & (1 << 3)) {
+		(void)*(e->base + rxdata);
+	}
+
+	/*
+	 * A burst longer than 32 bits takes 32 bits from every FIFO entry, so only 32-bit words can be
+	 * chained into 4096-bit single bursts. SS is negated between bursts (every 128 words), and after
+	 * every word for 8 and 16-bit words (one word per burst, multiple burst mode).
+	 */
+	if (word_len == 4) {
+		*(e->base + configreg) &= ~(0xF << 8);
+	}
+	else {
+		*(e->base + configreg) |= (0xF << 8);
+		ecspi_setBurst(dev_no, word_len * 8);
+	}
+	/* Start on TXFIFO write. */
+	*(e->base + conreg) |= (1 << 3);
+
+	/* All but the last round are multiples of DMA_WML words, each of them fits in the BD rings */
+	round_max = (tx != 0 && rx != 0) ? (DMA_BD_CNT - 1) * _PAGE_SIZE : DMA_BD_CNT * DMA_SCRATCH_SZ;
+
+	while (len > 0 && res == 0) {
+		words = len / word_len;
+
+		if (len > round_max) {
+			round = round_max;
+			wml = DMA_WML;
+		}
+		else if (word_len == 4 && len >= DMA_BURST_MAX) {
+			/* Keep rounds at burst boundaries, so the burst length is only changed for the tail */
+			round = len - len % DMA_BURST_MAX;
+			wml = DMA_WML;
+		}
+		else if (words >= DMA_WML) {
+			round = (words - words % DMA_WML) * word_len;
+			wml = DMA_WML;
+		}
+		else {
+			round = len;
+			wml = words;
+		}
+
+		if (ecspi_dmaWatermark(dev_no, wml * word_len) < 0) {
+			res = -4;
+			break;
+		}
+
+		/* The previous round has been received, so no burst is in progress */
+		if (word_len == 4 && burst_left == 0) {
+			burst_left = (len > DMA_BURST_MAX) ? DMA_BURST_MAX : len;
+			ecspi_setBurst(dev_no, burst_left * 8);
+		}
+
+		rx_cnt = ecspi_dmaFillBd(e->rx_bd, rx, e->dma_paddr + DMA_SINK_OFFS, round, command[word_len], SDMA_BD_INTR);
+		tx_cnt = ecspi_dmaFillBd(e->tx_bd, tx, e->dma_paddr + DMA_ZERO_OFFS, round, command[word_len], 0);
+
+		sdma_enable(&e->rx_sdma);
+		sdma_enable(&e->tx_sdma);
+
+		/* RX request above wml - 1 words, TX request at or below DMA_WML words in the FIFO */
+		*(e->base + dmareg) = (1 << 23) | ((wml - 1) << 16) | (1 << 7) | DMA_WML;
+
+		do
+			sdma_wait_for_intr(&e->rx_sdma, &cnt);
+		while (e->rx_bd[rx_cnt - 1].flags & SDMA_BD_DONE);
+
+		*(e->base + dmareg) = 0;
+
+		for (i = 0; i < rx_cnt; ++i) {
+			if (e->rx_bd[i].flags & SDMA_BD_ERR)
+				res = -4;
+		}
+
+		for (i = 0; i < tx_cnt; ++i) {
+			if (e->tx_bd[i].flags & (SDMA_BD_ERR | SDMA_BD_DONE))
+				res = -4;
+		}
+
+		if (tx != 0)
+			tx += round;
+		if (rx != 0)
+			rx += round;
+		len -= round;
+		/* Full bursts end with the round, the tail burst may span two rounds */
+		burst_left = (burst_left > round) ? burst_left - round : 0;
+	}
+
+	*(e->base + conreg) &= ~(1 << 3);
+
+	return res;
+}
+
+
 addr_t ecspi_getTxFifoPAddr(int dev_no)
 {
 	return ecspi_addr[dev_no - 1] + txdata * 4;
@@ -0,0 +1,149 @@
+/*
+ * Phoenix-RTOS
+ *
+ * IMX6ULL NAND bad block table
+ *
+ * Copyright 2019 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/minmax.h>
+#include <sys/mman.h>
+
+#include "flashbbt.h"
+
+#define FLASHBBT_PAGE_SIZE 4096
+#define FLASHBBT_PAGES_PER_BLOCK 64
+
+/* Blocks checked with a single flashdrv_readbbm() call */
+#define FLASHBBT_BATCH 256
+
+
+void flashbbt_init(flashbbt_t *bbt)
+{
+	memset(bbt, 0, sizeof(*bbt));
+}
+
+
+int flashbbt_mark(flashbbt_t *bbt, uint32_t block)
+{
+	if (block >= FLASHBBT_BLOCKS || flashbbt_isbad(bbt, block))
+		return 0;
+
+	bbt->map[block / 32] |= 1u << (block % 32);
+	bbt->count++;
+	bbt->marked++;
+
+	return 1;
+}
+
+
+int flashbbt_scan(flashbbt_t *bbt, flashdrv_dma_t *dma, uint32_t start, uint32_t end)
+{
+	uint8_t markers[FLASHBBT_BATCH];
+	uint32_t block;
+	int i, n;
+
+	end = min(end, FLASHBBT_BLOCKS);
+
+	for (block = start; block < end; block += n) {
+		n = min(end - block, FLASHBBT_BATCH);
+
+		/* Failed chain is retried block by block, unreadable blocks are bad */
+		if (flashdrv_readbbm(dma, block, n, markers) != EOK) {
+			for (i = 0; i < n; i++) {
+				if (flashdrv_readbbm(dma, block + i, 1, markers + i) != EOK) {
+					markers[i] = 0;
+					bbt->errors++;
+				}
+			}
+		}
+
+		for (i = 0; i < n; i++) {
+			if (markers[i] != 0xff)
+				flashbbt_mark(bbt, block + i);
+		}
+	}
+
+	bbt->marked = 0;
+	bbt->source = flashbbt_src_scan;
+
+	return EOK;
+}
+
+
+static int flashbbt_readpage(flashdrv_dma_t *dma, uint32_t paddr, void *data, flashdrv_meta_t *meta)
+{
+	int status = flashdrv_read(dma, paddr, data, meta);
+
+	if (status < 0 || status == flash_uncorrectable)
+		return -EIO;
+
+	return (status == flash_erased) ? -ENOENT : EOK;
+}
+
+
+int flashbbt_load(flashbbt_t *bbt, flashdrv_dma_t *dma)
+{
+	uint32_t *data, page, i;
+	flashdrv_meta_t *meta;
+	int copy, err = -ENOENT;
+
+	data = mmap(NULL, 2 * FLASHBBT_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_UNCACHED, OID_NULL, 0);
+	if (data == MAP_FAILED)
+		return -ENOMEM;
+
+	meta = (flashdrv_meta_t *)((char *)data + FLASHBBT_PAGE_SIZE);
+
+	for (copy = 0; copy < FLASHBBT_DBBT_COPIES && err != EOK; copy++) {
+		page = FLASHBBT_DBBT_PAGE + copy * FLASHBBT_PAGES_PER_BLOCK;
+
+		if (flashbbt_readpage(dma, page, data, meta) != EOK || data[1] != FLASHBBT_DBBT_FINGERPRINT)
+			continue;
+
+		flashbbt_init(bbt);
+
+		/* List page is written only if there are bad blocks */
+		if ((err = flashbbt_readpage(dma, page + 4, data, meta)) == -ENOENT) {
+			err = EOK;
+			break;
+		}
+
+		if (err != EOK || data[1] > FLASHBBT_PAGE_SIZE / sizeof(uint32_t) - 2) {
+			err = -EIO;
+			continue;
+		}
+
+		for (i = 0; i < data[1]; i++)
+			flashbbt_mark(bbt, data[2 + i]);
+	}
+
+	if (err == EOK) {
+		bbt->marked = 0;
+		bbt->source = flashbbt_src_dbbt;
+	}
+
+	munmap(data, 2 * FLASHBBT_PAGE_SIZE);
+
+	return err;
+}
+
+
+int flashbbt_list(const flashbbt_t *bbt, uint32_t *list, int max)
+{
+	uint32_t block, w;
+	int n = 0;
+
+	for (block = 0; block < FLASHBBT_BLOCKS && n < max; block += 32) {
+		/* Skip whole words of good blocks */
+		for (w = bbt->map[block / 32]; w && n < max; w &= w - 1)
+			list[n++] = block + __builtin_ctz(w);
+	}
+
+	return n;
+}
@@ -0,0 +1,71 @@
+/*
+ * Phoenix-RTOS
+ *
+ * IMX6ULL NAND bad block table
+ *
+ * Copyright 2019 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _IMX6ULL_FLASHBBT_H_
+#define _IMX6ULL_FLASHBBT_H_
+
+#include <stdint.h>
+#include "flashdrv.h"
+
+#define FLASHBBT_BLOCKS 4096
+
+/* DBBT written by nandtool, header page followed by the bad block list 4 pages further */
+#define FLASHBBT_DBBT_PAGE 0x100
+#define FLASHBBT_DBBT_COPIES 4
+#define FLASHBBT_DBBT_FINGERPRINT 0x54424244
+
+
+enum { flashbbt_src_none = 0, flashbbt_src_dbbt, flashbbt_src_scan };
+
+
+typedef struct {
+	uint32_t map[FLASHBBT_BLOCKS / 32];
+	uint32_t count;   /* Bad blocks in the table */
+	uint32_t marked;  /* Blocks marked since the table was loaded or scanned */
+	uint32_t errors;  /* Blocks which could not be read during scan */
+	uint32_t source;  /* Where the table comes from, flashbbt_src_* */
+} flashbbt_t;
+
+
+static inline int flashbbt_isbad(const flashbbt_t *bbt, uint32_t block)
+{
+	if (bbt == NULL)
+		return 0;
+
+	/* Blocks outside of the chip are never usable */
+	if (block >= FLASHBBT_BLOCKS)
+		return 1;
+
+	return (bbt->map[block / 32] >> (block % 32)) & 1;
+}
+
+
+extern void flashbbt_init(flashbbt_t *bbt);
+
+
+/* Returns 1 if the block was not marked before */
+extern int flashbbt_mark(flashbbt_t *bbt, uint32_t block);
+
+
+/* Scans factory markers of blocks [start, end) */
+extern int flashbbt_scan(flashbbt_t *bbt, flashdrv_dma_t *dma, uint32_t start, uint32_t end);
+
+
+/* Loads the table from the first valid DBBT copy, returns -ENOENT if there is none */
+extern int flashbbt_load(flashbbt_t *bbt, flashdrv_dma_t *dma);
+
+
+/* Fills list with bad block numbers in ascending order, returns number of entries */
+extern int flashbbt_list(const flashbbt_t *bbt, uint32_t *list, int max);
+
+
+#endif
@@ -20,6 +20,7 @@
 #include <string.h>
 
 #include <sys/msg.h>
+#include <sys/minmax.h>
 #include <sys/threads.h>
 #include <sys/mman.h>
 #include <sys/interrupt.h>
@@ -28,6 +29,23 @@
 
 #include "flashdrv.h"
 
+/* Descriptor memory of a single flashdrv_dma_t, enough for a chain of FLASHDRV_CHAIN_PAGES pages */
+#define FLASHDRV_DMA_SIZE (4 * SIZE_PAGE)
+#define FLASHDRV_CHAIN_PAGES 32
+#define FLASHDRV_PAGES_PER_BLOCK 64
+#define FLASHDRV_DATA_SIZE 4096
+#define FLASHDRV_AUX_SIZE 32
+#define FLASHDRV_AUX_OFFS (FLASHDRV_DMA_SIZE - FLASHDRV_CHAIN_PAGES * FLASHDRV_AUX_SIZE)
+
+/* Time (in us) for the BCH to finish decoding after the DMA chain ended */
+#define FLASHDRV_BCH_TIMEOUT 100000
+
+/* Bad block marker position in the raw first page of a block */
+#define FLASHDRV_BBM_COLUMN 4096
+
+/* Maximum size of descriptors appended to the chain in a single step */
+#define DMA_MAX_STEP 96
+
 
 enum {
 	apbh_ctrl0 = 0, apbh_ctrl0_set, apbh_ctrl0_clr, apbh_ctrl0_tog,
@@ -204,6 +222,8 @@ struct {
 	unsigned pagesz, metasz;
 
 	int result, bch_status, bch_done;
+
+	void (*invalidate)(uint32_t paddr, int block);
 } flashdrv_common;
 
 
@@ -273,7 +293,7 @@ static int bch_irqHandler(unsigned int n, void *data)
 {
 	/* Clear interrupt flags */
 	flashdrv_common.bch_status = *(flashdrv_common.bch + bch_status0);
-	flashdrv_common.bch_done = 1;
+	flashdrv_common.bch_done++;
 	*(flashdrv_common.bch + bch_ctrl_clr) = 1;
 	return 1;
 }
@@ -423,7 +443,7 @@ static void flashdrv_setDevClock(int dev, int state)
 
 flashdrv_dma_t *flashdrv_dmanew(void)
 {
-	flashdrv_dma_t *dma = mmap(NULL, SIZE_PAGE, PROT_READ | PROT_WRITE, MAP_UNCACHED, OID_NULL, 0);
+	flashdrv_dma_t *dma = mmap(NULL, FLASHDRV_DMA_SIZE, PROT_READ | PROT_WRITE, MAP_UNCACHED, OID_NULL, 0);
 	dma->last = NULL;
 	dma->first = NULL;
 
@@ -433,21 +453,37 @@ flashdrv_dma_t *flashdrv_dmanew(void)
 
 void flashdrv_dmadestroy(flashdrv_dma_t *dma)
 {
-	munmap(dma, SIZE_PAGE);
+	munmap(dma, FLASHDRV_DMA_SIZE);
 }
 
 
-int flashdrv_wait4ready(flashdrv_dma_t *dma, int chip, int err)
+/* Returns place for the next descriptors, making sure they do not cross a page boundary */
+static void *flashdrv_dmanext(flashdrv_dma_t *dma)
 {
-	void *next = dma->last, *prev = dma->last;
-	int sz;
-	dma_t *terminator;
+	void *next = dma->last;
+	uintptr_t offs;
 
 	if (next != NULL)
 		next += dma_size(dma->last);
 	else
 		next = dma->buffer;
 
+	offs = (uintptr_t)next & (SIZE_PAGE - 1);
+	if (offs + DMA_MAX_STEP > SIZE_PAGE)
+		next += SIZE_PAGE - offs;
+
+	return next;
+}
+
+
+int flashdrv_wait4ready(flashdrv_dma_t *dma, int chip, int err)
+{
+	void *next, *prev = dma->last;
+	int sz;
+	dma_t *terminator;
+
+	next = flashdrv_dmanext(dma);
+
 	terminator = next;
 
 	if (err != EOK) {
@@ -473,12 +509,7 @@ int flashdrv_wait4ready(flashdrv_dma_t *dma, int chip, int err)
 
 int flashdrv_disablebch(flashdrv_dma_t *dma, int chip)
 {
-	void *next = dma->last;
-
-	if (next != NULL)
-		next += dma_size(dma->last);
-	else
-		next = dma->buffer;
+	void *next = flashdrv_dmanext(dma);
 
 	nand_disablebch(next, chip);
 	dma_sequence(dma->last, next);
@@ -493,12 +524,7 @@ int flashdrv_disablebch(flashdrv_dma_t *dma, int chip)
 
 int flashdrv_finish(flashdrv_dma_t *dma)
 {
-	void *next = dma->last;
-
-	if (next != NULL)
-		next += dma_size(dma->last);
-	else
-		next = dma->buffer;
+	void *next = flashdrv_dmanext(dma);
 
 	dma_terminate(next, EOK);
 	dma_sequence(dma->last, next);
@@ -512,15 +538,10 @@ int flashdrv_finish(flashdrv_dma_t *dma)
 
 int flashdrv_issue(flashdrv_dma_t *dma, int c, int chip, void *addr, unsigned datasz, void *data, void *aux)
 {
-	void *next = dma->last;
+	void *next = flashdrv_dmanext(dma);
 	int sz;
 	char *cmdaddr;
 
-	if (next != NULL)
-		next += dma_size(dma->last);
-	else
-		next = dma->buffer;
-
 	if (commands[c].data > 0 && datasz != commands[c].data)
 		return -EINVAL;
 
@@ -568,12 +589,7 @@ int flashdrv_issue(flashdrv_dma_t *dma, int c, int chip, void *addr, unsigned da
 
 int flashdrv_readback(flashdrv_dma_t *dma, int chip, int bufsz, void *buf, void *aux)
 {
-	void *next = dma->last;
-
-	if (next != NULL)
-		next += dma_size(dma->last);
-	else
-		next = dma->buffer;
+	void *next = flashdrv_dmanext(dma);
 
 	if (aux == NULL)
 		/* No error correction */
@@ -593,14 +609,9 @@ int flashdrv_readback(flashdrv_dma_t *dma, int chip, int bufsz, void *buf, void
 
 int flashdrv_readcompare(flashdrv_dma_t *dma, int chip, uint16_t mask, uint16_t value, int err)
 {
-	void *next = dma->last, *terminator;
+	void *next = flashdrv_dmanext(dma), *terminator;
 	int sz;
 
-	if (next != NULL)
-		next += dma_size(dma->last);
-	else
-		next = dma->buffer;
-
 	terminator = next;
 	sz = dma_terminate(terminator, err);
 	next += sz;
@@ -646,6 +657,19 @@ int flashdrv_reset(flashdrv_dma_t *dma)
 }
 
 
+static void flashdrv_invalidate(uint32_t paddr, int block)
+{
+	if (flashdrv_common.invalidate != NULL)
+		flashdrv_common.invalidate(paddr, block);
+}
+
+
+void flashdrv_setinvalidate(void (*invalidate)(uint32_t paddr, int block))
+{
+	flashdrv_common.invalidate = invalidate;
+}
+
+
 int flashdrv_write(flashdrv_dma_t *dma, uint32_t paddr, void *data, char *aux)
 {
 	int chip = 0, channel = 0, sz;
@@ -697,6 +721,8 @@ int flashdrv_write(flashdrv_dma_t *dma, uint32_t paddr, void *data, char *aux)
 
 	mutexUnlock(flashdrv_common.mutex);
 
+	flashdrv_invalidate(paddr, 0);
+
 	return err;
 }
 
@@ -742,6 +768,207 @@ int flashdrv_read(flashdrv_dma_t *dma, uint32_t paddr, void *data, flashdrv_meta
 }
 
 
+/* Combines ECC statuses, the result is the worst one */
+static int flashdrv_mergestatus(int result, int status)
+{
+	if (result == flash_uncorrectable || status == flash_uncorrectable)
+		return flash_uncorrectable;
+
+	if (status == flash_erased)
+		return result;
+
+	if (result == flash_erased)
+		return status;
+
+	return max(result, status);
+}
+
+
+static int flashdrv_pagestatus(flashdrv_meta_t *meta)
+{
+	int i, status = flash_erased;
+
+	for (i = 0; i < sizeof(meta->errors); i++)
+		status = flashdrv_mergestatus(status, (unsigned char)meta->errors[i]);
+
+	return status;
+}
+
+
+static int flashdrv_readchain(flashdrv_dma_t *dma, uint32_t paddr, int n, void *data, flashdrv_meta_t *meta)
+{
+	int chip = 0, channel = 0, sz, i, result, err;
+	char addr[5] = { 0 };
+	char *aux = (char *)dma + FLASHDRV_AUX_OFFS;
+	memcpy(addr + 2, &paddr, 3);
+
+	sz = (data != NULL) ? flashdrv_common.pagesz : flashdrv_common.metasz;
+
+	dma->first = NULL;
+	dma->last = NULL;
+
+	flashdrv_wait4ready(dma, chip, EOK);
+	flashdrv_issue(dma, flash_read_page, chip, addr, 0, NULL, NULL);
+	flashdrv_wait4ready(dma, chip, EOK);
+
+	/* Page i is transferred through BCH while the array loads page i + 1 into the data register */
+	for (i = 0; i < n; i++) {
+		if (n > 1) {
+			flashdrv_issue(dma, (i < n - 1) ? flash_read_page_cache_sequential : flash_read_page_cache_last, chip, NULL, 0, NULL, NULL);
+			flashdrv_wait4ready(dma, chip, EOK);
+		}
+
+		flashdrv_readback(dma, chip, sz, (data != NULL) ? (char *)data + i * FLASHDRV_DATA_SIZE : NULL, aux + i * FLASHDRV_AUX_SIZE);
+		/* BCH reports the handle of the last decoded page */
+		((gpmi_dma6_t *)dma->last)->eccctrl |= (i + 1) << 16;
+		flashdrv_disablebch(dma, chip);
+	}
+	flashdrv_finish(dma);
+
+	mutexLock(flashdrv_common.mutex);
+	flashdrv_common.result = 1;
+	flashdrv_common.bch_done = 0;
+	flashdrv_common.bch_status = 0;
+	dma_run((dma_t *)dma->first, channel);
+
+	mutexLock(flashdrv_common.wait_mutex);
+	while (flashdrv_common.result > 0)
+		condWait(flashdrv_common.dma_cond, flashdrv_common.wait_mutex, 0);
+
+	/* BCH completions may be coalesced into a single interrupt - pages are decoded in order,
+	 * so the chain is done when the last page's handle is reported */
+	err = flashdrv_common.result;
+	while (err == EOK && ((flashdrv_common.bch_status >> 20) & 0xfff) != n) {
+		if (condWait(flashdrv_common.bch_cond, flashdrv_common.wait_mutex, FLASHDRV_BCH_TIMEOUT) < 0)
+			err = -ETIMEDOUT;
+	}
+	mutexUnlock(flashdrv_common.wait_mutex);
+	mutexUnlock(flashdrv_common.mutex);
+
+	if (err < 0)
+		return err;
+
+	result = flash_erased;
+	for (i = 0; i < n; i++) {
+		if (meta != NULL)
+			memcpy(meta + i, aux + i * FLASHDRV_AUX_SIZE, sizeof(*meta));
+
+		result = flashdrv_mergestatus(result, flashdrv_pagestatus((flashdrv_meta_t *)(aux + i * FLASHDRV_AUX_SIZE)));
+	}
+
+	return result;
+}
+
+
+int flashdrv_read_pages(flashdrv_dma_t *dma, uint32_t paddr, int n, void *data, flashdrv_meta_t *meta)
+{
+	int cnt, status, result = flash_erased;
+
+	if (n <= 0)
+		return -EINVAL;
+
+	while (n) {
+		/* Cache read does not cross erase block boundary */
+		cnt = min(n, FLASHDRV_CHAIN_PAGES);
+		cnt = min(cnt, FLASHDRV_PAGES_PER_BLOCK - (paddr & (FLASHDRV_PAGES_PER_BLOCK - 1)));
+
+		if ((status = flashdrv_readchain(dma, paddr, cnt, data, meta)) < 0)
+			return status;
+
+		result = flashdrv_mergestatus(result, status);
+
+		paddr += cnt;
+		n -= cnt;
+		if (data != NULL)
+			data = (char *)data + cnt * FLASHDRV_DATA_SIZE;
+		if (meta != NULL)
+			meta += cnt;
+	}
+
+	return result;
+}
+
+
+static int flashdrv_writechain(flashdrv_dma_t *dma, uint32_t paddr, int n, void *data, flashdrv_meta_t *meta)
+{
+	int chip = 0, channel = 0, i, err;
+	char addr[5] = { 0 };
+	char *aux = (char *)dma + FLASHDRV_AUX_OFFS;
+	uint32_t page;
+
+	for (i = 0; i < n; i++) {
+		if (meta != NULL)
+			memcpy(aux + i * FLASHDRV_AUX_SIZE, meta[i].metadata, sizeof(meta[i].metadata));
+		else
+			memset(aux + i * FLASHDRV_AUX_SIZE, 0xff, sizeof(meta[i].metadata));
+	}
+
+	dma->first = NULL;
+	dma->last = NULL;
+
+	flashdrv_wait4ready(dma, chip, EOK);
+
+	/* Data of page i + 1 is loaded into the cache register while page i is being programmed */
+	for (i = 0; i < n; i++) {
+		page = paddr + i;
+		memcpy(addr + 2, &page, 3);
+
+		flashdrv_issue(dma, (i < n - 1) ? flash_program_page_cache : flash_program_page, chip, addr,
+			flashdrv_common.pagesz, (char *)data + i * FLASHDRV_DATA_SIZE, aux + i * FLASHDRV_AUX_SIZE);
+		flashdrv_wait4ready(dma, chip, EOK);
+		flashdrv_issue(dma, flash_read_status, 0, NULL, 0, NULL, NULL);
+
+		/* FAIL bit is valid for the last page only, FAILC reports the previous cache program */
+		flashdrv_readcompare(dma, chip, (i < n - 1) ? 0x2 : 0x3, 0, -1);
+	}
+	flashdrv_finish(dma);
+
+	mutexLock(flashdrv_common.mutex);
+	flashdrv_common.result = 1;
+	dma_run((dma_t *)dma->first, channel);
+
+	mutexLock(flashdrv_common.wait_mutex);
+	while (flashdrv_common.result > 0)
+		condWait(flashdrv_common.dma_cond, flashdrv_common.wait_mutex, 0);
+	mutexUnlock(flashdrv_common.wait_mutex);
+
+	err = flashdrv_common.result;
+	mutexUnlock(flashdrv_common.mutex);
+
+	return err;
+}
+
+
+int flashdrv_write_pages(flashdrv_dma_t *dma, uint32_t paddr, int n, void *data, flashdrv_meta_t *meta)
+{
+	int i, cnt, err = EOK;
+
+	if (n <= 0 || data == NULL)
+		return -EINVAL;
+
+	while (n) {
+		cnt = min(n, FLASHDRV_CHAIN_PAGES);
+		cnt = min(cnt, FLASHDRV_PAGES_PER_BLOCK - (paddr & (FLASHDRV_PAGES_PER_BLOCK - 1)));
+
+		err = flashdrv_writechain(dma, paddr, cnt, data, meta);
+
+		for (i = 0; i < cnt; i++)
+			flashdrv_invalidate(paddr + i, 0);
+
+		if (err)
+			break;
+
+		paddr += cnt;
+		n -= cnt;
+		data = (char *)data + cnt * FLASHDRV_DATA_SIZE;
+		if (meta != NULL)
+			meta += cnt;
+	}
+
+	return err;
+}
+
+
 int flashdrv_erase(flashdrv_dma_t *dma, uint32_t paddr)
 {
 	int chip = 0, channel = 0, result;
@@ -766,6 +993,8 @@ int flashdrv_erase(flashdrv_dma_t *dma, uint32_t paddr)
 	result = flashdrv_common.result;
 	mutexUnlock(flashdrv_common.mutex);
 
+	flashdrv_invalidate(paddr, 1);
+
 	return result;
 }
 
@@ -798,6 +1027,8 @@ int flashdrv_writeraw(flashdrv_dma_t *dma, uint32_t paddr, void *data, int sz)
 	err = flashdrv_common.result;
 	mutexUnlock(flashdrv_common.mutex);
 
+	flashdrv_invalidate(paddr, 0);
+
 	return err;
 }
 
@@ -835,6 +1066,60 @@ int flashdrv_readraw(flashdrv_dma_t *dma, uint32_t paddr, void *data, int sz)
 }
 
 
+int flashdrv_readbbm(flashdrv_dma_t *dma, uint32_t block, int n, uint8_t *markers)
+{
+	int chip = 0, channel = 0, i, cnt, err = EOK;
+	char addr[5] = { 0 };
+	char *aux = (char *)dma + FLASHDRV_AUX_OFFS;
+	uint32_t paddr;
+
+	if (n <= 0)
+		return -EINVAL;
+
+	/* Marker column in the raw page */
+	addr[0] = FLASHDRV_BBM_COLUMN & 0xff;
+	addr[1] = FLASHDRV_BBM_COLUMN >> 8;
+
+	for (; n && err == EOK; n -= cnt, block += cnt, markers += cnt) {
+		cnt = min(n, FLASHDRV_CHAIN_PAGES);
+
+		dma->first = NULL;
+		dma->last = NULL;
+
+		/* Only the marker byte of the first page of each block is transferred */
+		for (i = 0; i < cnt; i++) {
+			paddr = (block + i) * FLASHDRV_PAGES_PER_BLOCK;
+			memcpy(addr + 2, &paddr, 3);
+
+			flashdrv_wait4ready(dma, chip, EOK);
+			flashdrv_issue(dma, flash_read_page, chip, addr, 0, NULL, NULL);
+			flashdrv_wait4ready(dma, chip, EOK);
+			flashdrv_readback(dma, chip, 1, aux + i * FLASHDRV_AUX_SIZE, NULL);
+			flashdrv_disablebch(dma, chip);
+		}
+		flashdrv_wait4ready(dma, chip, EOK);
+		flashdrv_finish(dma);
+
+		mutexLock(flashdrv_common.mutex);
+		flashdrv_common.result = 1;
+		dma_run((dma_t *)dma->first, channel);
+
+		mutexLock(flashdrv_common.wait_mutex);
+		while (flashdrv_common.result > 0)
+			condWait(flashdrv_common.dma_cond, flashdrv_common.wait_mutex, 0);
+		mutexUnlock(flashdrv_common.wait_mutex);
+
+		err = flashdrv_common.result;
+		mutexUnlock(flashdrv_common.mutex);
+
+		for (i = 0; i < cnt; i++)
+			markers[i] = aux[i * FLASHDRV_AUX_SIZE];
+	}
+
+	return err;
+}
+
+
 void flashdrv_rundma(flashdrv_dma_t *dma)
 {
 	int channel = 0;
@@ -856,6 +1141,7 @@ void flashdrv_init(void)
 	flashdrv_common.metasz = 16 + 26;
 
 	flashdrv_common.dma_cond = flashdrv_common.bch_cond = flashdrv_common.mutex = 0;
+	flashdrv_common.invalidate = NULL;
 
 	condCreate(&flashdrv_common.bch_cond);
 	condCreate(&flashdrv_common.dma_cond);
@@ -33,6 +33,10 @@ enum {
 };
 
 
+/* Returned by program and erase when the chip reports failure */
+#define FLASHDRV_STATUS_FAIL -1
+
+
 enum {
 	flash_no_errors = 0,
 	flash_uncorrectable = 0xfe,
@@ -61,6 +65,12 @@ extern int flashdrv_write(flashdrv_dma_t *dma, uint32_t paddr, void *data, char
 extern int flashdrv_read(flashdrv_dma_t *dma, uint32_t paddr, void *data, flashdrv_meta_t *meta);
 
 
+extern int flashdrv_read_pages(flashdrv_dma_t *dma, uint32_t paddr, int n, void *data, flashdrv_meta_t *meta);
+
+
+extern int flashdrv_write_pages(flashdrv_dma_t *dma, uint32_t paddr, int n, void *data, flashdrv_meta_t *meta);
+
+
 extern int flashdrv_erase(flashdrv_dma_t *dma, uint32_t paddr);
 
 
@@ -70,6 +80,13 @@ extern int flashdrv_writeraw(flashdrv_dma_t *dma, uint32_t paddr, void *data, in
 extern int flashdrv_readraw(flashdrv_dma_t *dma, uint32_t paddr, void *data, int sz);
 
 
+/* Reads bad block markers of n consecutive blocks, batched in DMA chains, 0xff means a good block */
+extern int flashdrv_readbbm(flashdrv_dma_t *dma, uint32_t block, int n, uint8_t *markers);
+
+
+extern void flashdrv_setinvalidate(void (*invalidate)(uint32_t paddr, int block));
+
+
 extern void flashdrv_init(void);
 
 #endif
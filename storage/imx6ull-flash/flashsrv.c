@@ -15,12 +15,23 @@
 #include "posix/idtree.h"
 #include "flashsrv.h"
 #include "flashdrv.h"
+#include "flashbbt.h"
 
 #include "../../../phoenix-rtos-filesystems/jffs2/libjffs2.h"
 
 #define LOG_ERROR(str, ...) do { fprintf(stderr, __FILE__  ":%d error: " str "\n", __LINE__, ##__VA_ARGS__); } while (0)
 #define TRACE(str, ...) do { if (0) fprintf(stderr, __FILE__  ":%d trace: " str "\n", __LINE__, ##__VA_ARGS__); } while (0)
 
+#define CACHE_DEFAULT_PAGES 32
+#define CACHE_DEFAULT_READAHEAD 8
+#define CACHE_INVALID_PAGE ((uint32_t)-1)
+
+/* Maximum number of pages transferred by a single DMA chain */
+#define IO_PAGES 16
+
+/* Lower priority class is served after being bypassed this many times */
+#define IO_STARVE 8
+
 typedef struct {
 	void *next, *prev;
 
@@ -46,15 +57,47 @@ typedef struct {
 } flashsrv_filesystem_t;
 
 
-typedef struct {
+typedef struct _flashsrv_io_t {
+	struct _flashsrv_io_t *next, *prev;
+	struct _flashsrv_partition_t *part;
+
+	msg_t msg;
+	unsigned rid;
+	unsigned port;
+	int cls;
+	time_t queued;
+
+	/* pages for writes, erase blocks for erases */
+	uint32_t paddr;
+	uint32_t n;
+	uint32_t done;
+} flashsrv_io_t;
+
+
+typedef struct _flashsrv_partition_t {
 	idnode_t node;
 	size_t start;
 	size_t size;
+
+	/* partitions with pending I/O are served round robin */
+	struct _flashsrv_partition_t *next, *prev;
+	flashsrv_io_t *queue[flashsrv_io_classes];
+	unsigned int depth;
 } flashsrv_partition_t;
 
 
+typedef struct _flashsrv_cpage_t {
+	struct _flashsrv_cpage_t *next, *prev;
+	struct _flashsrv_cpage_t *hnext;
+
+	uint32_t paddr;
+	char data[FLASH_PAGE_SIZE];
+} flashsrv_cpage_t;
+
+
 struct {
 	char poolStacks[4][4 * 4096] __attribute__((aligned(8)));
+	char ioStack[4 * 4096] __attribute__((aligned(8)));
 
 	rbtree_t filesystems;
 	idtree_t partitions;
@@ -65,6 +108,42 @@ struct {
 	void *databuf;
 	void *rawdatabuf;
 	void *metabuf;
+
+	struct {
+		handle_t lock;
+		unsigned int size;
+		unsigned int used;
+		unsigned int readahead;
+
+		flashsrv_cpage_t *pages;
+		flashsrv_cpage_t *lru;
+		flashsrv_cpage_t **hash;
+		unsigned int hashmask;
+		unsigned int gen;
+
+		/* sequential stream detection */
+		uint32_t lastpage;
+		uint32_t rapage;
+		unsigned int racnt;
+
+		uint32_t hits;
+		uint32_t misses;
+		uint32_t prefetches;
+		uint32_t invalidations;
+	} cache;
+
+	struct {
+		handle_t lock, cond;
+
+		flashsrv_partition_t *active;
+		flashsrv_partition_t root;
+		unsigned int bypassed[flashsrv_io_classes];
+
+		flashsrv_iostats_t stats;
+
+		/* Bad block table, updated when erase or program fails */
+		flashbbt_t bbt;
+	} io;
 } flashsrv_common;
 
 
@@ -213,125 +292,325 @@ static flashsrv_filesystem_t *flashsrv_mountFs(flashsrv_partition_t *partition,
 }
 
 
-static int flashsrv_erase(size_t start, size_t end)
+/* Page cache - LRU of ECC corrected pages, the least recently used page is at the list head */
+
+static flashsrv_cpage_t **flashsrv_cacheBucket(uint32_t paddr)
 {
-	flashdrv_dma_t *dma;
-	int i, err;
+	return &flashsrv_common.cache.hash[paddr & flashsrv_common.cache.hashmask];
+}
 
-	TRACE("Erase %d %d", start, end);
 
-	if (start % (FLASH_PAGE_SIZE * PAGES_PER_BLOCK))
-		return -EINVAL;
+static flashsrv_cpage_t *flashsrv_cacheFind(uint32_t paddr)
+{
+	flashsrv_cpage_t *e;
 
-	if (end % (FLASH_PAGE_SIZE * PAGES_PER_BLOCK))
-		return -EINVAL;
+	for (e = *flashsrv_cacheBucket(paddr); e != NULL; e = e->hnext) {
+		if (e->paddr == paddr)
+			break;
+	}
 
-	if (end < start)
-		return -EINVAL;
+	return e;
+}
 
-	start /= FLASH_PAGE_SIZE * PAGES_PER_BLOCK;
-	end /= FLASH_PAGE_SIZE * PAGES_PER_BLOCK;
 
-	dma = flashsrv_common.dma;
+static void flashsrv_cacheDrop(flashsrv_cpage_t *e)
+{
+	flashsrv_cpage_t **pp;
 
-	for (i = start; i < end; i++) {
-		err = flashdrv_erase(dma, i * PAGES_PER_BLOCK);
+	for (pp = flashsrv_cacheBucket(e->paddr); *pp != e; pp = &(*pp)->hnext)
+		;
 
-		if (err) {
-			LOG_ERROR("erase error %d", err);
-			break;
-		}
+	*pp = e->hnext;
+	e->hnext = NULL;
+	e->paddr = CACHE_INVALID_PAGE;
+	flashsrv_common.cache.used--;
+
+	/* Reuse invalidated pages first */
+	LIST_REMOVE(&flashsrv_common.cache.lru, e);
+	LIST_ADD(&flashsrv_common.cache.lru, e);
+	flashsrv_common.cache.lru = e;
+}
+
+
+static int flashsrv_cacheGet(uint32_t paddr, char *data, int offs, int len)
+{
+	flashsrv_cpage_t *e;
+
+	if (!flashsrv_common.cache.size)
+		return 0;
+
+	mutexLock(flashsrv_common.cache.lock);
+	if ((e = flashsrv_cacheFind(paddr)) == NULL) {
+		mutexUnlock(flashsrv_common.cache.lock);
+		return 0;
 	}
 
-	return err;
+	memcpy(data, e->data + offs, len);
+
+	LIST_REMOVE(&flashsrv_common.cache.lru, e);
+	LIST_ADD(&flashsrv_common.cache.lru, e);
+	flashsrv_common.cache.hits++;
+	mutexUnlock(flashsrv_common.cache.lock);
+
+	return 1;
 }
 
 
-static int flashsrv_partoff(id_t id, size_t start, size_t size, size_t *partoff)
+/* gen is the cache generation sampled before the page was read from NAND */
+static void flashsrv_cachePut(uint32_t paddr, const char *data, unsigned int gen)
 {
-	flashsrv_partition_t *p = NULL;
-	id_t rootID = ROOT_ID;
+	flashsrv_cpage_t *e, **bucket;
 
-	if (id == rootID) {
-		*partoff = 0;
-		return EOK;
+	if (!flashsrv_common.cache.size)
+		return;
+
+	mutexLock(flashsrv_common.cache.lock);
+
+	/* Page was modified while being read - the data might be stale */
+	if (gen != flashsrv_common.cache.gen || flashsrv_cacheFind(paddr) != NULL) {
+		mutexUnlock(flashsrv_common.cache.lock);
+		return;
 	}
 
-	mutexLock(flashsrv_common.lock);
-	p = lib_treeof(flashsrv_partition_t, node, idtree_find(&flashsrv_common.partitions, id));
-	mutexUnlock(flashsrv_common.lock);
+	e = flashsrv_common.cache.lru;
+	if (e->paddr != CACHE_INVALID_PAGE)
+		flashsrv_cacheDrop(e);
 
-	if (p == NULL)
-		return -EINVAL;
+	memcpy(e->data, data, FLASH_PAGE_SIZE);
+	e->paddr = paddr;
+	bucket = flashsrv_cacheBucket(paddr);
+	e->hnext = *bucket;
+	*bucket = e;
+	flashsrv_common.cache.used++;
 
-	TRACE("Partition: size %d, start %d", p->size * PAGES_PER_BLOCK * FLASH_PAGE_SIZE, p->start);
-	if ((start + size) > (p->size * PAGES_PER_BLOCK * FLASH_PAGE_SIZE))
-		return -EINVAL;
+	LIST_REMOVE(&flashsrv_common.cache.lru, e);
+	LIST_ADD(&flashsrv_common.cache.lru, e);
+
+	mutexUnlock(flashsrv_common.cache.lock);
+}
+
+
+/* Called by flashdrv after every program/erase, also those issued by filesystems */
+static void flashsrv_cacheInvalidate(uint32_t paddr, int block)
+{
+	flashsrv_cpage_t *e;
+	uint32_t i, n = 1;
+
+	if (block) {
+		paddr &= ~(PAGES_PER_BLOCK - 1);
+		n = PAGES_PER_BLOCK;
+	}
+
+	mutexLock(flashsrv_common.cache.lock);
+	flashsrv_common.cache.gen++;
+
+	if (flashsrv_common.cache.size) {
+		for (i = 0; i < n; i++) {
+			if ((e = flashsrv_cacheFind(paddr + i)) != NULL) {
+				flashsrv_cacheDrop(e);
+				flashsrv_common.cache.invalidations++;
+			}
+		}
+	}
+	mutexUnlock(flashsrv_common.cache.lock);
+}
 
-	*partoff = p->start * FLASH_PAGE_SIZE * PAGES_PER_BLOCK;
+
+static int flashsrv_cacheInit(unsigned int size, unsigned int readahead)
+{
+	flashsrv_cpage_t *pages;
+	flashsrv_cpage_t **hash;
+	unsigned int i, hashsz;
+
+	flashsrv_common.cache.readahead = size ? min(readahead, size / 2) : 0;
+	flashsrv_common.cache.lastpage = CACHE_INVALID_PAGE;
+
+	if (!size)
+		return EOK;
+
+	for (hashsz = 1; hashsz < size; hashsz <<= 1)
+		;
+
+	if ((pages = malloc(size * sizeof(*pages))) == NULL)
+		return -ENOMEM;
+
+	if ((hash = calloc(hashsz, sizeof(*hash))) == NULL) {
+		free(pages);
+		return -ENOMEM;
+	}
+
+	mutexLock(flashsrv_common.cache.lock);
+	flashsrv_common.cache.pages = pages;
+	flashsrv_common.cache.hash = hash;
+	flashsrv_common.cache.hashmask = hashsz - 1;
+	flashsrv_common.cache.lru = NULL;
+	flashsrv_common.cache.used = 0;
+
+	for (i = 0; i < size; i++) {
+		pages[i].paddr = CACHE_INVALID_PAGE;
+		pages[i].hnext = NULL;
+		LIST_ADD(&flashsrv_common.cache.lru, &pages[i]);
+	}
+
+	flashsrv_common.cache.size = size;
+	mutexUnlock(flashsrv_common.cache.lock);
 
 	return EOK;
 }
 
 
-static int flashsrv_write(id_t id, size_t start, char *data, size_t size)
+/* Returns length of the run of pages starting at paddr which are not cached */
+static int flashsrv_cacheMissing(uint32_t paddr, int max)
 {
-	flashdrv_dma_t *dma;
-	int i, err;
-	char *databuf;
-	void *metabuf;
-	size_t partoff = 0;
-	size_t writesz = size;
+	int n;
 
-	if (flashsrv_partoff(id, start, size, &partoff) < 0)
-		return -EINVAL;
+	if (!flashsrv_common.cache.size)
+		return max;
 
-	start += partoff;
+	mutexLock(flashsrv_common.cache.lock);
+	for (n = 1; n < max; n++) {
+		if (flashsrv_cacheFind(paddr + n) != NULL)
+			break;
+	}
+	mutexUnlock(flashsrv_common.cache.lock);
 
-	TRACE("Write off: %d, size: %d, ptr: %p", start, size, data);
+	return n;
+}
 
-	if (size & (FLASH_PAGE_SIZE - 1))
-		return -EINVAL;
 
-	if (start & (FLASH_PAGE_SIZE - 1))
-		return -EINVAL;
+static int flashsrv_uncorrectable(flashdrv_meta_t *meta)
+{
+	int i;
 
-	if (data == NULL)
-		return flashsrv_erase(start, start + size);
+	for (i = 0; i < sizeof(meta->errors); i++) {
+		if ((unsigned char)meta->errors[i] == flash_uncorrectable)
+			return 1;
+	}
 
-	dma = flashsrv_common.dma;
-	databuf = flashsrv_common.databuf;
-	metabuf = flashsrv_common.metabuf;
+	return 0;
+}
 
-	memset(metabuf, 0xff, sizeof(flashdrv_meta_t));
 
-	for (i = 0; size; i++) {
-		memcpy(databuf, data + FLASH_PAGE_SIZE * i, FLASH_PAGE_SIZE);
-		err = flashdrv_write(dma, start / FLASH_PAGE_SIZE + i, databuf, metabuf);
+/* Reads n pages into databuf with a single DMA chain, returns number of leading pages read correctly */
+static int flashsrv_fetch(uint32_t paddr, int n, int prefetch)
+{
+	flashdrv_meta_t *meta = flashsrv_common.metabuf;
+	char *databuf = flashsrv_common.databuf;
+	unsigned int gen;
+	int i;
 
-		if (err) {
-			LOG_ERROR("write error %d", err);
+	mutexLock(flashsrv_common.cache.lock);
+	gen = flashsrv_common.cache.gen;
+	mutexUnlock(flashsrv_common.cache.lock);
+
+	if (flashdrv_read_pages(flashsrv_common.dma, paddr, n, databuf, meta) < 0)
+		return -EIO;
+
+	for (i = 0; i < n; i++) {
+		if (flashsrv_uncorrectable(meta + i))
 			break;
+
+		flashsrv_cachePut(paddr + i, databuf + i * FLASH_PAGE_SIZE, gen);
+	}
+
+	mutexLock(flashsrv_common.cache.lock);
+	if (prefetch)
+		flashsrv_common.cache.prefetches += i;
+	else
+		flashsrv_common.cache.misses += i;
+	mutexUnlock(flashsrv_common.cache.lock);
+
+	if (!i) {
+		if (!prefetch)
+			LOG_ERROR("uncorrectable read");
+		return -EIO;
+	}
+
+	return i;
+}
+
+
+/* Detects sequential access and schedules readahead of the following pages of the same erase block */
+static void flashsrv_cacheAccess(uint32_t first, uint32_t last)
+{
+	uint32_t end;
+
+	if (!flashsrv_common.cache.readahead)
+		return;
+
+	if (first == flashsrv_common.cache.lastpage || first == flashsrv_common.cache.lastpage + 1) {
+		end = (last | (PAGES_PER_BLOCK - 1)) + 1;
+		flashsrv_common.cache.rapage = last + 1;
+		flashsrv_common.cache.racnt = min(flashsrv_common.cache.readahead, end - last - 1);
+	}
+	else {
+		flashsrv_common.cache.racnt = 0;
+	}
+
+	flashsrv_common.cache.lastpage = last;
+}
+
+
+/* Executed after the read request was answered */
+static void flashsrv_cacheReadahead(void)
+{
+	int n, cached;
+
+	while (flashsrv_common.cache.racnt) {
+		mutexLock(flashsrv_common.cache.lock);
+		cached = (flashsrv_cacheFind(flashsrv_common.cache.rapage) != NULL);
+		mutexUnlock(flashsrv_common.cache.lock);
+
+		if (cached) {
+			flashsrv_common.cache.rapage++;
+			flashsrv_common.cache.racnt--;
+			continue;
 		}
-		size -= FLASH_PAGE_SIZE;
+
+		n = flashsrv_cacheMissing(flashsrv_common.cache.rapage, min(flashsrv_common.cache.racnt, IO_PAGES));
+		if ((n = flashsrv_fetch(flashsrv_common.cache.rapage, n, 1)) < 0)
+			break;
+
+		flashsrv_common.cache.rapage += n;
+		flashsrv_common.cache.racnt -= n;
 	}
 
-	writesz -= size;
+	flashsrv_common.cache.racnt = 0;
+}
 
-	return writesz;
+
+static int flashsrv_partoff(id_t id, size_t start, size_t size, size_t *partoff)
+{
+	flashsrv_partition_t *p = NULL;
+	id_t rootID = ROOT_ID;
+
+	if (id == rootID) {
+		*partoff = 0;
+		return EOK;
+	}
+
+	mutexLock(flashsrv_common.lock);
+	p = lib_treeof(flashsrv_partition_t, node, idtree_find(&flashsrv_common.partitions, id));
+	mutexUnlock(flashsrv_common.lock);
+
+	if (p == NULL)
+		return -EINVAL;
+
+	TRACE("Partition: size %d, start %d", p->size * PAGES_PER_BLOCK * FLASH_PAGE_SIZE, p->start);
+	if ((start + size) > (p->size * PAGES_PER_BLOCK * FLASH_PAGE_SIZE))
+		return -EINVAL;
+
+	*partoff = p->start * FLASH_PAGE_SIZE * PAGES_PER_BLOCK;
+
+	return EOK;
 }
 
 
 static int flashsrv_read(id_t id, size_t offset, char *data, size_t size)
 {
-	flashdrv_dma_t *dma;
-	char *databuf;
-	size_t rp, totalBytes = 0;
+	size_t rp, lastpage, totalBytes = 0;
 	size_t partoff = 0;
-	int pageoffs, writesz, err = EOK;
-
-	dma = flashsrv_common.dma;
-	databuf = flashsrv_common.databuf;
+	int i, n, pageoffs, writesz;
 
 	if (flashsrv_partoff(id, offset, size, &partoff) < 0)
 		return -EINVAL;
@@ -342,23 +621,39 @@ static int flashsrv_read(id_t id, size_t offset, char *data, size_t size)
 
 	TRACE("Read off: %d, size: %d.", offset, size);
 
+	if (!size)
+		return 0;
+
+	lastpage = (offset + size - 1) / FLASH_PAGE_SIZE;
+	flashsrv_cacheAccess(rp, lastpage);
+
 	while (size) {
-		err = flashdrv_read(dma, rp, databuf, flashsrv_common.metabuf);
+		writesz = min(size, FLASH_PAGE_SIZE - pageoffs);
 
-		if (err == flash_uncorrectable) {
-			LOG_ERROR("uncorrectable read");
-			err = -EIO;
-			break;
+		if (flashsrv_cacheGet(rp, data + totalBytes, pageoffs, writesz)) {
+			size -= writesz;
+			totalBytes += writesz;
+			rp++;
+			pageoffs = 0;
+			continue;
 		}
 
-		writesz = min(size, FLASH_PAGE_SIZE - pageoffs);
-		memcpy(data + totalBytes, databuf, writesz);
+		/* Read the whole run of missing pages at once */
+		n = flashsrv_cacheMissing(rp, min(lastpage - rp + 1, IO_PAGES));
+		if ((n = flashsrv_fetch(rp, n, 0)) < 0) {
+			flashsrv_common.cache.racnt = 0;
+			break;
+		}
 
-		size -= writesz;
-		totalBytes += writesz;
-		rp++;
+		for (i = 0; i < n; i++) {
+			writesz = min(size, FLASH_PAGE_SIZE - pageoffs);
+			memcpy(data + totalBytes, (char *)flashsrv_common.databuf + i * FLASH_PAGE_SIZE + pageoffs, writesz);
 
-		pageoffs = 0;
+			size -= writesz;
+			totalBytes += writesz;
+			rp++;
+			pageoffs = 0;
+		}
 	}
 
 	return totalBytes;
@@ -411,27 +706,6 @@ static void flashsrv_syncAll(void)
 }
 
 
-static int flashsrv_devErase(flash_i_devctl_t *idevctl, int type)
-{
-	size_t partoff = 0;
-	size_t start = 0;
-	size_t end = 0;
-
-	if ( type == flashsrv_devctl_erase) {
-		if (flashsrv_partoff(idevctl->erase.oid.id, idevctl->erase.offset, idevctl->erase.size, &partoff) < 0)
-			return -EINVAL;
-	}
-
-	start = idevctl->erase.offset + partoff;
-	end = start + idevctl->erase.size;
-
-	if (end % ERASE_BLOCK_SIZE || start % ERASE_BLOCK_SIZE)
-		return -EINVAL;
-
-	return flashsrv_erase(start, end);
-}
-
-
 static int flashsrv_devWriteRaw(flash_i_devctl_t *idevctl, char *data)
 {
 	flashdrv_dma_t *dma;
@@ -542,14 +816,6 @@ static void flashsrv_devCtrl(msg_t *msg)
 	flash_o_devctl_t *odevctl = (flash_o_devctl_t *)msg->o.raw;
 
 	switch (idevctl->type) {
-	case flashsrv_devctl_erase :
-		odevctl->err = flashsrv_devErase(idevctl, flashsrv_devctl_erase);
-		break;
-
-	case flashsrv_devctl_chiperase :
-		odevctl->err = flashsrv_devErase(idevctl, flashsrv_devctl_chiperase);
-		break;
-
 	case flashsrv_devctl_writeraw :
 		odevctl->err = flashsrv_devWriteRaw(idevctl, msg->i.data);
 		break;
@@ -569,6 +835,55 @@ static void flashsrv_devCtrl(msg_t *msg)
 }
 
 
+/* Statistics and bad block table are answered directly by the device thread */
+static void flashsrv_devStats(msg_t *msg)
+{
+	flash_i_devctl_t *idevctl = (flash_i_devctl_t *)msg->i.raw;
+	flash_o_devctl_t *odevctl = (flash_o_devctl_t *)msg->o.raw;
+
+	if (idevctl->type == flashsrv_devctl_cachestats) {
+		mutexLock(flashsrv_common.cache.lock);
+		odevctl->cachestats.size = flashsrv_common.cache.size;
+		odevctl->cachestats.used = flashsrv_common.cache.used;
+		odevctl->cachestats.hits = flashsrv_common.cache.hits;
+		odevctl->cachestats.misses = flashsrv_common.cache.misses;
+		odevctl->cachestats.prefetches = flashsrv_common.cache.prefetches;
+		odevctl->cachestats.invalidations = flashsrv_common.cache.invalidations;
+		mutexUnlock(flashsrv_common.cache.lock);
+		odevctl->err = EOK;
+		return;
+	}
+
+	if (idevctl->type == flashsrv_devctl_bbt) {
+		if (msg->o.data != NULL && msg->o.size < sizeof(flashsrv_common.io.bbt.map)) {
+			odevctl->err = -EINVAL;
+			return;
+		}
+
+		mutexLock(flashsrv_common.io.lock);
+		if (msg->o.data != NULL)
+			memcpy(msg->o.data, flashsrv_common.io.bbt.map, sizeof(flashsrv_common.io.bbt.map));
+		odevctl->bbt.blocks = BLOCKS_CNT;
+		odevctl->bbt.count = flashsrv_common.io.bbt.count;
+		odevctl->bbt.marked = flashsrv_common.io.bbt.marked;
+		odevctl->bbt.source = flashsrv_common.io.bbt.source;
+		mutexUnlock(flashsrv_common.io.lock);
+		odevctl->err = EOK;
+		return;
+	}
+
+	if (msg->o.data == NULL || msg->o.size < sizeof(flashsrv_iostats_t)) {
+		odevctl->err = -EINVAL;
+		return;
+	}
+
+	mutexLock(flashsrv_common.io.lock);
+	memcpy(msg->o.data, &flashsrv_common.io.stats, sizeof(flashsrv_iostats_t));
+	mutexUnlock(flashsrv_common.io.lock);
+	odevctl->err = EOK;
+}
+
+
 static int flashsrv_fileAttr(int type, id_t id)
 {
 	flashsrv_partition_t *p = NULL;
@@ -593,10 +908,382 @@ static int flashsrv_fileAttr(int type, id_t id)
 }
 
 
+/* I/O scheduler - device requests are queued per partition and class and answered out of order */
+
+static flashsrv_partition_t *flashsrv_getPartition(id_t id)
+{
+	flashsrv_partition_t *p;
+	id_t rootID = ROOT_ID;
+
+	if (id == rootID)
+		return &flashsrv_common.io.root;
+
+	mutexLock(flashsrv_common.lock);
+	p = lib_treeof(flashsrv_partition_t, node, idtree_find(&flashsrv_common.partitions, id));
+	mutexUnlock(flashsrv_common.lock);
+
+	return p;
+}
+
+
+static int flashsrv_ioSubmit(msg_t *msg, unsigned rid, unsigned port, flashsrv_partition_t *p, int cls, uint32_t paddr, uint32_t n)
+{
+	flashsrv_iostats_t *stats = &flashsrv_common.io.stats;
+	flashsrv_io_t *req;
+
+	if ((req = malloc(sizeof(*req))) == NULL)
+		return -ENOMEM;
+
+	memcpy(&req->msg, msg, sizeof(*msg));
+	req->rid = rid;
+	req->port = port;
+	req->part = p;
+	req->cls = cls;
+	req->paddr = paddr;
+	req->n = n;
+	req->done = 0;
+	gettime(&req->queued, NULL);
+
+	mutexLock(flashsrv_common.io.lock);
+	LIST_ADD(&p->queue[cls], req);
+	if (!p->depth++)
+		LIST_ADD(&flashsrv_common.io.active, p);
+
+	if (++stats->depth[cls] > stats->maxdepth[cls])
+		stats->maxdepth[cls] = stats->depth[cls];
+	mutexUnlock(flashsrv_common.io.lock);
+
+	condSignal(flashsrv_common.io.cond);
+
+	return EOK;
+}
+
+
+static void flashsrv_ioComplete(flashsrv_io_t *req, int err)
+{
+	flashsrv_iostats_t *stats = &flashsrv_common.io.stats;
+	flashsrv_partition_t *p = req->part;
+	time_t now, latency, ms;
+	unsigned int b;
+
+	gettime(&now, NULL);
+	latency = now - req->queued;
+
+	for (b = 0, ms = latency / 1000; ms && b < FLASHSRV_IO_HIST - 1; ms >>= 1)
+		b++;
+
+	mutexLock(flashsrv_common.io.lock);
+	LIST_REMOVE(&p->queue[req->cls], req);
+	if (!--p->depth)
+		LIST_REMOVE(&flashsrv_common.io.active, p);
+
+	stats->depth[req->cls]--;
+	stats->completed[req->cls]++;
+	stats->hist[req->cls][b]++;
+	if (latency > stats->maxlatency[req->cls])
+		stats->maxlatency[req->cls] = latency;
+	mutexUnlock(flashsrv_common.io.lock);
+
+	if (req->msg.type == mtDevCtl)
+		((flash_o_devctl_t *)req->msg.o.raw)->err = err;
+	else
+		req->msg.o.io.err = err;
+
+	msgRespond(req->port, &req->msg, req->rid);
+	free(req);
+}
+
+
+/* Selects class and partition of the next request, has to be called with io.lock held */
+static int flashsrv_ioPick(flashsrv_partition_t **part)
+{
+	flashsrv_iostats_t *stats = &flashsrv_common.io.stats;
+	flashsrv_partition_t *p;
+	int cls, c;
+
+	if ((p = flashsrv_common.io.active) == NULL)
+		return -1;
+
+	for (cls = 0; !stats->depth[cls]; cls++)
+		;
+
+	for (c = flashsrv_io_classes - 1; c > cls; c--) {
+		if (stats->depth[c] && flashsrv_common.io.bypassed[c] >= IO_STARVE)
+			break;
+	}
+
+	for (cls = c++; c < flashsrv_io_classes; c++) {
+		if (stats->depth[c])
+			flashsrv_common.io.bypassed[c]++;
+	}
+	flashsrv_common.io.bypassed[cls] = 0;
+
+	while (p->queue[cls] == NULL)
+		p = p->next;
+
+	flashsrv_common.io.active = p->next;
+	*part = p;
+
+	return cls;
+}
+
+
+static void flashsrv_ioRead(flashsrv_partition_t *p)
+{
+	flashsrv_io_t *req;
+	int pending;
+
+	mutexLock(flashsrv_common.io.lock);
+	req = p->queue[flashsrv_io_read];
+	mutexUnlock(flashsrv_common.io.lock);
+
+	TRACE("DEV read - id: %llu, size: %d, off: %llu ", req->msg.i.io.oid.id, req->msg.o.size, req->msg.i.io.offs);
+	flashsrv_ioComplete(req, flashsrv_read(req->msg.i.io.oid.id, req->msg.i.io.offs, req->msg.o.data, req->msg.o.size));
+
+	mutexLock(flashsrv_common.io.lock);
+	pending = flashsrv_common.io.stats.depth[flashsrv_io_read];
+	mutexUnlock(flashsrv_common.io.lock);
+
+	/* Readahead doesn't delay queued reads */
+	if (!pending)
+		flashsrv_cacheReadahead();
+}
+
+
+static void flashsrv_markBad(uint32_t first, uint32_t last)
+{
+	uint32_t block;
+
+	mutexLock(flashsrv_common.io.lock);
+	for (block = first; block <= last; block++) {
+		if (flashbbt_mark(&flashsrv_common.io.bbt, block))
+			LOG_ERROR("block %u marked bad", block);
+	}
+	mutexUnlock(flashsrv_common.io.lock);
+}
+
+
+/* Programs the first queued write merged with following writes of adjacent pages */
+static void flashsrv_ioWrite(flashsrv_partition_t *p)
+{
+	flashsrv_io_t *req, *r, *run[IO_PAGES];
+	uint32_t cnt[IO_PAGES], paddr;
+	int i, len, nrun = 0, n = 0, err = EOK;
+
+	mutexLock(flashsrv_common.io.lock);
+	req = p->queue[flashsrv_io_write];
+	paddr = req->paddr + req->done;
+
+	while (req != NULL) {
+		run[nrun] = req;
+		cnt[nrun] = min(req->n - req->done, IO_PAGES - n);
+		n += cnt[nrun++];
+
+		if (n == IO_PAGES || req->done + cnt[nrun - 1] < req->n)
+			break;
+
+		/* Requests already in the run start below paddr + n */
+		r = p->queue[flashsrv_io_write];
+		req = NULL;
+		do {
+			if (r->paddr + r->done == paddr + n && r->done < r->n) {
+				req = r;
+				break;
+			}
+			r = r->next;
+		} while (r != p->queue[flashsrv_io_write]);
+	}
+
+	if (nrun > 1)
+		flashsrv_common.io.stats.merged += nrun - 1;
+	if (n)
+		flashsrv_common.io.stats.programs++;
+	mutexUnlock(flashsrv_common.io.lock);
+
+	if (n) {
+		for (i = 0, n = 0; i < nrun; n += cnt[i++])
+			memcpy((char *)flashsrv_common.databuf + n * FLASH_PAGE_SIZE, (char *)run[i]->msg.i.data + run[i]->done * FLASH_PAGE_SIZE, cnt[i] * FLASH_PAGE_SIZE);
+
+		TRACE("Write page: %u, pages: %d, requests: %d", paddr, n, nrun);
+
+		/* Program status tells a failed block only if the run is written block by block */
+		for (i = 0; i < n && !err; i += len) {
+			len = min(n - i, PAGES_PER_BLOCK - (paddr + i) % PAGES_PER_BLOCK);
+
+			if ((err = flashdrv_write_pages(flashsrv_common.dma, paddr + i, len, (char *)flashsrv_common.databuf + i * FLASH_PAGE_SIZE, NULL)) != 0) {
+				LOG_ERROR("write error %d", err);
+				if (err == FLASHDRV_STATUS_FAIL)
+					flashsrv_markBad((paddr + i) / PAGES_PER_BLOCK, (paddr + i) / PAGES_PER_BLOCK);
+			}
+		}
+	}
+
+	/* Number of pages written before the error is returned, as before */
+	for (i = 0; i < nrun; i++) {
+		if (!err)
+			run[i]->done += cnt[i];
+
+		if (err || run[i]->done == run[i]->n)
+			flashsrv_ioComplete(run[i], run[i]->done * FLASH_PAGE_SIZE);
+	}
+}
+
+
+/* Long erases are split into single blocks, so reads are served in between */
+static void flashsrv_ioErase(flashsrv_partition_t *p)
+{
+	flashsrv_io_t *req;
+	int err = EOK, bad;
+
+	mutexLock(flashsrv_common.io.lock);
+	req = p->queue[flashsrv_io_erase];
+	mutexUnlock(flashsrv_common.io.lock);
+
+	if (req->done < req->n) {
+		TRACE("Erase block %u", req->paddr + req->done);
+
+		mutexLock(flashsrv_common.io.lock);
+		bad = flashbbt_isbad(&flashsrv_common.io.bbt, req->paddr + req->done);
+		mutexUnlock(flashsrv_common.io.lock);
+
+		/* Erasing a bad block could clear its factory marker */
+		if (bad)
+			err = -EIO;
+		else if ((err = flashdrv_erase(flashsrv_common.dma, (req->paddr + req->done) * PAGES_PER_BLOCK)) != 0) {
+			LOG_ERROR("erase error %d", err);
+			if (err == FLASHDRV_STATUS_FAIL)
+				flashsrv_markBad(req->paddr + req->done, req->paddr + req->done);
+		}
+		else
+			req->done++;
+	}
+
+	if (err || req->done == req->n)
+		flashsrv_ioComplete(req, err);
+}
+
+
+static void flashsrv_ioCtl(flashsrv_partition_t *p)
+{
+	flashsrv_io_t *req;
+
+	mutexLock(flashsrv_common.io.lock);
+	req = p->queue[flashsrv_io_ctl];
+	mutexUnlock(flashsrv_common.io.lock);
+
+	flashsrv_devCtrl(&req->msg);
+	flashsrv_ioComplete(req, ((flash_o_devctl_t *)req->msg.o.raw)->err);
+}
+
+
+static void flashsrv_ioThread(void *arg)
+{
+	flashsrv_partition_t *p;
+	int cls;
+
+	for (;;) {
+		mutexLock(flashsrv_common.io.lock);
+		while ((cls = flashsrv_ioPick(&p)) < 0)
+			condWait(flashsrv_common.io.cond, flashsrv_common.io.lock, 0);
+		mutexUnlock(flashsrv_common.io.lock);
+
+		switch (cls) {
+		case flashsrv_io_read:
+			flashsrv_ioRead(p);
+			break;
+
+		case flashsrv_io_write:
+			flashsrv_ioWrite(p);
+			break;
+
+		case flashsrv_io_ctl:
+			flashsrv_ioCtl(p);
+			break;
+
+		case flashsrv_io_erase:
+			flashsrv_ioErase(p);
+			break;
+		}
+	}
+}
+
+
+static int flashsrv_queueRead(msg_t *msg, unsigned rid, unsigned port)
+{
+	flashsrv_partition_t *p;
+
+	if ((p = flashsrv_getPartition(msg->i.io.oid.id)) == NULL)
+		return -EINVAL;
+
+	return flashsrv_ioSubmit(msg, rid, port, p, flashsrv_io_read, 0, 0);
+}
+
+
+/* Write without data erases the range */
+static int flashsrv_queueWrite(msg_t *msg, unsigned rid, unsigned port)
+{
+	flashsrv_partition_t *p;
+	size_t start = msg->i.io.offs;
+	size_t size = msg->i.size ? msg->i.size : msg->i.io.len;
+
+	if ((p = flashsrv_getPartition(msg->i.io.oid.id)) == NULL)
+		return -EINVAL;
+
+	if ((start + size) > (p->size * ERASE_BLOCK_SIZE))
+		return -EINVAL;
+
+	start += p->start * ERASE_BLOCK_SIZE;
+
+	TRACE("DEV write - off: %d, size: %d, ptr: %p", start, size, msg->i.data);
+
+	if ((size & (FLASH_PAGE_SIZE - 1)) || (start & (FLASH_PAGE_SIZE - 1)))
+		return -EINVAL;
+
+	if (msg->i.data != NULL)
+		return flashsrv_ioSubmit(msg, rid, port, p, flashsrv_io_write, start / FLASH_PAGE_SIZE, size / FLASH_PAGE_SIZE);
+
+	if ((size % ERASE_BLOCK_SIZE) || (start % ERASE_BLOCK_SIZE))
+		return -EINVAL;
+
+	return flashsrv_ioSubmit(msg, rid, port, p, flashsrv_io_erase, start / ERASE_BLOCK_SIZE, size / ERASE_BLOCK_SIZE);
+}
+
+
+static int flashsrv_queueDevCtl(msg_t *msg, unsigned rid, unsigned port)
+{
+	flash_i_devctl_t *idevctl = (flash_i_devctl_t *)msg->i.raw;
+	flashsrv_partition_t *p = &flashsrv_common.io.root;
+	size_t start, size;
+
+	if (idevctl->type != flashsrv_devctl_erase && idevctl->type != flashsrv_devctl_chiperase)
+		return flashsrv_ioSubmit(msg, rid, port, p, flashsrv_io_ctl, 0, 0);
+
+	start = idevctl->erase.offset;
+	size = idevctl->erase.size;
+
+	if (idevctl->type == flashsrv_devctl_erase) {
+		if ((p = flashsrv_getPartition(idevctl->erase.oid.id)) == NULL)
+			return -EINVAL;
+
+		if ((start + size) > (p->size * ERASE_BLOCK_SIZE))
+			return -EINVAL;
+
+		start += p->start * ERASE_BLOCK_SIZE;
+	}
+
+	if ((size % ERASE_BLOCK_SIZE) || (start % ERASE_BLOCK_SIZE))
+		return -EINVAL;
+
+	return flashsrv_ioSubmit(msg, rid, port, p, flashsrv_io_erase, start / ERASE_BLOCK_SIZE, size / ERASE_BLOCK_SIZE);
+}
+
+
 static void flashsrv_devThread(void *arg)
 {
 	msg_t msg;
 	unsigned rid, port = (unsigned)arg;
+	flash_i_devctl_t *idevctl = (flash_i_devctl_t *)msg.i.raw;
+	int err;
 
 	for (;;) {
 		if (msgRecv(port, &msg, &rid) < 0)
@@ -604,13 +1291,15 @@ static void flashsrv_devThread(void *arg)
 
 		switch (msg.type) {
 		case mtRead:
-			TRACE("DEV read - id: %llu, size: %d, off: %llu ", msg.i.io.oid.id, msg.o.size, msg.i.io.offs);
-			msg.o.io.err = flashsrv_read(msg.i.io.oid.id, msg.i.io.offs, msg.o.data, msg.o.size);
+			if ((err = flashsrv_queueRead(&msg, rid, port)) == EOK)
+				continue;
+			msg.o.io.err = err;
 			break;
 
 		case mtWrite:
-			TRACE("DEV write - id: %llu, size: %d, off: %llu", msg.i.io.oid.id, msg.i.size, msg.i.io.offs);
-			msg.o.io.err = flashsrv_write(msg.i.io.oid.id, msg.i.io.offs, msg.i.data, msg.i.size ? msg.i.size : msg.i.io.len);
+			if ((err = flashsrv_queueWrite(&msg, rid, port)) == EOK)
+				continue;
+			msg.o.io.err = err;
 			break;
 
 		case mtMount:
@@ -622,7 +1311,14 @@ static void flashsrv_devThread(void *arg)
 			break;
 
 		case mtDevCtl:
-			flashsrv_devCtrl(&msg);
+			if (idevctl->type == flashsrv_devctl_cachestats || idevctl->type == flashsrv_devctl_iostats || idevctl->type == flashsrv_devctl_bbt) {
+				flashsrv_devStats(&msg);
+				break;
+			}
+
+			if ((err = flashsrv_queueDevCtl(&msg, rid, port)) == EOK)
+				continue;
+			((flash_o_devctl_t *)msg.o.raw)->err = err;
 			break;
 
 		case mtGetAttr:
@@ -651,7 +1347,9 @@ static int flashsrv_partition(size_t start, size_t size)
 {
 	flashsrv_partition_t *p;
 
-	p = malloc(sizeof(*p));
+	/* Scheduler queues and links start out empty */
+	if ((p = calloc(1, sizeof(*p))) == NULL)
+		return -ENOMEM;
 
 	p->start = start;
 	p->size = size;
@@ -674,6 +1372,7 @@ static void daemonize(void)
 int main(int argc, char **argv)
 {
 	int i, c;
+	unsigned int cachesz = CACHE_DEFAULT_PAGES, readahead = CACHE_DEFAULT_READAHEAD;
 	oid_t oid = {0, 0}, rootoid;
 	flashsrv_filesystem_t *rootfs = NULL;
 	flashsrv_partition_t *p;
@@ -692,16 +1391,33 @@ int main(int argc, char **argv)
 
 	flashsrv_common.queue = NULL;
 
+	mutexCreate(&flashsrv_common.io.lock);
+	condCreate(&flashsrv_common.io.cond);
+	flashsrv_common.io.root.start = 0;
+	flashsrv_common.io.root.size = BLOCKS_CNT;
+
 	flashdrv_init();
 	flashsrv_common.dma = flashdrv_dmanew();
-	flashsrv_common.databuf = mmap(NULL, FLASH_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_UNCACHED, NULL, -1);
+	flashsrv_common.databuf = mmap(NULL, IO_PAGES * FLASH_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_UNCACHED, NULL, -1);
 	flashsrv_common.rawdatabuf = mmap(NULL, 2 * FLASH_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_UNCACHED, NULL, -1);
 	flashsrv_common.metabuf = mmap(NULL, FLASH_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_UNCACHED, NULL, -1);
 
+	/* Bad block table is taken from DBBT written by nandtool, chip is scanned only if there is none */
+	flashbbt_init(&flashsrv_common.io.bbt);
+	if (flashbbt_load(&flashsrv_common.io.bbt, flashsrv_common.dma) != EOK) {
+		LOG_ERROR("no valid DBBT, scanning bad block markers");
+		flashbbt_scan(&flashsrv_common.io.bbt, flashsrv_common.dma, 0, BLOCKS_CNT);
+	}
+
+	mutexCreate(&flashsrv_common.cache.lock);
+	flashdrv_setinvalidate(flashsrv_cacheInvalidate);
+
 	for (i = 0; i < sizeof(flashsrv_common.poolStacks) / sizeof(flashsrv_common.poolStacks[0]); ++i)
 		beginthread(flashsrv_poolThread, 4, flashsrv_common.poolStacks[i], sizeof(flashsrv_common.poolStacks[i]), NULL);
 
-	while ((c = getopt(argc, argv, "r:p:")) != -1) {
+	beginthread(flashsrv_ioThread, 4, flashsrv_common.ioStack, sizeof(flashsrv_common.ioStack), NULL);
+
+	while ((c = getopt(argc, argv, "r:p:c:a:")) != -1) {
 		switch (c) {
 		case 'r':
 			if (argv[optind] == NULL) {
@@ -736,11 +1452,22 @@ int main(int argc, char **argv)
 			optind += 1;
 			break;
 
+		case 'c':
+			cachesz = atoi(optarg);
+			break;
+
+		case 'a':
+			readahead = atoi(optarg);
+			break;
+
 		default:
 			break;
 		}
 	}
 
+	if (flashsrv_cacheInit(cachesz, readahead) < 0)
+		LOG_ERROR("failed to allocate page cache, caching disabled");
+
 	for (n = lib_rbMinimum(flashsrv_common.partitions.root); n; n = lib_rbNext(n)) {
 		p = lib_treeof(flashsrv_partition_t, node, n);
 		oid.id = idtree_id(&p->node);
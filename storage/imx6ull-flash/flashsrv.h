@@ -27,7 +27,12 @@
 #define ROOT_ID -1
 
 enum { flashsrv_devctl_erase = 0, flashsrv_devctl_chiperase, flashsrv_devctl_writeraw, flashsrv_devctl_writemeta,
-	 flashsrv_devctl_readraw };
+	 flashsrv_devctl_readraw, flashsrv_devctl_cachestats, flashsrv_devctl_iostats, flashsrv_devctl_bbt };
+
+/* I/O scheduler request classes, in order of priority */
+enum { flashsrv_io_read = 0, flashsrv_io_write, flashsrv_io_ctl, flashsrv_io_erase, flashsrv_io_classes };
+
+#define FLASHSRV_IO_HIST 10
 
 typedef struct {
 	int type;
@@ -61,6 +66,38 @@ typedef struct {
 
 typedef struct {
 	int err;
+
+	union {
+		struct {
+			uint32_t size;
+			uint32_t used;
+			uint32_t hits;
+			uint32_t misses;
+			uint32_t prefetches;
+			uint32_t invalidations;
+		} cachestats;
+
+		/* Bitmap of bad blocks (bit b of word b / 32) is returned in output data if provided */
+		struct {
+			uint32_t blocks;
+			uint32_t count;
+			uint32_t marked;
+			uint32_t source;
+		} bbt;
+	};
 } __attribute__((packed)) flash_o_devctl_t;
 
+
+/* Returned in output data of flashsrv_devctl_iostats. Histogram bucket 0 counts requests completed
+ * in less than 1 ms, bucket b in less than 2^b ms, the last one all slower requests */
+typedef struct {
+	uint32_t depth[flashsrv_io_classes];
+	uint32_t maxdepth[flashsrv_io_classes];
+	uint32_t completed[flashsrv_io_classes];
+	uint32_t maxlatency[flashsrv_io_classes];
+	uint32_t hist[flashsrv_io_classes][FLASHSRV_IO_HIST];
+	uint32_t programs;
+	uint32_t merged;
+} flashsrv_iostats_t;
+
 #endif
@@ -44,32 +44,25 @@ void dbbt_fingerprint(dbbt_t *dbbt)
 }
 
 
-int dbbt_block_is_bad(dbbt_t *dbbt, uint32_t block_num)
-{
-	int i;
-
-	if (dbbt == NULL)
-		return 0;
-
-	for (i = 0; i < dbbt->entries_num; i++) {
-		if (block_num == dbbt->bad_block[i])
-			return 1;
-	}
-
-	return 0;
-}
-
-
-int dbbt_flash(flashdrv_dma_t *dma, dbbt_t *dbbt)
+int dbbt_flash(flashdrv_dma_t *dma, const flashbbt_t *bbt)
 {
 	int i, err;
 	uint32_t page_num = DBBT_START;
+	dbbt_t *dbbt;
 	void *data = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_UNCACHED, OID_NULL, 0);
 	void *meta = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_UNCACHED, OID_NULL, 0);
 
+	/* Header page and a single page of bad block numbers */
+	if ((dbbt = calloc(1, sizeof(dbbt_t) + PAGE_SIZE)) == NULL) {
+		munmap(data, PAGE_SIZE);
+		munmap(meta, PAGE_SIZE);
+		return -1;
+	}
+
 	dbbt_fingerprint(dbbt);
 
 	dbbt->size = 1;
+	dbbt->entries_num = flashbbt_list(bbt, dbbt->bad_block, BB_MAX);
 
 	memset(meta, 0xff, PAGE_SIZE);
 
@@ -87,8 +80,9 @@ int dbbt_flash(flashdrv_dma_t *dma, dbbt_t *dbbt)
 		page_num += PAGES_PER_BLOCK;
 	}
 
+	free(dbbt);
 	munmap(data, PAGE_SIZE);
-	munmap(data, PAGE_SIZE);
+	munmap(meta, PAGE_SIZE);
 	return 0;
 }
 
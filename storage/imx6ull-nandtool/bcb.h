@@ -17,6 +17,7 @@
 
 #include <stdint.h>
 #include "../../storage/imx6ull-flash/flashdrv.h"
+#include "../../storage/imx6ull-flash/flashbbt.h"
 
 #define PAGE_SIZE 4096
 #define RAW_PAGE_SIZE 4320
@@ -102,8 +103,7 @@ typedef struct _dbbt_t {
 
 int fcb_flash(flashdrv_dma_t *dma, fcb_t *fcb_ret);
 
-int dbbt_flash(flashdrv_dma_t *dma, dbbt_t *dbbt);
-
-int dbbt_block_is_bad(dbbt_t *dbbt, uint32_t block_num);
+/* Writes all copies of DBBT with bad blocks from bbt */
+int dbbt_flash(flashdrv_dma_t *dma, const flashbbt_t *bbt);
 
 #endif /* _BCB_H_ */
@@ -91,6 +91,10 @@
 #include <string.h>
 #include "bch.h"
 
+#if defined(USE_CHIEN_SEARCH) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#include <arm_neon.h>
+#endif
+
 #if defined(CONFIG_BCH_CONST_PARAMS)
 #define GF_M(_p)               (CONFIG_BCH_CONST_M)
 #define GF_T(_p)               (CONFIG_BCH_CONST_T)
@@ -187,33 +191,34 @@ static void store_ecc8(struct bch_control *bch, uint8_t *dst,
 /*
  * reverse bit for byte
  */
-static uint8_t reverse_bit(uint8_t in_byte)
+static inline uint8_t reverse_bit(uint8_t in_byte)
 {
-	int i;
-	uint8_t out_byte = 0;
-
-	for (i = 0; i < 8; i++) {
-		if (in_byte & ((0x80) >> i)) {
-			out_byte |= 1 << i;
-		}
-	}
+	in_byte = ((in_byte >> 1) & 0x55) | ((in_byte & 0x55) << 1);
+	in_byte = ((in_byte >> 2) & 0x33) | ((in_byte & 0x33) << 2);
 
-	return out_byte;
+	return (in_byte >> 4) | (in_byte << 4);
 }
 
  /*
-  * swap 32-bit data, including bit reverse and swap to big endian
+  * swap 32-bit data, including bit reverse and swap to big endian,
+  * which is a reversal of all 32 bits
   */
-static uint32_t swap_data(uint32_t data)
+static inline uint32_t swap_data(uint32_t data)
 {
-	uint32_t r = 0;
+#if defined(__arm__) && defined(__ARM_ARCH) && (__ARM_ARCH >= 7)
+	uint32_t r;
 
-	r = reverse_bit(data & 0xFF) << 24;
-	r |= reverse_bit((data >> 8) & 0xFF) << 16;
-	r |= reverse_bit((data >> 16) & 0xFF) << 8;
-	r |= reverse_bit((data >> 24) & 0xFF);
+	__asm__ ("rbit %0, %1" : "=r" (r) : "r" (data));
 
 	return r;
+#else
+	data = ((data >> 1) & 0x55555555) | ((data & 0x55555555) << 1);
+	data = ((data >> 2) & 0x33333333) | ((data & 0x33333333) << 2);
+	data = ((data >> 4) & 0x0f0f0f0f) | ((data & 0x0f0f0f0f) << 4);
+	data = ((data >> 8) & 0x00ff00ff) | ((data & 0x00ff00ff) << 8);
+
+	return (data >> 16) | (data << 16);
+#endif
 }
 
 /**
@@ -241,7 +246,11 @@ void encode_bch(struct bch_control *bch, const uint8_t *data,
 	const uint32_t * const tab1 = tab0 + 256*(l+1);
 	const uint32_t * const tab2 = tab1 + 256*(l+1);
 	const uint32_t * const tab3 = tab2 + 256*(l+1);
-	const uint32_t *pdata, *p0, *p1, *p2, *p3;
+	const uint32_t * const tab4 = tab3 + 256*(l+1);
+	const uint32_t * const tab5 = tab4 + 256*(l+1);
+	const uint32_t * const tab6 = tab5 + 256*(l+1);
+	const uint32_t * const tab7 = tab6 + 256*(l+1);
+	const uint32_t *pdata, *p0, *p1, *p2, *p3, *p4, *p5, *p6, *p7;
 
 	if (ecc) {
 		/* load ecc parity bytes into internal 32-bit buffer */
@@ -276,7 +285,34 @@ void encode_bch(struct bch_control *bch, const uint8_t *data,
 	 *           yyyyyyyy  00000000  00000000  mod g = r2 (precomputed)
 	 * xxxxxxxx  00000000  00000000  00000000  mod g = r3 (precomputed)
 	 * xxxxxxxx  yyyyyyyy  zzzzzzzz  tttttttt  mod g = r0^r1^r2^r3
+	 *
+	 * pairs of words are processed at once with tables r4..r7 holding
+	 * remainders of bytes shifted by further 32 bits, the index of the
+	 * second word doesn't depend on the remainder of the first one
 	 */
+	while (l && mlen >= 2) {
+		w = r[1]^swap_data(pdata[1]);
+		p0 = tab0 + (l+1)*((w >>  0) & 0xff);
+		p1 = tab1 + (l+1)*((w >>  8) & 0xff);
+		p2 = tab2 + (l+1)*((w >> 16) & 0xff);
+		p3 = tab3 + (l+1)*((w >> 24) & 0xff);
+
+		w = r[0]^swap_data(pdata[0]);
+		p4 = tab4 + (l+1)*((w >>  0) & 0xff);
+		p5 = tab5 + (l+1)*((w >>  8) & 0xff);
+		p6 = tab6 + (l+1)*((w >> 16) & 0xff);
+		p7 = tab7 + (l+1)*((w >> 24) & 0xff);
+
+		for (i = 0; i < l-1; i++)
+			r[i] = r[i+2]^p0[i]^p1[i]^p2[i]^p3[i]^p4[i]^p5[i]^p6[i]^p7[i];
+
+		r[l-1] = p0[l-1]^p1[l-1]^p2[l-1]^p3[l-1]^p4[l-1]^p5[l-1]^p6[l-1]^p7[l-1];
+		r[l] = p0[l]^p1[l]^p2[l]^p3[l]^p4[l]^p5[l]^p6[l]^p7[l];
+
+		pdata += 2;
+		mlen -= 2;
+	}
+
 	while (mlen--) {
 		/* input data is read in big-endian format */
 		/*TODO: big little endian*/
@@ -424,35 +460,43 @@ static inline int a_ilog(struct bch_control *bch, unsigned int x)
 
 /*
  * compute 2t syndromes of ecc polynomial, i.e. ecc(a^j) for j=1..2t
+ *
+ * ecc polynomial is evaluated with Horner scheme over its bytes,
+ * v(x) = (..(B0(x).x^8 + B1(x)).x^8 + ..).x^(ecc_bits-8*nbytes), where
+ * values of byte polynomials Bk(a^j) are looked up in syn_tab
  */
 static void compute_syndromes(struct bch_control *bch, uint32_t *ecc,
 			      unsigned int *syn)
 {
-	int i, j, s;
-	unsigned int m;
-	uint32_t poly;
+	int j, k;
+	unsigned int m, v, e, b;
 	const int t = GF_T(bch);
-
-	s = bch->ecc_bits;
+	const unsigned int n = GF_N(bch);
+	const int nbytes = DIV_ROUND_UP(bch->ecc_bits, 8);
+	const uint16_t *tab;
 
 	/* make sure extra bits in last ecc word are cleared */
-	m = ((unsigned int)s) & 31;
+	m = bch->ecc_bits & 31;
 	if (m)
-		ecc[s/32] &= ~((1u << (32-m))-1);
-	memset(syn, 0, 2*t*sizeof(*syn));
+		ecc[bch->ecc_bits/32] &= ~((1u << (32-m))-1);
 
 	/* compute v(a^j) for j=1 .. 2t-1 */
-	do {
-		poly = *ecc++;
-		s -= 32;
-		while (poly) {
-			i = deg(poly);
-			for (j = 0; j < 2*t; j += 2)
-				syn[j] ^= a_pow(bch, (j+1)*(i+s));
-
-			poly ^= (1 << i);
+	for (j = 0; j < t; j++) {
+		tab = bch->syn_tab + 256*j;
+		e = (8*(2*j+1)) % n;
+
+		for (k = 0, v = 0; k < nbytes; k++) {
+			b = (ecc[k/4] >> (24-8*(k & 3))) & 0xff;
+			if (v)
+				v = bch->a_pow_tab[mod_s(bch, bch->a_log_tab[v]+e)];
+			v ^= tab[b];
 		}
-	} while (s > 0);
+
+		if (v)
+			v = bch->a_pow_tab[mod_s(bch, bch->a_log_tab[v]+n-((2*j+1)*(8*nbytes-bch->ecc_bits)) % n)];
+
+		syn[2*j] = v;
+	}
 
 	/* v(a^(2j)) = v(a^j)^2 */
 	for (j = 0; j < t; j++)
@@ -990,34 +1034,76 @@ static int find_poly_roots(struct bch_control *bch, unsigned int k,
 
 #if defined(USE_CHIEN_SEARCH)
 /*
- * exhaustive root search (Chien) implementation - not used, included only for
- * reference/comparison tests
+ * exhaustive root search (Chien), selected with USE_CHIEN_SEARCH
+ *
+ * terms c[j].a^(j*i) of elp(a^i) are kept in log domain and advanced by j
+ * for every i, so each point costs a table lookup and addition per term
  */
 static int chien_search(struct bch_control *bch, unsigned int len,
 			struct gf_poly *p, unsigned int *roots)
 {
-	int m;
-	unsigned int i, j, syn, syn0, count = 0;
+	unsigned int i, j, cnt, syn, syn0, count = 0;
+	const unsigned int n = GF_N(bch);
 	const unsigned int k = 8*len+bch->ecc_bits;
+	const unsigned int first = n-k+1;
+	const uint16_t *pow = bch->a_pow_tab;
+	uint16_t *lg = bch->chien_log, *step = bch->chien_step;
 
 	/* use a log-based representation of polynomial */
 	gf_poly_logrep(bch, p, bch->cache);
-	bch->cache[p->deg] = 0;
 	syn0 = gf_div(bch, p->c[0], p->c[p->deg]);
 
-	for (i = GF_N(bch)-k+1; i <= GF_N(bch); i++) {
+	/* keep non-zero terms only, last one is monic */
+	for (j = 1, cnt = 0; j <= p->deg; j++) {
+		if (j < p->deg && bch->cache[j] < 0)
+			continue;
+
+		lg[cnt] = ((j < p->deg ? bch->cache[j] : 0)+(unsigned long long)j*first) % n;
+		step[cnt++] = j;
+	}
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	for (j = cnt; j & 7; j++) {
+		lg[j] = 0;
+		step[j] = 0;
+	}
+
+	const uint16x8_t vn = vdupq_n_u16(n);
+
+	for (i = first; i <= n; i++) {
+		/* compute elp(a^i) */
+		for (j = 0, syn = syn0; j < cnt; j++)
+			syn ^= pow[lg[j]];
+
+		if (syn == 0) {
+			roots[count++] = n-i;
+			if (count == p->deg)
+				break;
+		}
+
+		for (j = 0; j < cnt; j += 8) {
+			uint16x8_t v = vaddq_u16(vld1q_u16(lg+j), vld1q_u16(step+j));
+			/* v-n wraps around for v < n */
+			vst1q_u16(lg+j, vminq_u16(v, vsubq_u16(v, vn)));
+		}
+	}
+#else
+	for (i = first; i <= n; i++) {
 		/* compute elp(a^i) */
-		for (j = 1, syn = syn0; j <= p->deg; j++) {
-			m = bch->cache[j];
-			if (m >= 0)
-				syn ^= a_pow(bch, m+j*i);
+		for (j = 0, syn = syn0; j < cnt; j++) {
+			syn ^= pow[lg[j]];
+			lg[j] += step[j];
+			if (lg[j] >= n)
+				lg[j] -= n;
 		}
+
 		if (syn == 0) {
-			roots[count++] = GF_N(bch)-i;
+			roots[count++] = n-i;
 			if (count == p->deg)
 				break;
 		}
 	}
+#endif
 	return (count == p->deg) ? count : 0;
 }
 #define find_poly_roots(_p, _k, _elp, _loc) chien_search(_p, len, _elp, _loc)
@@ -1161,11 +1247,12 @@ static void build_mod8_tables(struct bch_control *bch, const uint32_t *g)
 {
 	int i, j, b, d;
 	uint32_t data, hi, lo, *tab;
+	const uint32_t *src, *p0, *p1, *p2, *p3;
 	const int l = BCH_ECC_WORDS(bch);
 	const int plen = DIV_ROUND_UP(bch->ecc_bits+1, 32);
 	const int ecclen = DIV_ROUND_UP(bch->ecc_bits, 32);
 
-	memset(bch->mod8_tab, 0, 4*256*l*sizeof(*bch->mod8_tab));
+	memset(bch->mod8_tab, 0, 8*256*l*sizeof(*bch->mod8_tab));
 
 	for (i = 0; i < 256; i++) {
 		/* p(X)=i is a small polynomial of weight <= 8 */
@@ -1186,6 +1273,43 @@ static void build_mod8_tables(struct bch_control *bch, const uint32_t *g)
 			}
 		}
 	}
+
+	/* (p(X).X^(8*b+32+deg(g))) mod g(X), remainder of table b times X^32 */
+	for (b = 4; b < 8; b++) {
+		for (i = 0; i < 256; i++) {
+			src = bch->mod8_tab + ((b-4)*256+i)*l;
+			tab = bch->mod8_tab + (b*256+i)*l;
+			p0 = bch->mod8_tab + l*(src[0] & 0xff);
+			p1 = bch->mod8_tab + l*(256+((src[0] >> 8) & 0xff));
+			p2 = bch->mod8_tab + l*(512+((src[0] >> 16) & 0xff));
+			p3 = bch->mod8_tab + l*(768+((src[0] >> 24) & 0xff));
+
+			for (j = 0; j < l-1; j++)
+				tab[j] = src[j+1]^p0[j]^p1[j]^p2[j]^p3[j];
+
+			tab[l-1] = p0[l-1]^p1[l-1]^p2[l-1]^p3[l-1];
+		}
+	}
+}
+
+/*
+ * compute values of byte polynomials at a^(2j+1) for syndrome computation
+ */
+static void build_syn_tables(struct bch_control *bch)
+{
+	unsigned int i, j, b;
+	uint16_t *tab;
+
+	for (j = 0; j < GF_T(bch); j++) {
+		tab = bch->syn_tab + 256*j;
+		tab[0] = 0;
+
+		for (i = 1; i < 256; i++) {
+			for (b = 0; !(i & (1 << b)); b++)
+				;
+			tab[i] = tab[i & (i-1)]^bch->a_pow_tab[((2*j+1)*b) % GF_N(bch)];
+		}
+	}
 }
 
 /*
@@ -1378,13 +1502,18 @@ struct bch_control *init_bch(int m, int t, unsigned int prim_poly)
 	bch->ecc_bytes = DIV_ROUND_UP(m*t, 8);
 	bch->a_pow_tab = bch_alloc((1+bch->n)*sizeof(*bch->a_pow_tab), &err);
 	bch->a_log_tab = bch_alloc((1+bch->n)*sizeof(*bch->a_log_tab), &err);
-	bch->mod8_tab  = bch_alloc(words*1024*sizeof(*bch->mod8_tab), &err);
+	bch->mod8_tab  = bch_alloc(words*2048*sizeof(*bch->mod8_tab), &err);
+	bch->syn_tab   = bch_alloc(t*256*sizeof(*bch->syn_tab), &err);
 	bch->ecc_buf   = bch_alloc(words*sizeof(*bch->ecc_buf), &err);
 	bch->ecc_buf2  = bch_alloc(words*sizeof(*bch->ecc_buf2), &err);
 	bch->xi_tab    = bch_alloc(m*sizeof(*bch->xi_tab), &err);
 	bch->syn       = bch_alloc(2*t*sizeof(*bch->syn), &err);
 	bch->cache     = bch_alloc(2*t*sizeof(*bch->cache), &err);
 	bch->elp       = bch_alloc((t+1)*sizeof(struct gf_poly_deg1), &err);
+#if defined(USE_CHIEN_SEARCH)
+	bch->chien_log  = bch_alloc((t+8)*sizeof(*bch->chien_log), &err);
+	bch->chien_step = bch_alloc((t+8)*sizeof(*bch->chien_step), &err);
+#endif
 
 	for (i = 0; i < ARRAY_SIZE(bch->poly_2t); i++)
 		bch->poly_2t[i] = bch_alloc(GF_POLY_SZ(2*t), &err);
@@ -1404,6 +1533,8 @@ struct bch_control *init_bch(int m, int t, unsigned int prim_poly)
 	build_mod8_tables(bch, genpoly);
 	free(genpoly);
 
+	build_syn_tables(bch);
+
 	err = build_deg2_base(bch);
 	if (err)
 		goto fail;
@@ -1427,6 +1558,11 @@ void free_bch(struct bch_control *bch)
 		free(bch->a_pow_tab);
 		free(bch->a_log_tab);
 		free(bch->mod8_tab);
+		free(bch->syn_tab);
+#if defined(USE_CHIEN_SEARCH)
+		free(bch->chien_log);
+		free(bch->chien_step);
+#endif
 		free(bch->ecc_buf);
 		free(bch->ecc_buf2);
 		free(bch->xi_tab);
@@ -1441,18 +1577,45 @@ void free_bch(struct bch_control *bch)
 	}
 }
 
+/*
+ * store bits [off, off+8*len) of src bit stream (LSB first) to dst
+ */
+static void bch_shift_copy(uint8_t *dst, const uint8_t *src, int len, int off)
+{
+	const uint8_t *p;
+	uint64_t w;
+	int k;
+
+	src += off/8;
+	off %= 8;
+
+	for (; len >= 4; len -= 4, src += 4, dst += 4) {
+		for (k = 7, w = 0, p = src; k >= 0; k--)
+			w = (w << 8) | p[k];
+
+		w >>= off;
+		dst[0] = w;
+		dst[1] = w >> 8;
+		dst[2] = w >> 16;
+		dst[3] = w >> 24;
+	}
+
+	for (; len > 0; len--, src++)
+		*dst++ = (src[0] >> off) | (src[1] << (8-off));
+}
+
 int encode_bch_ecc(void *source_block, size_t source_size,
 				   void *target_block, size_t target_size,
 				   int version)
 {
-
+	static struct bch_control *bch_cache[2];
 	struct bch_control *bch;
 	uint8_t *ecc_buf;
 	int ecc_buf_size;
 	uint8_t *tmp_buf;
 	int tmp_buf_size;
 	int real_buf_size;
-	int i, j;
+	int i, j, blk, end;
 	int ecc_bit_off;
 	int data_ecc_blk_size;
 	int low_byte_off, low_bit_off;
@@ -1504,10 +1667,14 @@ int encode_bch_ecc(void *source_block, size_t source_size,
 	if (target_size < m + b0 + e0*gf/8 + n*bn + n*en*gf/8)
 		return -EINVAL;
 
-	/* init bch, using default polynomial */
-	bch = init_bch(gf, en, 0);
-	if(!bch)
-		return -EINVAL;
+	/* init bch, using default polynomial, tables are kept for next calls */
+	bch = bch_cache[version-2];
+	if (!bch) {
+		bch = init_bch(gf, en, 0);
+		if(!bch)
+			return -EINVAL;
+		bch_cache[version-2] = bch;
+	}
 
 	/* buffer for ecc */
 	ecc_buf_size = (gf * en + 7)/8;
@@ -1515,12 +1682,14 @@ int encode_bch_ecc(void *source_block, size_t source_size,
 	if(!ecc_buf)
 		return -EINVAL;
 
-	/* temp buffer to store data and ecc */
+	/* temp buffer to store data and ecc, with slack for word reads */
 	tmp_buf_size = b0 + (e0 * gf + 7)/8 + (bn + (en * gf + 7)/8) * 7;
-	tmp_buf = malloc(tmp_buf_size);
-	if(!tmp_buf)
+	tmp_buf = malloc(tmp_buf_size + 8);
+	if(!tmp_buf) {
+		free(ecc_buf);
 		return -EINVAL;
-	memset(tmp_buf, 0, tmp_buf_size);
+	}
+	memset(tmp_buf, 0, tmp_buf_size + 8);
 
 	/* generate ecc code for each data block and store in temp buffer */
 
@@ -1554,16 +1723,31 @@ int encode_bch_ecc(void *source_block, size_t source_size,
 		/* size of a data block plus ecc block */
 		data_ecc_blk_size = bn +(gf*en+7)/8;
 
-		for (i = 0; i < real_buf_size; i++) {
-			low_bit_off = ((i/data_ecc_blk_size) * ecc_bit_off)%8;
-			low_byte_off = ((i/data_ecc_blk_size) * ecc_bit_off)/8;
-			high_bit_off = (((i+1)/data_ecc_blk_size) * ecc_bit_off)%8;
-			high_byte_off = (((i+1)/data_ecc_blk_size) * ecc_bit_off)/8;
-
-			byte_low = tmp_buf[i+low_byte_off] >> low_bit_off;
-			byte_high = tmp_buf[i+1+high_byte_off] << (8 - high_bit_off);
-
-			*(uint8_t *)(target_block + i + m) = (byte_low | byte_high);
+		/*
+		 * within a block the padding bits of all previous ecc blocks are
+		 * dropped, i.e. output is the bit stream shifted by a constant offset
+		 */
+		for (i = 0, blk = 0; i < real_buf_size; blk++) {
+			end = (blk+1)*data_ecc_blk_size - 1;
+			if (end > real_buf_size)
+				end = real_buf_size;
+
+			bch_shift_copy(target_block + m + i, tmp_buf + i, end - i, blk * ecc_bit_off);
+			i = end;
+
+			/* last byte of a block combines bits of two blocks */
+			if (i < real_buf_size) {
+				low_bit_off = ((i/data_ecc_blk_size) * ecc_bit_off)%8;
+				low_byte_off = ((i/data_ecc_blk_size) * ecc_bit_off)/8;
+				high_bit_off = (((i+1)/data_ecc_blk_size) * ecc_bit_off)%8;
+				high_byte_off = (((i+1)/data_ecc_blk_size) * ecc_bit_off)/8;
+
+				byte_low = tmp_buf[i+low_byte_off] >> low_bit_off;
+				byte_high = tmp_buf[i+1+high_byte_off] << (8 - high_bit_off);
+
+				*(uint8_t *)(target_block + i + m) = (byte_low | byte_high);
+				i++;
+			}
 		}
 	}
 
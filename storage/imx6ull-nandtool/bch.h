@@ -56,7 +56,8 @@
  * @ecc_bytes:  ecc max size (m*t bits) in bytes
  * @a_pow_tab:  Galois field GF(2^m) exponentiation lookup table
  * @a_log_tab:  Galois field GF(2^m) log lookup table
- * @mod8_tab:   remainder generator polynomial lookup tables
+ * @mod8_tab:   remainder generator polynomial lookup tables (8 byte slices)
+ * @syn_tab:    byte polynomial values at a^(2j+1) for syndrome computation
  * @ecc_buf:    ecc parity words buffer
  * @ecc_buf2:   ecc parity words buffer
  * @xi_tab:     GF(2^m) base for solving degree 2 polynomial roots
@@ -64,6 +65,8 @@
  * @cache:      log-based polynomial representation buffer
  * @elp:        error locator polynomial
  * @poly_2t:    temporary polynomials of degree 2t
+ * @chien_log:  Chien search log-domain terms (USE_CHIEN_SEARCH only)
+ * @chien_step: Chien search term increments (USE_CHIEN_SEARCH only)
  */
 struct bch_control {
 	unsigned int    m;
@@ -75,6 +78,7 @@ struct bch_control {
 	uint16_t       *a_pow_tab;
 	uint16_t       *a_log_tab;
 	uint32_t       *mod8_tab;
+	uint16_t       *syn_tab;
 	uint32_t       *ecc_buf;
 	uint32_t       *ecc_buf2;
 	unsigned int   *xi_tab;
@@ -82,6 +86,8 @@ struct bch_control {
 	int            *cache;
 	struct gf_poly *elp;
 	struct gf_poly *poly_2t[4];
+	uint16_t       *chien_log;
+	uint16_t       *chien_step;
 };
 
 struct bch_control *init_bch(int m, int t, unsigned int prim_poly);
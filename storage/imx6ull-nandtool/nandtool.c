@@ -23,6 +23,8 @@
 
 #include <sys/msg.h>
 #include <sys/mman.h>
+#include <sys/minmax.h>
+#include <sys/threads.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 
@@ -35,6 +37,15 @@
 #define PAGES_PER_BLOCK 64
 #define FLASH_PAGE_SIZE 0x1000
 
+/* Image flashing pipeline, slot matches a single flashdrv write chain */
+#define FLASH_SLOTS 4
+#define FLASH_SLOT_PAGES 32
+#define FLASH_ERASE_AHEAD 4
+
+/* flash_image() flags */
+#define FLASH_ERASE  (1 << 0)
+#define FLASH_VERIFY (1 << 1)
+
 /* jffs2 cleanmarker - write it on clean blocks to mount faster */
 struct cleanmarker
 {
@@ -50,6 +61,46 @@ static const struct cleanmarker oob_cleanmarker =
 	.len = 8
 };
 
+enum { slot_free = 0, slot_full, slot_check };
+
+
+typedef struct {
+	int state;
+	int lpage;
+	int npages;
+	uint32_t crc;
+} flash_slot_t;
+
+
+typedef struct {
+	handle_t lock;
+	handle_t cond;
+
+	int fd;
+	size_t size;
+	int pgsz;
+	int raw;
+	int verify;
+	int npages;
+	int nslots;
+	char *buf;
+	flash_slot_t slot[FLASH_SLOTS];
+	flashbbt_t bbt;
+
+	int err;
+	int stop;
+	int rdone;
+	int mismatch;
+	int badpage;
+
+	int eblock;
+	int egood;
+	int ebad;
+
+	char stack[4 * 4096] __attribute__((aligned(8)));
+} flash_pipe_t;
+
+
 /* tests */
 test_func_t test_func[16];
 int test_cnt;
@@ -62,55 +113,214 @@ int test_cnt;
 	} while (0)
 
 
-static inline int check_block(char *raw_block)
+static uint32_t flash_crc32(uint32_t crc, const uint8_t *buf, size_t len)
 {
-	if (raw_block[4096] != 0xff)
-		return 1;
-	return 0;
+	static uint32_t tab[256];
+	uint32_t c;
+	int i, j;
+
+	if (!tab[1]) {
+		for (i = 0; i < 256; i++) {
+			for (c = i, j = 0; j < 8; j++)
+				c = (c & 1) ? (c >> 1) ^ 0xedb88320 : c >> 1;
+			tab[i] = c;
+		}
+	}
+
+	crc = ~crc;
+	while (len--)
+		crc = tab[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
 }
 
 
-int flash_image(void *arg, char *path, uint32_t start, uint32_t block_offset, int silent, int raw, dbbt_t *dbbt)
+/* Reader thread, fills ring slots in order and checks CRC of pages read back after writing */
+static void flash_reader(void *arg)
 {
-	int ret = 0;
-	int imgfd, pgsz, offs = 0;
-	struct stat *stat;
-	void *img;
-	void *img_buf;
-	void *meta_buf;
-	uint32_t page_num, block_num;
+	flash_pipe_t *pipe = arg;
+	flash_slot_t *slot;
+	char *buf;
+	size_t want, got;
+	int k, ret, state;
+
+	for (k = 0; k < pipe->nslots + FLASH_SLOTS; k++) {
+		slot = pipe->slot + (k % FLASH_SLOTS);
+		buf = pipe->buf + (k % FLASH_SLOTS) * FLASH_SLOT_PAGES * pipe->pgsz;
+
+		mutexLock(pipe->lock);
+		while (slot->state == slot_full && !pipe->stop)
+			condWait(pipe->cond, pipe->lock, 0);
+		state = slot->state;
+		mutexUnlock(pipe->lock);
+
+		if (pipe->stop)
+			break;
+
+		if (state == slot_check && flash_crc32(0, (uint8_t *)buf, slot->npages * pipe->pgsz) != slot->crc) {
+			mutexLock(pipe->lock);
+			if (!pipe->mismatch++)
+				pipe->badpage = slot->lpage;
+			mutexUnlock(pipe->lock);
+		}
+
+		/* Remaining slots are only checked */
+		if (k >= pipe->nslots) {
+			mutexLock(pipe->lock);
+			slot->state = slot_free;
+			mutexUnlock(pipe->lock);
+			continue;
+		}
+
+		slot->lpage = k * FLASH_SLOT_PAGES;
+		slot->npages = min(FLASH_SLOT_PAGES, pipe->npages - slot->lpage);
+
+		want = min((size_t)slot->npages * pipe->pgsz, pipe->size - (size_t)slot->lpage * pipe->pgsz);
+		for (got = 0; got < want; got += ret) {
+			if ((ret = read(pipe->fd, buf + got, want - got)) <= 0)
+				break;
+		}
+
+		memset(buf + got, 0, slot->npages * pipe->pgsz - got);
+
+		if (pipe->verify)
+			slot->crc = flash_crc32(0, (uint8_t *)buf, slot->npages * pipe->pgsz);
+
+		mutexLock(pipe->lock);
+		if (got < want)
+			pipe->err = -EIO;
+		slot->state = slot_full;
+		condBroadcast(pipe->cond);
+		mutexUnlock(pipe->lock);
+
+		if (got < want)
+			break;
+	}
+
+	mutexLock(pipe->lock);
+	pipe->rdone = 1;
+	condBroadcast(pipe->cond);
+	mutexUnlock(pipe->lock);
+
+	endthread();
+}
+
+
+/* Erases next good block ahead of the write pointer, block failing to erase is marked bad and skipped */
+static int flash_eraseNext(flashdrv_dma_t *dma, flash_pipe_t *pipe, flashbbt_t *bbt)
+{
+	int err = EOK;
+
+	if (!flashbbt_isbad(bbt, pipe->eblock)) {
+		if ((err = flashdrv_erase(dma, pipe->eblock * PAGES_PER_BLOCK)) != EOK) {
+			pipe->ebad = pipe->eblock;
+			if (bbt != NULL && err == FLASHDRV_STATUS_FAIL) {
+				printf("Erasing block %d returned error %d, marked as bad\n", pipe->eblock, err);
+				flashbbt_mark(bbt, pipe->eblock);
+				err = EOK;
+			}
+		}
+		else {
+			pipe->egood++;
+		}
+	}
+	pipe->eblock++;
+
+	return err;
+}
+
+
+static int flash_writeRun(flashdrv_dma_t *dma, flash_pipe_t *pipe, uint32_t paddr, int n, char *data, void *stage)
+{
+	int i, ret = EOK;
+
+	if (!pipe->raw)
+		return flashdrv_write_pages(dma, paddr, n, data, NULL);
+
+	for (i = 0; i < n && ret == EOK; i++) {
+		memcpy(stage, data + i * RAW_PAGE_SIZE, RAW_PAGE_SIZE);
+		ret = flashdrv_writeraw(dma, paddr + i, stage, RAW_PAGE_SIZE);
+	}
+
+	return ret;
+}
+
+
+static int flash_readRun(flashdrv_dma_t *dma, flash_pipe_t *pipe, uint32_t paddr, int n, char *data, void *stage)
+{
+	int i, ret = EOK;
+
+	if (!pipe->raw) {
+		ret = flashdrv_read_pages(dma, paddr, n, data, NULL);
+		return (ret < 0 || ret == flash_uncorrectable) ? -EIO : EOK;
+	}
+
+	for (i = 0; i < n && ret == EOK; i++) {
+		ret = flashdrv_readraw(dma, paddr + i, stage, RAW_PAGE_SIZE);
+		memcpy(data + i * RAW_PAGE_SIZE, stage, RAW_PAGE_SIZE);
+	}
+
+	return ret;
+}
+
+
+/*
+ * Image is read by a separate thread into a ring of FLASH_SLOTS buffers while pages are programmed
+ * in multi-page chains. With FLASH_ERASE blocks are erased ahead of the write pointer while waiting
+ * for data, with FLASH_VERIFY written pages are read back and CRC is checked by the reader thread.
+ */
+int flash_image(void *arg, char *path, uint32_t start, uint32_t block_offset, int silent, int raw, flashbbt_t *bbt, int flags)
+{
+	int ret = 0, err = 0;
+	int k, i, n = 0, pgsz;
+	struct stat stat;
+	flash_pipe_t *pipe;
+	flash_slot_t *slot;
+	void *stage;
+	char *buf;
+	uint32_t lpage, block = start, paddr;
 	flashdrv_dma_t *dma;
 
 	nand_msg(silent, "\n------ FLASH ------\n");
 
-	if (start < 0) {
-		nand_msg(silent, "Start block must by larger than 0\n");
+	nand_msg(silent, "Flashing %s starting from block %d... \n", path, start);
+
+	if ((pipe = calloc(1, sizeof(*pipe))) == NULL) {
+		nand_msg(silent, "Out of memory\n");
 		nand_msg(silent, "\n------------------\n");
 		return -1;
 	}
 
-	stat = malloc(sizeof(struct stat));
-
-	nand_msg(silent, "Flashing %s starting from block %d... \n", path, start);
-	imgfd = open(path, O_RDONLY);
-
-	if (fstat(imgfd, stat)) {
+	if ((pipe->fd = open(path, O_RDONLY)) < 0 || fstat(pipe->fd, &stat)) {
 		nand_msg(silent, "File stat failed\n");
 		nand_msg(silent, "\n------------------\n");
+		if (pipe->fd >= 0)
+			close(pipe->fd);
+		free(pipe);
 		return -1;
 	}
 
-	img = mmap(NULL, (stat->st_size + 0xfff) & ~0xfff, PROT_READ | PROT_WRITE, 0, OID_NULL, 0);
-
-	img_buf = mmap(NULL, 2 * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_UNCACHED, OID_PHYSMEM, 0x900000);
-	meta_buf = img_buf + PAGE_SIZE;
-
-	memset(meta_buf, 0xff, sizeof(flashdrv_meta_t));
-
-	while ((ret = read(imgfd, img + offs, 1024)) > 0) {
-		offs += ret;
-		if (offs >= stat->st_size)
-			break;
+	pgsz = raw ? RAW_PAGE_SIZE : PAGE_SIZE;
+	pipe->pgsz = pgsz;
+	pipe->raw = raw;
+	pipe->size = stat.st_size;
+	pipe->npages = (stat.st_size + pgsz - 1) / pgsz;
+	pipe->nslots = (pipe->npages + FLASH_SLOT_PAGES - 1) / FLASH_SLOT_PAGES;
+	pipe->verify = !!(flags & FLASH_VERIFY);
+	pipe->eblock = (flags & FLASH_ERASE) ? start : BLOCKS_CNT;
+
+	/* Raw pages cross page boundaries, they are written from physically contiguous OCRAM */
+	pipe->buf = mmap(NULL, (FLASH_SLOTS * FLASH_SLOT_PAGES * pgsz + SIZE_PAGE - 1) & ~(SIZE_PAGE - 1), PROT_READ | PROT_WRITE, MAP_UNCACHED, OID_NULL, 0);
+	stage = raw ? mmap(NULL, 2 * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_UNCACHED, OID_PHYSMEM, 0x900000) : NULL;
+
+	if (pipe->buf == MAP_FAILED || stage == MAP_FAILED) {
+		nand_msg(silent, "Failed to map buffers\n");
+		nand_msg(silent, "\n------------------\n");
+		if (pipe->buf != MAP_FAILED)
+			munmap(pipe->buf, (FLASH_SLOTS * FLASH_SLOT_PAGES * pgsz + SIZE_PAGE - 1) & ~(SIZE_PAGE - 1));
+		close(pipe->fd);
+		free(pipe);
+		return -1;
 	}
 
 	if (arg == NULL) {
@@ -121,31 +331,111 @@ int flash_image(void *arg, char *path, uint32_t start, uint32_t block_offset, in
 	} else
 		dma = (flashdrv_dma_t *)arg;
 
-	offs = 0;
-	pgsz = raw ? RAW_PAGE_SIZE : PAGE_SIZE;
-	while (offs < stat->st_size) {
-		page_num = (offs / pgsz) + (start * 64);
-		block_num = page_num / (PAGES_PER_BLOCK);
+	/* Standalone flashing skips blocks listed in DBBT */
+	if (bbt == NULL && flashbbt_load(&pipe->bbt, dma) == EOK)
+		bbt = &pipe->bbt;
+
+	mutexCreate(&pipe->lock);
+	condCreate(&pipe->cond);
+	beginthread(flash_reader, 4, pipe->stack, sizeof(pipe->stack), pipe);
+
+	for (k = 0; k < pipe->nslots && !err; k++) {
+		slot = pipe->slot + (k % FLASH_SLOTS);
+		buf = pipe->buf + (k % FLASH_SLOTS) * FLASH_SLOT_PAGES * pgsz;
+
+		/* Erase ahead while waiting for data, image takes (npages - 1) / PAGES_PER_BLOCK + 1 good blocks */
+		mutexLock(pipe->lock);
+		while (slot->state != slot_full && !pipe->err) {
+			if (pipe->egood * PAGES_PER_BLOCK < pipe->npages && pipe->eblock < min(block + FLASH_ERASE_AHEAD, BLOCKS_CNT)) {
+				mutexUnlock(pipe->lock);
+				ret = flash_eraseNext(dma, pipe, bbt);
+				mutexLock(pipe->lock);
+				if (ret != EOK)
+					break;
+				continue;
+			}
+			condWait(pipe->cond, pipe->lock, 0);
+		}
+		mutexUnlock(pipe->lock);
 
-		if (!(page_num % PAGES_PER_BLOCK) && dbbt_block_is_bad(dbbt, block_num)) {
-			start++;
-			continue;
+		if (pipe->err || ret != EOK) {
+			if (ret != EOK)
+				nand_msg(silent, "Erasing block %d returned error %d\n", pipe->ebad, ret);
+			err = 1;
+			break;
 		}
-		memset(img_buf, 0x00, pgsz);
-		memcpy(img_buf, img + offs, pgsz + offs > stat->st_size ? stat->st_size - offs : pgsz);
-		if (!raw) {
-			if ((ret = flashdrv_write(dma,  page_num + block_offset, img_buf, meta_buf))) {
-				nand_msg(silent, "Image write error 0x%x at offset 0x%x\n", ret, offs);
-				return -1;
+
+		for (i = 0; i < slot->npages; i += n) {
+			lpage = slot->lpage + i;
+
+			/* Blocks up to the current one have to be erased before programming */
+			if (!(lpage % PAGES_PER_BLOCK)) {
+				if (lpage)
+					block++;
+
+				do {
+					while (block < BLOCKS_CNT && flashbbt_isbad(bbt, block))
+						block++;
+
+					while (block < BLOCKS_CNT && pipe->eblock <= block && (ret = flash_eraseNext(dma, pipe, bbt)) == EOK)
+						;
+				} while (ret == EOK && block < BLOCKS_CNT && flashbbt_isbad(bbt, block));
+			}
+
+			if (ret != EOK) {
+				nand_msg(silent, "Erasing block %d returned error %d\n", pipe->ebad, ret);
+				break;
+			}
+
+			if (block >= BLOCKS_CNT) {
+				nand_msg(silent, "Image does not fit, no good blocks left at offset 0x%x\n", lpage * pgsz);
+				ret = -ENOSPC;
+				break;
 			}
-		} else {
-			if ((ret = flashdrv_writeraw(dma, (offs / RAW_PAGE_SIZE) + (start * 64) + block_offset, img_buf, RAW_PAGE_SIZE))) {
-				nand_msg(silent, "Image write raw error 0x%x at offset 0x%x\n", ret, offs);
-				return -1;
+
+			n = min(slot->npages - i, PAGES_PER_BLOCK - (lpage % PAGES_PER_BLOCK));
+			paddr = block * PAGES_PER_BLOCK + (lpage % PAGES_PER_BLOCK);
+
+			/* Offset applies to the first page only */
+			if (!lpage && block_offset) {
+				n = 1;
+				paddr += block_offset;
+			}
+
+			if ((ret = flash_writeRun(dma, pipe, paddr, n, buf + i * pgsz, stage))) {
+				nand_msg(silent, "Image write%s error 0x%x at offset 0x%x\n", raw ? " raw" : "", ret, lpage * pgsz);
+				break;
+			}
+
+			if (pipe->verify && (ret = flash_readRun(dma, pipe, paddr, n, buf + i * pgsz, stage))) {
+				nand_msg(silent, "Image readback error 0x%x at offset 0x%x\n", ret, lpage * pgsz);
+				break;
 			}
 		}
-		offs += pgsz;
-		block_offset = 0;
+
+		if (ret != EOK)
+			err = 1;
+
+		mutexLock(pipe->lock);
+		slot->state = pipe->verify ? slot_check : slot_free;
+		condBroadcast(pipe->cond);
+		mutexUnlock(pipe->lock);
+	}
+
+	mutexLock(pipe->lock);
+	if (err)
+		pipe->stop = 1;
+	condBroadcast(pipe->cond);
+	while (!pipe->rdone)
+		condWait(pipe->cond, pipe->lock, 0);
+	mutexUnlock(pipe->lock);
+
+	if (pipe->err)
+		nand_msg(silent, "File read error\n");
+
+	if (pipe->mismatch) {
+		nand_msg(silent, "Verification failed, %d CRC mismatch(es), first at offset 0x%x\n", pipe->mismatch, pipe->badpage * pgsz);
+		err = 1;
 	}
 
 	nand_msg(silent, "\n------------------\n");
@@ -153,28 +443,30 @@ int flash_image(void *arg, char *path, uint32_t start, uint32_t block_offset, in
 	if (arg == NULL)
 		flashdrv_dmadestroy(dma);
 
-	return ret;
+	resourceDestroy(pipe->cond);
+	resourceDestroy(pipe->lock);
+	if (stage != NULL)
+		munmap(stage, 2 * PAGE_SIZE);
+	munmap(pipe->buf, (FLASH_SLOTS * FLASH_SLOT_PAGES * pgsz + SIZE_PAGE - 1) & ~(SIZE_PAGE - 1));
+	close(pipe->fd);
+	free(pipe);
+
+	return err ? -1 : 0;
 }
 
 
-int flash_check_range(void *arg, int start, int end, int silent, dbbt_t **dbbt)
+/* Builds bad block table of blocks [start, end) from factory markers, read in batched DMA chains */
+int flash_check_range(void *arg, int start, int end, int silent, flashbbt_t *bbt)
 {
 	flashdrv_dma_t *dma;
-	int i, ret = 0;
-	int bad = 0;
-	int err = 0;
-	void *raw_data = mmap(NULL, 2 * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_UNCACHED, OID_PHYSMEM, 0x900000);
-	uint32_t bbt[256] = { 0 };
-	uint32_t bbtn = 0;
-	int dbbtsz;
-
-	if (raw_data == MAP_FAILED) {
-		nand_msg(silent, "Failed to map pages from OC RAM\n");
+	flashbbt_t *tab = bbt;
+	int i, bad = 0;
+
+	if (tab == NULL && (tab = malloc(sizeof(*tab))) == NULL) {
+		nand_msg(silent, "Out of memory\n");
 		return -1;
 	}
 
-	memset(raw_data, 0, 4320);
-
 	if (arg == NULL) {
 		flashdrv_init();
 		dma = flashdrv_dmanew();
@@ -184,53 +476,39 @@ int flash_check_range(void *arg, int start, int end, int silent, dbbt_t **dbbt)
 
 	nand_msg(silent, "\n------ CHECK ------\n");
 
-	for (i = start; i < end; i++) {
-
-		memset(raw_data, 0, RAW_PAGE_SIZE);
-		ret = flashdrv_readraw(dma, (i * PAGES_PER_BLOCK), raw_data, RAW_PAGE_SIZE);
-
-		if (ret != EOK) {
-			nand_msg(silent, "Reading block %d returned an error\n", i);
-			err++;
-			bbt[bbtn++] = i;
-		}
+	flashbbt_init(tab);
+	flashbbt_scan(tab, dma, start, end);
 
-		if (check_block(raw_data)) {
+	for (i = start; i < end; i++) {
+		if (flashbbt_isbad(tab, i)) {
 			nand_msg(silent, "Block %d is marked as bad\n", i);
 			bad++;
-			bbt[bbtn++] = i;
-		}
-
-		if (bbtn >= BB_MAX) {
-			nand_msg(silent, "Too many bad blocks. Flash is not usable\n");
-			break;
 		}
 	}
 
-	nand_msg(silent, "\nTotal blocks read: %d\n\n", i);
-	nand_msg(silent, "Number of read errors: %d\n", err);
+	if (tab->count >= BB_MAX)
+		nand_msg(silent, "Too many bad blocks. Flash is not usable\n");
+
+	nand_msg(silent, "\nTotal blocks read: %d\n\n", end - start);
+	nand_msg(silent, "Number of read errors: %u\n", tab->errors);
 	nand_msg(silent, "Number of bad blocks:  %d\n", bad);
 	nand_msg(silent, "------------------\n");
 
-	if (dbbt != NULL && bbtn < BB_MAX) {
-		dbbtsz = (sizeof(dbbt_t) + (sizeof(uint32_t) * bbtn) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
-		*dbbt = malloc(dbbtsz);
-		memset(*dbbt, 0, dbbtsz);
-		memcpy(&((*dbbt)->bad_block), &bbt, sizeof(uint32_t) * bbtn);
-		(*dbbt)->entries_num = bbtn;
-	}
-
 	if (arg == NULL)
 		flashdrv_dmadestroy(dma);
 
-	munmap(raw_data, 2 * PAGE_SIZE);
-	return (bbtn >= BB_MAX);
+	bad = (tab->count >= BB_MAX);
+
+	if (bbt == NULL)
+		free(tab);
+
+	return bad;
 }
 
 
-int flash_check(void *arg, int silent, dbbt_t **dbbt)
+int flash_check(void *arg, int silent, flashbbt_t *bbt)
 {
-	return flash_check_range(arg, 0, BLOCKS_CNT, silent, dbbt);
+	return flash_check_range(arg, 0, BLOCKS_CNT, silent, bbt);
 }
 
 
@@ -262,7 +540,8 @@ void flash_test(int test_no, void * arg)
 }
 
 
-void flash_erase(void *arg, int start, int end, int silent)
+/* Blocks known to be bad are not erased, blocks which fail to erase are added to bbt */
+void flash_erase(void *arg, int start, int end, int silent, flashbbt_t *bbt)
 {
 	flashdrv_dma_t *dma;
 	int i;
@@ -283,9 +562,15 @@ void flash_erase(void *arg, int start, int end, int silent)
 		dma = (flashdrv_dma_t *)arg;
 
 	for (i = start; i < end; i++) {
+		if (flashbbt_isbad(bbt, i))
+			continue;
+
 		err = flashdrv_erase(dma, PAGES_PER_BLOCK * i);
-		if (err)
+		if (err) {
 			printf("Erasing block %d returned error %d\n", i, err);
+			if (bbt != NULL && err == FLASHDRV_STATUS_FAIL)
+				flashbbt_mark(bbt, i);
+		}
 	}
 	if (arg == NULL)
 		flashdrv_dmadestroy(dma);
@@ -293,7 +578,7 @@ void flash_erase(void *arg, int start, int end, int silent)
 }
 
 
-int flash_write_cleanmarkers(void *arg, int start, int end)
+int flash_write_cleanmarkers(void *arg, int start, int end, flashbbt_t *bbt)
 {
 	flashdrv_dma_t *dma;
 	void *metabuf;
@@ -311,7 +596,8 @@ int flash_write_cleanmarkers(void *arg, int start, int end)
 	memset(metabuf, 0xff, PAGE_SIZE);
 	memcpy(metabuf, &oob_cleanmarker, 8);
 	for (i = start; i < end; i++) {
-		ret += flashdrv_write(dma, (i * PAGES_PER_BLOCK), NULL, metabuf);
+		if (!flashbbt_isbad(bbt, i))
+			ret += flashdrv_write(dma, (i * PAGES_PER_BLOCK), NULL, metabuf);
 	}
 
 	return ret;
@@ -322,7 +608,7 @@ void set_nandboot(char *primary, char *secondary, char *rootfs, size_t rootfssz,
 	int ret = 0, err = 0;
 	flashdrv_dma_t *dma;
 	fcb_t *fcb = malloc(sizeof(fcb_t));
-	dbbt_t *dbbt;
+	flashbbt_t *bbt = malloc(sizeof(flashbbt_t));
 
 	flashdrv_init();
 	dma = flashdrv_dmanew();
@@ -331,20 +617,31 @@ void set_nandboot(char *primary, char *secondary, char *rootfs, size_t rootfssz,
 	printf("\n- NANDBOOT SETUP -\n");
 	printf("Root partition size: %u\n", rootfssz);
 
+	/* Table written by previous setup is reused, markers are scanned before erasing can destroy them */
+	flashbbt_init(bbt);
+	if (flashbbt_load(bbt, dma) == EOK) {
+		printf("Using bad block table from DBBT, %u bad blocks\n", bbt->count);
+		ret = (bbt->count >= BB_MAX);
+	}
+	else {
+		printf("Scanning for bad blocks\n");
+		ret = flash_check(dma, 1, bbt);
+	}
+
 	if (!rwfs_erase) {
 		printf("Erasing rootfs only\n");
-		flash_erase(dma, 0, 64 + (2 * rootfssz), 1);
-		ret = flash_check_range(dma, 0, 64 + (2 * rootfssz), 1, &dbbt);
+		flash_erase(dma, 0, 64 + (2 * rootfssz), 1, bbt);
 	}
 	else {
 		printf("Erasing rootfs and data partition\n");
-		flash_erase(dma, 0, BLOCKS_CNT, 1);
-		ret = flash_check(dma, 1, &dbbt);
-		flash_write_cleanmarkers(dma, 64 + (2 * rootfssz), BLOCKS_CNT);
+		flash_erase(dma, 0, BLOCKS_CNT, 1, bbt);
+		flash_write_cleanmarkers(dma, 64 + (2 * rootfssz), BLOCKS_CNT, bbt);
 	}
 
-	if (ret) {
+	if (ret || bbt->count >= BB_MAX) {
 		printf("Error while checking flash %d\n", ret);
+		free(bbt);
+		free(fcb);
 		return;
 	}
 
@@ -357,35 +654,35 @@ void set_nandboot(char *primary, char *secondary, char *rootfs, size_t rootfssz,
 		if (ret >= 4) {
 			printf("ERROR: Flashing fcb failed entirely - this device won't boot correctly\n");
 			printf("------ FAIL ------\n");
-			free(dbbt);
+			free(bbt);
 			free(fcb);
 			return;
 		} else
 			printf("WARNING: Flashing fcb failed %d out of 4 times - this may impact device's lifespan\n", ret);
 	}
 
-	if(dbbt_flash(dma, dbbt))
+	if(dbbt_flash(dma, bbt))
 		err++;
 
 	printf("Flashing primary image: %s\n", primary);
-	if (flash_image(dma, primary, fcb->fw1_start / PAGES_PER_BLOCK, 0, 1, 0, dbbt))
+	if (flash_image(dma, primary, fcb->fw1_start / PAGES_PER_BLOCK, 0, 1, 0, bbt, 0))
 		err++;
 
 	printf("Flashing secondary image: %s\n", secondary);
-	if (flash_image(dma, secondary, fcb->fw2_start / PAGES_PER_BLOCK, 0, 1, 0, dbbt))
+	if (flash_image(dma, secondary, fcb->fw2_start / PAGES_PER_BLOCK, 0, 1, 0, bbt, 0))
 		err++;
 
 	printf("Flashing rootfs: %s\n", rootfs);
-	if (flash_image(dma, rootfs, 64, 0, 1, 0, dbbt))
+	if (flash_image(dma, rootfs, 64, 0, 1, 0, bbt, 0))
 		err++;
 
-	if (flash_image(dma, rootfs, 64 + rootfssz, 0, 1, 0, dbbt))
+	if (flash_image(dma, rootfs, 64 + rootfssz, 0, 1, 0, bbt, 0))
 		err++;
 
 	flashdrv_dmadestroy(dma);
 	printf("------------------\n");
 
-	free(dbbt);
+	free(bbt);
 	free(fcb);
 
 	if (err)
@@ -401,6 +698,8 @@ void print_help(void)
 			"\t-i (path) - file path (requires -s option)\n" \
 			"\t-r (path) - just like -i option but raw\n" \
 			"\t-s (number) - start flashing from page (requires -i option)\n" \
+			"\t-E - erase blocks ahead of writing (with -i/-r option)\n" \
+			"\t-V - read back and verify written pages (with -i/-r option)\n" \
 			"\t-c - search for bad blocks from factory and print summary\n" \
 			"\t-h - print this message\n" \
 			"\t-t (number) - run test #no\n" \
@@ -564,10 +863,10 @@ int main(int argc, char **argv)
 	char *path = NULL;
 	int start = -1;
 	char *tok, *primary, *secondary, *rootfs;
-	int len, i, raw = 0;
+	int len, i, raw = 0, flags = 0;
 	size_t rootfssz = 64, erase_data = 0;
 
-	while ((c = getopt(argc, argv, "i:r:s:hct:e:f:U")) != -1) {
+	while ((c = getopt(argc, argv, "i:r:s:hct:e:f:UEV")) != -1) {
 		switch (c) {
 
 			case 'i':
@@ -598,9 +897,9 @@ int main(int argc, char **argv)
 					start = atoi(tok);
 					tok = strtok(NULL,":");
 					if (tok != NULL)
-						flash_erase(NULL, start, atoi(tok), 0);
+						flash_erase(NULL, start, atoi(tok), 0, NULL);
 					else
-						flash_erase(NULL, start, start, 0);
+						flash_erase(NULL, start, start, 0, NULL);
 				} else
 					print_help();
 				return 0;
@@ -653,6 +952,14 @@ int main(int argc, char **argv)
 			case 'U':
 				return flash_update_tool(argv + optind) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 
+			case 'E':
+				flags |= FLASH_ERASE;
+				break;
+
+			case 'V':
+				flags |= FLASH_VERIFY;
+				break;
+
 			case 'h':
 			default:
 				print_help();
@@ -665,5 +972,5 @@ int main(int argc, char **argv)
 		return 0;
 	}
 
-	return flash_image(NULL, path, start, 0, 0, raw, NULL) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+	return flash_image(NULL, path, start, 0, 0, raw, NULL, flags) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 }
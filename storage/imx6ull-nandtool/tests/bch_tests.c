@@ -0,0 +1,525 @@
+/*
+ * Phoenix-RTOS
+ *
+ * imx6ull-nandtool BCH host tests
+ *
+ * Checks table-driven encoder, syndromes, Chien search and FCB ecc packing
+ * against the reference bit-serial implementations and compares speed
+ *
+ * Copyright 2018, 2019 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#define USE_CHIEN_SEARCH
+#include "../bch.c"
+
+
+#define FCB_SIZE     1024
+#define PAGE_SIZE    4096
+#define BENCH_ROUNDS 2000
+
+
+/* reference implementations */
+
+static uint8_t ref_reverse_bit(uint8_t in_byte)
+{
+	int i;
+	uint8_t out_byte = 0;
+
+	for (i = 0; i < 8; i++) {
+		if (in_byte & ((0x80) >> i)) {
+			out_byte |= 1 << i;
+		}
+	}
+
+	return out_byte;
+}
+
+
+static uint32_t ref_swap_data(uint32_t data)
+{
+	uint32_t r = 0;
+
+	r = ref_reverse_bit(data & 0xFF) << 24;
+	r |= ref_reverse_bit((data >> 8) & 0xFF) << 16;
+	r |= ref_reverse_bit((data >> 16) & 0xFF) << 8;
+	r |= ref_reverse_bit((data >> 24) & 0xFF);
+
+	return r;
+}
+
+
+static void ref_encode_bch(struct bch_control *bch, const uint8_t *data,
+		unsigned int len, uint8_t *ecc)
+{
+	const unsigned int l = BCH_ECC_WORDS(bch)-1;
+	unsigned int i, mlen;
+	unsigned long m;
+	uint32_t w, r[l+1];
+	const uint32_t * const tab0 = bch->mod8_tab;
+	const uint32_t * const tab1 = tab0 + 256*(l+1);
+	const uint32_t * const tab2 = tab1 + 256*(l+1);
+	const uint32_t * const tab3 = tab2 + 256*(l+1);
+	const uint32_t *pdata, *p0, *p1, *p2, *p3;
+
+	load_ecc8(bch, bch->ecc_buf, ecc);
+
+	m = ((unsigned long)data) & 3;
+	if (m) {
+		mlen = (len < (4-m)) ? len : 4-m;
+		encode_bch_unaligned(bch, data, mlen, bch->ecc_buf);
+		data += mlen;
+		len  -= mlen;
+	}
+
+	pdata = (uint32_t *)data;
+	mlen  = len/4;
+	data += 4*mlen;
+	len  -= 4*mlen;
+	memcpy(r, bch->ecc_buf, sizeof(r));
+
+	while (mlen--) {
+		w = r[0]^ref_swap_data(*pdata++);
+		p0 = tab0 + (l+1)*((w >>  0) & 0xff);
+		p1 = tab1 + (l+1)*((w >>  8) & 0xff);
+		p2 = tab2 + (l+1)*((w >> 16) & 0xff);
+		p3 = tab3 + (l+1)*((w >> 24) & 0xff);
+
+		for (i = 0; i < l; i++)
+			r[i] = r[i+1]^p0[i]^p1[i]^p2[i]^p3[i];
+
+		r[l] = p0[l]^p1[l]^p2[l]^p3[l];
+	}
+	memcpy(bch->ecc_buf, r, sizeof(r));
+
+	if (len)
+		encode_bch_unaligned(bch, data, len, bch->ecc_buf);
+
+	store_ecc8(bch, ecc, bch->ecc_buf);
+}
+
+
+static void ref_compute_syndromes(struct bch_control *bch, uint32_t *ecc,
+			      unsigned int *syn)
+{
+	int i, j, s;
+	unsigned int m;
+	uint32_t poly;
+	const int t = GF_T(bch);
+
+	s = bch->ecc_bits;
+
+	m = ((unsigned int)s) & 31;
+	if (m)
+		ecc[s/32] &= ~((1u << (32-m))-1);
+	memset(syn, 0, 2*t*sizeof(*syn));
+
+	do {
+		poly = *ecc++;
+		s -= 32;
+		while (poly) {
+			i = deg(poly);
+			for (j = 0; j < 2*t; j += 2)
+				syn[j] ^= a_pow(bch, (j+1)*(i+s));
+
+			poly ^= (1 << i);
+		}
+	} while (s > 0);
+
+	for (j = 0; j < t; j++)
+		syn[2*j+1] = gf_sqr(bch, syn[j]);
+}
+
+
+static int ref_chien_search(struct bch_control *bch, unsigned int len,
+			struct gf_poly *p, unsigned int *roots)
+{
+	int m;
+	unsigned int i, j, syn, syn0, count = 0;
+	const unsigned int k = 8*len+bch->ecc_bits;
+
+	gf_poly_logrep(bch, p, bch->cache);
+	bch->cache[p->deg] = 0;
+	syn0 = gf_div(bch, p->c[0], p->c[p->deg]);
+
+	for (i = GF_N(bch)-k+1; i <= GF_N(bch); i++) {
+		for (j = 1, syn = syn0; j <= p->deg; j++) {
+			m = bch->cache[j];
+			if (m >= 0)
+				syn ^= a_pow(bch, m+j*i);
+		}
+		if (syn == 0) {
+			roots[count++] = GF_N(bch)-i;
+			if (count == p->deg)
+				break;
+		}
+	}
+	return (count == p->deg) ? count : 0;
+}
+
+
+static void ref_pack(uint8_t *target, const uint8_t *tmp_buf, int real_buf_size, int ecc_bit_off, int data_ecc_blk_size)
+{
+	int i, low_byte_off, low_bit_off, high_byte_off, high_bit_off;
+	uint8_t byte_low, byte_high;
+
+	for (i = 0; i < real_buf_size; i++) {
+		low_bit_off = ((i/data_ecc_blk_size) * ecc_bit_off)%8;
+		low_byte_off = ((i/data_ecc_blk_size) * ecc_bit_off)/8;
+		high_bit_off = (((i+1)/data_ecc_blk_size) * ecc_bit_off)%8;
+		high_byte_off = (((i+1)/data_ecc_blk_size) * ecc_bit_off)/8;
+
+		byte_low = tmp_buf[i+low_byte_off] >> low_bit_off;
+		byte_high = tmp_buf[i+1+high_byte_off] << (8 - high_bit_off);
+
+		target[i] = (byte_low | byte_high);
+	}
+}
+
+
+static int ref_encode_bch_ecc(uint8_t *source, uint8_t *target, int version)
+{
+	struct bch_control *bch;
+	uint8_t ecc_buf[128], *tmp_buf;
+	int i, j, ecc_buf_size, tmp_buf_size, real_buf_size;
+	const int m = 32, b0 = 128, bn = 128, n = 7, gf = 13, en = (version == 2) ? 62 : 40;
+
+	if ((bch = init_bch(gf, en, 0)) == NULL)
+		return -1;
+
+	ecc_buf_size = (gf * en + 7)/8;
+	tmp_buf_size = b0 + (bn + ecc_buf_size) * 8;
+	if ((tmp_buf = calloc(1, tmp_buf_size)) == NULL) {
+		free_bch(bch);
+		return -1;
+	}
+
+	for (i = 0; i < n+1; i++) {
+		memset(ecc_buf, 0, ecc_buf_size);
+		ref_encode_bch(bch, source + i * bn, bn, ecc_buf);
+		memcpy(tmp_buf + i * (bn + ecc_buf_size), source + i * bn, bn);
+
+		for (j = 0; j < ecc_buf_size; j++)
+			ecc_buf[j] = ref_reverse_bit(ecc_buf[j]);
+
+		memcpy(tmp_buf + (i+1)*bn + i*ecc_buf_size, ecc_buf, ecc_buf_size);
+	}
+
+	memset(target, 0, m);
+	real_buf_size = (b0*8 + gf*en + (bn*8 + gf*en)*n)/8;
+
+	if (!((gf * en)%8))
+		memcpy(target + m, tmp_buf, real_buf_size);
+	else
+		ref_pack(target + m, tmp_buf, real_buf_size, 8 - (gf * en)%8, bn + ecc_buf_size);
+
+	free(tmp_buf);
+	free_bch(bch);
+
+	return 0;
+}
+
+
+/* helpers */
+
+static void test_random(uint8_t *buf, size_t len)
+{
+	while (len--)
+		*buf++ = rand();
+}
+
+
+static double test_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void test_flip(uint8_t *data, unsigned int len, uint8_t *ecc, unsigned int nbits)
+{
+	unsigned int bit = rand() % nbits;
+
+	if (bit < 8 * len)
+		data[bit / 8] ^= 1 << (bit % 8);
+	else
+		ecc[(bit - 8 * len) / 8] ^= 0x80 >> ((bit - 8 * len) % 8);
+}
+
+
+/* tests */
+
+static int test_swap(void)
+{
+	uint32_t i, w;
+
+	for (i = 0; i < 0x100000; i++) {
+		w = (uint32_t)rand() ^ ((uint32_t)rand() << 16);
+		if (swap_data(w) != ref_swap_data(w) || reverse_bit(i) != ref_reverse_bit(i)) {
+			printf("swap: mismatch for %08x\n", w);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+static int test_encode(struct bch_control *bch)
+{
+	static uint8_t data[PAGE_SIZE + 3];
+	uint8_t ecc[128], ref[128];
+	unsigned int i, off, len;
+
+	for (i = 0; i < 2000; i++) {
+		/* unaligned data is slow path (and warns), check it occasionally */
+		off = (i % 200) ? 0 : rand() % 4;
+		len = rand() % (PAGE_SIZE / 2 + 1);
+		if (i % 200)
+			len &= ~3;
+		test_random(data, sizeof(data));
+
+		/* start from non-zero parity to check incremental encoding */
+		test_random(ecc, bch->ecc_bytes);
+		memcpy(ref, ecc, bch->ecc_bytes);
+		ref[bch->ecc_bytes - 1] &= ~((1u << (8 * bch->ecc_bytes - bch->ecc_bits)) - 1);
+		memcpy(ecc, ref, bch->ecc_bytes);
+
+		encode_bch(bch, data + off, len, ecc);
+		ref_encode_bch(bch, data + off, len, ref);
+
+		if (memcmp(ecc, ref, bch->ecc_bytes)) {
+			printf("encode: t=%u mismatch for len %u offset %u\n", bch->t, len, off);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+static int test_decode(struct bch_control *bch)
+{
+	static uint8_t data[512], ecc[128], calc[128];
+	unsigned int syn[256], ref[256], errloc[128], errref[128];
+	unsigned int i, k, nerr, len;
+	int err, rerr;
+
+	for (i = 0; i < 500; i++) {
+		len = 16 + rand() % (sizeof(data) - 16);
+		if (8 * len > bch->n - bch->ecc_bits)
+			len = (bch->n - bch->ecc_bits) / 8;
+
+		test_random(data, len);
+		memset(ecc, 0, sizeof(ecc));
+		encode_bch(bch, data, len, ecc);
+
+		/* up to t correctable errors, sometimes more */
+		nerr = rand() % (bch->t + 3);
+		for (k = 0; k < nerr; k++)
+			test_flip(data, len, ecc, 8 * len + bch->ecc_bits);
+
+		memset(calc, 0, sizeof(calc));
+		encode_bch(bch, data, len, calc);
+		load_ecc8(bch, bch->ecc_buf, calc);
+		load_ecc8(bch, bch->ecc_buf2, ecc);
+		for (k = 0; k < BCH_ECC_WORDS(bch); k++)
+			bch->ecc_buf[k] ^= bch->ecc_buf2[k];
+		memcpy(bch->ecc_buf2, bch->ecc_buf, BCH_ECC_WORDS(bch) * sizeof(uint32_t));
+
+		compute_syndromes(bch, bch->ecc_buf, syn);
+		ref_compute_syndromes(bch, bch->ecc_buf2, ref);
+		if (memcmp(syn, ref, 2 * bch->t * sizeof(*syn))) {
+			printf("syndromes: t=%u mismatch\n", bch->t);
+			return -1;
+		}
+
+		err = compute_error_locator_polynomial(bch, syn);
+		if (err <= 0)
+			continue;
+
+		rerr = ref_chien_search(bch, len, bch->elp, errref);
+		err = chien_search(bch, len, bch->elp, errloc);
+		if (err != rerr || memcmp(errloc, errref, err * sizeof(*errloc))) {
+			printf("chien: t=%u mismatch (%d/%d roots)\n", bch->t, err, rerr);
+			return -1;
+		}
+
+		/* Chien search has to agree with Berlekamp-Trace-Algorithm for correctable errors */
+		if (nerr > bch->t)
+			continue;
+
+		rerr = (find_poly_roots)(bch, 1, bch->elp, errref);
+		if (err != rerr) {
+			printf("chien: t=%u %d roots, BTA found %d\n", bch->t, err, rerr);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+static int test_fcb(int version)
+{
+	static uint8_t src[FCB_SIZE], dst[PAGE_SIZE], ref[PAGE_SIZE];
+	int i;
+
+	for (i = 0; i < 50; i++) {
+		test_random(src, sizeof(src));
+		memset(dst, 0x5a, sizeof(dst));
+		memset(ref, 0x5a, sizeof(ref));
+
+		if (encode_bch_ecc(src, sizeof(src), dst, sizeof(dst), version) < 0 || ref_encode_bch_ecc(src, ref, version) < 0) {
+			printf("fcb: v%d encoding failed\n", version);
+			return -1;
+		}
+
+		if (memcmp(dst, ref, sizeof(dst))) {
+			printf("fcb: v%d mismatch\n", version);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+/* benchmarks */
+
+static void bench(struct bch_control *bch)
+{
+	static uint8_t data[PAGE_SIZE];
+	uint8_t ecc[128];
+	unsigned int syn[256], errloc[128], i, k;
+	double t0, t1, t2;
+
+	test_random(data, sizeof(data));
+
+	t0 = test_time();
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		memset(ecc, 0, sizeof(ecc));
+		ref_encode_bch(bch, data, sizeof(data) / 8, ecc);
+	}
+	t1 = test_time();
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		memset(ecc, 0, sizeof(ecc));
+		encode_bch(bch, data, sizeof(data) / 8, ecc);
+	}
+	t2 = test_time();
+	printf("t=%-3u encode     %8.2f -> %8.2f MB/s\n", bch->t,
+		BENCH_ROUNDS * sizeof(data) / 8 / (t1 - t0) / 1e6, BENCH_ROUNDS * sizeof(data) / 8 / (t2 - t1) / 1e6);
+
+	for (k = 0; k < BCH_ECC_WORDS(bch); k++)
+		bch->ecc_buf2[k] = (uint32_t)rand() ^ ((uint32_t)rand() << 16);
+
+	t0 = test_time();
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		memcpy(bch->ecc_buf, bch->ecc_buf2, BCH_ECC_WORDS(bch) * sizeof(uint32_t));
+		ref_compute_syndromes(bch, bch->ecc_buf, syn);
+	}
+	t1 = test_time();
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		memcpy(bch->ecc_buf, bch->ecc_buf2, BCH_ECC_WORDS(bch) * sizeof(uint32_t));
+		compute_syndromes(bch, bch->ecc_buf, syn);
+	}
+	t2 = test_time();
+	printf("t=%-3u syndromes  %8.2f -> %8.2f us\n", bch->t,
+		(t1 - t0) * 1e6 / BENCH_ROUNDS, (t2 - t1) * 1e6 / BENCH_ROUNDS);
+
+	/* error locator of t errors in 512 bytes */
+	memset(ecc, 0, sizeof(ecc));
+	encode_bch(bch, data, 512, ecc);
+	for (k = 0; k < bch->t; k++)
+		test_flip(data, 512, ecc, 512 * 8);
+	memset(bch->ecc_buf2, 0, BCH_ECC_WORDS(bch) * sizeof(uint32_t));
+	decode_bch(bch, data, 512, ecc, NULL, NULL, errloc);
+
+	t0 = test_time();
+	for (i = 0; i < BENCH_ROUNDS / 20; i++)
+		ref_chien_search(bch, 512, bch->elp, errloc);
+	t1 = test_time();
+	for (i = 0; i < BENCH_ROUNDS / 20; i++)
+		chien_search(bch, 512, bch->elp, errloc);
+	t2 = test_time();
+	printf("t=%-3u chien      %8.2f -> %8.2f us\n", bch->t,
+		(t1 - t0) * 1e6 / (BENCH_ROUNDS / 20), (t2 - t1) * 1e6 / (BENCH_ROUNDS / 20));
+}
+
+
+static void bench_fcb(int version)
+{
+	static uint8_t src[FCB_SIZE], dst[PAGE_SIZE];
+	double t0, t1, t2;
+	int i;
+
+	test_random(src, sizeof(src));
+
+	t0 = test_time();
+	for (i = 0; i < BENCH_ROUNDS / 20; i++)
+		ref_encode_bch_ecc(src, dst, version);
+	t1 = test_time();
+	for (i = 0; i < BENCH_ROUNDS / 20; i++)
+		encode_bch_ecc(src, sizeof(src), dst, sizeof(dst), version);
+	t2 = test_time();
+	printf("v%d    fcb        %8.2f -> %8.2f us\n", version,
+		(t1 - t0) * 1e6 / (BENCH_ROUNDS / 20), (t2 - t1) * 1e6 / (BENCH_ROUNDS / 20));
+}
+
+
+int main(int argc, char **argv)
+{
+	static const unsigned int tv[] = { 4, 8, 16, 40, 62 };
+	struct bch_control *bch;
+	unsigned int i;
+	int err = 0;
+
+	srand(argc > 1 ? atoi(argv[1]) : 1);
+
+	err |= test_swap();
+
+	for (i = 0; i < sizeof(tv) / sizeof(tv[0]); i++) {
+		if ((bch = init_bch(13, tv[i], 0)) == NULL) {
+			printf("init_bch: t=%u failed\n", tv[i]);
+			return 1;
+		}
+
+		err |= test_encode(bch);
+		err |= test_decode(bch);
+		free_bch(bch);
+	}
+
+	err |= test_fcb(2);
+	err |= test_fcb(3);
+
+	if (err) {
+		printf("bch: FAILED\n");
+		return 1;
+	}
+
+	printf("bch: all tests passed\n");
+
+	if (argc > 2) {
+		for (i = 0; i < sizeof(tv) / sizeof(tv[0]); i++) {
+			bch = init_bch(13, tv[i], 0);
+			bench(bch);
+			free_bch(bch);
+		}
+
+		bench_fcb(2);
+		bench_fcb(3);
+	}
+
+	return 0;
+}
@@ -0,0 +1,619 @@
+/*
+ * Phoenix-RTOS
+ *
+ * AHCI host bus adapter core
+ *
+ * Copyright 2019 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ahci.h"
+
+
+/* Register polling step and timeouts (in us) */
+#define AHCI_POLL_STEP     1000
+#define AHCI_RESET_TIMEOUT 1000000
+#define AHCI_STOP_TIMEOUT  500000
+#define AHCI_LINK_TIMEOUT  50000
+
+/* Command list (1 KiB), received FIS (256 bytes) and IDENTIFY data share a page */
+#define AHCI_FIS_OFFS     1024
+#define AHCI_SCRATCH_OFFS 2048
+
+#define AHCI_PXIE (AHCI_PXIS_DHRS | AHCI_PXIS_SDBS | AHCI_PXIS_ERR)
+
+
+static int ahci_wait(volatile uint32_t *base, unsigned int reg, uint32_t mask, uint32_t val, unsigned int timeout)
+{
+	unsigned int t;
+
+	for (t = 0; (ahci_read(base, reg) & mask) != val; t += AHCI_POLL_STEP) {
+		if (t >= timeout)
+			return -ETIMEDOUT;
+
+		usleep(AHCI_POLL_STEP);
+	}
+
+	return EOK;
+}
+
+
+/* Stops command processing, clears PxCI and PxSACT */
+static int ahci_port_stop(volatile uint32_t *regs)
+{
+	uint32_t cmd = ahci_read(regs, ahci_pxcmd);
+
+	if (cmd & AHCI_PXCMD_ST)
+		ahci_write(regs, ahci_pxcmd, cmd & ~AHCI_PXCMD_ST);
+
+	return ahci_wait(regs, ahci_pxcmd, AHCI_PXCMD_CR, 0, AHCI_STOP_TIMEOUT);
+}
+
+
+static int ahci_port_start(volatile uint32_t *regs)
+{
+	if (ahci_wait(regs, ahci_pxtfd, AHCI_TFD_BSY | AHCI_TFD_DRQ, 0, AHCI_TIMEOUT) < 0)
+		return -ETIMEDOUT;
+
+	ahci_write(regs, ahci_pxcmd, ahci_read(regs, ahci_pxcmd) | AHCI_PXCMD_ST);
+
+	return EOK;
+}
+
+
+/* Stops command processing and FIS reception before the port is set up */
+static int ahci_port_idle(volatile uint32_t *regs)
+{
+	uint32_t cmd;
+
+	if (ahci_port_stop(regs) < 0)
+		return -ETIMEDOUT;
+
+	if ((cmd = ahci_read(regs, ahci_pxcmd)) & AHCI_PXCMD_FRE)
+		ahci_write(regs, ahci_pxcmd, cmd & ~AHCI_PXCMD_FRE);
+
+	return ahci_wait(regs, ahci_pxcmd, AHCI_PXCMD_FR, 0, AHCI_STOP_TIMEOUT);
+}
+
+
+/* COMRESET, brings the drive out of an error state */
+static int ahci_port_reset(volatile uint32_t *regs)
+{
+	uint32_t sctl = ahci_read(regs, ahci_pxsctl) & ~AHCI_SCTL_DET_MASK;
+	int err;
+
+	ahci_write(regs, ahci_pxsctl, sctl | AHCI_SCTL_DET_INIT);
+	usleep(AHCI_POLL_STEP);
+	ahci_write(regs, ahci_pxsctl, sctl);
+
+	err = ahci_wait(regs, ahci_pxssts, AHCI_SSTS_DET_MASK, AHCI_SSTS_DET_PHY, AHCI_RESET_TIMEOUT);
+	ahci_write(regs, ahci_pxserr, 0xffffffff);
+
+	return err;
+}
+
+
+static void ahci_fis(volatile uint8_t *fis, uint8_t cmd, uint64_t lba, uint16_t features, uint16_t count, uint8_t device)
+{
+	fis[0] = AHCI_FIS_H2D;
+	fis[1] = AHCI_FIS_CMD;
+	fis[2] = cmd;
+	fis[3] = features & 0xff;
+	fis[4] = lba & 0xff;
+	fis[5] = (lba >> 8) & 0xff;
+	fis[6] = (lba >> 16) & 0xff;
+	fis[7] = device;
+	fis[8] = (lba >> 24) & 0xff;
+	fis[9] = (lba >> 32) & 0xff;
+	fis[10] = (lba >> 40) & 0xff;
+	fis[11] = features >> 8;
+	fis[12] = count & 0xff;
+	fis[13] = count >> 8;
+	fis[14] = 0;
+	fis[15] = 0;
+	fis[16] = fis[17] = fis[18] = fis[19] = 0;
+}
+
+
+/* Describes buffer with the command table PRDT, returns number of bytes covered (whole sectors) */
+static size_t ahci_prdt(ahci_port_t *port, unsigned int slot, char *buff, size_t len, unsigned int *nprd)
+{
+	volatile ahci_cmdtbl_t *tbl = &port->tables[slot];
+	uint64_t base[AHCI_PRDT_ENTRIES], pa;
+	uint32_t size[AHCI_PRDT_ENTRIES];
+	size_t done = 0, chunk, trim;
+	int n = -1, i;
+
+	while (done < len) {
+		chunk = AHCI_PAGE_SIZE - (((uintptr_t)buff + done) & (AHCI_PAGE_SIZE - 1));
+		if (chunk > len - done)
+			chunk = len - done;
+
+		pa = ahci_dma_addr(buff + done);
+
+		/* Merge physically contiguous pages */
+		if (n >= 0 && base[n] + size[n] == pa && size[n] + chunk <= AHCI_PRD_BYTES) {
+			size[n] += chunk;
+		}
+		else {
+			if (++n == AHCI_PRDT_ENTRIES) {
+				n--;
+				break;
+			}
+			base[n] = pa;
+			size[n] = chunk;
+		}
+
+		done += chunk;
+	}
+
+	/* A command transfers whole sectors */
+	for (trim = done % port->sector_size; trim >= size[n]; n--)
+		trim -= size[n];
+	size[n] -= trim;
+	done -= done % port->sector_size;
+
+	for (i = 0; i <= n; i++) {
+		tbl->prdt[i].dba = (uint32_t)base[i];
+		tbl->prdt[i].dbau = (uint32_t)(base[i] >> 32);
+		tbl->prdt[i].reserved = 0;
+		tbl->prdt[i].dbc = size[i] - 1;
+	}
+
+	*nprd = n + 1;
+
+	return done;
+}
+
+
+static void ahci_issue(ahci_port_t *port, unsigned int slot, ahci_req_t *req, uint64_t now)
+{
+	volatile ahci_cmdtbl_t *tbl = &port->tables[slot];
+	volatile ahci_cmdhdr_t *hdr = &port->clist[slot];
+	uint32_t numsects = req->numsects;
+	unsigned int nprd;
+	uint8_t cmd;
+
+	if (numsects > (port->lba48 ? 65536 : 256))
+		numsects = port->lba48 ? 65536 : 256;
+
+	numsects = ahci_prdt(port, slot, req->buff, (size_t)numsects * port->sector_size, &nprd) / port->sector_size;
+	hdr->flags = AHCI_CMD_CFL | ((req->direction == AHCI_WRITE) ? AHCI_CMD_WRITE : 0) | (nprd << AHCI_CMD_PRDTL_SHIFT);
+	hdr->prdbc = 0;
+
+	/* Sector count of 0 stands for the maximum */
+	if (port->ncq) {
+		cmd = (req->direction == AHCI_WRITE) ? AHCI_ATA_WRITE_FPDMA : AHCI_ATA_READ_FPDMA;
+		ahci_fis(tbl->cfis, cmd, req->lba, numsects & 0xffff, slot << 3, AHCI_FIS_LBA);
+	}
+	else if (port->lba48) {
+		cmd = (req->direction == AHCI_WRITE) ? AHCI_ATA_WRITE_DMA_EXT : AHCI_ATA_READ_DMA_EXT;
+		ahci_fis(tbl->cfis, cmd, req->lba, 0, numsects & 0xffff, AHCI_FIS_LBA);
+	}
+	else {
+		cmd = (req->direction == AHCI_WRITE) ? AHCI_ATA_WRITE_DMA : AHCI_ATA_READ_DMA;
+		ahci_fis(tbl->cfis, cmd, req->lba & 0xffffff, 0, numsects & 0xff, AHCI_FIS_LBA | ((req->lba >> 24) & 0xf));
+	}
+
+	req->cursects = numsects;
+	req->issued = now;
+	port->slot[slot] = req;
+	port->busy |= 1u << slot;
+
+	/* Command table has to be visible before the command is issued */
+	__sync_synchronize();
+
+	if (port->ncq)
+		ahci_write(port->regs, ahci_pxsact, 1u << slot);
+	ahci_write(port->regs, ahci_pxci, 1u << slot);
+}
+
+
+/* Issues queued requests to free slots */
+static void ahci_port_issue(ahci_port_t *port, uint64_t now)
+{
+	uint32_t mask = (port->depth == 32) ? 0xffffffff : (1u << port->depth) - 1, free;
+	ahci_req_t *req;
+
+	while ((req = port->pending) != NULL && (free = ~port->busy & mask) != 0) {
+		if ((port->pending = req->next) == NULL)
+			port->tail = NULL;
+
+		ahci_issue(port, __builtin_ctz(free), req, now);
+	}
+}
+
+
+static void ahci_requeue(ahci_port_t *port, ahci_req_t *req)
+{
+	if ((req->next = port->pending) == NULL)
+		port->tail = req;
+	port->pending = req;
+}
+
+
+static void ahci_finish(ahci_req_t **done, ahci_req_t *req, int err)
+{
+	req->err = err;
+	req->next = *done;
+	*done = req;
+}
+
+
+static void ahci_retire(ahci_port_t *port, unsigned int slot, ahci_req_t **done)
+{
+	ahci_req_t *req = port->slot[slot];
+	size_t len = (size_t)req->cursects * port->sector_size;
+
+	port->slot[slot] = NULL;
+	port->busy &= ~(1u << slot);
+
+	req->lba += req->cursects;
+	req->numsects -= req->cursects;
+	req->buff += len;
+	req->done += len;
+	req->cursects = 0;
+
+	/* Remaining part of a split request goes first */
+	if (req->numsects)
+		ahci_requeue(port, req);
+	else
+		ahci_finish(done, req, EOK);
+}
+
+
+/* Executes non-queued command in slot 0 polling for completion, used at init and during recovery */
+static int ahci_exec(ahci_port_t *port, uint8_t cmd, uint64_t lba, uint16_t count, volatile uint8_t *buff, size_t len)
+{
+	volatile uint32_t *regs = port->regs;
+	volatile ahci_cmdtbl_t *tbl = &port->tables[0];
+	uint64_t pa = ahci_dma_addr((void *)buff);
+	unsigned int t;
+
+	ahci_fis(tbl->cfis, cmd, lba, 0, count, 0);
+	tbl->prdt[0].dba = (uint32_t)pa;
+	tbl->prdt[0].dbau = (uint32_t)(pa >> 32);
+	tbl->prdt[0].reserved = 0;
+	tbl->prdt[0].dbc = len - 1;
+
+	port->clist[0].flags = AHCI_CMD_CFL | (1 << AHCI_CMD_PRDTL_SHIFT);
+	port->clist[0].prdbc = 0;
+
+	__sync_synchronize();
+	ahci_write(regs, ahci_pxci, 1);
+
+	for (t = 0; ahci_read(regs, ahci_pxci) & 1; t += AHCI_POLL_STEP) {
+		if ((ahci_read(regs, ahci_pxis) & AHCI_PXIS_ERR) || t >= AHCI_TIMEOUT)
+			break;
+
+		usleep(AHCI_POLL_STEP);
+	}
+
+	if ((ahci_read(regs, ahci_pxci) & 1) || (ahci_read(regs, ahci_pxtfd) & AHCI_TFD_ERR)) {
+		ahci_port_stop(regs);
+		ahci_write(regs, ahci_pxis, 0xffffffff);
+		return -EIO;
+	}
+
+	ahci_write(regs, ahci_pxis, 0xffffffff);
+
+	return EOK;
+}
+
+
+/*
+ * Commands outstanding at an error are reissued once the port is recovered, the failed
+ * ones (failed mask) at most AHCI_RETRIES times. Failed queued command is reported by
+ * the NCQ error log, reading the log also brings the drive out of the error state.
+ */
+static void ahci_port_recover(ahci_port_t *port, uint32_t failed, ahci_req_t **done)
+{
+	volatile uint32_t *regs = port->regs;
+	ahci_req_t *req;
+	unsigned int slot;
+	uint32_t tfd;
+	int err;
+
+	port->resets++;
+	ahci_port_stop(regs);
+
+	ahci_write(regs, ahci_pxserr, 0xffffffff);
+	ahci_write(regs, ahci_pxis, 0xffffffff);
+
+	/* Drive stuck busy needs a COMRESET */
+	if ((tfd = ahci_read(regs, ahci_pxtfd)) & (AHCI_TFD_BSY | AHCI_TFD_DRQ))
+		err = ahci_port_reset(regs);
+	else
+		err = EOK;
+
+	if (err == EOK)
+		err = ahci_port_start(regs);
+
+	if (err == EOK && port->ncq && (tfd & AHCI_TFD_ERR)) {
+		if (ahci_exec(port, AHCI_ATA_READ_LOG_EXT, AHCI_LOG_NCQ_ERR, 1, port->scratch, AHCI_DEF_SECTOR_SIZE) == EOK &&
+			!(port->scratch[0] & AHCI_LOG_NQ) && (failed & (1u << (port->scratch[0] & AHCI_LOG_TAG_MASK))))
+			failed = 1u << (port->scratch[0] & AHCI_LOG_TAG_MASK);
+		else if ((err = ahci_port_reset(regs)) == EOK)
+			err = ahci_port_start(regs);
+	}
+
+	ahci_write(regs, ahci_pxis, 0xffffffff);
+	__sync_fetch_and_and(&port->is, 0);
+
+	if (err < 0)
+		port->offline = 1;
+
+	while (port->busy) {
+		slot = __builtin_ctz(port->busy);
+		req = port->slot[slot];
+		port->slot[slot] = NULL;
+		port->busy &= ~(1u << slot);
+		req->cursects = 0;
+
+		if (!port->offline && (!(failed & (1u << slot)) || req->retries++ < AHCI_RETRIES))
+			ahci_requeue(port, req);
+		else
+			ahci_finish(done, req, -EIO);
+	}
+
+	if (!port->offline)
+		return;
+
+	while ((req = port->pending) != NULL) {
+		port->pending = req->next;
+		ahci_finish(done, req, -EIO);
+	}
+	port->tail = NULL;
+}
+
+
+static void ahci_port_free(ahci_port_t *port)
+{
+	if (port->tables != NULL)
+		ahci_dma_free((void *)port->tables, port->hba->nslots * sizeof(ahci_cmdtbl_t));
+
+	if (port->clist != NULL)
+		ahci_dma_free((void *)port->clist, AHCI_PAGE_SIZE);
+
+	free(port);
+}
+
+
+static int ahci_port_init(ahci_hba_t *hba, unsigned int n)
+{
+	volatile uint32_t *regs = hba->regs + AHCI_PORT(n);
+	ahci_port_t *port;
+	volatile uint8_t *mem;
+	uint64_t pa;
+	unsigned int i;
+
+	if (ahci_port_idle(regs) < 0)
+		return -EBUSY;
+
+	ahci_write(regs, ahci_pxcmd, ahci_read(regs, ahci_pxcmd) | AHCI_PXCMD_SUD | AHCI_PXCMD_POD);
+
+	if (ahci_wait(regs, ahci_pxssts, AHCI_SSTS_DET_MASK, AHCI_SSTS_DET_PHY, AHCI_LINK_TIMEOUT) < 0)
+		return -ENODEV;
+
+	if ((port = calloc(1, sizeof(*port))) == NULL)
+		return -ENOMEM;
+
+	port->hba = hba;
+	port->regs = regs;
+	port->index = n;
+
+	if ((mem = ahci_dma_alloc(AHCI_PAGE_SIZE)) == NULL) {
+		ahci_port_free(port);
+		return -ENOMEM;
+	}
+
+	memset((void *)mem, 0, AHCI_PAGE_SIZE);
+	port->clist = (volatile ahci_cmdhdr_t *)mem;
+	port->fis = mem + AHCI_FIS_OFFS;
+	port->scratch = mem + AHCI_SCRATCH_OFFS;
+
+	if ((port->tables = ahci_dma_alloc(hba->nslots * sizeof(ahci_cmdtbl_t))) == NULL) {
+		ahci_port_free(port);
+		return -ENOMEM;
+	}
+
+	memset((void *)port->tables, 0, hba->nslots * sizeof(ahci_cmdtbl_t));
+
+	for (i = 0; i < hba->nslots; i++) {
+		pa = ahci_dma_addr((void *)&port->tables[i]);
+		port->clist[i].ctba = (uint32_t)pa;
+		port->clist[i].ctbau = (uint32_t)(pa >> 32);
+	}
+
+	pa = ahci_dma_addr((void *)port->clist);
+	ahci_write(regs, ahci_pxclb, (uint32_t)pa);
+	ahci_write(regs, ahci_pxclbu, (uint32_t)(pa >> 32));
+
+	pa = ahci_dma_addr((void *)port->fis);
+	ahci_write(regs, ahci_pxfb, (uint32_t)pa);
+	ahci_write(regs, ahci_pxfbu, (uint32_t)(pa >> 32));
+
+	ahci_write(regs, ahci_pxserr, 0xffffffff);
+	ahci_write(regs, ahci_pxis, 0xffffffff);
+	ahci_write(regs, ahci_pxcmd, ahci_read(regs, ahci_pxcmd) | AHCI_PXCMD_FRE);
+
+	/* Signature comes with the initial D2H FIS, a drive stuck busy gets a COMRESET */
+	if (ahci_port_start(regs) < 0 && (ahci_port_reset(regs) < 0 || ahci_port_start(regs) < 0)) {
+		ahci_port_idle(regs);
+		ahci_port_free(port);
+		return -EIO;
+	}
+
+	/* ATAPI and port multipliers are not supported */
+	if (ahci_read(regs, ahci_pxsig) != AHCI_SIG_ATA || ahci_exec(port, AHCI_ATA_IDENTIFY, 0, 0, port->scratch, sizeof(atainfo_t)) < 0) {
+		ahci_port_idle(regs);
+		ahci_port_free(port);
+		return -ENODEV;
+	}
+
+	memcpy(&port->info, (void *)port->scratch, sizeof(atainfo_t));
+
+	port->lba48 = (port->info.commands2_sup & AHCI_INFO_LBA48) ? 1 : 0;
+	port->size = port->lba48 ? port->info.lba48_totalsectors : port->info.lba28_totalsectors;
+
+	if ((port->info.physlog_sector_size & AHCI_INFO_SECTOR_MASK) == AHCI_INFO_SECTOR_LARGE && port->info.log_sector_size)
+		port->sector_size = 2 * port->info.log_sector_size;
+	else
+		port->sector_size = AHCI_DEF_SECTOR_SIZE;
+
+	/* Drive reports its queue depth - 1 */
+	port->ncq = ((hba->cap & AHCI_CAP_SNCQ) && port->lba48 && (port->info.sata_capabilities & AHCI_INFO_NCQ)) ? 1 : 0;
+	port->depth = 1;
+
+	if (port->ncq) {
+		port->depth = (port->info.queue_depth & AHCI_INFO_QDEPTH_MASK) + 1;
+		if (port->depth > hba->nslots)
+			port->depth = hba->nslots;
+	}
+
+	ahci_write(regs, ahci_pxis, 0xffffffff);
+	ahci_write(regs, ahci_pxie, AHCI_PXIE);
+
+	hba->ports[n] = port;
+
+	return EOK;
+}
+
+
+int ahci_hba_init(ahci_hba_t *hba, volatile uint32_t *regs)
+{
+	uint32_t pi;
+	unsigned int i;
+
+	memset(hba, 0, sizeof(*hba));
+	hba->regs = regs;
+
+	/* Reset drops the state left by firmware */
+	ahci_write(regs, ahci_ghc, AHCI_GHC_AE);
+	ahci_write(regs, ahci_ghc, AHCI_GHC_AE | AHCI_GHC_HR);
+
+	if (ahci_wait(regs, ahci_ghc, AHCI_GHC_HR, 0, AHCI_RESET_TIMEOUT) < 0)
+		return -ETIMEDOUT;
+
+	ahci_write(regs, ahci_ghc, AHCI_GHC_AE);
+
+	hba->cap = ahci_read(regs, ahci_cap);
+	hba->nslots = ((hba->cap >> 8) & 0x1f) + 1;
+	pi = ahci_read(regs, ahci_pi);
+
+	for (i = 0; i < AHCI_MAX_PORTS; i++) {
+		if ((pi & (1u << i)) && ahci_port_init(hba, i) == EOK)
+			hba->nports++;
+	}
+
+	return hba->nports;
+}
+
+
+void ahci_hba_enable(ahci_hba_t *hba)
+{
+	ahci_write(hba->regs, ahci_is, 0xffffffff);
+	ahci_write(hba->regs, ahci_ghc, ahci_read(hba->regs, ahci_ghc) | AHCI_GHC_IE);
+}
+
+
+int ahci_isr(ahci_hba_t *hba)
+{
+	volatile uint32_t *regs;
+	uint32_t is, pending, pis;
+	unsigned int i;
+
+	if ((is = ahci_read(hba->regs, ahci_is)) == 0)
+		return -1;
+
+	for (pending = is; pending; pending &= pending - 1) {
+		i = __builtin_ctz(pending);
+		regs = hba->regs + AHCI_PORT(i);
+
+		pis = ahci_read(regs, ahci_pxis);
+		ahci_write(regs, ahci_pxis, pis);
+
+		if (hba->ports[i] != NULL)
+			__sync_fetch_and_or(&hba->ports[i]->is, pis);
+	}
+
+	/* Port interrupts have to be cleared first */
+	ahci_write(hba->regs, ahci_is, is);
+
+	return 0;
+}
+
+
+int ahci_submit(ahci_port_t *port, ahci_req_t *req, uint64_t now)
+{
+	/* PRD addresses are word aligned */
+	if ((uintptr_t)req->buff & 1)
+		return -EINVAL;
+
+	if (port->offline)
+		return -EIO;
+
+	req->next = NULL;
+	req->retries = 0;
+	req->cursects = 0;
+	req->done = 0;
+	req->err = EOK;
+
+	if (port->tail != NULL)
+		port->tail->next = req;
+	else
+		port->pending = req;
+	port->tail = req;
+
+	ahci_port_issue(port, now);
+
+	return EOK;
+}
+
+
+ahci_req_t *ahci_complete(ahci_hba_t *hba, uint64_t now)
+{
+	ahci_req_t *done = NULL;
+	ahci_port_t *port;
+	uint32_t is, finished, busy, expired;
+	unsigned int i, slot;
+
+	for (i = 0; i < AHCI_MAX_PORTS; i++) {
+		if ((port = hba->ports[i]) == NULL)
+			continue;
+
+		is = __sync_fetch_and_and(&port->is, 0);
+
+		if (is & AHCI_PXIS_ERR) {
+			ahci_port_recover(port, port->busy, &done);
+		}
+		else if (port->busy) {
+			/* Queued commands complete when PxSACT clears, the others when PxCI clears */
+			finished = port->busy & ~(ahci_read(port->regs, ahci_pxsact) | ahci_read(port->regs, ahci_pxci));
+
+			for (; finished; finished &= finished - 1)
+				ahci_retire(port, __builtin_ctz(finished), &done);
+
+			for (expired = 0, busy = port->busy; busy; busy &= busy - 1) {
+				slot = __builtin_ctz(busy);
+				if (now - port->slot[slot]->issued > AHCI_TIMEOUT)
+					expired |= 1u << slot;
+			}
+
+			if (expired)
+				ahci_port_recover(port, expired, &done);
+		}
+
+		ahci_port_issue(port, now);
+	}
+
+	return done;
+}
@@ -0,0 +1,228 @@
+/*
+ * Phoenix-RTOS
+ *
+ * AHCI host bus adapter core
+ *
+ * Copyright 2019 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _DEV_AHCI_H_
+#define _DEV_AHCI_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../pc-ata/pc-ata_info.h"
+
+#define AHCI_MAX_PORTS 32
+#define AHCI_MAX_SLOTS 32
+#define AHCI_PAGE_SIZE 4096
+
+/* Command table of 1 KiB, a table never crosses a page */
+#define AHCI_PRDT_ENTRIES 56
+#define AHCI_PRD_BYTES (4 * 1024 * 1024)
+
+#define AHCI_DEF_SECTOR_SIZE 512
+
+/* Commands not completed within AHCI_TIMEOUT reset the port (in us) */
+#define AHCI_TIMEOUT 10000000
+
+/* Requests interrupted by a port reset are reissued AHCI_RETRIES times */
+#define AHCI_RETRIES 2
+
+/* Port registers window, port n registers start at word AHCI_PORT(n) */
+#define AHCI_REGS_SIZE 0x1100
+#define AHCI_PORT(n) (0x40 + 0x20 * (n))
+
+
+/* Generic host control registers (32-bit word offsets) */
+enum { ahci_cap = 0, ahci_ghc, ahci_is, ahci_pi, ahci_vs, ahci_ccc_ctl, ahci_ccc_ports,
+	ahci_em_loc, ahci_em_ctl, ahci_cap2, ahci_bohc };
+
+/* Port registers (32-bit word offsets from AHCI_PORT(n)) */
+enum { ahci_pxclb = 0, ahci_pxclbu, ahci_pxfb, ahci_pxfbu, ahci_pxis, ahci_pxie, ahci_pxcmd,
+	ahci_pxtfd = 8, ahci_pxsig, ahci_pxssts, ahci_pxsctl, ahci_pxserr, ahci_pxsact, ahci_pxci,
+	ahci_pxsntf, ahci_pxfbs };
+
+/* CAP bits */
+enum { AHCI_CAP_S64A = 1u << 31, AHCI_CAP_SNCQ = 1 << 30, AHCI_CAP_SSS = 1 << 27 };
+
+/* GHC bits */
+enum { AHCI_GHC_AE = 1u << 31, AHCI_GHC_IE = 1 << 1, AHCI_GHC_HR = 1 };
+
+/* PxCMD bits */
+enum { AHCI_PXCMD_ST = 1, AHCI_PXCMD_SUD = 1 << 1, AHCI_PXCMD_POD = 1 << 2, AHCI_PXCMD_FRE = 1 << 4,
+	AHCI_PXCMD_FR = 1 << 14, AHCI_PXCMD_CR = 1 << 15 };
+
+/* PxIS and PxIE bits */
+enum { AHCI_PXIS_DHRS = 1, AHCI_PXIS_PSS = 1 << 1, AHCI_PXIS_DSS = 1 << 2, AHCI_PXIS_SDBS = 1 << 3,
+	AHCI_PXIS_UFS = 1 << 4, AHCI_PXIS_DPS = 1 << 5, AHCI_PXIS_PCS = 1 << 6, AHCI_PXIS_PRCS = 1 << 22,
+	AHCI_PXIS_OFS = 1 << 24, AHCI_PXIS_INFS = 1 << 26, AHCI_PXIS_IFS = 1 << 27, AHCI_PXIS_HBDS = 1 << 28,
+	AHCI_PXIS_HBFS = 1 << 29, AHCI_PXIS_TFES = 1 << 30 };
+
+/* Interrupts requiring a port reset */
+#define AHCI_PXIS_ERR (AHCI_PXIS_TFES | AHCI_PXIS_HBFS | AHCI_PXIS_HBDS | AHCI_PXIS_IFS | AHCI_PXIS_OFS | AHCI_PXIS_UFS)
+
+/* PxTFD status bits */
+enum { AHCI_TFD_BSY = 0x80, AHCI_TFD_DRQ = 0x08, AHCI_TFD_ERR = 0x01 };
+
+/* PxSSTS device detection, PxSCTL device initialization */
+enum { AHCI_SSTS_DET_MASK = 0xf, AHCI_SSTS_DET_PHY = 3, AHCI_SCTL_DET_MASK = 0xf, AHCI_SCTL_DET_INIT = 1 };
+
+/* PxSIG of an ATA drive */
+#define AHCI_SIG_ATA 0x00000101
+
+/* Command header flags */
+enum { AHCI_CMD_CFL = 5, AHCI_CMD_WRITE = 1 << 6, AHCI_CMD_PRDTL_SHIFT = 16 };
+
+/* Register Host to Device FIS */
+enum { AHCI_FIS_H2D = 0x27, AHCI_FIS_CMD = 0x80, AHCI_FIS_LBA = 0x40 };
+
+/* ATA commands */
+enum { AHCI_ATA_READ_DMA = 0xC8, AHCI_ATA_READ_DMA_EXT = 0x25, AHCI_ATA_WRITE_DMA = 0xCA,
+	AHCI_ATA_WRITE_DMA_EXT = 0x35, AHCI_ATA_READ_FPDMA = 0x60, AHCI_ATA_WRITE_FPDMA = 0x61,
+	AHCI_ATA_READ_LOG_EXT = 0x2F, AHCI_ATA_IDENTIFY = 0xEC };
+
+/* NCQ command error log page, NQ - error not related to a queued command */
+enum { AHCI_LOG_NCQ_ERR = 0x10, AHCI_LOG_NQ = 0x80, AHCI_LOG_TAG_MASK = 0x1f };
+
+/* IDENTIFY data bits */
+enum { AHCI_INFO_LBA48 = 0x400, AHCI_INFO_NCQ = 0x100, AHCI_INFO_QDEPTH_MASK = 0x1f,
+	AHCI_INFO_SECTOR_MASK = 0xd000, AHCI_INFO_SECTOR_LARGE = 0x5000 };
+
+// Directions:
+enum { AHCI_READ = 0x00, AHCI_WRITE = 0x01 };
+
+
+typedef struct {
+	uint32_t flags;             /* CFL, W, PRDTL */
+	uint32_t prdbc;             /* bytes transferred */
+	uint32_t ctba;
+	uint32_t ctbau;
+	uint32_t reserved[4];
+} ahci_cmdhdr_t;
+
+
+typedef struct {
+	uint32_t dba;
+	uint32_t dbau;
+	uint32_t reserved;
+	uint32_t dbc;               /* byte count - 1 */
+} ahci_prd_t;
+
+
+typedef struct {
+	uint8_t cfis[64];
+	uint8_t acmd[16];
+	uint8_t reserved[48];
+	ahci_prd_t prdt[AHCI_PRDT_ENTRIES];
+} ahci_cmdtbl_t;
+
+
+typedef struct _ahci_req_t {
+	struct _ahci_req_t *next;
+
+	uint8_t direction;
+	uint8_t retries;
+	uint64_t lba;
+	uint32_t numsects;          /* sectors left */
+	uint32_t cursects;          /* sectors of the issued command */
+	char *buff;
+
+	size_t done;                /* bytes transferred */
+	int err;
+	uint64_t issued;
+} ahci_req_t;
+
+
+typedef struct _ahci_port_t {
+	struct _ahci_hba_t *hba;
+	volatile uint32_t *regs;
+	unsigned int index;
+
+	uint8_t ncq;                /* READ/WRITE FPDMA QUEUED used */
+	uint8_t lba48;
+	unsigned int depth;         /* command slots used */
+
+	uint64_t size;              /* in sectors */
+	uint32_t sector_size;
+	atainfo_t info;
+
+	volatile ahci_cmdhdr_t *clist;
+	volatile uint8_t *fis;
+	volatile uint8_t *scratch;  /* IDENTIFY data */
+	volatile ahci_cmdtbl_t *tables;
+
+	uint32_t busy;              /* slots with an issued command */
+	volatile uint32_t is;       /* interrupt status collected by ahci_isr() */
+	ahci_req_t *slot[AHCI_MAX_SLOTS];
+	ahci_req_t *pending, *tail; /* FIFO of requests waiting for a slot */
+
+	uint8_t offline;            /* drive didn't come back after a reset */
+	uint32_t resets;
+} ahci_port_t;
+
+
+typedef struct _ahci_hba_t {
+	volatile uint32_t *regs;
+	uint32_t cap;
+	unsigned int nslots;
+	unsigned int nports;        /* ports with an ATA drive */
+	ahci_port_t *ports[AHCI_MAX_PORTS];
+} ahci_hba_t;
+
+
+#ifndef AHCI_MOCK
+
+static inline uint32_t ahci_read(volatile uint32_t *base, unsigned int reg)
+{
+	return *(base + reg);
+}
+
+
+static inline void ahci_write(volatile uint32_t *base, unsigned int reg, uint32_t val)
+{
+	*(base + reg) = val;
+}
+
+#else
+
+/* Register accesses are emulated by the host tests */
+uint32_t ahci_read(volatile uint32_t *base, unsigned int reg);
+void ahci_write(volatile uint32_t *base, unsigned int reg, uint32_t val);
+
+#endif
+
+
+/* Uncached, page aligned memory for command lists and tables, provided by the platform */
+void *ahci_dma_alloc(size_t size);
+void ahci_dma_free(void *va, size_t size);
+uint64_t ahci_dma_addr(void *va);
+
+
+/*
+ * The functions below are not thread safe, the caller serializes them
+ * except for ahci_isr() which may run concurrently with the others
+ */
+
+/* Resets the HBA, starts ports and identifies drives, returns number of drives */
+int ahci_hba_init(ahci_hba_t *hba, volatile uint32_t *regs);
+
+/* Enables HBA interrupts, to be called once the interrupt handler is registered */
+void ahci_hba_enable(ahci_hba_t *hba);
+
+/* Interrupt handler, returns -1 if the HBA didn't request the interrupt */
+int ahci_isr(ahci_hba_t *hba);
+
+/* Queues a request (direction, lba, numsects and buff set), now is current time in us */
+int ahci_submit(ahci_port_t *port, ahci_req_t *req, uint64_t now);
+
+/* Reaps completed commands, handles errors and timeouts and issues queued requests,
+ * returns list of finished requests (req->err set on failure) */
+ahci_req_t *ahci_complete(ahci_hba_t *hba, uint64_t now);
+
+#endif
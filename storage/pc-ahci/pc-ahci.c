@@ -0,0 +1,351 @@
+/*
+ * Phoenix-RTOS
+ *
+ * AHCI SATA controller driver
+ *
+ * Copyright 2019 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/threads.h>
+#include <sys/msg.h>
+#include <sys/mman.h>
+#include <sys/interrupt.h>
+#include <sys/platform.h>
+
+#include "pc-ahci.h"
+
+
+typedef struct {
+	ahci_req_t req;
+
+	msg_t msg;
+	unsigned int rid;
+	char *buff;
+	size_t len;
+	char *bounce;               /* word aligned copy of an odd addressed buffer */
+} ahci_msgreq_t;
+
+
+static pci_id_t ahci_pci_tbl[] = {
+	{ PCI_ANY, PCI_ANY, PCI_ANY, PCI_ANY, 0x0106 },
+	{ 0, }
+};
+
+
+struct {
+	ahci_ctrl_t ctrls[AHCI_MAX_HBAS];
+	unsigned int nctrls;
+	uint32_t port;
+} ahci_common;
+
+
+void *ahci_dma_alloc(size_t size)
+{
+	void *va;
+
+	if ((va = mmap(NULL, (size + SIZE_PAGE - 1) & ~(SIZE_PAGE - 1), PROT_READ | PROT_WRITE, MAP_UNCACHED, OID_NULL, 0)) == MAP_FAILED)
+		return NULL;
+
+	return va;
+}
+
+
+void ahci_dma_free(void *va, size_t size)
+{
+	munmap(va, (size + SIZE_PAGE - 1) & ~(SIZE_PAGE - 1));
+}
+
+
+uint64_t ahci_dma_addr(void *va)
+{
+	return va2pa(va);
+}
+
+
+static int ahci_interrupt(unsigned int irq, void *arg)
+{
+	ahci_ctrl_t *ctrl = (ahci_ctrl_t *)arg;
+
+	return ahci_isr(&ctrl->hba);
+}
+
+
+static void ahci_respond(ahci_msgreq_t *r)
+{
+	if (r->req.err < 0) {
+		r->msg.o.io.err = r->req.err;
+	}
+	else {
+		if (r->bounce != NULL && r->req.direction == AHCI_READ)
+			memcpy(r->buff, r->bounce, r->len);
+		r->msg.o.io.err = r->len;
+	}
+
+	msgRespond(ahci_common.port, &r->msg, r->rid);
+
+	free(r->bounce);
+	free(r);
+}
+
+
+/* Completes requests, woken up by the interrupt */
+static void ahci_thread(void *arg)
+{
+	ahci_ctrl_t *ctrl = (ahci_ctrl_t *)arg;
+	ahci_req_t *done, *req;
+	time_t now;
+
+	mutexLock(ctrl->lock);
+
+	for (;;) {
+		condWait(ctrl->cond, ctrl->lock, AHCI_POLL);
+
+		gettime(&now, NULL);
+
+		if ((done = ahci_complete(&ctrl->hba, now)) == NULL)
+			continue;
+
+		mutexUnlock(ctrl->lock);
+
+		while ((req = done) != NULL) {
+			done = req->next;
+			ahci_respond((ahci_msgreq_t *)req);
+		}
+
+		mutexLock(ctrl->lock);
+	}
+}
+
+
+static int ahci_queue(ahci_ctrl_t *ctrl, ahci_port_t *ap, msg_t *msg, unsigned int rid, uint8_t direction, offs_t offs, char *buff, size_t len)
+{
+	ahci_msgreq_t *r;
+	time_t now;
+	int err;
+
+	if (((uint64_t)offs % ap->sector_size) || (len % ap->sector_size) || (uint64_t)offs / ap->sector_size + len / ap->sector_size > ap->size)
+		return -EINVAL;
+
+	if ((r = malloc(sizeof(*r))) == NULL)
+		return -ENOMEM;
+
+	memcpy(&r->msg, msg, sizeof(*msg));
+	r->rid = rid;
+	r->buff = buff;
+	r->len = len;
+	r->bounce = NULL;
+
+	/* Busmaster transfers words */
+	if ((uintptr_t)buff & 1) {
+		if ((r->bounce = malloc(len)) == NULL) {
+			free(r);
+			return -ENOMEM;
+		}
+
+		if (direction == AHCI_WRITE)
+			memcpy(r->bounce, buff, len);
+		buff = r->bounce;
+	}
+
+	r->req.direction = direction;
+	r->req.lba = (uint64_t)offs / ap->sector_size;
+	r->req.numsects = len / ap->sector_size;
+	r->req.buff = buff;
+
+	gettime(&now, NULL);
+
+	mutexLock(ctrl->lock);
+	err = ahci_submit(ap, &r->req, now);
+	mutexUnlock(ctrl->lock);
+
+	if (err < 0) {
+		free(r->bounce);
+		free(r);
+	}
+
+	return err;
+}
+
+
+static int ahci_init_one(ahci_ctrl_t *ctrl)
+{
+	uint32_t base = ctrl->dev.resources[5].base, offs = base & (SIZE_PAGE - 1);
+	size_t size = (offs + AHCI_REGS_SIZE + SIZE_PAGE - 1) & ~(SIZE_PAGE - 1);
+	ahci_port_t *ap;
+	void *va;
+	int i, n;
+
+	/* ABAR */
+	if (!base)
+		return -ENODEV;
+
+	if ((va = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_DEVICE | MAP_UNCACHED, OID_PHYSMEM, base - offs)) == MAP_FAILED)
+		return -ENOMEM;
+
+	if ((n = ahci_hba_init(&ctrl->hba, (volatile uint32_t *)((char *)va + offs))) <= 0) {
+		munmap(va, size);
+		return -ENODEV;
+	}
+
+	mutexCreate(&ctrl->lock);
+	condCreate(&ctrl->cond);
+
+	/* MSI is not configurable through platformctl, the legacy interrupt line is used */
+	if (interrupt(ctrl->dev.irq, ahci_interrupt, ctrl, ctrl->cond, &ctrl->inth) < 0) {
+		printf("ahci: Can't register interrupt %u\n", ctrl->dev.irq);
+		return -EIO;
+	}
+
+	ahci_hba_enable(&ctrl->hba);
+
+	for (i = 0; i < AHCI_MAX_PORTS; i++) {
+		if ((ap = ctrl->hba.ports[i]) == NULL)
+			continue;
+
+		printf("ahci: %u:%d %llu sectors of %u bytes, %s, queue depth %u\n", (unsigned int)(ctrl - ahci_common.ctrls), i,
+			(unsigned long long)ap->size, ap->sector_size, ap->ncq ? "NCQ" : ap->lba48 ? "LBA48" : "LBA28", ap->depth);
+	}
+
+	return beginthread(ahci_thread, 4, ctrl->stack, sizeof(ctrl->stack), ctrl);
+}
+
+
+static int ahci_generic_init(void)
+{
+	platformctl_t pctl;
+	ahci_ctrl_t *ctrl;
+	unsigned int i;
+
+	pctl.action = pctl_get;
+	pctl.type = pctl_pci;
+
+	ahci_common.nctrls = 0;
+
+	for (i = 0; ahci_pci_tbl[i].cl != 0 && ahci_common.nctrls < AHCI_MAX_HBAS; i++) {
+		pctl.pci.id = ahci_pci_tbl[i];
+		memset(&pctl.pci.dev, 0, sizeof(pctl.pci.dev));
+
+		/* Bus is searched from the given function on, continue after the one found */
+		while (ahci_common.nctrls < AHCI_MAX_HBAS && platformctl(&pctl) == EOK) {
+			ctrl = &ahci_common.ctrls[ahci_common.nctrls];
+			ctrl->dev = pctl.pci.dev;
+
+			printf("ahci :%2u:%2u:%2u-->%6u,%6u-->%3u,%3u \n", ctrl->dev.b, ctrl->dev.d, ctrl->dev.f,
+				ctrl->dev.device & 0xFFFF, ctrl->dev.vendor & 0xFFFF, (ctrl->dev.cl >> 8) & 0xFF, ctrl->dev.cl & 0xFF);
+
+			if (ahci_init_one(ctrl) >= 0)
+				ahci_common.nctrls++;
+
+			if (++pctl.pci.dev.f == 8) {
+				pctl.pci.dev.f = 0;
+				if (++pctl.pci.dev.d == 32) {
+					pctl.pci.dev.d = 0;
+					if (pctl.pci.dev.b++ == 255)
+						break;
+				}
+			}
+		}
+	}
+
+	if (!ahci_common.nctrls) {
+		printf("ahci: no devices found\n");
+		return -ENOENT;
+	}
+
+	return ahci_common.nctrls;
+}
+
+
+static void ahci_run(void)
+{
+	msg_t msg;
+	ahci_msg_t *amsg;
+	ahci_ctrl_t *ctrl;
+	ahci_port_t *ap;
+	unsigned int rid;
+	uint8_t direction;
+	size_t len;
+	char *buff;
+	int err;
+
+	for (;;) {
+		if (msgRecv(ahci_common.port, &msg, &rid) < 0)
+			continue;
+
+		amsg = msg.i.data;
+
+		switch (msg.type) {
+			case mtRead:
+			case mtWrite:
+				if (amsg == NULL || msg.i.size < sizeof(ahci_msg_t) || amsg->bus >= ahci_common.nctrls ||
+					amsg->channel >= AHCI_MAX_PORTS || amsg->device != 0) {
+					err = -EINVAL;
+					break;
+				}
+
+				ctrl = &ahci_common.ctrls[amsg->bus];
+
+				if ((ap = ctrl->hba.ports[amsg->channel]) == NULL) {
+					err = -ENOENT;
+					break;
+				}
+
+				if (msg.type == mtRead) {
+					direction = AHCI_READ;
+					buff = msg.o.data;
+					len = msg.o.size;
+				}
+				else {
+					direction = AHCI_WRITE;
+					buff = amsg->data;
+					len = amsg->len;
+				}
+
+				/* Queued requests are answered by the completion threads */
+				if ((err = len ? ahci_queue(ctrl, ap, &msg, rid, direction, amsg->offset, buff, len) : 0) == EOK && len)
+					continue;
+				break;
+
+			default:
+				err = -EINVAL;
+				break;
+		}
+
+		msg.o.io.err = err;
+		msgRespond(ahci_common.port, &msg, rid);
+	}
+}
+
+
+int main(int argc, char **argv)
+{
+	oid_t toid;
+
+	printf("ahci: Initializing\n");
+
+	/* Completion threads answer requests, so the port has to exist before controllers are initialized */
+	portCreate(&ahci_common.port);
+
+	if (ahci_generic_init() < 0)
+		return -1;
+
+	if (portRegister(ahci_common.port, "/dev/ahci", &toid) < 0) {
+		printf("ahci: Can't register port %d\n", ahci_common.port);
+		return -1;
+	}
+
+	ahci_run();
+
+	return 0;
+}
@@ -0,0 +1,55 @@
+/*
+ * Phoenix-RTOS
+ *
+ * AHCI SATA controller driver
+ *
+ * Copyright 2019 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _DEV_PC_AHCI_H_
+#define _DEV_PC_AHCI_H_
+
+#include <stdint.h>
+#include <sys/threads.h>
+#include <sys/msg.h>
+
+#include <phoenix/arch/ia32.h>
+
+#include "ahci.h"
+
+#define AHCI_MAX_HBAS 4
+
+/* Completion thread wakes up at least every AHCI_POLL to check command timeouts (in us) */
+#define AHCI_POLL 100000
+
+
+typedef struct {
+	ahci_hba_t hba;
+	pci_device_t dev;
+
+	/* Serializes the HBA core, taken by the server and completion threads */
+	handle_t lock;
+	handle_t cond;
+	handle_t inth;
+	char stack[4096] __attribute__((aligned(8)));
+} ahci_ctrl_t;
+
+
+/*
+ * mtRead/mtWrite message, same layout as ata_msg_t, result in msg.o.io.err
+ * bus - HBA, channel - port, device - has to be 0 (port multipliers are not supported)
+ */
+typedef struct _ahci_msg_t {
+	uint16_t bus;
+	uint16_t channel;
+	uint16_t device;
+	offs_t offset;
+	uint16_t len;
+	char data[];
+} __attribute__((packed)) ahci_msg_t;
+
+#endif
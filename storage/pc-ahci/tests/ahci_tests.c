@@ -0,0 +1,773 @@
+/*
+ * Phoenix-RTOS
+ *
+ * pc-ahci host tests
+ *
+ * Drives the AHCI core against an emulated HBA register file: port enumeration,
+ * PRDT scatter-gather, NCQ with out of order completion, error recovery and timeouts
+ *
+ * Copyright 2019 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#define EOK 0
+#define AHCI_MOCK
+#include "../ahci.c"
+
+
+#define MOCK_PORTS   3
+#define MOCK_SECTORS 8192
+#define MOCK_PAGES   16384
+#define MOCK_PA_BASE 0x100000000ULL
+
+#define MOCK_TFD_IDLE 0x50
+#define MOCK_SSTS_UP  0x113
+
+
+static uint32_t mock_regs[AHCI_REGS_SIZE / 4];
+
+static struct {
+	uint8_t present;
+	uint8_t ncq;
+	uint8_t *disk;
+
+	uint32_t inflight;     /* queued commands waiting for mock_finish() */
+	uint32_t maxinflight;
+	uint8_t error;         /* NCQ error state, cleared by the error log or COMRESET */
+	uint8_t errtag;
+	int64_t fail_lba;      /* commands covering it fail */
+	int hang;              /* commands issued while set never complete */
+
+	unsigned int cmds;
+	unsigned int comresets;
+} mock_drive[MOCK_PORTS];
+
+static uintptr_t mock_pages[MOCK_PAGES];
+static unsigned int mock_npages;
+
+static int mock_errors;
+
+
+#define mock_check(cond, ...) \
+	do { \
+		if (!(cond)) { \
+			printf(__VA_ARGS__); \
+			mock_errors++; \
+		} \
+	} while (0)
+
+
+/* Fake physical addresses, above 4 GiB to exercise the upper address registers */
+
+static uint64_t mock_map(void *va)
+{
+	uintptr_t page = (uintptr_t)va & ~(uintptr_t)(AHCI_PAGE_SIZE - 1);
+	unsigned int i;
+
+	for (i = 0; i < mock_npages; i++) {
+		if (mock_pages[i] == page)
+			break;
+	}
+
+	if (i == mock_npages) {
+		if (mock_npages == MOCK_PAGES) {
+			printf("mock: out of pages\n");
+			exit(1);
+		}
+		mock_pages[mock_npages++] = page;
+	}
+
+	return MOCK_PA_BASE + ((uint64_t)i * AHCI_PAGE_SIZE) + ((uintptr_t)va & (AHCI_PAGE_SIZE - 1));
+}
+
+
+/* Maps buffer pages in order (physically contiguous) or in random order */
+static void mock_map_buffer(char *buff, size_t len, int shuffle)
+{
+	uintptr_t page = (uintptr_t)buff & ~(uintptr_t)(AHCI_PAGE_SIZE - 1), end = (uintptr_t)buff + len;
+	unsigned int n = (end - page + AHCI_PAGE_SIZE - 1) / AHCI_PAGE_SIZE, i, j;
+	uintptr_t *pages = malloc(n * sizeof(*pages)), t;
+
+	for (i = 0; i < n; i++)
+		pages[i] = page + i * AHCI_PAGE_SIZE;
+
+	for (i = 0; shuffle && i < n; i++) {
+		j = rand() % n;
+		t = pages[i];
+		pages[i] = pages[j];
+		pages[j] = t;
+	}
+
+	for (i = 0; i < n; i++)
+		mock_map((void *)pages[i]);
+
+	free(pages);
+}
+
+
+static void *mock_va(uint64_t pa)
+{
+	uint64_t i = (pa - MOCK_PA_BASE) / AHCI_PAGE_SIZE;
+
+	if (pa < MOCK_PA_BASE || i >= mock_npages) {
+		printf("mock: invalid address %llx\n", (unsigned long long)pa);
+		exit(1);
+	}
+
+	return (void *)(mock_pages[i] + (pa & (AHCI_PAGE_SIZE - 1)));
+}
+
+
+/* Copies between a PRD region and drive memory, page by page */
+static void mock_dma(uint64_t pa, uint8_t *mem, size_t len, int write)
+{
+	size_t chunk;
+
+	while (len) {
+		chunk = AHCI_PAGE_SIZE - (pa & (AHCI_PAGE_SIZE - 1));
+		if (chunk > len)
+			chunk = len;
+
+		if (write)
+			memcpy(mem, mock_va(pa), chunk);
+		else
+			memcpy(mock_va(pa), mem, chunk);
+
+		pa += chunk;
+		mem += chunk;
+		len -= chunk;
+	}
+}
+
+
+void *ahci_dma_alloc(size_t size)
+{
+	void *va;
+
+	size = (size + AHCI_PAGE_SIZE - 1) & ~(AHCI_PAGE_SIZE - 1);
+
+	if (posix_memalign(&va, AHCI_PAGE_SIZE, size))
+		return NULL;
+
+	mock_map_buffer(va, size, 0);
+
+	return va;
+}
+
+
+void ahci_dma_free(void *va, size_t size)
+{
+	free(va);
+}
+
+
+uint64_t ahci_dma_addr(void *va)
+{
+	return mock_map(va);
+}
+
+
+static void mock_irq(unsigned int n, uint32_t is)
+{
+	volatile uint32_t *regs = mock_regs + AHCI_PORT(n);
+
+	regs[ahci_pxis] |= is;
+
+	if (regs[ahci_pxie] & is)
+		mock_regs[ahci_is] |= 1u << n;
+}
+
+
+static void mock_hba_reset(void)
+{
+	unsigned int n;
+
+	for (n = 0; n < MOCK_PORTS; n++) {
+		memset(mock_regs + AHCI_PORT(n), 0, 0x80);
+		mock_drive[n].inflight = 0;
+		mock_drive[n].error = 0;
+	}
+
+	mock_regs[ahci_ghc] = 0;
+	mock_regs[ahci_is] = 0;
+}
+
+
+/* Link comes up, the drive sends its signature */
+static void mock_link(unsigned int n)
+{
+	volatile uint32_t *regs = mock_regs + AHCI_PORT(n);
+
+	if (!mock_drive[n].present)
+		return;
+
+	regs[ahci_pxssts] = MOCK_SSTS_UP;
+	regs[ahci_pxsig] = AHCI_SIG_ATA;
+	regs[ahci_pxtfd] = MOCK_TFD_IDLE;
+}
+
+
+static void mock_identify(unsigned int n, atainfo_t *info)
+{
+	memset(info, 0, sizeof(*info));
+	info->commands2_sup = AHCI_INFO_LBA48;
+	info->lba48_totalsectors = MOCK_SECTORS;
+	info->lba28_totalsectors = MOCK_SECTORS;
+
+	if (mock_drive[n].ncq) {
+		info->sata_capabilities = AHCI_INFO_NCQ;
+		info->queue_depth = 31;
+	}
+}
+
+
+static void mock_fail(unsigned int n, unsigned int slot)
+{
+	mock_regs[AHCI_PORT(n) + ahci_pxtfd] = MOCK_TFD_IDLE | AHCI_TFD_ERR;
+	mock_drive[n].error = 1;
+	mock_drive[n].errtag = slot;
+	mock_irq(n, AHCI_PXIS_TFES);
+}
+
+
+static void mock_exec(unsigned int n, unsigned int slot)
+{
+	volatile uint32_t *regs = mock_regs + AHCI_PORT(n);
+	ahci_cmdhdr_t *hdr = (ahci_cmdhdr_t *)mock_va(regs[ahci_pxclb] | ((uint64_t)regs[ahci_pxclbu] << 32)) + slot;
+	ahci_cmdtbl_t *tbl = mock_va(hdr->ctba | ((uint64_t)hdr->ctbau << 32));
+	unsigned int nprd = hdr->flags >> AHCI_CMD_PRDTL_SHIFT, i, count;
+	uint8_t *fis = tbl->cfis, page[AHCI_DEF_SECTOR_SIZE];
+	uint64_t lba, pa;
+	size_t len, total = 0;
+	int write = (hdr->flags & AHCI_CMD_WRITE) != 0, ncq = 0;
+
+	mock_drive[n].cmds++;
+
+	mock_check(fis[0] == AHCI_FIS_H2D && (fis[1] & AHCI_FIS_CMD) && (hdr->flags & 0x1f) == AHCI_CMD_CFL, "mock: port %u slot %u invalid FIS\n", n, slot);
+	mock_check(nprd > 0 && nprd <= AHCI_PRDT_ENTRIES, "mock: port %u slot %u invalid PRDTL %u\n", n, slot, nprd);
+
+	lba = fis[4] | (fis[5] << 8) | (fis[6] << 16) | ((uint64_t)fis[8] << 24) | ((uint64_t)fis[9] << 32) | ((uint64_t)fis[10] << 40);
+
+	for (i = 0; i < nprd; i++) {
+		mock_check(!(tbl->prdt[i].dba & 1) && (tbl->prdt[i].dbc & 1) && tbl->prdt[i].dbc < AHCI_PRD_BYTES, "mock: invalid PRD %u\n", i);
+		total += (tbl->prdt[i].dbc & 0x3fffff) + 1;
+	}
+
+	switch (fis[2]) {
+		case AHCI_ATA_IDENTIFY:
+			mock_identify(n, (atainfo_t *)page);
+			mock_dma(tbl->prdt[0].dba | ((uint64_t)tbl->prdt[0].dbau << 32), page, sizeof(page), 0);
+			regs[ahci_pxci] &= ~(1u << slot);
+			mock_irq(n, AHCI_PXIS_PSS);
+			return;
+
+		case AHCI_ATA_READ_LOG_EXT:
+			mock_check(fis[4] == AHCI_LOG_NCQ_ERR && fis[12] == 1, "mock: invalid READ LOG EXT\n");
+			memset(page, 0, sizeof(page));
+			page[0] = mock_drive[n].error ? mock_drive[n].errtag : AHCI_LOG_NQ;
+			mock_drive[n].error = 0;
+			regs[ahci_pxtfd] = MOCK_TFD_IDLE;
+			mock_dma(tbl->prdt[0].dba | ((uint64_t)tbl->prdt[0].dbau << 32), page, sizeof(page), 0);
+			regs[ahci_pxci] &= ~(1u << slot);
+			mock_irq(n, AHCI_PXIS_PSS);
+			return;
+
+		case AHCI_ATA_READ_FPDMA:
+		case AHCI_ATA_WRITE_FPDMA:
+			ncq = 1;
+			count = fis[3] | (fis[11] << 8);
+			mock_check(mock_drive[n].ncq, "mock: port %u NCQ command to non NCQ drive\n", n);
+			mock_check((fis[12] >> 3) == slot && (regs[ahci_pxsact] & (1u << slot)), "mock: port %u invalid tag %u\n", n, slot);
+			mock_check(write == (fis[2] == AHCI_ATA_WRITE_FPDMA), "mock: direction mismatch\n");
+			break;
+
+		case AHCI_ATA_READ_DMA_EXT:
+		case AHCI_ATA_WRITE_DMA_EXT:
+			count = fis[12] | (fis[13] << 8);
+			mock_check(regs[ahci_pxci] == (1u << slot) && !regs[ahci_pxsact], "mock: port %u non-queued command overlaps others\n", n);
+			mock_check(write == (fis[2] == AHCI_ATA_WRITE_DMA_EXT), "mock: direction mismatch\n");
+			break;
+
+		default:
+			mock_check(0, "mock: unexpected command %02x\n", fis[2]);
+			return;
+	}
+
+	if (!count)
+		count = 65536;
+
+	mock_check(total == (size_t)count * AHCI_DEF_SECTOR_SIZE, "mock: PRDT covers %zu bytes, %u sectors requested\n", total, count);
+	mock_check(lba + count <= MOCK_SECTORS, "mock: access beyond the disk\n");
+
+	if (mock_drive[n].hang)
+		return;
+
+	if (mock_drive[n].error || (mock_drive[n].fail_lba >= (int64_t)lba && mock_drive[n].fail_lba < (int64_t)(lba + count))) {
+		if (!mock_drive[n].error)
+			mock_fail(n, slot);
+		else
+			mock_irq(n, AHCI_PXIS_TFES);
+		return;
+	}
+
+	for (i = 0, len = 0; i < nprd; i++) {
+		pa = tbl->prdt[i].dba | ((uint64_t)tbl->prdt[i].dbau << 32);
+		mock_dma(pa, mock_drive[n].disk + lba * AHCI_DEF_SECTOR_SIZE + len, (tbl->prdt[i].dbc & 0x3fffff) + 1, write);
+		len += (tbl->prdt[i].dbc & 0x3fffff) + 1;
+	}
+
+	/* Queued commands are accepted at once and complete on mock_finish() */
+	regs[ahci_pxci] &= ~(1u << slot);
+
+	if (ncq) {
+		mock_drive[n].inflight |= 1u << slot;
+		if (__builtin_popcount(mock_drive[n].inflight) > mock_drive[n].maxinflight)
+			mock_drive[n].maxinflight = __builtin_popcount(mock_drive[n].inflight);
+	}
+	else {
+		hdr->prdbc = total;
+		mock_irq(n, AHCI_PXIS_DHRS);
+	}
+}
+
+
+static void mock_finish(unsigned int n, uint32_t mask)
+{
+	mask &= mock_drive[n].inflight;
+
+	if (!mask)
+		return;
+
+	mock_drive[n].inflight &= ~mask;
+	mock_regs[AHCI_PORT(n) + ahci_pxsact] &= ~mask;
+	mock_irq(n, AHCI_PXIS_SDBS);
+}
+
+
+uint32_t ahci_read(volatile uint32_t *base, unsigned int reg)
+{
+	return *(base + reg);
+}
+
+
+void ahci_write(volatile uint32_t *base, unsigned int reg, uint32_t val)
+{
+	unsigned int r = (base - mock_regs) + reg, n, i;
+	volatile uint32_t *regs;
+	uint32_t prev;
+
+	if (r < AHCI_PORT(0)) {
+		if (r == ahci_ghc && (val & AHCI_GHC_HR))
+			mock_hba_reset();
+		else if (r == ahci_is)
+			mock_regs[r] &= ~val;
+		else if (r != ahci_cap && r != ahci_pi)
+			mock_regs[r] = val;
+		return;
+	}
+
+	n = (r - AHCI_PORT(0)) / 0x20;
+	regs = mock_regs + AHCI_PORT(n);
+	prev = regs[r - AHCI_PORT(n)];
+
+	switch (r - AHCI_PORT(n)) {
+		case ahci_pxis:
+		case ahci_pxserr:
+			regs[r - AHCI_PORT(n)] &= ~val;
+			break;
+
+		case ahci_pxcmd:
+			val &= ~(AHCI_PXCMD_CR | AHCI_PXCMD_FR);
+
+			if (val & AHCI_PXCMD_ST) {
+				mock_check(val & AHCI_PXCMD_FRE, "mock: port %u started without FIS receive\n", n);
+				mock_check(!(regs[ahci_pxtfd] & (AHCI_TFD_BSY | AHCI_TFD_DRQ)), "mock: port %u started while busy\n", n);
+				val |= AHCI_PXCMD_CR;
+			}
+			else {
+				/* Stopping the port clears issued commands */
+				regs[ahci_pxci] = 0;
+				regs[ahci_pxsact] = 0;
+				mock_drive[n].inflight = 0;
+			}
+
+			if (val & AHCI_PXCMD_FRE) {
+				mock_check((regs[ahci_pxclb] || regs[ahci_pxclbu]) && (regs[ahci_pxfb] || regs[ahci_pxfbu]), "mock: port %u FIS receive without buffers\n", n);
+				val |= AHCI_PXCMD_FR;
+			}
+
+			if ((val & AHCI_PXCMD_SUD) && !(prev & AHCI_PXCMD_SUD))
+				mock_link(n);
+
+			regs[ahci_pxcmd] = val;
+			break;
+
+		case ahci_pxsctl:
+			regs[ahci_pxsctl] = val;
+
+			if ((val & AHCI_SCTL_DET_MASK) == AHCI_SCTL_DET_INIT) {
+				regs[ahci_pxssts] = 0;
+				regs[ahci_pxtfd] = 0x80;
+			}
+			else if ((prev & AHCI_SCTL_DET_MASK) == AHCI_SCTL_DET_INIT) {
+				mock_drive[n].comresets++;
+				mock_drive[n].error = 0;
+				mock_link(n);
+			}
+			break;
+
+		case ahci_pxsact:
+			mock_check(regs[ahci_pxcmd] & AHCI_PXCMD_ST, "mock: port %u SACT written while stopped\n", n);
+			regs[ahci_pxsact] |= val;
+			break;
+
+		case ahci_pxci:
+			mock_check(regs[ahci_pxcmd] & AHCI_PXCMD_ST, "mock: port %u command issued while stopped\n", n);
+			mock_check(!(regs[ahci_pxci] & val) && !(mock_drive[n].inflight & val), "mock: port %u slot reused while busy\n", n);
+			regs[ahci_pxci] |= val;
+
+			for (i = 0; i < 32; i++) {
+				if (val & (1u << i))
+					mock_exec(n, i);
+			}
+			break;
+
+		default:
+			regs[r - AHCI_PORT(n)] = val;
+			break;
+	}
+}
+
+
+static ahci_hba_t hba;
+static uint64_t now;
+
+
+static void mock_setup(void)
+{
+	unsigned int n;
+
+	memset(mock_regs, 0, sizeof(mock_regs));
+	mock_regs[ahci_cap] = AHCI_CAP_S64A | AHCI_CAP_SNCQ | AHCI_CAP_SSS | (31 << 8) | (MOCK_PORTS - 1);
+	mock_regs[ahci_pi] = (1u << MOCK_PORTS) - 1;
+
+	/* Port 0 - NCQ drive, port 1 - drive without NCQ, port 2 - empty */
+	for (n = 0; n < MOCK_PORTS; n++) {
+		memset(&mock_drive[n], 0, sizeof(mock_drive[n]));
+		mock_drive[n].present = (n < 2);
+		mock_drive[n].ncq = (n == 0);
+		mock_drive[n].fail_lba = -1;
+		mock_drive[n].disk = calloc(MOCK_SECTORS, AHCI_DEF_SECTOR_SIZE);
+
+		/* Left running by firmware */
+		mock_regs[AHCI_PORT(n) + ahci_pxcmd] = AHCI_PXCMD_ST | AHCI_PXCMD_CR | AHCI_PXCMD_FRE | AHCI_PXCMD_FR;
+	}
+}
+
+
+static int test_init(void)
+{
+	ahci_port_t *ap;
+	unsigned int n;
+
+	if (ahci_hba_init(&hba, mock_regs) != 2 || hba.nslots != 32) {
+		printf("init: expected 2 drives and 32 slots, found %u and %u\n", hba.nports, hba.nslots);
+		return -1;
+	}
+
+	ahci_hba_enable(&hba);
+
+	mock_check(hba.ports[2] == NULL, "init: empty port enumerated\n");
+	mock_check(mock_regs[ahci_ghc] & AHCI_GHC_IE, "init: interrupts disabled\n");
+	mock_check(mock_regs[AHCI_PORT(0) + ahci_pxclbu] == (MOCK_PA_BASE >> 32), "init: upper address not set\n");
+
+	for (n = 0; n < 2; n++) {
+		if ((ap = hba.ports[n]) == NULL) {
+			printf("init: port %u not enumerated\n", n);
+			return -1;
+		}
+
+		mock_check(ap->size == MOCK_SECTORS && ap->sector_size == AHCI_DEF_SECTOR_SIZE && ap->lba48, "init: port %u geometry\n", n);
+		mock_check((mock_regs[AHCI_PORT(n) + ahci_pxcmd] & (AHCI_PXCMD_ST | AHCI_PXCMD_FRE)) == (AHCI_PXCMD_ST | AHCI_PXCMD_FRE), "init: port %u not started\n", n);
+	}
+
+	mock_check(hba.ports[0]->ncq && hba.ports[0]->depth == 32, "init: port 0 NCQ depth %u\n", hba.ports[0]->depth);
+	mock_check(!hba.ports[1]->ncq && hba.ports[1]->depth == 1, "init: port 1 queue depth %u\n", hba.ports[1]->depth);
+
+	return mock_errors ? -1 : 0;
+}
+
+
+/* Completes queued commands in random order, collects finished requests */
+static int drain(unsigned int cnt, int *failed)
+{
+	ahci_req_t *done, *req;
+	unsigned int finished = 0, spins, n;
+	uint32_t mask;
+
+	*failed = 0;
+
+	for (spins = 0; finished < cnt; spins++) {
+		if (spins > 100000) {
+			printf("drain: stuck with %u of %u requests finished\n", finished, cnt);
+			return -1;
+		}
+
+		for (n = 0; n < MOCK_PORTS; n++) {
+			if ((mask = mock_drive[n].inflight & (uint32_t)rand()) == 0)
+				mask = mock_drive[n].inflight & -mock_drive[n].inflight;
+
+			/* Let the queue fill up first */
+			if (__builtin_popcount(mock_drive[n].inflight) == 32 || !hba.ports[n] || !hba.ports[n]->pending)
+				mock_finish(n, mask);
+		}
+
+		while (ahci_isr(&hba) == 0)
+			;
+
+		for (done = ahci_complete(&hba, now); (req = done) != NULL; finished++) {
+			done = req->next;
+
+			if (req->err < 0)
+				(*failed)++;
+		}
+	}
+
+	return 0;
+}
+
+
+typedef struct {
+	ahci_req_t req;
+	char *mem;
+	char *buff;
+	uint64_t lba;
+	uint32_t numsects;
+} test_req_t;
+
+
+/* Random requests to disjoint areas, some of them bigger than a single command PRDT */
+static test_req_t *test_reqs(unsigned int cnt, unsigned int maxsects)
+{
+	test_req_t *t = calloc(cnt, sizeof(*t));
+	unsigned int i, span = MOCK_SECTORS / cnt;
+
+	for (i = 0; i < cnt; i++) {
+		t[i].numsects = 1 + rand() % (span < maxsects ? span : maxsects);
+		t[i].lba = (uint64_t)i * span + rand() % (span - t[i].numsects + 1);
+		t[i].mem = malloc(t[i].numsects * AHCI_DEF_SECTOR_SIZE + AHCI_PAGE_SIZE);
+		t[i].buff = t[i].mem + 2 * (rand() % (AHCI_PAGE_SIZE / 2));
+		mock_map_buffer(t[i].buff, t[i].numsects * AHCI_DEF_SECTOR_SIZE, i & 1);
+	}
+
+	return t;
+}
+
+
+static void test_free(test_req_t *t, unsigned int cnt)
+{
+	unsigned int i;
+
+	for (i = 0; i < cnt; i++)
+		free(t[i].mem);
+	free(t);
+
+	/* Pages of freed buffers may be reused */
+	mock_npages = 0;
+	for (i = 0; i < MOCK_PORTS; i++) {
+		if (hba.ports[i] != NULL) {
+			mock_map_buffer((char *)hba.ports[i]->clist, AHCI_PAGE_SIZE, 0);
+			mock_map_buffer((char *)hba.ports[i]->tables, hba.nslots * sizeof(ahci_cmdtbl_t), 0);
+		}
+	}
+}
+
+
+static void test_submit(unsigned int n, test_req_t *t, unsigned int cnt, uint8_t direction)
+{
+	unsigned int i;
+
+	for (i = 0; i < cnt; i++) {
+		t[i].req.direction = direction;
+		t[i].req.lba = t[i].lba;
+		t[i].req.numsects = t[i].numsects;
+		t[i].req.buff = t[i].buff;
+
+		if (ahci_submit(hba.ports[n], &t[i].req, now) < 0)
+			mock_check(0, "submit: port %u request %u rejected\n", n, i);
+	}
+}
+
+
+static int test_io(unsigned int n, unsigned int cnt, unsigned int maxsects)
+{
+	test_req_t *t = test_reqs(cnt, maxsects);
+	unsigned int i, j;
+	int failed;
+
+	for (i = 0; i < cnt; i++) {
+		for (j = 0; j < t[i].numsects * AHCI_DEF_SECTOR_SIZE; j++)
+			t[i].buff[j] = rand();
+	}
+
+	test_submit(n, t, cnt, AHCI_WRITE);
+	if (drain(cnt, &failed) < 0 || failed)
+		mock_check(0, "io: port %u %d writes failed\n", n, failed);
+
+	for (i = 0; i < cnt; i++) {
+		mock_check(t[i].req.done == t[i].numsects * AHCI_DEF_SECTOR_SIZE, "io: port %u write %u incomplete\n", n, i);
+		mock_check(!memcmp(mock_drive[n].disk + t[i].lba * AHCI_DEF_SECTOR_SIZE, t[i].buff, t[i].numsects * AHCI_DEF_SECTOR_SIZE),
+			"io: port %u write %u data mismatch\n", n, i);
+
+		/* Scramble the buffer before reading back */
+		memset(t[i].buff, 0xa5, t[i].numsects * AHCI_DEF_SECTOR_SIZE);
+	}
+
+	test_submit(n, t, cnt, AHCI_READ);
+	if (drain(cnt, &failed) < 0 || failed)
+		mock_check(0, "io: port %u %d reads failed\n", n, failed);
+
+	for (i = 0; i < cnt; i++) {
+		mock_check(!memcmp(mock_drive[n].disk + t[i].lba * AHCI_DEF_SECTOR_SIZE, t[i].buff, t[i].numsects * AHCI_DEF_SECTOR_SIZE),
+			"io: port %u read %u data mismatch\n", n, i);
+	}
+
+	mock_check(!hba.ports[n]->busy && !hba.ports[n]->pending, "io: port %u not idle\n", n);
+
+	test_free(t, cnt);
+
+	return mock_errors ? -1 : 0;
+}
+
+
+static int test_ncq(void)
+{
+	mock_drive[0].maxinflight = 0;
+
+	/* More requests than slots, split requests reissued */
+	if (test_io(0, 64, 1024) < 0)
+		return -1;
+
+	if (mock_drive[0].maxinflight != 32) {
+		printf("ncq: at most %u commands queued\n", mock_drive[0].maxinflight);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+static int test_error(void)
+{
+	ahci_port_t *ap = hba.ports[0];
+	test_req_t *t = test_reqs(16, 64);
+	unsigned int i, resets = ap->resets, comresets = mock_drive[0].comresets;
+	int failed;
+
+	/* Media error under request 5, the others complete */
+	mock_drive[0].fail_lba = t[5].lba;
+	test_submit(0, t, 16, AHCI_READ);
+
+	if (drain(16, &failed) < 0 || failed != 1 || t[5].req.err != -EIO) {
+		printf("error: %d requests failed, request 5 result %d\n", failed, t[5].req.err);
+		test_free(t, 16);
+		return -1;
+	}
+
+	for (i = 0; i < 16; i++)
+		mock_check(i == 5 || t[i].req.err == EOK, "error: request %u failed\n", i);
+
+	/* Failed command found in the NCQ error log, no COMRESET needed */
+	mock_check(ap->resets == resets + 1 + AHCI_RETRIES, "error: %u recoveries\n", ap->resets - resets);
+	mock_check(mock_drive[0].comresets == comresets, "error: unexpected COMRESET\n");
+	mock_check(!ap->offline, "error: port offline\n");
+
+	mock_drive[0].fail_lba = -1;
+	test_free(t, 16);
+
+	return mock_errors ? -1 : 0;
+}
+
+
+static int test_timeout(void)
+{
+	ahci_port_t *ap = hba.ports[1];
+	test_req_t *t = test_reqs(2, 16);
+	int failed;
+
+	/* Lost command is retried after the timeout */
+	mock_drive[1].hang = 1;
+	test_submit(1, t, 2, AHCI_WRITE);
+	mock_drive[1].hang = 0;
+
+	if (ap->busy != 1 || ahci_complete(&hba, now) != NULL) {
+		printf("timeout: request completed before the timeout\n");
+		test_free(t, 2);
+		return -1;
+	}
+
+	mock_regs[AHCI_PORT(1) + ahci_pxtfd] |= AHCI_TFD_BSY;
+	now += AHCI_TIMEOUT + 1;
+
+	if (drain(2, &failed) < 0 || failed || t[0].req.retries != 1 || t[1].req.retries != 0) {
+		printf("timeout: %d failed, retries %u %u\n", failed, t[0].req.retries, t[1].req.retries);
+		test_free(t, 2);
+		return -1;
+	}
+
+	mock_check(mock_drive[1].comresets == 1, "timeout: busy drive not reset\n");
+	test_free(t, 2);
+
+	return mock_errors ? -1 : 0;
+}
+
+
+static int test_isr(void)
+{
+	/* Shared interrupt line */
+	mock_regs[ahci_is] = 0;
+
+	if (ahci_isr(&hba) != -1) {
+		printf("isr: interrupt claimed with HBA IS clear\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+	int err = 0;
+
+	srand(argc > 1 ? atoi(argv[1]) : 1);
+
+	mock_setup();
+
+	if (test_init() < 0) {
+		printf("ahci: FAILED\n");
+		return 1;
+	}
+
+	err |= test_isr();
+	err |= test_io(1, 16, 1024);
+	err |= test_ncq();
+	err |= test_error();
+	err |= test_timeout();
+
+	if (err || mock_errors) {
+		printf("ahci: FAILED\n");
+		return 1;
+	}
+
+	printf("ahci: all tests passed\n");
+
+	return 0;
+}
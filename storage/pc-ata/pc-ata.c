@@ -21,8 +21,10 @@
 #include <arch/ia32/io.h>
 #include <sys/threads.h>
 #include <sys/msg.h>
+#include <sys/mman.h>
 #include <sys/interrupt.h>
 #include <sys/platform.h>
+#include <sys/list.h>
 
 #include "pc-ata.h"
 
@@ -36,8 +38,13 @@ static pci_id_t ata_pci_tbl[] = {
 ata_opt_t ata_defaults = {
 	.force = 0,
 	.use_int = 1,
-	.use_dma = 0,
-	.use_multitransfer = 0
+	.use_dma = 1,
+	.use_multitransfer = 0,
+	.write_through = 0,
+	.cache_size = ATA_DEF_CACHE_SIZE,
+	.flush_policy = ata_flush_threshold,
+	.flush_size = ATA_FLUSH_SIZE,
+	.flush_time = ATA_FLUSH_TIME
 };
 
 struct ata_bus buses[8] = {};
@@ -51,6 +58,10 @@ static int ata_interrupt(unsigned int irq, void *dev_instance);
 #define ata_ch_write(ac, reg, data) outb((void *)0 + (ac)->reg_addr[(reg)], (data))
 #define ata_ch_read_buffer(ac, reg, buff, quads) insl((void *)0 + (ac)->reg_addr[(reg)], (buff), (quads))
 
+/* DMA completion is waited for in slices, so a missed wakeup costs one slice at most */
+#define ATA_DMA_WAIT_SLICE 100000
+#define ATA_DMA_WAIT_SLICES 100
+
 static inline void insl(void *addr, void *buffer, uint32_t quads)\
 {
 	int i;
@@ -142,29 +153,30 @@ int ata_wait(struct ata_channel *ac, uint8_t irq)
 }
 
 
-/* TODO: divide to dma_setup, command_setup, pio_access, dma_access */
-
-int ata_access(uint8_t direction, struct ata_dev *ad, uint32_t lba, uint8_t numsects, void *buffer)
+/*
+ * Selects the drive and writes the task file, returns the addressing mode used (0: CHS, 1: LBA28, 2: LBA48).
+ * LBA48 is forced by ext, it's up to the caller to check if it's supported.
+ */
+static int ata_setup(struct ata_dev *ad, uint64_t lba, uint32_t numsects, uint8_t ext)
 {
 	struct ata_channel *ac = ad->ac;
-
-	uint8_t lba_mode = 0; /* 0: CHS, 1:LBA28, 2: LBA48 */
-	uint8_t cmd;
-	uint8_t astatus = 0;
+	uint8_t lba_mode;
 	uint8_t slavebit = ad->drive;
 	uint8_t lba_io[6] = { 0 };
 	uint8_t head, sect;
-	uint16_t bus = ac->base;
-	uint16_t words = 256;
-	uint16_t cyl, i, b;
-
-	int err = 0;
-
-	ata_ch_write(ac, ATA_REG_CONTROL, ac->no_int << 1);
-
-	ata_ch_write(ac, ATA_REG_BMSTATUS, ATA_BMR_STAT_ERR);
-
-	if (ad->info.capabilities_1 & 0x200)  { // Drive supports LBA?
+	uint16_t cyl;
+
+	if (ext || (ad->lba48 && (lba + numsects > 0x10000000 || numsects > ATA_MAX_LBA28_SECTORS))) {
+		/* LBA48 */
+		lba_mode  = 2;
+		lba_io[0] = (lba >> 0) & 0xFF;
+		lba_io[1] = (lba >> 8) & 0xFF;
+		lba_io[2] = (lba >> 16) & 0xFF;
+		lba_io[3] = (lba >> 24) & 0xFF;
+		lba_io[4] = (lba >> 32) & 0xFF;
+		lba_io[5] = (lba >> 40) & 0xFF;
+		head      = 0; // Lower 4-bits of HDDEVSEL are not used here.
+	} else if (ad->info.capabilities_1 & ATA_INFO_CAPABILITIES_1_LBA) {
 		/* LBA28 */
 		lba_mode  = 1;
 		lba_io[0] = (lba & 0x000000FF) >> 0;
@@ -193,12 +205,234 @@ int ata_access(uint8_t direction, struct ata_dev *ad, uint32_t lba, uint8_t nums
 
 	while (ata_ch_read(ac, ATA_REG_STATUS) & (ATA_SR_BSY | ATA_SR_DRQ));
 
-	ata_ch_write(ac, ATA_REG_SECCOUNT0, numsects);
+	/* LBA48 registers are two bytes deep - high order bytes go first */
+	if (lba_mode == 2) {
+		ata_ch_write(ac, ATA_REG_SECCOUNT1, (numsects >> 8) & 0xFF);
+		ata_ch_write(ac, ATA_REG_LBA3, lba_io[3]);
+		ata_ch_write(ac, ATA_REG_LBA4, lba_io[4]);
+		ata_ch_write(ac, ATA_REG_LBA5, lba_io[5]);
+	}
+
+	/* 0 stands for 256 (65536 in LBA48) sectors */
+	ata_ch_write(ac, ATA_REG_SECCOUNT0, numsects & 0xFF);
 	ata_ch_write(ac, ATA_REG_LBA0, lba_io[0]);
 	ata_ch_write(ac, ATA_REG_LBA1, lba_io[1]);
 	ata_ch_write(ac, ATA_REG_LBA2, lba_io[2]);
 
-	cmd = direction ? ATA_CMD_WRITE_PIO : ATA_CMD_READ_PIO;
+	return lba_mode;
+}
+
+
+/*
+ * Fills the channel PRD table with physical regions of the buffer.
+ * Returns number of bytes described (multiple of the sector size), 0 if buffer can't be used for DMA
+ */
+static uint32_t ata_dma_prd(struct ata_dev *ad, void *buffer, uint32_t len)
+{
+	volatile uint32_t *prd = ad->ac->prd;
+	uint32_t pa, chunk, cnt, rem, done = 0;
+	int n = -1;
+
+	/* Busmaster transfers words */
+	if ((uintptr_t)buffer & 1)
+		return 0;
+
+	while (done < len) {
+		chunk = SIZE_PAGE - (((uintptr_t)buffer + done) & (SIZE_PAGE - 1));
+		if (chunk > len - done)
+			chunk = len - done;
+
+		pa = (uint32_t)va2pa(buffer + done);
+
+		/* Merge physically contiguous pages, a region can't cross 64 KiB boundary */
+		if (n >= 0 && prd[2 * n] + prd[2 * n + 1] == pa && (pa & 0xFFFF) != 0) {
+			prd[2 * n + 1] += chunk;
+		} else {
+			if (++n == ATA_PRD_ENTRIES) {
+				n--;
+				break;
+			}
+			prd[2 * n] = pa;
+			prd[2 * n + 1] = chunk;
+		}
+
+		done += chunk;
+	}
+
+	/* Out of PRD entries - transfer whole sectors only */
+	rem = done % ad->sector_size;
+	done -= rem;
+
+	while (rem) {
+		cnt = rem < prd[2 * n + 1] ? rem : prd[2 * n + 1];
+		prd[2 * n + 1] -= cnt;
+		rem -= cnt;
+
+		if (!prd[2 * n + 1])
+			n--;
+	}
+
+	if (n < 0)
+		return 0;
+
+	/* 0 stands for 64 KiB region */
+	for (cnt = 0; cnt <= n; cnt++)
+		prd[2 * cnt + 1] &= 0xFFFF;
+
+	prd[2 * n + 1] |= ATA_PRD_EOT;
+	__sync_synchronize();
+
+	return done;
+}
+
+
+static int ata_dma_wait(struct ata_channel *ac)
+{
+	int i, err = 0;
+
+	mutexLock(ac->irq_spin);
+	for (i = 0; !ac->irq_invoked; i++) {
+		if (i == ATA_DMA_WAIT_SLICES) {
+			err = -ETIME;
+			break;
+		}
+		condWait(ac->waitq, ac->irq_spin, ATA_DMA_WAIT_SLICE);
+	}
+	ac->irq_invoked = 0;
+	mutexUnlock(ac->irq_spin);
+
+	return err;
+}
+
+
+/* Writes the drive cache to the media */
+static int ata_flush(struct ata_dev *ad)
+{
+	struct ata_channel *ac = ad->ac;
+	uint8_t status;
+	int err = 0;
+
+	ata_ch_write(ac, ATA_REG_CONTROL, ac->no_int << 1);
+
+	while (ata_ch_read(ac, ATA_REG_STATUS) & (ATA_SR_BSY | ATA_SR_DRQ));
+	ata_ch_write(ac, ATA_REG_HDDEVSEL, 0xA0 | (ad->drive << 4));
+	while (ata_ch_read(ac, ATA_REG_STATUS) & (ATA_SR_BSY | ATA_SR_DRQ));
+
+	mutexLock(ac->irq_spin);
+	ac->irq_invoked = 0;
+	mutexUnlock(ac->irq_spin);
+
+	ata_ch_write(ac, ATA_REG_COMMAND, ad->lba48 ? ATA_CMD_CACHE_FLUSH_EXT : ATA_CMD_CACHE_FLUSH);
+
+	/* Flushing a large cache takes a while, wait for the interrupt in slices */
+	if (!ac->no_int)
+		err = ata_dma_wait(ac);
+
+	ata_polling(ac, 0);
+	status = ata_ch_read(ac, ATA_REG_STATUS);
+
+	if (err < 0 || (status & (ATA_SR_DF | ATA_SR_ERR))) {
+		printf("ata: [%d:%d] cache flush failed, status 0x%02x\n", ad->channel, ad->drive, status);
+		return -EIO;
+	}
+
+	return EOK;
+}
+
+
+/* DMA writes are issued as forced unit access */
+static inline int ata_dma_fua(struct ata_dev *ad)
+{
+	return ad->fua && (ad->flush_policy == ata_flush_fua);
+}
+
+
+/* Returns number of sectors transferred, negative value if the transfer has to be retried using PIO */
+static int ata_dma_access(uint8_t direction, struct ata_dev *ad, uint64_t lba, uint32_t numsects, void *buffer)
+{
+	struct ata_channel *ac = ad->ac;
+	uint32_t len;
+	uint8_t cmd, bmsta, bmdir, fua;
+	int lba_mode, err;
+
+	if ((len = ata_dma_prd(ad, buffer, numsects * ad->sector_size)) == 0)
+		return -EINVAL;
+
+	numsects = len / ad->sector_size;
+	bmdir = (direction == ATA_READ) ? ATA_BMR_CMD_RDENABLE : ATA_BMR_CMD_WRENABLE;
+
+	ata_ch_write(ac, ATA_REG_CONTROL, 0);
+
+	/* Stop the engine, clear interrupt and error bits (keep drive DMA capable bits) */
+	ata_ch_write(ac, ATA_REG_BMCOMMAND, ATA_BMR_CMD_STOP);
+	bmsta = ata_ch_read(ac, ATA_REG_BMSTATUS);
+	ata_ch_write(ac, ATA_REG_BMSTATUS, (bmsta & (ATA_BMR_STAT_DEV0_DMA | ATA_BMR_STAT_DEV1_DMA)) | ATA_BMR_STAT_INTR | ATA_BMR_STAT_ERR);
+
+	outl((void *)0 + ac->reg_addr[ATA_REG_BMPRD], ac->prd_phys);
+	ata_ch_write(ac, ATA_REG_BMCOMMAND, bmdir);
+
+	/* Forced unit access writes go to the media, bypassing the drive cache */
+	fua = (direction == ATA_WRITE) && ata_dma_fua(ad);
+	lba_mode = ata_setup(ad, lba, numsects, fua);
+
+	if (direction == ATA_READ)
+		cmd = (lba_mode == 2) ? ATA_CMD_READ_DMA_EXT : ATA_CMD_READ_DMA;
+	else if (fua)
+		cmd = ATA_CMD_WRITE_DMA_FUA_EXT;
+	else
+		cmd = (lba_mode == 2) ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_WRITE_DMA;
+
+	mutexLock(ac->irq_spin);
+	ac->irq_invoked = 0;
+	mutexUnlock(ac->irq_spin);
+
+	ata_ch_write(ac, ATA_REG_COMMAND, cmd);
+	ata_ch_write(ac, ATA_REG_BMCOMMAND, bmdir | ATA_BMR_CMD_START);
+
+	err = ata_dma_wait(ac);
+
+	ata_ch_write(ac, ATA_REG_BMCOMMAND, ATA_BMR_CMD_STOP);
+	bmsta = ac->bmstatus_irq | ata_ch_read(ac, ATA_REG_BMSTATUS);
+
+	if (err < 0) {
+		printf("ata: [%d:%d] DMA timeout\n", ad->channel, ad->drive);
+		return -EIO;
+	}
+
+	if ((bmsta & ATA_BMR_STAT_ERR) || (ac->status & (ATA_SR_BSY | ATA_SR_DF | ATA_SR_DRQ | ATA_SR_ERR))) {
+		printf("ata: [%d:%d] DMA error, bm status 0x%02x, status 0x%02x\n", ad->channel, ad->drive, bmsta, ac->status);
+		return -EIO;
+	}
+
+	return numsects;
+}
+
+
+static int ata_pio_access(uint8_t direction, struct ata_dev *ad, uint64_t lba, uint32_t numsects, void *buffer)
+{
+	struct ata_channel *ac = ad->ac;
+
+	uint8_t cmd;
+	uint8_t astatus = 0;
+	uint16_t bus = ac->base;
+	uint16_t words = 256;
+	uint16_t b;
+	uint32_t i;
+	int lba_mode;
+
+	int err = 0;
+
+	ata_ch_write(ac, ATA_REG_CONTROL, ac->no_int << 1);
+
+	if (ac->bmide)
+		ata_ch_write(ac, ATA_REG_BMSTATUS, ATA_BMR_STAT_ERR);
+
+	lba_mode = ata_setup(ad, lba, numsects, 0);
+
+	if (direction == ATA_READ)
+		cmd = (lba_mode == 2) ? ATA_CMD_READ_PIO_EXT : ATA_CMD_READ_PIO;
+	else
+		cmd = (lba_mode == 2) ? ATA_CMD_WRITE_PIO_EXT : ATA_CMD_WRITE_PIO;
 
 	ata_ch_write(ac, ATA_REG_COMMAND, cmd);
 
@@ -260,25 +494,56 @@ int ata_access(uint8_t direction, struct ata_dev *ad, uint32_t lba, uint8_t nums
 				astatus = ac->status;
 
 		}
+	}
 
-		ata_ch_write(ac, ATA_REG_COMMAND, ATA_CMD_CACHE_FLUSH);
+	return i;
+}
 
-		if (!ac->no_int) {
-			if ((err = ata_wait(ac, 1)) != 0) {
-				ata_polling(ac, 1); // Polling.
-			}
+
+/* Accounts data written to the drive cache, it's flushed according to the flush policy */
+static void ata_unflushed(struct ata_dev *ad, uint32_t len)
+{
+	if (!ad->stats.unflushed)
+		gettime(&ad->unflushed_since, NULL);
+	ad->stats.unflushed += len;
+}
+
+
+int ata_access(uint8_t direction, struct ata_dev *ad, uint64_t lba, uint32_t numsects, void *buffer)
+{
+	int ret;
+
+	if (ad->dma) {
+		if ((ret = ata_dma_access(direction, ad, lba, numsects, buffer)) > 0) {
+			/* Forced unit access writes are on the media already */
+			if (direction == ATA_WRITE && !ata_dma_fua(ad))
+				ata_unflushed(ad, ret * ad->sector_size);
+			return ret;
+		}
+
+		/* Misaligned buffer or DMA failure - fall back to PIO */
+		if (ret == -EIO) {
+			printf("ata: [%d:%d] switching to PIO\n", ad->channel, ad->drive);
+			ad->dma = 0;
 		}
 	}
 
-	return i;
+	if (numsects > ATA_MAX_PIO_DRQ)
+		numsects = ATA_MAX_PIO_DRQ;
+
+	if ((ret = ata_pio_access(direction, ad, lba, numsects, buffer)) > 0 && direction == ATA_WRITE)
+		ata_unflushed(ad, ret * ad->sector_size);
+
+	return ret;
 }
 
-// TODO: fixme 64 bits
+
 static int ata_io(struct ata_dev *ad, offs_t offs, char *buff, unsigned int len, int direction)
 {
-	uint32_t begin_lba = 0;
-	uint32_t sectors = 0;
+	uint64_t begin_lba = 0;
+	uint32_t sectors = 0, maxsects;
 	uint32_t ret = 0;
+	int n;
 
 	if (ad == NULL)
 		return -EINVAL;
@@ -286,41 +551,855 @@ static int ata_io(struct ata_dev *ad, offs_t offs, char *buff, unsigned int len,
 	if (!ad->reserved)
 		return -ENOENT;
 
-	if (((uint32_t)offs % ad->sector_size) || (len % ad->sector_size)) {
+	if (((uint64_t)offs % ad->sector_size) || (len % ad->sector_size)) {
 		printf("panic on the disco sector %s\n", "");
 		return -EINVAL;
 	}
 
-	begin_lba = (uint32_t)offs / ad->sector_size; // starting sector
+	begin_lba = (uint64_t)offs / ad->sector_size; // starting sector
 	sectors = len / ad->sector_size;
+	maxsects = ad->lba48 ? ATA_MAX_LBA48_SECTORS : ATA_MAX_LBA28_SECTORS;
 
-	for (; sectors >= ATA_MAX_PIO_DRQ; sectors -= ATA_MAX_PIO_DRQ) {
-		// sectors actually read
-		ata_access(direction, ad, begin_lba, (uint8_t)ATA_MAX_PIO_DRQ, buff); // FIXME: BUG: TODO: ATA_MAX_PIO_DRQ is getting squashed to 8bits here!!!
+	while (sectors) {
+		n = ata_access(direction, ad, begin_lba, sectors < maxsects ? sectors : maxsects, buff);
 
-		begin_lba += ATA_MAX_PIO_DRQ;
-		buff += ATA_MAX_PIO_DRQ * ad->sector_size;
-		ret += ATA_MAX_PIO_DRQ * ad->sector_size;
-	}
+		if (n <= 0)
+			break;
 
-	if (sectors) {
-		ata_access(direction, ad, begin_lba, (uint8_t)sectors, buff);
-		ret += sectors * ad->sector_size;
+		begin_lba += n;
+		buff += n * ad->sector_size;
+		ret += n * ad->sector_size;
+		sectors -= n;
 	}
 
 	return ret;
 }
 
 
+/* Sector cache - accessed by the channel thread only */
+
+#define ATA_CLINE_NONE ((uint64_t)-1)
+
+enum { ata_cache_read, ata_cache_overlay, ata_cache_fill, ata_cache_write, ata_cache_store, ata_cache_update };
+
+
+static inline uint32_t ata_mask(unsigned int first, unsigned int cnt)
+{
+	return (cnt >= 32) ? ~0u : ((1u << cnt) - 1) << first;
+}
+
+
+static struct ata_cline *ata_cache_find(struct ata_cache *c, uint64_t line)
+{
+	struct ata_cline *cl;
+
+	for (cl = c->hash[line % ATA_CACHE_HASH]; cl != NULL && cl->line != line; cl = cl->hnext)
+		;
+
+	return cl;
+}
+
+
+static void ata_cache_unhash(struct ata_cache *c, struct ata_cline *cl)
+{
+	struct ata_cline **p;
+
+	for (p = &c->hash[cl->line % ATA_CACHE_HASH]; *p != cl; p = &(*p)->hnext)
+		;
+
+	*p = cl->hnext;
+}
+
+
+/* Flushes the drive cache */
+static int ata_barrier(struct ata_dev *ad)
+{
+	time_t start, end;
+	int err;
+
+	gettime(&start, NULL);
+	err = ata_flush(ad);
+	gettime(&end, NULL);
+
+	ad->stats.unflushed = 0;
+	ad->stats.flushes++;
+	ad->stats.flushtime += end - start;
+	if (end - start > ad->stats.flushmax)
+		ad->stats.flushmax = end - start;
+
+	if (err < 0)
+		ad->stats.errors++;
+
+	return err;
+}
+
+
+/* Returns time left to flush required by ata_flush_threshold policy, -1 if there is no data to flush */
+static time_t ata_flush_due(struct ata_dev *ad, time_t now)
+{
+	if (ad->flush_policy != ata_flush_threshold || !ad->stats.unflushed)
+		return -1;
+
+	if (now - ad->unflushed_since >= ad->flush_time)
+		return 0;
+
+	return ad->unflushed_since + ad->flush_time - now;
+}
+
+
+/* Applies the flush policy after data has been written, data written with forced unit access isn't accounted */
+static void ata_written(struct ata_dev *ad)
+{
+	time_t now;
+
+	if (!ad->stats.unflushed)
+		return;
+
+	gettime(&now, NULL);
+
+	switch (ad->flush_policy) {
+		case ata_flush_barrier:
+			break;
+
+		case ata_flush_threshold:
+			if (ad->stats.unflushed >= ad->flush_size || ata_flush_due(ad, now) == 0)
+				ata_barrier(ad);
+			break;
+
+		default:
+			ata_barrier(ad);
+			break;
+	}
+}
+
+
+static int ata_xfer(struct ata_dev *ad, uint64_t lba, uint32_t numsects, char *buff, int direction)
+{
+	if (ata_io(ad, (offs_t)lba * ad->sector_size, buff, numsects * ad->sector_size, direction) != numsects * ad->sector_size) {
+		printf("ata: [%d:%d] %s error at sector %llu\n", ad->channel, ad->drive, direction == ATA_READ ? "read" : "write", (unsigned long long)lba);
+		ad->stats.errors++;
+		return -EIO;
+	}
+
+	ad->head = lba + numsects;
+
+	if (direction == ATA_WRITE)
+		ata_written(ad);
+
+	return EOK;
+}
+
+
+/* Writes dirty sector runs of the line to the disk, runs which failed stay dirty */
+static int ata_cache_clean(struct ata_dev *ad, struct ata_cline *cl)
+{
+	struct ata_cache *c = &ad->cache;
+	unsigned int s, e;
+	int err = EOK;
+
+	for (s = 0; s < c->lsects; s = e + 1) {
+		for (; s < c->lsects && !(cl->dirty & (1u << s)); s++)
+			;
+
+		for (e = s; e < c->lsects && (cl->dirty & (1u << e)); e++)
+			;
+
+		if (s == e)
+			break;
+
+		if (ata_xfer(ad, cl->line * c->lsects + s, e - s, cl->data + s * ad->sector_size, ATA_WRITE) < 0) {
+			err = -EIO;
+			continue;
+		}
+
+		cl->dirty &= ~ata_mask(s, e - s);
+		ad->stats.writebacks++;
+	}
+
+	if (!cl->dirty)
+		c->ndirty--;
+
+	return err;
+}
+
+
+/*
+ * Returns the line moved to the end of LRU list, the least recently used line is reused if line is not cached.
+ * Returns NULL if the line to reuse couldn't be written back, it's moved to the end of LRU list as well.
+ */
+static struct ata_cline *ata_cache_get(struct ata_dev *ad, uint64_t line)
+{
+	struct ata_cache *c = &ad->cache;
+	struct ata_cline *cl;
+
+	if ((cl = ata_cache_find(c, line)) == NULL) {
+		cl = c->lru;
+
+		if (cl->dirty && ata_cache_clean(ad, cl) < 0) {
+			LIST_REMOVE(&c->lru, cl);
+			LIST_ADD(&c->lru, cl);
+			return NULL;
+		}
+
+		if (cl->line != ATA_CLINE_NONE) {
+			ata_cache_unhash(c, cl);
+			ad->stats.evictions++;
+		}
+
+		cl->line = line;
+		cl->valid = 0;
+		cl->hnext = c->hash[line % ATA_CACHE_HASH];
+		c->hash[line % ATA_CACHE_HASH] = cl;
+	}
+
+	LIST_REMOVE(&c->lru, cl);
+	LIST_ADD(&c->lru, cl);
+
+	return cl;
+}
+
+
+static int ata_cache_hit(struct ata_dev *ad, uint64_t lba, uint32_t numsects)
+{
+	struct ata_cache *c = &ad->cache;
+	struct ata_cline *cl;
+	uint32_t cnt, m;
+
+	for (; numsects; lba += cnt, numsects -= cnt) {
+		cnt = c->lsects - lba % c->lsects;
+		if (cnt > numsects)
+			cnt = numsects;
+
+		m = ata_mask(lba % c->lsects, cnt);
+
+		if ((cl = ata_cache_find(c, lba / c->lsects)) == NULL || (cl->valid & m) != m)
+			return 0;
+	}
+
+	return 1;
+}
+
+
+/*
+ * Copies sectors between the buffer and the cache:
+ * ata_cache_read - valid sectors to the buffer
+ * ata_cache_overlay - dirty sectors to the buffer
+ * ata_cache_fill - buffer to sectors which are not dirty
+ * ata_cache_write - buffer to sectors, marks them dirty
+ * ata_cache_store, ata_cache_update - buffer to sectors written to the disk, update affects cached lines only
+ * Fails only if a line for ata_cache_write can't be reused, other operations skip such lines.
+ */
+static int ata_cache_xfer(struct ata_dev *ad, uint64_t lba, uint32_t numsects, char *buff, int op)
+{
+	struct ata_cache *c = &ad->cache;
+	struct ata_cline *cl;
+	uint32_t cnt, m, i, s, ssz = ad->sector_size;
+
+	for (; numsects; lba += cnt, numsects -= cnt, buff += cnt * ssz) {
+		s = lba % c->lsects;
+		cnt = c->lsects - s;
+		if (cnt > numsects)
+			cnt = numsects;
+
+		m = ata_mask(s, cnt);
+
+		if (op == ata_cache_fill || op == ata_cache_write || op == ata_cache_store)
+			cl = ata_cache_get(ad, lba / c->lsects);
+		else
+			cl = ata_cache_find(c, lba / c->lsects);
+
+		if (cl == NULL) {
+			if (op == ata_cache_write)
+				return -EIO;
+			continue;
+		}
+
+		switch (op) {
+			case ata_cache_read:
+			case ata_cache_overlay:
+				m &= (op == ata_cache_read) ? cl->valid : cl->dirty;
+				for (i = s; i < s + cnt; i++) {
+					if (m & (1u << i))
+						memcpy(buff + (i - s) * ssz, cl->data + i * ssz, ssz);
+				}
+				break;
+
+			case ata_cache_fill:
+				for (i = s; i < s + cnt; i++) {
+					if (!(cl->dirty & (1u << i)))
+						memcpy(cl->data + i * ssz, buff + (i - s) * ssz, ssz);
+				}
+				cl->valid |= m;
+				break;
+
+			case ata_cache_write:
+				memcpy(cl->data + s * ssz, buff, cnt * ssz);
+				if (!cl->dirty)
+					c->ndirty++;
+				cl->valid |= m;
+				cl->dirty |= m;
+				break;
+
+			default:
+				memcpy(cl->data + s * ssz, buff, cnt * ssz);
+				if (cl->dirty && !(cl->dirty &= ~m))
+					c->ndirty--;
+				cl->valid |= m;
+				break;
+		}
+	}
+
+	return EOK;
+}
+
+
+/* Writes back a run of dirty sectors starting at the lowest dirty line, coalescing following lines */
+static int ata_cache_flush(struct ata_dev *ad)
+{
+	struct ata_cache *c = &ad->cache;
+	struct ata_cline *cl = NULL, *first;
+	uint32_t i, s, n = 0, max = ATA_MERGE_BYTES / ad->sector_size;
+	uint64_t lba;
+
+	for (i = 0; i < c->nlines; i++) {
+		if (c->lines[i].dirty && (cl == NULL || c->lines[i].line < cl->line))
+			cl = &c->lines[i];
+	}
+
+	if (cl == NULL)
+		return EOK;
+
+	for (s = 0; !(cl->dirty & (1u << s)); s++)
+		;
+
+	first = cl;
+	lba = cl->line * c->lsects + s;
+
+	for (;;) {
+		for (i = s; i < c->lsects && (cl->dirty & (1u << i)) && n < max; i++, n++)
+			memcpy(ad->ac->bounce + n * ad->sector_size, cl->data + i * ad->sector_size, ad->sector_size);
+
+		if (i < c->lsects || n == max)
+			break;
+
+		if ((cl = ata_cache_find(c, cl->line + 1)) == NULL || !(cl->dirty & 1))
+			break;
+
+		s = 0;
+	}
+
+	/* Sectors stay dirty until they are on the disk */
+	if (ata_xfer(ad, lba, n, ad->ac->bounce, ATA_WRITE) < 0)
+		return -EIO;
+
+	ad->stats.writebacks++;
+
+	/* The run covers the lines up to their ends except for the last one */
+	for (cl = first, s = lba % c->lsects; n; cl = ata_cache_find(c, cl->line + 1), s = 0) {
+		i = (n < c->lsects - s) ? n : c->lsects - s;
+		if (!(cl->dirty &= ~ata_mask(s, i)))
+			c->ndirty--;
+		n -= i;
+	}
+
+	return EOK;
+}
+
+
+static int ata_cache_init(struct ata_dev *ad, uint32_t size, uint8_t write_through)
+{
+	struct ata_cache *c = &ad->cache;
+	size_t lsize;
+	char *data;
+	unsigned int i;
+
+	memset(c, 0, sizeof(*c));
+	c->write_through = write_through;
+
+	if ((c->lsects = ATA_CACHE_LINE / ad->sector_size) == 0)
+		c->lsects = 1;
+
+	lsize = c->lsects * ad->sector_size;
+
+	if ((c->nlines = (size_t)size * 1024 / lsize) < 2) {
+		c->nlines = 0;
+		return EOK;
+	}
+
+	if ((c->lines = malloc(c->nlines * sizeof(struct ata_cline))) == NULL) {
+		c->nlines = 0;
+		return -ENOMEM;
+	}
+
+	if ((data = mmap(NULL, (c->nlines * lsize + SIZE_PAGE - 1) & ~(SIZE_PAGE - 1), PROT_READ | PROT_WRITE, MAP_ANONYMOUS, OID_NULL, 0)) == MAP_FAILED) {
+		free(c->lines);
+		c->lines = NULL;
+		c->nlines = 0;
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < c->nlines; i++) {
+		c->lines[i].line = ATA_CLINE_NONE;
+		c->lines[i].valid = 0;
+		c->lines[i].dirty = 0;
+		c->lines[i].data = data + i * lsize;
+		LIST_ADD(&c->lru, &c->lines[i]);
+	}
+
+	/* Transfers larger than half of the cache bypass it */
+	c->maxsects = c->nlines / 2 * c->lsects;
+	if (c->maxsects > ATA_MERGE_BYTES / ad->sector_size)
+		c->maxsects = ATA_MERGE_BYTES / ad->sector_size;
+
+	return EOK;
+}
+
+
+/* Request queue */
+
+static int ata_submit(struct ata_dev *ad, msg_t *msg, unsigned int rid, uint8_t direction, offs_t offs, char *buff, size_t len)
+{
+	struct ata_channel *ac = ad->ac;
+	struct ata_req *req, *r;
+
+	if (!ad->reserved)
+		return -ENOENT;
+
+	if (((uint64_t)offs % ad->sector_size) || (len % ad->sector_size) || (uint64_t)offs / ad->sector_size + len / ad->sector_size > ad->size)
+		return -EINVAL;
+
+	if ((req = malloc(sizeof(*req))) == NULL)
+		return -ENOMEM;
+
+	memcpy(&req->msg, msg, sizeof(*msg));
+	req->rid = rid;
+	req->direction = direction;
+	req->lba = (uint64_t)offs / ad->sector_size;
+	req->numsects = len / ad->sector_size;
+	req->buff = buff;
+	gettime(&req->queued, NULL);
+
+	mutexLock(ac->lock);
+
+	req->seq = ad->seq++;
+
+	/* Keep the queue sorted, insert before the first request with higher LBA */
+	if ((r = ad->queue) != NULL) {
+		while (r->lba <= req->lba && (r = r->next) != ad->queue)
+			;
+
+		LIST_ADD(&r, req);
+
+		if (req->lba < ad->queue->lba)
+			ad->queue = req;
+	}
+	else {
+		LIST_ADD(&ad->queue, req);
+	}
+
+	if (++ad->stats.depth > ad->stats.maxdepth)
+		ad->stats.maxdepth = ad->stats.depth;
+
+	mutexUnlock(ac->lock);
+	condSignal(ac->cond);
+
+	return EOK;
+}
+
+
+static int ata_sync_submit(struct ata_dev *ad, msg_t *msg, unsigned int rid)
+{
+	struct ata_channel *ac = ad->ac;
+	struct ata_req *req;
+
+	if ((req = malloc(sizeof(*req))) == NULL)
+		return -ENOMEM;
+
+	memcpy(&req->msg, msg, sizeof(*msg));
+	req->rid = rid;
+	gettime(&req->queued, NULL);
+
+	mutexLock(ac->lock);
+	req->seq = ad->seq++;
+	LIST_ADD(&ad->syncq, req);
+	mutexUnlock(ac->lock);
+	condSignal(ac->cond);
+
+	return EOK;
+}
+
+
+/* Requests queued after a pending sync are held back until it completes */
+static inline int ata_eligible(struct ata_dev *ad, struct ata_req *req)
+{
+	return (ad->syncq == NULL) || ((int32_t)(req->seq - ad->syncq->seq) < 0);
+}
+
+
+/*
+ * Removes the next request from the drive queue with requests merged into it, has to be called with the channel lock held.
+ * Returns NULL if there are no requests preceding the pending sync.
+ */
+static struct ata_req *ata_dequeue(struct ata_dev *ad)
+{
+	struct ata_req *req = NULL, *old = NULL, *r, *m, *batch = NULL;
+	uint32_t n, max = ATA_MERGE_BYTES / ad->sector_size;
+	time_t now;
+
+	if ((r = ad->queue) == NULL)
+		return NULL;
+
+	gettime(&now, NULL);
+
+	/* C-LOOK - first request at or above the head position, wrap to the lowest one. Expired requests go first */
+	do {
+		if (!ata_eligible(ad, r))
+			continue;
+
+		if (req == NULL || (req->lba < ad->head && r->lba >= ad->head))
+			req = r;
+
+		if (now - r->queued > ATA_DEADLINE && (old == NULL || r->queued < old->queued))
+			old = r;
+	} while ((r = r->next) != ad->queue);
+
+	if (old != NULL)
+		req = old;
+
+	if (req == NULL)
+		return NULL;
+
+	LIST_REMOVE(&ad->queue, req);
+	LIST_ADD(&batch, req);
+	ad->stats.depth--;
+
+	/* Merge requests adjacent to the end of the batch */
+	for (n = req->numsects; n < max && (r = ad->queue) != NULL; n += m->numsects) {
+		m = NULL;
+		do {
+			if (r->lba == req->lba + n && r->direction == req->direction && n + r->numsects <= max && ata_eligible(ad, r)) {
+				m = r;
+				break;
+			}
+		} while ((r = r->next) != ad->queue);
+
+		if (m == NULL)
+			break;
+
+		LIST_REMOVE(&ad->queue, m);
+		LIST_ADD(&batch, m);
+		ad->stats.depth--;
+		ad->stats.merges++;
+	}
+
+	return batch;
+}
+
+
+/* Copies the write batch to the cache, fails if a dirty line can't be written back to make room for it */
+static int ata_cache_absorb(struct ata_dev *ad, struct ata_req *batch)
+{
+	struct ata_req *r = batch;
+	int err;
+
+	do {
+		if ((err = ata_cache_xfer(ad, r->lba, r->numsects, r->buff, ata_cache_write)) < 0)
+			return err;
+
+		ad->stats.absorbed += r->numsects;
+	} while ((r = r->next) != batch);
+
+	return EOK;
+}
+
+
+static void ata_serve(struct ata_dev *ad, struct ata_req *batch)
+{
+	struct ata_cache *c = &ad->cache;
+	struct ata_req *r;
+	uint64_t lba = batch->lba, a, b;
+	uint32_t n = 0, ssz = ad->sector_size;
+	char *buff;
+	int err = EOK;
+
+	r = batch;
+	do {
+		n += r->numsects;
+	} while ((r = r->next) != batch);
+
+	if (batch->direction == ATA_READ) {
+		if (c->nlines && ata_cache_hit(ad, lba, n)) {
+			ad->stats.hits += n;
+			r = batch;
+			do {
+				ata_cache_xfer(ad, r->lba, r->numsects, r->buff, ata_cache_read);
+			} while ((r = r->next) != batch);
+		}
+		else {
+			ad->stats.misses += n;
+			a = lba;
+			b = lba + n;
+
+			/* Read whole lines if they fit in the cache */
+			if (c->nlines && n <= c->maxsects) {
+				a -= a % c->lsects;
+				b += (c->lsects - b % c->lsects) % c->lsects;
+				if (b > ad->size)
+					b = ad->size;
+
+				if (b - a > c->maxsects) {
+					a = lba;
+					b = lba + n;
+				}
+			}
+
+			buff = (a == lba && b == lba + n && batch->next == batch) ? batch->buff : ad->ac->bounce;
+
+			if ((err = ata_xfer(ad, a, b - a, buff, ATA_READ)) == EOK) {
+				if (c->nlines) {
+					/* Dirty sectors are newer than the disk contents */
+					ata_cache_xfer(ad, a, b - a, buff, ata_cache_overlay);
+					if (b - a <= c->maxsects)
+						ata_cache_xfer(ad, a, b - a, buff, ata_cache_fill);
+				}
+
+				if (buff != batch->buff) {
+					r = batch;
+					do {
+						memcpy(r->buff, buff + (r->lba - a) * ssz, r->numsects * ssz);
+					} while ((r = r->next) != batch);
+				}
+			}
+		}
+	}
+	/* Writes which can't be absorbed by the cache go to the disk */
+	else if (!c->nlines || c->write_through || n > c->maxsects || ata_cache_absorb(ad, batch) < 0) {
+		if ((buff = (batch->next == batch) ? batch->buff : ad->ac->bounce) != batch->buff) {
+			r = batch;
+			do {
+				memcpy(buff + (r->lba - lba) * ssz, r->buff, r->numsects * ssz);
+			} while ((r = r->next) != batch);
+		}
+
+		if ((err = ata_xfer(ad, lba, n, buff, ATA_WRITE)) == EOK && c->nlines)
+			ata_cache_xfer(ad, lba, n, buff, n <= c->maxsects ? ata_cache_store : ata_cache_update);
+	}
+
+	while ((r = batch) != NULL) {
+		LIST_REMOVE(&batch, r);
+		r->msg.o.io.err = (err < 0) ? err : r->numsects * ssz;
+		msgRespond(port, &r->msg, r->rid);
+		free(r);
+	}
+}
+
+
+/* Writes back cached data and flushes the drive cache, all requests preceding the sync are completed at this point */
+static void ata_sync(struct ata_dev *ad, struct ata_req *req)
+{
+	int err = EOK;
+
+	while (ad->cache.ndirty && (err = ata_cache_flush(ad)) == EOK)
+		;
+
+	req->msg.o.io.err = (err < 0) ? err : ata_barrier(ad);
+	msgRespond(port, &req->msg, req->rid);
+	free(req);
+}
+
+
+/* Writes back dirty lines once the channel is idle for ATA_WB_DELAY and flushes drives due, returns time to wait for */
+static time_t ata_idle(struct ata_channel *ac, time_t idle)
+{
+	time_t now, t, wait = 0;
+	int i, done = 0;
+
+	gettime(&now, NULL);
+
+	for (i = 0; i < 2; i++) {
+		if (!ac->devices[i].cache.ndirty)
+			continue;
+
+		if (now - idle >= ATA_WB_DELAY) {
+			/* Failed write back is retried after another delay */
+			if (ata_cache_flush(&ac->devices[i]) == EOK)
+				done = 1;
+			else if (!wait || ATA_WB_DELAY < wait)
+				wait = ATA_WB_DELAY;
+		}
+		else {
+			wait = idle + ATA_WB_DELAY - now;
+		}
+	}
+
+	for (i = 0; i < 2; i++) {
+		if ((t = ata_flush_due(&ac->devices[i], now)) == 0) {
+			ata_barrier(&ac->devices[i]);
+			done = 1;
+		}
+		else if (t > 0 && (!wait || t < wait)) {
+			wait = t;
+		}
+	}
+
+	/* Check for new requests before doing more */
+	return done ? -1 : wait;
+}
+
+
+static void ata_channel_thread(void *arg)
+{
+	struct ata_channel *ac = (struct ata_channel *)arg;
+	struct ata_dev *ad;
+	struct ata_req *batch;
+	time_t idle = 0, wait;
+
+	mutexLock(ac->lock);
+
+	for (;;) {
+		/* Drives with pending requests are served alternately */
+		if (ac->devices[ac->next].queue == NULL && ac->devices[ac->next].syncq == NULL)
+			ac->next ^= 1;
+
+		ad = &ac->devices[ac->next];
+
+		if (ad->queue == NULL && ad->syncq == NULL) {
+			if (!idle)
+				gettime(&idle, NULL);
+
+			mutexUnlock(ac->lock);
+			wait = ata_idle(ac, idle);
+			mutexLock(ac->lock);
+
+			if (wait >= 0)
+				condWait(ac->cond, ac->lock, wait);
+			continue;
+		}
+
+		idle = 0;
+		ac->next ^= 1;
+
+		if ((batch = ata_dequeue(ad)) == NULL) {
+			batch = ad->syncq;
+			LIST_REMOVE(&ad->syncq, batch);
+			mutexUnlock(ac->lock);
+
+			ata_sync(ad, batch);
+		}
+		else {
+			mutexUnlock(ac->lock);
+
+			ata_serve(ad, batch);
+		}
+
+		mutexLock(ac->lock);
+	}
+}
+
+
+static int ata_channel_init(struct ata_channel *ac, ata_opt_t *opt)
+{
+	struct ata_dev *ad;
+	int i;
+
+	if (!ac->devices[0].reserved && !ac->devices[1].reserved)
+		return EOK;
+
+	if ((ac->bounce = mmap(NULL, ATA_MERGE_BYTES, PROT_READ | PROT_WRITE, MAP_ANONYMOUS, OID_NULL, 0)) == MAP_FAILED) {
+		ac->devices[0].reserved = 0;
+		ac->devices[1].reserved = 0;
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < 2; i++) {
+		ad = &ac->devices[i];
+		if (!ad->reserved)
+			continue;
+
+		ad->flush_policy = opt->flush_policy;
+		ad->flush_size = (uint64_t)opt->flush_size * 1024;
+		ad->flush_time = (time_t)opt->flush_time * 1000;
+
+		if (ata_cache_init(ad, opt->cache_size, opt->write_through) < 0)
+			printf("ata: [%d:%d] failed to allocate cache, caching disabled\n", ad->channel, ad->drive);
+	}
+
+	mutexCreate(&ac->lock);
+	condCreate(&ac->cond);
+
+	return beginthread(ata_channel_thread, 4, ac->stack, sizeof(ac->stack), ac);
+}
+
+
+/* Sync requests are answered by the channel thread, other devctls are answered here */
+static void ata_devctl(msg_t *msg, unsigned int rid)
+{
+	ata_devctl_t *devctl = (ata_devctl_t *)msg->i.raw;
+	struct ata_dev *ad = NULL;
+	int err = EOK;
+
+	if (devctl->bus >= buses_cnt || devctl->channel > 1 || devctl->device > 1)
+		err = -EINVAL;
+	else if (!(ad = &buses[devctl->bus].ac[devctl->channel].devices[devctl->device])->reserved)
+		err = -ENOENT;
+
+	if (err == EOK) {
+		switch (devctl->type) {
+			case ata_devctl_stats:
+				if (msg->o.data == NULL || msg->o.size < sizeof(ata_stats_t)) {
+					err = -EINVAL;
+					break;
+				}
+
+				/* Counters are updated by the channel thread, the snapshot is not atomic */
+				mutexLock(ad->ac->lock);
+				ad->stats.lines = ad->cache.nlines;
+				ad->stats.dirty = ad->cache.ndirty;
+				memcpy(msg->o.data, &ad->stats, sizeof(ata_stats_t));
+				mutexUnlock(ad->ac->lock);
+				break;
+
+			case ata_devctl_sync:
+				if ((err = ata_sync_submit(ad, msg, rid)) == EOK)
+					return;
+				break;
+
+			case ata_devctl_flush:
+				if (devctl->flush.policy < ata_flush_always || devctl->flush.policy > ata_flush_threshold ||
+						(devctl->flush.policy == ata_flush_threshold && (!devctl->flush.size || !devctl->flush.time))) {
+					err = -EINVAL;
+					break;
+				}
+
+				mutexLock(ad->ac->lock);
+				ad->flush_policy = devctl->flush.policy;
+				ad->flush_size = (uint64_t)devctl->flush.size * 1024;
+				ad->flush_time = (time_t)devctl->flush.time * 1000;
+				mutexUnlock(ad->ac->lock);
+				break;
+
+			default:
+				err = -EINVAL;
+				break;
+		}
+	}
+
+	msg->o.io.err = err;
+	msgRespond(port, msg, rid);
+}
+
+
 static int ata_interrupt(unsigned int irq, void *dev_instance)
 {
 	struct ata_channel *ac = (struct ata_channel*)dev_instance;
 	int res = 0; //IHRES_IGNORE;
 
-	ac->bmstatus_irq = ata_ch_read(ac, ATA_REG_BMSTATUS); // Read Status Register.
+	if (ac->bmide) {
+		ac->bmstatus_irq = ata_ch_read(ac, ATA_REG_BMSTATUS); // Read Status Register.
+		if (ac->bmstatus_irq & ATA_BMR_STAT_INTR)
+			ata_ch_write(ac, ATA_REG_BMSTATUS, (ac->bmstatus_irq & (ATA_BMR_STAT_DEV0_DMA | ATA_BMR_STAT_DEV1_DMA)) | ATA_BMR_STAT_INTR);
+	}
 	ac->status = ata_ch_read(ac, ATA_REG_STATUS); // Read Status Register.
-	if (ac->bmstatus_irq & ATA_BMR_STAT_INTR)
-		ata_ch_write(ac,ATA_REG_BMSTATUS,ATA_BMR_STAT_INTR);
 
 	ac->irq_invoked = 1;
 
@@ -355,8 +1434,9 @@ int ata_init_bus(struct ata_bus *ab)
 	ab->ac[ATA_SECONDARY].base  = (B2 & 0xFFFFFFFC) + 0x170 * (!B2);
 	ab->ac[ATA_SECONDARY].ctrl  = (B3 & 0xFFFFFFFC) + 0x376 * (!B3);
 
-	ab->ac[ATA_PRIMARY  ].bmide = (B4 & 0xFFFFFFFC) + ATA_REG_BMPRIMARY;
-	ab->ac[ATA_SECONDARY].bmide = (B4 & 0xFFFFFFFC) + ATA_REG_BMSECONDARY;
+	/* No busmaster registers - PIO only */
+	ab->ac[ATA_PRIMARY  ].bmide = B4 ? (B4 & 0xFFFFFFFC) + ATA_REG_BMPRIMARY : 0;
+	ab->ac[ATA_SECONDARY].bmide = B4 ? (B4 & 0xFFFFFFFC) + ATA_REG_BMSECONDARY : 0;
 
 	ata_chInitRegs(&(ab->ac[ATA_PRIMARY]));
 	ata_chInitRegs(&(ab->ac[ATA_SECONDARY]));
@@ -375,7 +1455,19 @@ int ata_init_bus(struct ata_bus *ab)
 
 		condCreate(&(ab->ac[i].waitq));
 
-		//ab->ac[i].bmstatus = ata_ch_read(&(ab->ac[i]), ATA_REG_BMSTATUS) & 0x60;
+		ab->ac[i].prd = NULL;
+		ab->ac[i].bmstatus = 0;
+
+		/* DMA completion is interrupt driven */
+		if (ab->ac[i].bmide && ab->config.use_dma && !ab->ac[i].no_int) {
+			ab->ac[i].bmstatus = ata_ch_read(&(ab->ac[i]), ATA_REG_BMSTATUS) & (ATA_BMR_STAT_DEV0_DMA | ATA_BMR_STAT_DEV1_DMA);
+
+			/* Single page never crosses 64 KiB boundary */
+			if ((ab->ac[i].prd = mmap(NULL, SIZE_PAGE, PROT_READ | PROT_WRITE, MAP_UNCACHED, OID_NULL, 0)) == MAP_FAILED)
+				ab->ac[i].prd = NULL;
+			else
+				ab->ac[i].prd_phys = (uint32_t)va2pa((void *)ab->ac[i].prd);
+		}
 
 		for (j = 0; j < 2; j++) {
 			uint8_t err = 0, status = 0;
@@ -414,9 +1506,24 @@ int ata_init_bus(struct ata_bus *ab)
 			if (!ab->ac[i].devices[j].sector_size)
 				ab->ac[i].devices[j].sector_size = ATA_DEF_SECTOR_SIZE;
 
-			ab->ac[i].devices[j].size = ab->ac[i].devices[j].info.lba28_totalsectors;
+			ab->ac[i].devices[j].lba48 = (ab->ac[i].devices[j].info.commands2_sup & ATA_INFO_COMMANDS_2_LBA48) ? 1 : 0;
+
+			if (ab->ac[i].devices[j].lba48)
+				ab->ac[i].devices[j].size = ab->ac[i].devices[j].info.lba48_totalsectors;
+			else
+				ab->ac[i].devices[j].size = ab->ac[i].devices[j].info.lba28_totalsectors;
+
+			/* Use DMA only if both the drive and the controller (as set up by firmware) support it */
+			ab->ac[i].devices[j].dma = (ab->ac[i].prd != NULL) && (ab->ac[i].bmstatus & (ATA_BMR_STAT_DEV0_DMA << j)) &&
+				(ab->ac[i].devices[j].info.capabilities_1 & ATA_INFO_CAPABILITIES_1_DMA);
 
-			printf("[%d:%d] %.5f GiB\n", i, j, (double)ab->ac[i].devices[j].size * ab->ac[i].devices[j].sector_size / 1000 / 1000 / 1000);
+			/* Forced unit access is available as LBA48 DMA command only */
+			ab->ac[i].devices[j].fua = ab->ac[i].devices[j].dma && ab->ac[i].devices[j].lba48 &&
+				((ab->ac[i].devices[j].info.commands3_sup & ATA_INFO_COMMANDS_3_MASK) == ATA_INFO_COMMANDS_3_VALID) &&
+				(ab->ac[i].devices[j].info.commands3_sup & ATA_INFO_COMMANDS_3_FUA);
+
+			printf("[%d:%d] %.5f GiB%s%s\n", i, j, (double)ab->ac[i].devices[j].size * ab->ac[i].devices[j].sector_size / 1000 / 1000 / 1000,
+				ab->ac[i].devices[j].lba48 ? ", LBA48" : "", ab->ac[i].devices[j].dma ? ", DMA" : "");
 		}
 	}
 
@@ -428,6 +1535,11 @@ int ata_init_bus(struct ata_bus *ab)
 		if (interrupt(ab->ac[1].irq_reg, ata_interrupt, (void *)&(ab->ac[1]), ab->ac[1].waitq, &ab->ac[1].inth) < 0)
 			return -EINVAL;
 
+	for (i = 0; i < 2; i++) {
+		if (ata_channel_init(&ab->ac[i], &ab->config) < 0)
+			printf("ata: channel %d initialization failed\n", i);
+	}
+
 	return 0;
 }
 
@@ -489,35 +1601,123 @@ static void ata_run(void *arg)
 	msg_t msg;
 	ata_msg_t *atamsg;
 	unsigned int rid;
-	struct ata_dev ad;
+	struct ata_dev *ad;
+	uint8_t direction;
+	size_t len;
+	char *buff;
+	int err;
 
 	for (;;) {
-		msgRecv(port, &msg, &rid);
+		if (msgRecv(port, &msg, &rid) < 0)
+			continue;
+
 		atamsg = msg.i.data;
-		ad = buses[atamsg->bus].ac[atamsg->channel].devices[atamsg->device];
 
 		switch (msg.type) {
 			case mtRead:
-				msg.o.io.err = ata_io(&ad, atamsg->offset, msg.o.data, msg.o.size, ATA_READ);
-				break;
 			case mtWrite:
-				msg.o.io.err = ata_io(&ad, atamsg->offset, atamsg->data, atamsg->len, ATA_WRITE);
+				if (atamsg == NULL || msg.i.size < sizeof(ata_msg_t) || atamsg->bus >= buses_cnt || atamsg->channel > 1 || atamsg->device > 1) {
+					err = -EINVAL;
+					break;
+				}
+
+				ad = &buses[atamsg->bus].ac[atamsg->channel].devices[atamsg->device];
+
+				if (msg.type == mtRead) {
+					direction = ATA_READ;
+					buff = msg.o.data;
+					len = msg.o.size;
+				}
+				else {
+					direction = ATA_WRITE;
+					buff = atamsg->data;
+					len = atamsg->len;
+				}
+
+				/* Queued requests are answered by the channel threads */
+				if ((err = len ? ata_submit(ad, &msg, rid, direction, atamsg->offset, buff, len) : 0) == EOK && len)
+					continue;
 				break;
+
+			case mtDevCtl:
+				ata_devctl(&msg, rid);
+				continue;
+
 			default:
+				err = -EINVAL;
 				break;
 		}
+
+		msg.o.io.err = err;
 		msgRespond(port, &msg, rid);
 	}
 }
 
-int main(void)
+/* Flush policy option: always | fua | barrier | threshold[:<KiB>[:<ms>]] */
+static int ata_parse_policy(char *arg, ata_opt_t *opt)
+{
+	static const char *names[] = { "always", "fua", "barrier", "threshold" };
+	char *p;
+	int i;
+
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (!strncmp(arg, names[i], strlen(names[i])))
+			break;
+	}
+
+	if (i == sizeof(names) / sizeof(names[0]))
+		return -EINVAL;
+
+	opt->flush_policy = i;
+	p = arg + strlen(names[i]);
+
+	if (i == ata_flush_threshold && *p == ':') {
+		opt->flush_size = strtoul(p + 1, &p, 0);
+		if (*p == ':')
+			opt->flush_time = strtoul(p + 1, &p, 0);
+	}
+
+	if (*p != '\0' || !opt->flush_size || !opt->flush_time)
+		return -EINVAL;
+
+	return EOK;
+}
+
+int main(int argc, char **argv)
 {
 	oid_t toid;
+	ata_opt_t opt = ata_defaults;
+	int c;
+
+	while ((c = getopt(argc, argv, "c:tf:")) != -1) {
+		switch (c) {
+			case 'c':
+				opt.cache_size = atoi(optarg);
+				break;
+
+			case 't':
+				opt.write_through = 1;
+				break;
+
+			case 'f':
+				if (ata_parse_policy(optarg, &opt) < 0) {
+					printf("ata: invalid flush policy %s\n", optarg);
+					return -1;
+				}
+				break;
+
+			default:
+				break;
+		}
+	}
 
 	printf("ata: Initializing %s\n","");
-	ata_generic_init(NULL);
 
+	/* Channel threads answer requests, so the port has to exist before buses are initialized */
 	portCreate(&port);
+
+	ata_generic_init(&opt);
+
 	if (portRegister(port, "/dev/ata", &toid) < 0) {
 		printf("ata: Can't register port %d\n", port);
 		return -1;
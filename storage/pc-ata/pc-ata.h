@@ -16,16 +16,38 @@
 
 #include <stdint.h>
 #include <sys/threads.h>
+#include <sys/msg.h>
 
 #include <phoenix/arch/ia32.h>
 
 #include "pc-ata_info.h"
 
 #define ATA_MAX_PIO_DRQ 256
+#define ATA_MAX_LBA28_SECTORS 256
+#define ATA_MAX_LBA48_SECTORS 65536
+#define ATA_PRD_ENTRIES 512
 #define ATA_DEF_SECTOR_SIZE 512
 #define ATA_DEF_INTR_PRIMARY	14
 #define ATA_DEF_INTR_SECONDARY  15
 
+/* Cache line size in bytes, sectors of a line are tracked in 32-bit masks */
+#define ATA_CACHE_LINE 4096
+#define ATA_CACHE_HASH 256
+#define ATA_DEF_CACHE_SIZE 1024
+
+/* Maximum size of a merged transfer in bytes */
+#define ATA_MERGE_BYTES (128 * 1024)
+
+/* Requests queued longer than ATA_DEADLINE are served before the elevator order (in us) */
+#define ATA_DEADLINE 500000
+
+/* Dirty lines are written back once the channel has been idle for ATA_WB_DELAY (in us) */
+#define ATA_WB_DELAY 1000000
+
+/* Default thresholds of ata_flush_threshold policy, in KiB and ms */
+#define ATA_FLUSH_SIZE 4096
+#define ATA_FLUSH_TIME 1000
+
 
 /* Status register bits */
 enum { ATA_SR_BSY = 0x80, ATA_SR_DRDY = 0x40, ATA_SR_DF = 0x20,
@@ -46,16 +68,37 @@ enum { ATA_ER_BBK = 0x80, ATA_ER_UNC = 0x40, ATA_ER_MC = 0x20,
 	ATA_ER_IDNF	= 0x10, ATA_ER_MCR = 0x08, ATA_ER_ABRT	= 0x04,
    	ATA_ER_TK0NF = 0x02, ATA_ER_AMNF = 0x01 };
 
+/* PRD entry flags */
+enum { ATA_PRD_EOT = 0x80000000 };
+
 /* ATA commands */
-enum { ATA_CMD_READ_PIO = 0x20, ATA_CMD_WRITE_PIO = 0x30,
-   	ATA_CMD_CACHE_FLUSH = 0xE7, ATA_CMD_PACKET = 0xA0,
+enum { ATA_CMD_READ_PIO = 0x20, ATA_CMD_READ_PIO_EXT = 0x24,
+	ATA_CMD_READ_DMA = 0xC8, ATA_CMD_READ_DMA_EXT = 0x25,
+	ATA_CMD_WRITE_PIO = 0x30, ATA_CMD_WRITE_PIO_EXT = 0x34,
+	ATA_CMD_WRITE_DMA = 0xCA, ATA_CMD_WRITE_DMA_EXT = 0x35, ATA_CMD_WRITE_DMA_FUA_EXT = 0x3D,
+   	ATA_CMD_CACHE_FLUSH = 0xE7, ATA_CMD_CACHE_FLUSH_EXT = 0xEA, ATA_CMD_PACKET = 0xA0,
 	ATA_CMD_IDENTIFY_PACKET = 0xA1, ATA_CMD_IDENTIFY = 0xEC };
 
+/* IDENTIFY data bits */
+enum { ATA_INFO_CAPABILITIES_1_DMA = 0x100, ATA_INFO_CAPABILITIES_1_LBA = 0x200,
+	ATA_INFO_COMMANDS_2_LBA48 = 0x400, ATA_INFO_COMMANDS_3_MASK = 0xC000, ATA_INFO_COMMANDS_3_VALID = 0x4000,
+	ATA_INFO_COMMANDS_3_FUA = 0x40 };
+
+/*
+ * Drive write cache flush policies:
+ * ata_flush_always - after every write
+ * ata_flush_fua - writes bypass the drive cache (flush after writes if FUA is not supported)
+ * ata_flush_barrier - on ata_devctl_sync only
+ * ata_flush_threshold - once the amount of data or time since the first unflushed write exceeds the threshold
+ */
+enum { ata_flush_always, ata_flush_fua, ata_flush_barrier, ata_flush_threshold };
+
 /* ATA register definitions */
 enum { ATA_REG_DATA = 0x00, ATA_REG_ERROR = 0x01, ATA_REG_FEATURES = 0x01,
 	ATA_REG_SECCOUNT0 = 0x02, ATA_REG_LBA0 = 0x03, ATA_REG_LBA1 = 0x04,
 	ATA_REG_LBA2 = 0x05, ATA_REG_HDDEVSEL = 0x06, ATA_REG_COMMAND = 0x07,
-	ATA_REG_STATUS = 0x07 };
+	ATA_REG_STATUS = 0x07, ATA_REG_SECCOUNT1 = 0x08, ATA_REG_LBA3 = 0x09,
+	ATA_REG_LBA4 = 0x0A, ATA_REG_LBA5 = 0x0B };
 
 /* eo. hob */
 enum { ATA_REG_CONTROL = 0x0C, ATA_REG_ALTSTATUS = 0x0C,
@@ -74,15 +117,76 @@ typedef struct _ata_opt_t {
 	uint8_t use_int; /* use int if possible */
 	uint8_t use_dma; /* use dma if possible */
 	uint8_t use_multitransfer; /* makes sense only without dma */
+	uint8_t write_through; /* complete writes after the disk transfer */
+	uint32_t cache_size; /* per drive cache size in KiB, 0 disables caching */
+	uint8_t flush_policy; /* default drive write cache flush policy */
+	uint32_t flush_size; /* ata_flush_threshold size in KiB */
+	uint32_t flush_time; /* ata_flush_threshold time in ms */
 } ata_opt_t;
 
+/* Drive statistics returned by ata_devctl_stats */
+typedef struct {
+	uint32_t lines;       /* cache size in lines */
+	uint32_t dirty;       /* lines holding data not written to the disk yet */
+	uint32_t hits;        /* read sectors found in the cache */
+	uint32_t misses;      /* read sectors transferred from the disk */
+	uint32_t absorbed;    /* written sectors completed in the cache */
+	uint32_t writebacks;  /* dirty sector runs written to the disk */
+	uint32_t evictions;   /* lines reused for other sectors */
+	uint32_t merges;      /* requests merged with a preceding one */
+	uint32_t depth;       /* requests currently queued */
+	uint32_t maxdepth;
+	uint32_t errors;
+	uint32_t flushes;     /* drive write cache flushes */
+	uint32_t flushmax;    /* longest flush in us */
+	uint64_t flushtime;   /* total time spent flushing in us */
+	uint64_t unflushed;   /* bytes written since the last flush */
+} ata_stats_t;
+
 struct ata_channel;
 
+struct ata_req {
+	struct ata_req *next, *prev;
+
+	msg_t msg;
+	unsigned int rid;
+	time_t queued;
+	uint32_t seq;
+
+	uint8_t direction;
+	uint64_t lba;
+	uint32_t numsects;
+	char *buff;
+};
+
+struct ata_cline {
+	struct ata_cline *next, *prev;  /* LRU list, least recently used first */
+	struct ata_cline *hnext;
+	uint64_t line;
+	uint32_t valid;                 /* sector masks */
+	uint32_t dirty;
+	char *data;
+};
+
+struct ata_cache {
+	struct ata_cline *lines;
+	struct ata_cline *lru;
+	struct ata_cline *hash[ATA_CACHE_HASH];
+	unsigned int nlines;
+	unsigned int lsects;            /* sectors per line */
+	unsigned int maxsects;          /* largest transfer going through the cache */
+	unsigned int ndirty;
+	uint8_t write_through;
+};
+
 struct ata_dev {
 	uint8_t reserved;
 	uint8_t channel;            /* 0 (Primary Channel) or 1 (Secondary Channel) */
 	uint8_t drive;              /* 0 (Master Drive) or 1 (Slave Drive) */
 	uint8_t type;               /* 0: ATA, 1:ATAPI */
+	uint8_t dma;                /* busmaster DMA enabled */
+	uint8_t lba48;              /* 48-bit addressing supported */
+	uint8_t fua;                /* WRITE DMA FUA EXT supported */
 
 	uint16_t signature;
 	uint16_t capabilities;
@@ -93,6 +197,22 @@ struct ata_dev {
 	atainfo_t info;
 
 	struct ata_channel *ac;
+
+	/* Pending requests sorted by LBA, served in C-LOOK order */
+	struct ata_req *queue;
+	uint64_t head;
+
+	/* Requests queued after a pending sync wait for its completion */
+	struct ata_req *syncq;
+	uint32_t seq;
+
+	int flush_policy;
+	uint64_t flush_size;
+	time_t flush_time;
+	time_t unflushed_since;
+
+	struct ata_cache cache;
+	ata_stats_t stats;
 };
 
 
@@ -110,11 +230,21 @@ struct ata_channel {
 	uint8_t bmstatus;
 	uint8_t bmstatus_irq;
 
+	volatile uint32_t *prd;  // PRD table (one page, physically contiguous)
+	uint32_t prd_phys;
+
 	handle_t irq_spin;
 	volatile uint8_t irq_invoked;
 	handle_t waitq;
 	handle_t inth;
 
+	/* Requests of both drives are served by the channel thread */
+	handle_t lock;
+	handle_t cond;
+	uint8_t next;            // Drive served next
+	char *bounce;            // Merged transfers buffer (ATA_MERGE_BYTES)
+	char stack[4096] __attribute__((aligned(8)));
+
 	struct ata_bus *ab;
 	struct ata_dev devices[2];
 };
@@ -135,6 +265,27 @@ typedef struct _ata_msg_t {
     char data[];
 } __attribute__((packed)) ata_msg_t;
 
+enum { ata_devctl_stats, ata_devctl_sync, ata_devctl_flush };
+
+/*
+ * mtDevCtl input (msg.i.raw), result in msg.o.io.err
+ * ata_devctl_stats - copies ata_stats_t to msg.o.data
+ * ata_devctl_sync - writes back cached data and flushes the drive cache once preceding requests complete
+ * ata_devctl_flush - sets the drive flush policy
+ */
+typedef struct {
+	int type;
+	uint16_t bus;
+	uint16_t channel;
+	uint16_t device;
+
+	struct {
+		int policy;
+		uint32_t size;              /* KiB */
+		uint32_t time;              /* ms */
+	} flush;
+} ata_devctl_t;
+
 // initialize on pci_device as ata bus
 int ata_init_one(pci_device_t *pdev, ata_opt_t *opt);
 
@@ -148,7 +299,7 @@ void ata_ch_read_buffer(struct ata_channel *ac, uint8_t reg, void *buffer, uint3
 
 
 int ata_polling(struct ata_channel *ac, uint8_t advanced_check);
-int ata_access(uint8_t direction, struct ata_dev *ad, uint32_t lba,uint8_t numsects, void *buffer);
+int ata_access(uint8_t direction, struct ata_dev *ad, uint64_t lba, uint32_t numsects, void *buffer);
 int ata_read_sectors(struct ata_dev *ad, uint8_t numsects, uint32_t lba, void *buff);
 int ata_write_sectors(struct ata_dev *ad, uint8_t numsects, uint32_t lba, void *buff);
 
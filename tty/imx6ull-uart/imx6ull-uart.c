@@ -30,6 +30,7 @@
 #include <posix/utils.h>
 
 #include <libtty.h>
+#include <sdma.h>
 
 #include <phoenix/arch/imx6ull.h>
 
@@ -71,6 +72,10 @@ uart_pctl_t uart_pctl_isel[8][2] = {
 
 unsigned uart_intr_number[8] = { 58, 59, 60, 61, 62, 49, 71, 72 };
 
+/* SDMA RX/TX events */
+unsigned uart_sdma_event[8][2] = { { 25, 26 }, { 27, 28 }, { 29, 30 }, { 31, 32 },
+	{ 33, 34 }, { 0, 1 }, { 43, 44 }, { 45, 46 } };
+
 typedef struct {
 	volatile uint32_t *base;
 	uint32_t mode;
@@ -81,6 +86,17 @@ typedef struct {
 	handle_t lock;
 
 	libtty_common_t tty_common;
+
+	/* SDMA mode */
+	int use_dma;
+	sdma_t rx_sdma;
+	sdma_t tx_sdma;
+	volatile sdma_buffer_desc_t *rx_bd;
+	volatile sdma_buffer_desc_t *tx_bd;
+	uint8_t *rx_buf;
+	uint8_t *tx_buf;
+	unsigned rx_idx;
+	unsigned rx_err_cnt;
 } uart_t;
 
 uart_t uart = { 0 };
@@ -89,6 +105,23 @@ uart_t uart = { 0 };
 
 #define BUFSIZE 4096
 
+/* TX FIFO depth and TXTL watermark (as set in UFCR) - TRDY guarantees this much free space */
+#define TXFIFO_SZ 32
+#define TXFIFO_WM 4
+
+#define RXFIFO_SZ 32
+
+/* wake up the reader during long RX bursts at least every RX_WAKE_THRESHOLD chars */
+#define RX_WAKE_THRESHOLD 256
+
+/* SDMA mode: all descriptors and buffers fit in a single uncached page */
+#define DMA_RX_BD_CNT 8
+#define DMA_RX_BD_SZ 256
+#define DMA_TX_BUF_SZ 1024
+#define DMA_BUF_OFFS 256
+#define DMA_WM 8
+#define DMA_PRIORITY 6
+
 void uart_thr(void *arg)
 {
 	uint32_t port = (uint32_t)arg;
@@ -150,6 +183,10 @@ static int uart_intr(unsigned int intr, void *data)
 
 static void uart_intrthr(void *arg)
 {
+	unsigned char txbuf[TXFIFO_SZ - TXFIFO_WM];
+	unsigned char rxbuf[RXFIFO_SZ];
+	size_t i, n;
+
 	for (;;) {
 		/* wait for character or transmit data */
 		mutexLock(uart.lock);
@@ -168,11 +205,25 @@ static void uart_intrthr(void *arg)
 		mutexUnlock(uart.lock);
 
 		/* RX */
-		while ((*(uart.base + usr2) & (1 << 0)))
-			libtty_putchar(&uart.tty_common, *(uart.base + urxd), NULL);
+		for (n = 0; (*(uart.base + usr2) & (1 << 0)); ) {
+			rxbuf[n++] = *(uart.base + urxd);
+			if (n == sizeof(rxbuf)) {
+				libtty_putchars(&uart.tty_common, rxbuf, n, NULL);
+				n = 0;
+			}
+		}
+		libtty_putchars(&uart.tty_common, rxbuf, n, NULL);
+		libtty_rx_commit(&uart.tty_common, NULL);
 
 		/* TX */
 		while (libtty_txready(&uart.tty_common)) {
+			if (*(uart.base + usr1) & (1 << 13)) { // TX FIFO below watermark - fill it in one go
+				n = libtty_getchars(&uart.tty_common, txbuf, sizeof(txbuf), NULL);
+				for (i = 0; i < n; ++i)
+					*(uart.base + utxd) = txbuf[i];
+				continue;
+			}
+
 			if (*(uart.base + uts) & (1 << 4)) { // check TXFULL bit
 				break; /* wait in main loop for TX to be ready before resuming operation */
 			}
@@ -182,6 +233,147 @@ static void uart_intrthr(void *arg)
 }
 
 
+static void uart_dma_rx_rearm(unsigned idx)
+{
+	uart.rx_bd[idx].count = DMA_RX_BD_SZ;
+	uart.rx_bd[idx].flags = SDMA_BD_DONE | SDMA_BD_INTR | SDMA_BD_CONT | ((idx == DMA_RX_BD_CNT - 1) ? SDMA_BD_WRAP : 0);
+}
+
+
+static void uart_dma_rxthr(void *arg)
+{
+	volatile sdma_buffer_desc_t *bd;
+	uint32_t cnt;
+	unsigned done;
+
+	for (;;) {
+		/* BDs are closed by the script either when full or on aging timer/idle line */
+		for (done = 0; done < DMA_RX_BD_CNT; ++done) {
+			bd = &uart.rx_bd[uart.rx_idx];
+			if (bd->flags & SDMA_BD_DONE)
+				break;
+
+			if (bd->flags & SDMA_BD_ERR)
+				uart.rx_err_cnt++;
+
+			libtty_putchars(&uart.tty_common, uart.rx_buf + uart.rx_idx * DMA_RX_BD_SZ, bd->count, NULL);
+
+			uart_dma_rx_rearm(uart.rx_idx);
+			uart.rx_idx = (uart.rx_idx + 1) % DMA_RX_BD_CNT;
+		}
+		libtty_rx_commit(&uart.tty_common, NULL);
+
+		/* channel stops on the first BD it doesn't own - restart it if the whole ring was filled */
+		if (done == DMA_RX_BD_CNT)
+			sdma_enable(&uart.rx_sdma);
+
+		sdma_wait_for_intr(&uart.rx_sdma, &cnt);
+	}
+}
+
+
+static void uart_dma_txthr(void *arg)
+{
+	size_t n;
+	uint32_t cnt;
+
+	for (;;) {
+		mutexLock(uart.lock);
+		while (!libtty_txready(&uart.tty_common))
+			condWait(uart.cond, uart.lock, 0);
+		mutexUnlock(uart.lock);
+
+		/* libtty TX buffer is not DMA-capable - chain up to DMA_TX_BUF_SZ chars from it in one transfer */
+		if ((n = libtty_getchars(&uart.tty_common, uart.tx_buf, DMA_TX_BUF_SZ, NULL)) == 0)
+			continue;
+
+		uart.tx_bd->count = n;
+		uart.tx_bd->flags = SDMA_BD_DONE | SDMA_BD_WRAP | SDMA_BD_INTR | SDMA_BD_LAST;
+
+		sdma_enable(&uart.tx_sdma);
+
+		do
+			sdma_wait_for_intr(&uart.tx_sdma, &cnt);
+		while (uart.tx_bd->flags & SDMA_BD_DONE);
+	}
+}
+
+
+static int uart_dma_channel_init(sdma_t *s, unsigned channel, addr_t bd_paddr, unsigned bd_cnt,
+		unsigned event, sdma_script_t script, addr_t per_addr)
+{
+	char dev_name[sizeof("/dev/sdma/chxx")];
+	sdma_channel_config_t cfg;
+	sdma_context_t ctx;
+
+	snprintf(dev_name, sizeof(dev_name), "/dev/sdma/ch%02u", channel);
+	if (sdma_open(s, dev_name) < 0)
+		return -1;
+
+	cfg.bd_paddr = bd_paddr;
+	cfg.bd_cnt = bd_cnt;
+	cfg.trig = sdma_trig__event;
+	cfg.event = event;
+	cfg.priority = DMA_PRIORITY;
+	cfg.flags = SDMA_CHANNEL_MANUAL_BD_DONE;
+
+	if (sdma_channel_configure(s, &cfg) < 0)
+		return -1;
+
+	sdma_context_init(&ctx);
+	sdma_context_set_pc(&ctx, script);
+	ctx.gr[0] = (event >= 32) ? (1 << (event - 32)) : 0; /* event mask */
+	ctx.gr[1] = (event < 32) ? (1 << event) : 0;
+	ctx.gr[6] = per_addr;
+	ctx.gr[7] = DMA_WM;
+
+	return sdma_context_set(s, &ctx);
+}
+
+
+/* RX and TX use SDMA channels dma_channel and dma_channel + 1 */
+static int uart_dma_init(unsigned dma_channel)
+{
+	addr_t paddr, uart_paddr = uart_addr[uart.dev_no - 1];
+	int spba = (uart_paddr < 0x02100000); /* SPBA window is 0x02000000-0x020fffff */
+	uint8_t *page;
+	unsigned i;
+
+	if ((page = sdma_alloc_uncached(&uart.rx_sdma, SIZE_PAGE, &paddr, 0)) == NULL)
+		return -1;
+
+	uart.rx_bd = (sdma_buffer_desc_t *)page;
+	uart.tx_bd = uart.rx_bd + DMA_RX_BD_CNT;
+	uart.rx_buf = page + DMA_BUF_OFFS;
+	uart.tx_buf = uart.rx_buf + DMA_RX_BD_CNT * DMA_RX_BD_SZ;
+	uart.rx_idx = 0;
+
+	for (i = 0; i < DMA_RX_BD_CNT; ++i) {
+		uart.rx_bd[i].command = SDMA_CMD_MODE_8_BIT;
+		uart.rx_bd[i].buffer_addr = paddr + DMA_BUF_OFFS + i * DMA_RX_BD_SZ;
+		uart.rx_bd[i].ext_buffer_addr = 0;
+		uart_dma_rx_rearm(i);
+	}
+
+	uart.tx_bd->count = 0;
+	uart.tx_bd->flags = SDMA_BD_WRAP;
+	uart.tx_bd->command = SDMA_CMD_MODE_8_BIT;
+	uart.tx_bd->buffer_addr = paddr + DMA_BUF_OFFS + DMA_RX_BD_CNT * DMA_RX_BD_SZ;
+	uart.tx_bd->ext_buffer_addr = 0;
+
+	if (uart_dma_channel_init(&uart.rx_sdma, dma_channel, paddr, DMA_RX_BD_CNT, uart_sdma_event[uart.dev_no - 1][0],
+			spba ? sdma_script__uartsh_2_mcu : sdma_script__uart_2_mcu, uart_paddr + urxd * sizeof(uint32_t)) < 0)
+		return -1;
+
+	if (uart_dma_channel_init(&uart.tx_sdma, dma_channel + 1, paddr + DMA_RX_BD_CNT * sizeof(sdma_buffer_desc_t), 1,
+			uart_sdma_event[uart.dev_no - 1][1], spba ? sdma_script__mcu_2_shp : sdma_script__mcu_2_ap,
+			uart_paddr + utxd * sizeof(uint32_t)) < 0)
+		return -1;
+
+	return sdma_enable(&uart.rx_sdma);
+}
+
+
 void set_clk(int dev_no)
 {
 	platformctl_t uart_clk;
@@ -309,12 +501,14 @@ static void signal_txready(void* _uart)
 
 char __attribute__((aligned(8))) stack[2048];
 char __attribute__((aligned(8))) stack0[2048];
+char __attribute__((aligned(8))) stack1[2048];
 
 static void print_usage(const char* progname) {
-	printf("Usage: %s [mode] [device] [speed] [parity] [use_rts_cts] or no args for default settings (cooked, uart1, B115200, 8N1)\n", progname);
+	printf("Usage: %s [mode] [device] [speed] [parity] [use_rts_cts] [dma_channel] or no args for default settings (cooked, uart1, B115200, 8N1)\n", progname);
 	printf("\tmode: 0 - raw, 1 - cooked\n\tdevice: 1 to 8\n");
 	printf("\tspeed: baud_rate\n\tparity: 0 - none, 1 - odd, 2 - even\n");
 	printf("\tuse_rts_cts: 0 - no hardware flow control, 1 - use hardware flow control\n");
+	printf("\tdma_channel: (optional) 0 - no DMA, n - use SDMA channels n (RX) and n+1 (TX)\n");
 }
 
 int main(int argc, char **argv)
@@ -327,6 +521,7 @@ int main(int argc, char **argv)
 	int parity = 0;
 	int is_cooked = 1;
 	int use_rts_cts = 0;
+	int dma_channel = 0;
 
 	libtty_callbacks_t callbacks = {
 		.arg = &uart,
@@ -338,14 +533,18 @@ int main(int argc, char **argv)
 	if (libtty_init(&uart.tty_common, &callbacks, BUFSIZE) < 0)
 		return -1;
 
+	libtty_set_rx_batch(&uart.tty_common, RX_WAKE_THRESHOLD);
+
 	if (argc == 1) {
 		uart.dev_no = 1;
-	} else if (argc == 6) {
+	} else if (argc == 6 || argc == 7) {
 		is_cooked = atoi(argv[1]);
 		uart.dev_no = atoi(argv[2]);
 		parity = atoi(argv[4]);
 		baud = libtty_int_to_baudrate(atoi(argv[3]));
 		use_rts_cts = atoi(argv[5]);
+		if (argc == 7)
+			dma_channel = atoi(argv[6]);
 	} else {
 		print_usage(argv[0]);
 		return 0;
@@ -375,6 +574,14 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+	/* channel 0 is used by the SDMA itself, TX uses dma_channel + 1 */
+	if (dma_channel < 0 || dma_channel > 30) {
+		printf("SDMA channel must be value 1-30 (or 0 for no DMA)\n");
+		print_usage(argv[0]);
+		return 1;
+	}
+	uart.use_dma = (dma_channel != 0);
+
 	if (portCreate(&port) != EOK)
 		return 2;
 
@@ -401,24 +608,48 @@ int main(int argc, char **argv)
 
 
 	/* set TX & RX FIFO watermark, DCE mode */
-	*(uart.base + ufcr) = (0x04 << 10) | (0 << 6) | (0x1);
+	if (uart.use_dma)
+		*(uart.base + ufcr) = (DMA_WM << 10) | (0 << 6) | DMA_WM;
+	else
+		*(uart.base + ufcr) = (TXFIFO_WM << 10) | (0 << 6) | (0x1);
 
 	/* set Reference Frequency Divider */
 	*(uart.base + ufcr) &= ~(0b111 << 7);
 	*(uart.base + ufcr) |= 0b010 << 7;
 
-	/* enable uart and rx ready interrupt */
-	*(uart.base + ucr1) |= 0x0201;
+	if (uart.use_dma) {
+		/* enable uart, RX/TX DMA requests and aging DMA request */
+		*(uart.base + ucr1) |= (1 << 8) | (1 << 3) | (1 << 2) | 0x1;
+
+		/* soft reset, tx&rx enable, aging timer enable, 8bit transmit */
+		*(uart.base + ucr2) = 0x4027 | (1 << 3);
+
+		/* DMA request on idle line condition */
+		*(uart.base + ucr4) |= 1 << 6;
+	} else {
+		/* enable uart and rx ready interrupt */
+		*(uart.base + ucr1) |= 0x0201;
 
-	/* soft reset, tx&rx enable, 8bit transmit */
-	*(uart.base + ucr2) = 0x4027;
+		/* soft reset, tx&rx enable, 8bit transmit */
+		*(uart.base + ucr2) = 0x4027;
+	}
 
 	set_cflag(&uart, &uart.tty_common.term.c_cflag);
 	set_baudrate(&uart, baud);
 
 	*(uart.base + ucr3) = 0x704;
 
-	beginthread(uart_intrthr, 3, &stack0, 2048, NULL);
+	if (uart.use_dma) {
+		if (uart_dma_init(dma_channel) < 0) {
+			printf("imx6ull-uart: SDMA initialization failed\n");
+			return 2;
+		}
+
+		beginthread(uart_dma_rxthr, 3, &stack0, 2048, NULL);
+		beginthread(uart_dma_txthr, 3, &stack1, 2048, NULL);
+	} else {
+		beginthread(uart_intrthr, 3, &stack0, 2048, NULL);
+	}
 	beginthread(uart_thr, 3, &stack, 2048, (void *)port);
 
 	sprintf(uartn, "uart%u", uart.dev_no % 10);
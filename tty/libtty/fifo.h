@@ -1,6 +1,9 @@
 #ifndef _LIBTTY_FIFO_H
 #define _LIBTTY_FIFO_H
 
+#include <stdint.h>
+#include <string.h>
+
 typedef struct fifo_s fifo_t;
 
 struct fifo_s {
@@ -84,21 +87,184 @@ static inline uint8_t fifo_peek_front(fifo_t *f)
 	return ret;
 }
 
+/* returns number of bytes pushed (limited by free space), data is copied in at most two spans */
+static inline unsigned int fifo_push_n(fifo_t *f, const uint8_t *data, unsigned int n)
+{
+	unsigned int span, space = fifo_freespace(f);
+
+	if (n > space)
+		n = space;
+
+	span = f->size_mask + 1 - f->head;
+	if (span > n)
+		span = n;
+
+	memcpy(&f->data[f->head], data, span);
+	memcpy(&f->data[0], data + span, n - span);
+	f->head = (f->head + n) & f->size_mask;
+
+	return n;
+}
+
+
+/* returns number of bytes popped (oldest first), data is copied out in at most two spans */
+static inline unsigned int fifo_pop_back_n(fifo_t *f, uint8_t *data, unsigned int n)
+{
+	unsigned int span, count = fifo_count(f);
+
+	if (n > count)
+		n = count;
+
+	span = f->size_mask + 1 - f->tail;
+	if (span > n)
+		span = n;
+
+	memcpy(data, &f->data[f->tail], span);
+	memcpy(data + span, &f->data[0], n - span);
+	f->tail = (f->tail + n) & f->size_mask;
+
+	return n;
+}
+
+
+/* zero-copy read access: returns length of the contiguous region of oldest bytes starting at *data */
+static inline unsigned int fifo_peek_back_span(fifo_t *f, const uint8_t **data)
+{
+	*data = &f->data[f->tail];
+
+	if (f->head >= f->tail)
+		return f->head - f->tail;
+
+	return f->size_mask + 1 - f->tail;
+}
+
+
+/* drop n bytes previously obtained via fifo_peek_back_span() */
+static inline void fifo_commit_back(fifo_t *f, unsigned int n)
+{
+	f->tail = (f->tail + n) & f->size_mask;
+}
+
+
+/* zero-copy write access: returns length of the contiguous free region starting at *data */
+static inline unsigned int fifo_reserve_span(fifo_t *f, uint8_t **data)
+{
+	unsigned int span = f->size_mask + 1 - f->head, space = fifo_freespace(f);
+
+	*data = &f->data[f->head];
+
+	return (span < space) ? span : space;
+}
+
+
+/* publish n bytes previously written via fifo_reserve_span() */
+static inline void fifo_commit_front(fifo_t *f, unsigned int n)
+{
+	f->head = (f->head + n) & f->size_mask;
+}
+
+
 static inline int fifo_has_char(fifo_t *f, char byte)
 {
-	unsigned int tail = f->tail;
+	/* may be called by the consumer while a lock-free producer pushes */
+	unsigned int head = __atomic_load_n(&f->head, __ATOMIC_ACQUIRE), tail = f->tail;
+
+	if (head >= tail)
+		return memchr(&f->data[tail], (uint8_t)byte, head - tail) != NULL;
+
+	if (memchr(&f->data[tail], (uint8_t)byte, f->size_mask + 1 - tail) != NULL)
+		return 1;
+
+	return memchr(&f->data[0], (uint8_t)byte, head) != NULL;
+}
+
+/*
+ * Single-producer/single-consumer variants: the producer owns head, the consumer owns tail.
+ * Own index is published with release semantics, the other side's index is observed with acquire semantics,
+ * so data can be exchanged without any lock.
+ */
+
+static inline unsigned int fifo_spsc_is_empty(fifo_t *f)
+{
+	return __atomic_load_n(&f->head, __ATOMIC_ACQUIRE) == f->tail;
+}
+
+
+static inline void fifo_spsc_push(fifo_t *f, uint8_t byte)
+{
+	f->data[f->head] = byte;
+	__atomic_store_n(&f->head, (f->head + 1) & f->size_mask, __ATOMIC_RELEASE);
+}
+
+
+static inline unsigned int fifo_spsc_is_full(fifo_t *f)
+{
+	return ((f->head + 1) & f->size_mask) == __atomic_load_n(&f->tail, __ATOMIC_ACQUIRE);
+}
+
+
+static inline unsigned int fifo_spsc_push_n(fifo_t *f, const uint8_t *data, unsigned int n)
+{
+	unsigned int span, head = f->head, space = (__atomic_load_n(&f->tail, __ATOMIC_ACQUIRE) - head - 1) & f->size_mask;
+
+	if (n > space)
+		n = space;
+
+	span = f->size_mask + 1 - head;
+	if (span > n)
+		span = n;
+
+	memcpy(&f->data[head], data, span);
+	memcpy(&f->data[0], data + span, n - span);
+	__atomic_store_n(&f->head, (head + n) & f->size_mask, __ATOMIC_RELEASE);
+
+	return n;
+}
+
+
+static inline unsigned int fifo_spsc_pop_back_n(fifo_t *f, uint8_t *data, unsigned int n)
+{
+	unsigned int span, tail = f->tail, count = (__atomic_load_n(&f->head, __ATOMIC_ACQUIRE) - tail) & f->size_mask;
+
+	if (n > count)
+		n = count;
+
+	span = f->size_mask + 1 - tail;
+	if (span > n)
+		span = n;
+
+	memcpy(data, &f->data[tail], span);
+	memcpy(data + span, &f->data[0], n - span);
+	__atomic_store_n(&f->tail, (tail + n) & f->size_mask, __ATOMIC_RELEASE);
+
+	return n;
+}
+
+
+/* zero-copy read access for the consumer, see fifo_peek_back_span() */
+static inline unsigned int fifo_spsc_peek_back_span(fifo_t *f, const uint8_t **data)
+{
+	unsigned int head = __atomic_load_n(&f->head, __ATOMIC_ACQUIRE), tail = f->tail;
+
+	*data = &f->data[tail];
+
+	if (head >= tail)
+		return head - tail;
 
-	if (fifo_is_empty(f))
-		return 0;
+	return f->size_mask + 1 - tail;
+}
 
-	while (tail != f->head) {
-		if (f->data[tail] == (uint8_t) byte)
-			return 1;
 
-		tail = (tail + 1) & f->size_mask;
-	}
+static inline void fifo_spsc_commit_back(fifo_t *f, unsigned int n)
+{
+	__atomic_store_n(&f->tail, (f->tail + n) & f->size_mask, __ATOMIC_RELEASE);
+}
 
-	return 0;
+
+/* consumer side flush - head is left to the producer */
+static inline void fifo_spsc_remove_all(fifo_t *f)
+{
+	__atomic_store_n(&f->tail, __atomic_load_n(&f->head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
 }
 
 #endif // _LIBTTY_FIFO_H
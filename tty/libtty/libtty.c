@@ -82,6 +82,12 @@ static void termios_optimize(libtty_common_t* tty)
 
 	tty->breakchars[n] = '\0';
 
+	// raw input - no per-char processing needed
+	tty->t_flags &= ~TF_BYPASS;
+	if (!CMP_FLAG(i, ICRNL | IGNCR | INLCR | ISTRIP | IXON) &&
+			!CMP_FLAG(l, ECHO | ECHONL | ICANON | IEXTEN | ISIG))
+		tty->t_flags |= TF_BYPASS;
+
 	// check if we have break char in the RX FIFO
 	tty->t_flags &= ~TF_HAVEBREAK;
 	if (CMP_FLAG(l, ICANON)) {
@@ -176,7 +182,7 @@ unsigned char libtty_getchar(libtty_common_t *tty, int *wake_writer)
 		*wake_writer = 0;
 
 	unsigned char ret = fifo_pop_back(tty->tx_fifo);
-	if (fifo_freespace(tty->rx_fifo) >= TX_FIFO_NOTFULL_WATERMARK) {
+	if (fifo_freespace(tty->tx_fifo) >= TX_FIFO_NOTFULL_WATERMARK) {
 		if (wake_writer)
 			*wake_writer = 1;
 		condSignal(tty->tx_waitq);
@@ -185,6 +191,85 @@ unsigned char libtty_getchar(libtty_common_t *tty, int *wake_writer)
 	return ret;
 }
 
+size_t libtty_getchars(libtty_common_t *tty, unsigned char *buf, size_t size, int *wake_writer)
+{
+	size_t len;
+
+	if (wake_writer)
+		*wake_writer = 0;
+
+	len = fifo_pop_back_n(tty->tx_fifo, buf, size);
+	if (len > 0 && fifo_freespace(tty->tx_fifo) >= TX_FIFO_NOTFULL_WATERMARK) {
+		if (wake_writer)
+			*wake_writer = 1;
+		condSignal(tty->tx_waitq);
+	}
+
+	return len;
+}
+
+size_t libtty_tx_span(libtty_common_t *tty, const unsigned char **data)
+{
+	return fifo_peek_back_span(tty->tx_fifo, data);
+}
+
+void libtty_tx_commit(libtty_common_t *tty, size_t len, int *wake_writer)
+{
+	unsigned int count = fifo_count(tty->tx_fifo);
+
+	if (wake_writer)
+		*wake_writer = 0;
+
+	/* output might have been flushed in the meantime */
+	if (len > count)
+		len = count;
+
+	fifo_commit_back(tty->tx_fifo, len);
+	if (len > 0 && fifo_freespace(tty->tx_fifo) >= TX_FIFO_NOTFULL_WATERMARK) {
+		if (wake_writer)
+			*wake_writer = 1;
+		condSignal(tty->tx_waitq);
+	}
+}
+
+void libtty_set_rx_batch(libtty_common_t *tty, unsigned int wake_threshold)
+{
+	mutexLock(tty->rx_mutex);
+	tty->rx_wake_threshold = wake_threshold;
+	tty->rx_pending = 0;
+	tty->rx_pending_break = 0;
+	tty->t_flags |= TF_RXBATCH;
+	mutexUnlock(tty->rx_mutex);
+}
+
+void libtty_rx_commit(libtty_common_t *tty, int *wake_reader)
+{
+	int wake;
+
+	if (wake_reader)
+		*wake_reader = 0;
+
+	if (tty->rx_pending == 0)
+		return;
+
+	// in ICANON mode signal only when the line ends
+	wake = !CMP_FLAG(l, ICANON) || tty->rx_pending_break;
+
+	mutexLock(tty->rx_mutex);
+	if (tty->rx_pending_break)
+		tty->t_flags |= TF_HAVEBREAK;
+
+	if (wake)
+		condSignal(tty->rx_waitq);
+	mutexUnlock(tty->rx_mutex);
+
+	tty->rx_pending = 0;
+	tty->rx_pending_break = 0;
+
+	if (wake_reader)
+		*wake_reader = wake;
+}
+
 int libtty_init(libtty_common_t* tty, libtty_callbacks_t* callbacks, unsigned int bufsize)
 {
 	memset(tty, 0, sizeof(*tty));
@@ -224,6 +309,16 @@ int libtty_init(libtty_common_t* tty, libtty_callbacks_t* callbacks, unsigned in
 }
 
 
+void libtty_set_mode_raw(libtty_common_t *tty)
+{
+	tty->term.c_iflag &= ~(IGNBRK | BRKINT | INLCR | IGNCR | ICRNL | ISTRIP);
+	tty->term.c_oflag &= ~OPOST;
+	tty->term.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+	/* IXON is kept, so the bypass is decided the same way as for TCSETS */
+	termios_optimize(tty);
+}
+
+
 int libtty_close(libtty_common_t* tty)
 {
 	mutexLock2(tty->tx_mutex, tty->rx_mutex);
@@ -257,6 +352,7 @@ int libtty_destroy(libtty_common_t* tty)
 ssize_t libtty_write(libtty_common_t *tty, const char *data, size_t size, unsigned mode)
 {
 	ssize_t len = 0;
+	size_t chunk;
 
 	// short path
 	if (tty->t_flags & TF_CLOSING)
@@ -283,14 +379,24 @@ ssize_t libtty_write(libtty_common_t *tty, const char *data, size_t size, unsign
 			condWait(tty->tx_waitq, tty->tx_mutex, 0);
 		}
 
-		if (CMP_FLAG(o, OPOST) && (CTL_VALID(*data))) { // we need to process this char
-			libttydisc_write_oproc(tty, *data);
+		if (CMP_FLAG(o, OPOST)) {
+			if (CTL_VALID(*data)) { // we need to process this char
+				libttydisc_write_oproc(tty, *data);
+				len += 1;
+				data += 1;
+				continue;
+			}
+
+			// copy the whole run of chars not needing output processing at once
+			for (chunk = 1; (len + chunk < size) && !CTL_VALID(data[chunk]); ++chunk)
+				;
 		} else {
-			fifo_push(tty->tx_fifo, *data);
+			chunk = size - len;
 		}
 
-		len += 1;
-		data += 1;
+		chunk = fifo_push_n(tty->tx_fifo, (const uint8_t *)data, chunk);
+		len += chunk;
+		data += chunk;
 	}
 
 	//DEBUG_CHAR('W');
@@ -377,7 +483,11 @@ void libtty_flush(libtty_common_t* tty, int type)
 {
 	if (type == TCIFLUSH || type == TCIOFLUSH) {
 		mutexLock(tty->rx_mutex);
-		fifo_remove_all(tty->rx_fifo);
+		// lock-free producer owns head - drop only up to it
+		if (tty->t_flags & TF_RXBATCH)
+			fifo_spsc_remove_all(tty->rx_fifo);
+		else
+			fifo_remove_all(tty->rx_fifo);
 		mutexUnlock(tty->rx_mutex);
 	}
 
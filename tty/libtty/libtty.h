@@ -54,6 +54,11 @@ struct libtty_common_s {
 	char breakchars[4];	/* enough to hold \n, VEOF and VEOL. */
 	unsigned int t_flags;
 
+	// batched (lock-free) RX - owned by the HW (producer) side
+	unsigned int rx_wake_threshold;
+	unsigned int rx_pending;
+	int rx_pending_break;
+
 	// TODO: remove
 	volatile uint32_t* debug;
 };
@@ -74,6 +79,7 @@ static inline void libtty_read_state_init(libtty_read_state_t *st) {
 #define	TF_LITERAL	0x00200	/* Accept the next character literally. */
 #define	TF_BYPASS	0x04000	/* Optimized input path. */
 #define TF_CLOSING  0x08000 /* TTY is being closed */
+#define TF_RXBATCH	0x10000	/* Lock-free RX, reader woken up by libtty_rx_commit() */
 
 
 /* bufsize: TX/RX buffer size - has to be power of 2 ! */
@@ -99,19 +105,29 @@ ssize_t libtty_read_nonblock(libtty_common_t *tty, char *data, size_t size, unsi
 
 /* internal (HW) interface */
 int libtty_putchar(libtty_common_t *tty, unsigned char c, int *wake_reader);
+int libtty_putchars(libtty_common_t *tty, const unsigned char *buf, size_t len, int *wake_reader);
 unsigned char libtty_getchar(libtty_common_t *tty, int *wake_writer);
+size_t libtty_getchars(libtty_common_t *tty, unsigned char *buf, size_t size, int *wake_writer);	// returns number of chars taken from TX buffer
+
+/* zero-copy TX (e.g. for DMA): libtty_tx_span() returns length of the contiguous span of chars waiting to be sent,
+ * the span stays valid until it is (possibly partially) released with libtty_tx_commit() */
+size_t libtty_tx_span(libtty_common_t *tty, const unsigned char **data);
+void libtty_tx_commit(libtty_common_t *tty, size_t len, int *wake_writer);
 void libtty_signal_pgrp(libtty_common_t* tty, int signal);
 
+/* optional batched RX mode (single producer - single consumer):
+ *  - libtty_putchar() publishes chars into the RX buffer without taking rx_mutex and without waking the reader
+ *  - HW driver has to call libtty_rx_commit() after each batch of received chars (e.g. after emptying the HW FIFO)
+ *  - if wake_threshold > 0 the reader is also woken up as soon as wake_threshold chars are pending
+ */
+void libtty_set_rx_batch(libtty_common_t *tty, unsigned int wake_threshold);
+void libtty_rx_commit(libtty_common_t *tty, int *wake_reader);
+
 int libtty_txready(libtty_common_t *tty);	// at least 1 character ready to be sent
 int libtty_txfull(libtty_common_t *tty);	// no more place in the TX buffer
 int libtty_rxready(libtty_common_t *tty);	// at least 1 character ready to be read out
 
-static inline void libtty_set_mode_raw(libtty_common_t *tty)
-{
-	tty->term.c_iflag &= ~(IGNBRK | BRKINT | INLCR | IGNCR | ICRNL | ISTRIP);
-	tty->term.c_oflag &= ~OPOST;
-	tty->term.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
-}
+void libtty_set_mode_raw(libtty_common_t *tty);
 
 /* utils */
 static inline int libtty_baudrate_to_int(speed_t baudrate)
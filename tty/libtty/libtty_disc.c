@@ -52,6 +52,7 @@
 #include <sys/threads.h>
 #include <termios.h>
 #include <signal.h>
+#include <string.h>
 #include <fcntl.h>
 #include <errno.h>
 
@@ -188,6 +189,10 @@ int libtty_putchar(libtty_common_t *tty, unsigned char c, int *wake_reader)
 	if (wake_reader)
 		*wake_reader = 0;
 
+	/* raw input - no processing needed */
+	if (tty->t_flags & TF_BYPASS)
+		goto processed;
+
 	/* ISTRIP: removing the top bit */
 	if (CMP_FLAG(i, ISTRIP))
 		c &= ~0x80;
@@ -269,6 +274,25 @@ int libtty_putchar(libtty_common_t *tty, unsigned char c, int *wake_reader)
 
 
 processed:
+	if (tty->t_flags & TF_RXBATCH) {
+		if (!fifo_spsc_is_full(tty->rx_fifo)) {
+			fifo_spsc_push(tty->rx_fifo, c);
+			tty->rx_pending += 1;
+		} else {
+			log_warn("RX OVERRUN!");
+		}
+
+		libttydisc_echo(tty, c);
+
+		if (CMP_FLAG(l, ICANON) && libttydisc_is_breakchar(tty, c))
+			tty->rx_pending_break = 1;
+
+		if (tty->rx_wake_threshold != 0 && tty->rx_pending >= tty->rx_wake_threshold)
+			libtty_rx_commit(tty, wake_reader);
+
+		return 0;
+	}
+
 	mutexLock(tty->rx_mutex);
 	if (!fifo_is_full(tty->rx_fifo)) {
 		fifo_push(tty->rx_fifo, c);
@@ -298,6 +322,54 @@ processed:
 }
 
 
+int libtty_putchars(libtty_common_t *tty, const unsigned char *buf, size_t len, int *wake_reader)
+{
+	size_t i, n;
+	int wake;
+
+	if (wake_reader)
+		*wake_reader = 0;
+
+	if (len == 0)
+		return 0;
+
+	/* line discipline needed - process char by char */
+	if (!(tty->t_flags & TF_BYPASS)) {
+		for (i = 0; i < len; ++i) {
+			libtty_putchar(tty, buf[i], &wake);
+			if (wake_reader)
+				*wake_reader |= wake;
+		}
+
+		return 0;
+	}
+
+	if (tty->t_flags & TF_RXBATCH) {
+		n = fifo_spsc_push_n(tty->rx_fifo, buf, len);
+		tty->rx_pending += n;
+
+		if (n < len)
+			log_warn("RX OVERRUN!");
+
+		if (tty->rx_wake_threshold != 0 && tty->rx_pending >= tty->rx_wake_threshold)
+			libtty_rx_commit(tty, wake_reader);
+
+		return 0;
+	}
+
+	mutexLock(tty->rx_mutex);
+	if (fifo_push_n(tty->rx_fifo, buf, len) < len)
+		log_warn("RX OVERRUN!");
+
+	if (wake_reader)
+		*wake_reader = 1;
+	condSignal(tty->rx_waitq);
+	mutexUnlock(tty->rx_mutex);
+
+	return 0;
+}
+
+
 int libttydisc_write_oproc(libtty_common_t *tty, char c)
 {
 	int ret = 0;
@@ -388,15 +460,30 @@ ssize_t libttydisc_read_canonical(libtty_common_t *tty, char *data, size_t size,
 	} while (1);
 
 	while (len < size) {
-		byte = (char) fifo_pop_back(tty->rx_fifo);
-		if (CMP_CC(VEOF, byte))
-			break; // EOF - dropping and exiting
+		const uint8_t *span;
+		const char *brk;
+		size_t n, copy;
 
-		*data++ = byte;
-		len += 1;
+		if ((n = fifo_spsc_peek_back_span(tty->rx_fifo, &span)) == 0)
+			break;
 
-		if (libttydisc_is_breakchar(tty, byte))
-			break; // EOL - exiting after the byte was added
+		if (n > size - len)
+			n = size - len;
+
+		copy = n;
+		if ((brk = libttydisc_find_breakchar(tty, (const char *)span, n)) != NULL) {
+			byte = *brk;
+			n = brk - (const char *)span + 1;
+			copy = CMP_CC(VEOF, byte) ? n - 1 : n; // EOF - dropping, EOL - adding the byte
+		}
+
+		memcpy(data, span, copy);
+		fifo_spsc_commit_back(tty->rx_fifo, n);
+		data += copy;
+		len += copy;
+
+		if (brk != NULL)
+			break;
 	}
 
 	if (libttydisc_is_breakchar(tty, byte)) { // loop ended due to breakchar
@@ -418,10 +505,11 @@ ssize_t libttydisc_read_raw(libtty_common_t *tty, char *data, size_t size, unsig
 	time_t vtime = (time_t)tty->term.c_cc[VTIME] * 100; // deciseconds to ms
 	time_t first_char_timeout = (vmin == 0) ? vtime : 0;
 	ssize_t len = 0;
+	size_t n;
 
 	if (st && st->timeout_ms >= 0) { /* continuing previous read */
 		int we_wanted_to_sleep_ms = (st->prevlen == 0) ? first_char_timeout : vtime;
-		if (fifo_is_empty(tty->rx_fifo)) {
+		if (fifo_spsc_is_empty(tty->rx_fifo)) {
 			if (we_wanted_to_sleep_ms == 0) // blocking read without timeout
 				return 0;
 			else if (st->timeout_ms > 0) { // no new data, wait some more time
@@ -438,7 +526,7 @@ ssize_t libttydisc_read_raw(libtty_common_t *tty, char *data, size_t size, unsig
 	}
 
 	while (len < size) {
-		if (fifo_is_empty(tty->rx_fifo)) {
+		if (fifo_spsc_is_empty(tty->rx_fifo)) {
 			if (mode & O_NONBLOCK) {
 				if (len == 0)
 					return -EWOULDBLOCK;
@@ -454,7 +542,7 @@ ssize_t libttydisc_read_raw(libtty_common_t *tty, char *data, size_t size, unsig
 						return 0;
 					} else { // blocking wait
 						mutexLock(tty->rx_mutex);
-						while (fifo_is_empty(tty->rx_fifo)) {
+						while (fifo_spsc_is_empty(tty->rx_fifo)) {
 							if (tty->t_flags & TF_CLOSING) {
 								mutexUnlock(tty->rx_mutex);
 								return len;
@@ -474,8 +562,9 @@ ssize_t libttydisc_read_raw(libtty_common_t *tty, char *data, size_t size, unsig
 			}
 		}
 
-		*data++ = fifo_pop_back(tty->rx_fifo);
-		len += 1;
+		n = fifo_spsc_pop_back_n(tty->rx_fifo, (uint8_t *)data, size - len);
+		data += n;
+		len += n;
 	}
 
 	return len;
@@ -21,6 +21,7 @@
 #include "fifo.h"
 
 #include <stdint.h>
+#include <string.h>
 #include <termios.h>
 
 /* termios comparison macro's. */
@@ -51,6 +52,21 @@ static inline int libttydisc_is_breakchar(libtty_common_t *tty, char c)
 	return 0;
 }
 
+/* returns the first breakchar in buf or NULL */
+static inline const char *libttydisc_find_breakchar(libtty_common_t *tty, const char *buf, size_t len)
+{
+	const char *ret = NULL, *p;
+
+	for (char* breakc = tty->breakchars; *breakc; ++breakc) {
+		if ((p = memchr(buf, *breakc, len)) != NULL) {
+			ret = p;
+			len = p - buf;
+		}
+	}
+
+	return ret;
+}
+
 static inline int libttydisc_rx_have_breakchar(libtty_common_t *tty)
 {
 	char* breakc = tty->breakchars;
@@ -38,23 +38,45 @@ struct {
 } imx_common;
 
 
+/* Waits for the oldest queued transfer and releases its slot */
+static int usbclient_reap(int endpt, int dir)
+{
+	return ctrl_waitTransfer(endpt, dir, imx_common.data.endpts[endpt].queue[dir].head);
+}
+
+
+static int usbclient_queue(int endpt, int dir, uint32_t len)
+{
+	endpt_queue_t *q = &imx_common.data.endpts[endpt].queue[dir];
+
+	return ctrl_queueTransfer(endpt, dir, (q->head + q->count) % USB_XFER_SLOTS, len);
+}
+
+
+/* Data is queued behind transfers in flight, errors of previous transfers are reported by following calls */
 int usbclient_send(int endpt, const void *data, unsigned int len)
 {
-	dtd_t *res;
+	endpt_queue_t *q = &imx_common.data.endpts[endpt].queue[USB_ENDPT_DIR_IN];
+	unsigned int sent = 0;
+	uint32_t chunk;
 
-	if (len > USB_BUFFER_SIZE)
+	if (!endpt || endpt >= ENDPOINTS_NUMBER || !imx_common.data.endpts[endpt].caps[USB_ENDPT_DIR_IN].init)
 		return -1;
 
-	if (!imx_common.data.endpts[endpt].caps[USB_ENDPT_DIR_IN].init)
-		return -1;
+	do {
+		if (q->count == USB_XFER_SLOTS && usbclient_reap(endpt, USB_ENDPT_DIR_IN) < 0)
+			return -1;
 
-	memcpy(imx_common.data.endpts[endpt].buf[USB_ENDPT_DIR_IN].vBuffer, data, len);
-	res = ctrl_execTransfer(endpt, imx_common.data.endpts[endpt].buf[USB_ENDPT_DIR_IN].pBuffer, len, USB_ENDPT_DIR_IN);
+		chunk = MIN(len - sent, q->size);
+		memcpy(q->vBuffer + ((q->head + q->count) % USB_XFER_SLOTS) * q->size, (const char *)data + sent, chunk);
 
-	if (DTD_ERROR(res))
-		return -1;
+		if (usbclient_queue(endpt, USB_ENDPT_DIR_IN, chunk) < 0)
+			return -1;
 
-	return len - DTD_SIZE(res);
+		sent += chunk;
+	} while (sent < len);
+
+	return len;
 }
 
 
@@ -81,28 +103,32 @@ static int usbclient_rcvEndp0(void *data, unsigned int len)
 
 int usbclient_receive(int endpt, void *data, unsigned int len)
 {
-	dtd_t *dtd;
+	endpt_queue_t *q;
+	unsigned int slot;
 	int res = -1;
 
-	if (len > USB_BUFFER_SIZE)
-		return -1;
-
-	if (!imx_common.data.endpts[endpt].caps[USB_ENDPT_DIR_OUT].init)
+	if (endpt >= ENDPOINTS_NUMBER || !imx_common.data.endpts[endpt].caps[USB_ENDPT_DIR_OUT].init)
 		return -1;
 
 	if (endpt) {
-		dtd = ctrl_execTransfer(endpt, imx_common.data.endpts[endpt].buf[USB_ENDPT_DIR_OUT].pBuffer, USB_BUFFER_SIZE, USB_ENDPT_DIR_OUT);
+		q = &imx_common.data.endpts[endpt].queue[USB_ENDPT_DIR_OUT];
 
-		if (!DTD_ERROR(dtd)) {
-			res = USB_BUFFER_SIZE - DTD_SIZE(dtd);
-			if (res > len)
-				res = len;
-
-			memcpy(data, (const char *)imx_common.data.endpts[endpt].buf[USB_ENDPT_DIR_OUT].vBuffer, res);
-		}
-		else {
-			res = -1;
+		/* Keep all slots primed, host sends next packets while previous ones are copied */
+		while (q->count < USB_XFER_SLOTS) {
+			if (usbclient_queue(endpt, USB_ENDPT_DIR_OUT, q->size) < 0)
+				return -1;
 		}
+
+		slot = q->head;
+		if ((res = usbclient_reap(endpt, USB_ENDPT_DIR_OUT)) < 0)
+			return -1;
+
+		if (res > len)
+			res = len;
+
+		memcpy(data, (const char *)q->vBuffer + slot * q->size, res);
+
+		usbclient_queue(endpt, USB_ENDPT_DIR_OUT, q->size);
 	}
 	else {
 		res = usbclient_rcvEndp0(data, len);
@@ -132,6 +158,11 @@ static void usbclient_irqThread(void *arg)
 			desc_classSetup(&imx_common.dc.setup);
 
 		ctrl_lfIrq();
+
+		/* Data endpoints transfers completion */
+		mutexLock(imx_common.dc.endptLock);
+		condBroadcast(imx_common.dc.endptCond);
+		mutexUnlock(imx_common.dc.endptLock);
 	}
 	mutexUnlock(imx_common.dc.irqLock);
 
@@ -146,18 +177,26 @@ static void usbclient_cleanData(void)
 	usbclient_buffDestory((void *)imx_common.dc.base, USB_BUFFER_SIZE);
 	usbclient_buffDestory((void *)imx_common.data.setupMem, USB_BUFFER_SIZE);
 
-	usbclient_buffDestory((void *)imx_common.dc.dtdMem, USB_BUFFER_SIZE);
+	if (imx_common.dc.dtdMem != NULL)
+		usbclient_buffDestory((void *)imx_common.dc.dtdMem, USB_BUFFER_SIZE);
 	usbclient_buffDestory((void *)imx_common.dc.endptqh, USB_BUFFER_SIZE);
 
-	for (i = 0; i < ENDPOINTS_NUMBER; ++i) {
-		if (imx_common.data.endpts[i].caps[USB_ENDPT_DIR_IN].init) {
-			usbclient_buffDestory((void *)imx_common.data.endpts[i].buf[USB_ENDPT_DIR_IN].vBuffer, USB_BUFFER_SIZE);
-			imx_common.data.endpts[i].buf[USB_ENDPT_DIR_IN].vBuffer = NULL;
+	for (i = 0; i < ENDPOINTS_DIR_NB; ++i) {
+		if (imx_common.data.endpts[0].buf[i].vBuffer != NULL) {
+			usbclient_buffDestory((void *)imx_common.data.endpts[0].buf[i].vBuffer, USB_BUFFER_SIZE);
+			imx_common.data.endpts[0].buf[i].vBuffer = NULL;
 		}
+	}
 
-		if (imx_common.data.endpts[i].caps[USB_ENDPT_DIR_OUT].init) {
-			usbclient_buffDestory((void *)imx_common.data.endpts[i].buf[USB_ENDPT_DIR_OUT].vBuffer, USB_BUFFER_SIZE);
-			imx_common.data.endpts[i].buf[USB_ENDPT_DIR_OUT].vBuffer = NULL;
+	for (i = 1; i < ENDPOINTS_NUMBER; ++i) {
+		if (imx_common.data.endpts[i].queue[USB_ENDPT_DIR_IN].vBuffer != NULL) {
+			usbclient_buffDestory((void *)imx_common.data.endpts[i].queue[USB_ENDPT_DIR_IN].vBuffer, USB_XFER_SLOTS * imx_common.data.endpts[i].queue[USB_ENDPT_DIR_IN].size);
+			imx_common.data.endpts[i].queue[USB_ENDPT_DIR_IN].vBuffer = NULL;
+		}
+
+		if (imx_common.data.endpts[i].queue[USB_ENDPT_DIR_OUT].vBuffer != NULL) {
+			usbclient_buffDestory((void *)imx_common.data.endpts[i].queue[USB_ENDPT_DIR_OUT].vBuffer, USB_XFER_SLOTS * imx_common.data.endpts[i].queue[USB_ENDPT_DIR_OUT].size);
+			imx_common.data.endpts[i].queue[USB_ENDPT_DIR_OUT].vBuffer = NULL;
 		}
 	}
 }
@@ -172,6 +211,9 @@ int usbclient_init(usb_desc_list_t *desList)
 	imx_common.dc.irqCond = 0;
 	imx_common.dc.endp0Lock = 0;
 	imx_common.dc.endp0Cond = 0;
+	imx_common.dc.endptLock = 0;
+	imx_common.dc.endptCond = 0;
+	imx_common.dc.resetCnt = 0;
 	imx_common.dc.runIrqThread = 1;
 
 	imx_common.dc.dev_addr = 0;
@@ -223,12 +265,33 @@ int usbclient_init(usb_desc_list_t *desList)
 		return -ENOENT;
 	}
 
+	if (mutexCreate(&imx_common.dc.endptLock) != EOK) {
+		usbclient_cleanData();
+		resourceDestroy(imx_common.dc.irqLock);
+		resourceDestroy(imx_common.dc.irqCond);
+		resourceDestroy(imx_common.dc.endp0Lock);
+		resourceDestroy(imx_common.dc.endp0Cond);
+		return -ENOENT;
+	}
+
+	if (condCreate(&imx_common.dc.endptCond) != EOK) {
+		usbclient_cleanData();
+		resourceDestroy(imx_common.dc.irqLock);
+		resourceDestroy(imx_common.dc.irqCond);
+		resourceDestroy(imx_common.dc.endp0Lock);
+		resourceDestroy(imx_common.dc.endp0Cond);
+		resourceDestroy(imx_common.dc.endptLock);
+		return -ENOENT;
+	}
+
 	if (ctrl_init(&imx_common.data, &imx_common.dc) < 0) {
 		usbclient_cleanData();
 		resourceDestroy(imx_common.dc.irqLock);
 		resourceDestroy(imx_common.dc.irqCond);
 		resourceDestroy(imx_common.dc.endp0Lock);
 		resourceDestroy(imx_common.dc.endp0Cond);
+		resourceDestroy(imx_common.dc.endptLock);
+		resourceDestroy(imx_common.dc.endptCond);
 		return -ENOENT;
 	}
 
@@ -263,6 +326,8 @@ int usbclient_destroy(void)
 	resourceDestroy(imx_common.dc.irqCond);
 	resourceDestroy(imx_common.dc.endp0Lock);
 	resourceDestroy(imx_common.dc.endp0Cond);
+	resourceDestroy(imx_common.dc.endptLock);
+	resourceDestroy(imx_common.dc.endptCond);
 
 	usbclient_cleanData();
 
@@ -21,6 +21,18 @@
 
 #define USB_BUFFER_SIZE 0x1000
 
+/* Transfer slot of bulk IN endpoints, longer than a single dTD can describe */
+#ifndef USB_XFER_SIZE
+#define USB_XFER_SIZE 0x8000
+#endif
+
+/* Transfers queued per data endpoint, next one is primed while the previous completes */
+#define USB_XFER_SLOTS 2
+
+/* dTD describes up to 5 pages, transfer buffers are page aligned */
+#define DTD_MAX_SIZE    (5 * 0x1000)
+#define USB_XFER_DTDS   ((USB_XFER_SIZE + DTD_MAX_SIZE - 1) / DTD_MAX_SIZE)
+
 #define ENDPOINTS_NUMBER 7
 #define ENDPOINTS_DIR_NB 2
 
@@ -101,12 +113,16 @@ typedef struct _usb_dc_t {
 	handle_t endp0Cond;
 	handle_t endp0Lock;
 
+	handle_t endptCond;
+	handle_t endptLock;
+
 	handle_t inth;
 	volatile uint8_t op;
 	usb_setup_packet_t setup;
 
 	int runIrqThread;
 	volatile uint32_t setupstat;
+	volatile uint32_t resetCnt;
 } usb_dc_t;
 
 
@@ -136,11 +152,31 @@ typedef struct _usb_buffer_t {
 } usb_buffer_t;
 
 
+/* transfer queue of data endpoint, dtd[0] is reserved for ctrl_execTransfer */
+typedef struct _endpt_queue_t {
+	volatile dtd_t *dtd;
+	addr_t pdtd;
+
+	uint8_t *vBuffer;
+	uint32_t page[USB_XFER_SLOTS * USB_XFER_SIZE / 0x1000];
+	uint32_t size;
+
+	uint32_t len[USB_XFER_SLOTS];
+	uint32_t resetCnt[USB_XFER_SLOTS];
+	uint8_t ndtd[USB_XFER_SLOTS];
+
+	volatile dtd_t *last;
+	uint8_t head;
+	uint8_t count;
+} endpt_queue_t;
+
+
 typedef struct _endpt_data_t {
 	endpt_caps_t caps[ENDPOINTS_DIR_NB];
 	endpt_ctrl_t ctrl[ENDPOINTS_DIR_NB];
 
 	usb_buffer_t buf[ENDPOINTS_DIR_NB];
+	endpt_queue_t queue[ENDPOINTS_DIR_NB];
 } endpt_data_t;
 
 
@@ -182,6 +218,15 @@ extern int ctrl_hfIrq(void);
 extern dtd_t *ctrl_execTransfer(int endpt, uint32_t paddr, uint32_t sz, int dir);
 
 
+/* Queues transfer of len bytes from/to slot buffer of data endpoint, returns without waiting,
+ * slot has to be the next free one, -EIO is returned if bus reset emptied the queue meanwhile */
+extern int ctrl_queueTransfer(int endpt, int dir, unsigned int slot, uint32_t len);
+
+
+/* Waits for the oldest queued transfer in slot and releases it, returns number of bytes transferred */
+extern int ctrl_waitTransfer(int endpt, int dir, unsigned int slot);
+
+
 extern void ctrl_reset(void);
 
 
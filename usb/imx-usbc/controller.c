@@ -24,7 +24,7 @@
 
 
 struct {
-	size_t qtdOffs;
+	size_t dtdCnt;
 
 	usb_dc_t *dc;
 	usb_common_data_t *data;
@@ -67,49 +67,57 @@ static int ctrl_allocBuff(int endpt, int dir)
 }
 
 
-static void *ctrl_allocQtdMem(void)
+static volatile dtd_t *ctrl_allocDtds(unsigned int n)
 {
-	if (!ctrl_common.qtdOffs) {
-		ctrl_common.dc->dtdMem = usbclient_allocBuff(USB_BUFFER_SIZE);
+	volatile dtd_t *dtd;
+
+	if (ctrl_common.dc->dtdMem == NULL) {
+		if ((ctrl_common.dc->dtdMem = usbclient_allocBuff(USB_BUFFER_SIZE)) == MAP_FAILED) {
+			ctrl_common.dc->dtdMem = NULL;
+			return NULL;
+		}
 		memset(ctrl_common.dc->dtdMem, 0, USB_BUFFER_SIZE);
 	}
 
-	return  (void *)(ctrl_common.dc->dtdMem + 0x40 * (ctrl_common.qtdOffs++));
-}
+	if ((ctrl_common.dtdCnt + n) * sizeof(dtd_t) > USB_BUFFER_SIZE)
+		return NULL;
 
+	dtd = (volatile dtd_t *)ctrl_common.dc->dtdMem + ctrl_common.dtdCnt;
+	ctrl_common.dtdCnt += n;
 
-static int ctrl_dtdInit(int endpt, int inQH, int outQh)
-{
-	dtd_t *dtd;
-	int qh = endpt * 2;
+	return dtd;
+}
 
-	if (!endpt)
-		return -EINVAL;
 
-	/* initialize dtd for selected endpoints */
-	if (outQh) {
-		dtd = ctrl_allocQtdMem();
+static int ctrl_initQueue(int endpt, int dir)
+{
+	endpt_queue_t *q = &ctrl_common.data->endpts[endpt].queue[dir];
+	unsigned int i;
+
+	/* OUT transfer ends on short packet, so it has to fit in a single dTD */
+	if (ctrl_common.data->endpts[endpt].ctrl[dir].type != USB_ENDPT_TYPE_BULK)
+		q->size = USB_BUFFER_SIZE;
+	else if (dir == USB_ENDPT_DIR_IN)
+		q->size = USB_XFER_SIZE;
+	else
+		q->size = MIN(USB_XFER_SIZE, DTD_MAX_SIZE);
+
+	if ((q->dtd = ctrl_allocDtds(1 + USB_XFER_SLOTS * USB_XFER_DTDS)) == NULL)
+		return -ENOMEM;
 
-		if (dtd == MAP_FAILED)
-			return -ENOMEM;
+	q->pdtd = VM_2_PHYM((void *)q->dtd);
 
-		ctrl_common.dc->endptqh[qh].base = (((uint32_t)va2pa(dtd)) & ~0xfff);
-		ctrl_common.dc->endptqh[qh].size = 0x40;
-		ctrl_common.dc->endptqh[qh].head = dtd;
-		ctrl_common.dc->endptqh[qh].tail = dtd;
+	if ((q->vBuffer = usbclient_allocBuff(USB_XFER_SLOTS * q->size)) == MAP_FAILED) {
+		q->vBuffer = NULL;
+		return -ENOMEM;
 	}
 
-	if (inQH) {
-		dtd = ctrl_allocQtdMem();
-
-		if (dtd == MAP_FAILED)
-			return -ENOMEM;
+	for (i = 0; i < (USB_XFER_SLOTS * q->size) / 0x1000; ++i)
+		q->page[i] = (uint32_t)va2pa(q->vBuffer + i * 0x1000) & ~0xfff;
 
-		ctrl_common.dc->endptqh[++qh].base = (((uint32_t)va2pa(dtd)) & ~0xfff) + (64 * sizeof(dtd_t));
-		ctrl_common.dc->endptqh[qh].size = 0x40;
-		ctrl_common.dc->endptqh[qh].head = dtd + 64;
-		ctrl_common.dc->endptqh[qh].tail = dtd + 64;
-	}
+	q->last = NULL;
+	q->head = 0;
+	q->count = 0;
 
 	return EOK;
 }
@@ -120,7 +128,7 @@ static int ctrl_initEndptQh(int endpt, int dir, endpt_data_t *endpt_init)
 	uint32_t setup = 0;
 	int qh = endpt * 2 + dir;
 
-	if (ctrl_allocBuff(endpt, dir) < 0)
+	if (ctrl_initQueue(endpt, dir) < 0)
 		return -ENOMEM;
 
 	ctrl_common.dc->endptqh[qh].caps =  endpt_init->caps[dir].max_pkt_len << 16;
@@ -145,14 +153,16 @@ int ctrl_endptInit(int endpt, endpt_data_t *endpt_init)
 	if (endpt == 0)
 		return -EINVAL;
 
-	if ((res = ctrl_dtdInit(endpt, endpt_init->caps[USB_ENDPT_DIR_IN].init, endpt_init->caps[USB_ENDPT_DIR_OUT].init)) != EOK)
-		return res;
-
 	for(i = 0; i < ENDPOINTS_DIR_NB; ++i) {
-		if (endpt_init->caps[i].init)
-			setup |= ctrl_initEndptQh(endpt, i, endpt_init);
+		if (endpt_init->caps[i].init) {
+			if ((res = ctrl_initEndptQh(endpt, i, endpt_init)) < 0)
+				return res;
+			setup |= res;
+		}
 	}
 
+	res = EOK;
+
 	*(ctrl_common.dc->base + endptctrl0 + endpt) = setup;
 
 	for(i = 0; i < ENDPOINTS_DIR_NB; ++i) {
@@ -256,19 +266,28 @@ static int ctrl_buildDtd(dtd_t *dtd, uint32_t paddr, uint32_t size)
 dtd_t *ctrl_execTransfer(int endpt, uint32_t paddr, uint32_t sz, int dir)
 {
 	int shift;
-	uint32_t offs;
+	uint32_t pdtd;
 	volatile dtd_t *dtd;
 
 	int qh = (endpt << 1) + dir;
 
-	dtd = ctrl_getDtd(endpt, dir);
+	if (endpt) {
+		/* Data endpoints have dTD reserved for synchronous transfers, valid while their queue is idle */
+		if ((dtd = ctrl_common.data->endpts[endpt].queue[dir].dtd) == NULL)
+			return NULL;
 
-	ctrl_buildDtd(dtd, paddr, sz);
+		pdtd = ctrl_common.data->endpts[endpt].queue[dir].pdtd;
+	}
+	else {
+		dtd = ctrl_getDtd(endpt, dir);
+		pdtd = ctrl_common.dc->endptqh[qh].base + ((uint32_t)dtd & (((ctrl_common.dc->endptqh[qh].size) * sizeof(dtd_t)) - 1));
+	}
+
+	ctrl_buildDtd((dtd_t *)dtd, paddr, sz);
 
 	shift = endpt + ((qh & 1) ? 16 : 0);
-	offs = (uint32_t)dtd & (((ctrl_common.dc->endptqh[qh].size) * sizeof(dtd_t)) - 1);
 
-	ctrl_common.dc->endptqh[qh].dtd_next = (ctrl_common.dc->endptqh[qh].base + offs) & ~1;
+	ctrl_common.dc->endptqh[qh].dtd_next = pdtd & ~1;
 	ctrl_common.dc->endptqh[qh].dtd_token &= ~(1 << 6);
 	ctrl_common.dc->endptqh[qh].dtd_token &= ~(1 << 7);
 
@@ -288,13 +307,190 @@ dtd_t *ctrl_execTransfer(int endpt, uint32_t paddr, uint32_t sz, int dir)
 	while (DTD_ACTIVE(dtd) && !DTD_ERROR(dtd))
 		;
 
-	return dtd;
+	return (dtd_t *)dtd;
+}
+
+
+static unsigned int ctrl_buildChain(endpt_queue_t *q, unsigned int slot, uint32_t len)
+{
+	volatile dtd_t *dtd = q->dtd + 1 + slot * USB_XFER_DTDS;
+	addr_t pdtd = q->pdtd + (1 + slot * USB_XFER_DTDS) * sizeof(dtd_t);
+	unsigned int i, n = 0, pg = (slot * q->size) / 0x1000;
+	uint32_t sz;
+
+	do {
+		sz = MIN(len, DTD_MAX_SIZE);
+
+		for (i = 0; i * 0x1000 < sz; ++i)
+			dtd[n].buff_ptr[i] = q->page[pg++];
+
+		dtd[n].dtd_token = (sz << 16) | (1 << 7);
+		len -= sz;
+		dtd[n].dtd_next = len ? (pdtd + (n + 1) * sizeof(dtd_t)) : 1;
+		n++;
+	} while (len);
+
+	/* Interrupt on completion of the whole chain only */
+	dtd[n - 1].dtd_token |= 1 << 15;
+
+	return n;
+}
+
+
+static int ctrl_enqueue(int endpt, int dir, unsigned int slot, uint32_t len)
+{
+	endpt_queue_t *q = &ctrl_common.data->endpts[endpt].queue[dir];
+	volatile dqh_t *qh = &ctrl_common.dc->endptqh[(endpt << 1) + dir];
+	uint32_t bit = 1 << (endpt + (dir ? 16 : 0));
+	uint32_t first, stat;
+	unsigned int n;
+
+	n = ctrl_buildChain(q, slot, len);
+	first = q->pdtd + (1 + slot * USB_XFER_DTDS) * sizeof(dtd_t);
+
+	q->len[slot] = len;
+	q->ndtd[slot] = n;
+	q->resetCnt[slot] = ctrl_common.dc->resetCnt;
+	q->count++;
+
+	/* Add dTDs to a non-empty list, endpoint still running picks them up without priming */
+	if (q->last != NULL) {
+		q->last->dtd_next = first;
+		q->last = q->dtd + 1 + slot * USB_XFER_DTDS + n - 1;
+
+		if (*(ctrl_common.dc->base + endptprime) & bit)
+			return EOK;
+
+		/* ATDTW trip wire guards endpoint status read against dTD retirement */
+		do {
+			*(ctrl_common.dc->base + usbcmd) |= 1 << 14;
+			stat = *(ctrl_common.dc->base + endptstat) & bit;
+		} while (!(*(ctrl_common.dc->base + usbcmd) & (1 << 14)));
+		*(ctrl_common.dc->base + usbcmd) &= ~(1 << 14);
+
+		if (stat)
+			return EOK;
+	}
+
+	q->last = q->dtd + 1 + slot * USB_XFER_DTDS + n - 1;
+
+	qh->dtd_next = first;
+	qh->dtd_token &= ~((1 << 7) | (1 << 6));
+
+	*(ctrl_common.dc->base + endptprime) |= bit;
+
+	return EOK;
+}
+
+
+int ctrl_queueTransfer(int endpt, int dir, unsigned int slot, uint32_t len)
+{
+	endpt_queue_t *q = &ctrl_common.data->endpts[endpt].queue[dir];
+	int res;
+
+	if (q->dtd == NULL || slot >= USB_XFER_SLOTS || len > q->size)
+		return -EINVAL;
+
+	mutexLock(ctrl_common.dc->endptLock);
+	if (q->count == USB_XFER_SLOTS)
+		res = -EBUSY;
+	/* Queue was emptied by bus reset after the slot was filled */
+	else if (slot != (q->head + q->count) % USB_XFER_SLOTS)
+		res = -EIO;
+	else
+		res = ctrl_enqueue(endpt, dir, slot, len);
+	mutexUnlock(ctrl_common.dc->endptLock);
+
+	return res;
+}
+
+
+/* Returns 1 while chain is active, 0 when completed, -EIO on error or bus reset */
+static int ctrl_chainStatus(endpt_queue_t *q, unsigned int slot)
+{
+	volatile dtd_t *dtd = q->dtd + 1 + slot * USB_XFER_DTDS;
+	unsigned int i;
+
+	if (q->resetCnt[slot] != ctrl_common.dc->resetCnt)
+		return -EIO;
+
+	for (i = 0; i < q->ndtd[slot]; ++i) {
+		if (DTD_ERROR((&dtd[i])))
+			return -EIO;
+		if (DTD_ACTIVE((&dtd[i])))
+			return 1;
+	}
+
+	return 0;
+}
+
+
+static void ctrl_flushQueue(int endpt, int dir)
+{
+	endpt_queue_t *q = &ctrl_common.data->endpts[endpt].queue[dir];
+	uint32_t bit = 1 << (endpt + (dir ? 16 : 0));
+
+	do {
+		*(ctrl_common.dc->base + endptflush) = bit;
+		while (*(ctrl_common.dc->base + endptflush) & bit)
+			;
+	} while (*(ctrl_common.dc->base + endptstat) & bit);
+
+	q->last = NULL;
+	q->head = 0;
+	q->count = 0;
+}
+
+
+int ctrl_waitTransfer(int endpt, int dir, unsigned int slot)
+{
+	endpt_queue_t *q = &ctrl_common.data->endpts[endpt].queue[dir];
+	volatile dtd_t *dtd = q->dtd + 1 + slot * USB_XFER_DTDS;
+	unsigned int i;
+	int res;
+
+	if (q->dtd == NULL || slot >= USB_XFER_SLOTS)
+		return -EINVAL;
+
+	mutexLock(ctrl_common.dc->endptLock);
+	if (q->count == 0 || slot != q->head) {
+		/* Queue was emptied by bus reset */
+		mutexUnlock(ctrl_common.dc->endptLock);
+		return -EIO;
+	}
+
+	while ((res = ctrl_chainStatus(q, slot)) > 0)
+		condWait(ctrl_common.dc->endptCond, ctrl_common.dc->endptLock, 0);
+
+	if (res == 0) {
+		res = q->len[slot];
+		for (i = 0; i < q->ndtd[slot]; ++i)
+			res -= DTD_SIZE((&dtd[i]));
+
+		q->head = (q->head + 1) % USB_XFER_SLOTS;
+		q->count--;
+	}
+	/* Bus reset has already emptied the queue, dTD error leaves the rest of it stale */
+	else if (q->resetCnt[slot] == ctrl_common.dc->resetCnt) {
+		ctrl_flushQueue(endpt, dir);
+	}
+	mutexUnlock(ctrl_common.dc->endptLock);
+
+	return res;
 }
 
 
 int ctrl_hfIrq(void)
 {
 	int endpt = 0;
+	uint32_t complete;
+
+	/* Data endpoints completion, threads waiting for transfers are woken up by irq thread */
+	if ((complete = *(ctrl_common.dc->base + endptcomplete) & ~((1 << 16) | 1)) != 0)
+		*(ctrl_common.dc->base + endptcomplete) = complete;
+
+	if (*(ctrl_common.dc->base + usbsts) & 0x3)
+		*(ctrl_common.dc->base + usbsts) = *(ctrl_common.dc->base + usbsts) & 0x3;
 
 	if ((ctrl_common.dc->setupstat = *(ctrl_common.dc->base + endptsetupstat)) & 0x1) {
 		/* trip winre set */
@@ -322,6 +518,9 @@ int ctrl_hfIrq(void)
 
 int ctrl_lfIrq(void)
 {
+	endpt_queue_t *q;
+	int endpt, dir;
+
 	if ((*(ctrl_common.dc->base + usbsts) & 1 << 6)) {
 
 		*(ctrl_common.dc->base + endptsetupstat) = *(ctrl_common.dc->base + endptsetupstat);
@@ -335,6 +534,19 @@ int ctrl_lfIrq(void)
 
 		*(ctrl_common.dc->base + usbsts) |= 1 << 6;
 		ctrl_common.dc->status = DC_DEFAULT;
+
+		/* Queued transfers were flushed, empty data endpoint queues and abort threads waiting for them */
+		mutexLock(ctrl_common.dc->endptLock);
+		for (endpt = 1; endpt < ENDPOINTS_NUMBER; ++endpt) {
+			for (dir = 0; dir < ENDPOINTS_DIR_NB; ++dir) {
+				q = &ctrl_common.data->endpts[endpt].queue[dir];
+				q->last = NULL;
+				q->head = 0;
+				q->count = 0;
+			}
+		}
+		ctrl_common.dc->resetCnt++;
+		mutexUnlock(ctrl_common.dc->endptLock);
 	}
 
 	return 1;
@@ -372,7 +584,8 @@ static void ctrl_devInit(void)
 int ctrl_init(usb_common_data_t *usb_data_in, usb_dc_t *dc_in)
 {
 	ctrl_common.dc = dc_in;
-	ctrl_common.qtdOffs = 0;
+	ctrl_common.dtdCnt = 0;
+	ctrl_common.dc->dtdMem = NULL;
 	ctrl_common.data = usb_data_in;
 
 	ctrl_devInit();
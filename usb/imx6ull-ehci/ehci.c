@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <errno.h>
 
 #include "ehci.h"
 #include "phy.h"
@@ -84,6 +85,17 @@
 
 #define USB_ADDR 0x02184000
 
+#define FRAME_LIST_SIZE 1024
+
+/* Bandwidth is tracked over 32 frames, endpoints with longer intervals are polled every 32 frames */
+#define PERIODIC_FRAMES 32
+#define UFRAME_BUDGET 100 /* us, 80% of microframe */
+#define TT_BUDGET 900 /* us, 90% of full/low speed frame */
+#define MAX_TT 8
+
+#define BIT_TIME(bytes) (7 * 8 * (bytes) / 6)
+#define NS_TO_US(ns) (((ns) + 999) / 1000)
+
 enum {
 	/* identification regs */
 	id = 0x0, hwgeneral, hwhost, hwdevice, hwtxbuf, hwrxbuf,
@@ -247,6 +259,13 @@ struct qh {
 	/* non-hardware fields */
 	struct qtd *last;
 	struct qh *next, *prev;
+
+	/* periodic schedule, next is used as link in frame list branch */
+	unsigned period : 6;
+	unsigned phase : 5;
+	unsigned input : 1;
+	unsigned tt : 3;
+	unsigned periodic : 1;
 };
 
 
@@ -262,15 +281,308 @@ struct {
 	volatile unsigned portsc;
 
 	handle_t common_lock;
+
+	handle_t periodic_lock;
+	struct qh *periodic_shadow[FRAME_LIST_SIZE];
+	unsigned short uframe_bw[PERIODIC_FRAMES][8];
+
+	struct {
+		int hub;
+		unsigned users;
+		unsigned short bw[PERIODIC_FRAMES];
+	} tt[MAX_TT];
 } ehci_common;
 
 
-void ehci_insertPeriodic(struct qh *qh)
+static unsigned ehci_hsUsecs(unsigned bytes)
+{
+	return NS_TO_US(((55 * 8 * 2083) + (2083 * (3 + BIT_TIME(bytes)))) / 1000 + 5);
+}
+
+
+/* Full/low speed bus time of interrupt transaction */
+static unsigned ehci_ttUsecs(int speed, int input, unsigned bytes)
+{
+	if (speed == low_speed)
+		return NS_TO_US((input ? 64060 : 64107) + 2 * 333 + 1000 + (67667 * (31 + 10 * BIT_TIME(bytes))) / 1000);
+
+	return NS_TO_US(9107 + 1000 + (8354 * (31 + 10 * BIT_TIME(bytes))) / 1000);
+}
+
+
+/* High speed time used in each S-mask and C-mask microframe and time used on TT */
+static void ehci_periodicUsecs(struct qh *qh, unsigned *usecs, unsigned *cusecs, unsigned *ttusecs)
+{
+	if (qh->endpoint_speed == high_speed) {
+		*usecs = ehci_hsUsecs(qh->max_packet_len) * qh->pipe_multiplier;
+		*cusecs = 0;
+		*ttusecs = 0;
+	}
+	else {
+		*usecs = ehci_hsUsecs(qh->input ? 1 : qh->max_packet_len);
+		*cusecs = ehci_hsUsecs(qh->input ? qh->max_packet_len : 0);
+		*ttusecs = ehci_ttUsecs(qh->endpoint_speed, qh->input, qh->max_packet_len);
+	}
+}
+
+
+static void ehci_periodicClaim(struct qh *qh, int sign)
+{
+	unsigned usecs, cusecs, ttusecs, f, u;
+
+	ehci_periodicUsecs(qh, &usecs, &cusecs, &ttusecs);
+
+	for (f = qh->phase; f < PERIODIC_FRAMES; f += qh->period) {
+		for (u = 0; u < 8; ++u) {
+			if (qh->interrupt_schedule_mask & (1 << u))
+				ehci_common.uframe_bw[f][u] += sign * usecs;
+
+			if (qh->split_completion_mask & (1 << u))
+				ehci_common.uframe_bw[f][u] += sign * cusecs;
+		}
+
+		if (qh->endpoint_speed != high_speed)
+			ehci_common.tt[qh->tt].bw[f] += sign * ttusecs;
+	}
+}
+
+
+/* Returns the highest microframe load after adding qh at given placement or -1 if it doesn't fit */
+static int ehci_periodicLoad(struct qh *qh, unsigned phase, unsigned smask, unsigned cmask)
 {
-	link_pointer_t ptr = { 0 };
+	unsigned usecs, cusecs, ttusecs, f, u, bw;
+	int load = 0;
+
+	ehci_periodicUsecs(qh, &usecs, &cusecs, &ttusecs);
+
+	for (f = phase; f < PERIODIC_FRAMES; f += qh->period) {
+		for (u = 0; u < 8; ++u) {
+			bw = ehci_common.uframe_bw[f][u];
+
+			if (smask & (1 << u))
+				bw += usecs;
+
+			if (cmask & (1 << u))
+				bw += cusecs;
+
+			if (bw > UFRAME_BUDGET)
+				return -1;
+
+			load = bw > load ? bw : load;
+		}
+
+		if (qh->endpoint_speed != high_speed && ehci_common.tt[qh->tt].bw[f] + ttusecs > TT_BUDGET)
+			return -1;
+	}
+
+	return load;
+}
+
+
+/* Branches of frame list tree are sorted by period (slow to fast), so faster QHs are shared between frames */
+static void ehci_periodicInsert(struct qh *qh)
+{
+	link_pointer_t *hw, ptr = { 0 };
+	struct qh **prev, *here;
+	unsigned i;
+
 	ptr.pointer = va2pa(qh) >> 5;
 	ptr.type = framelist_qh;
-	ehci_common.periodic_list[0] = ptr;
+
+	for (i = qh->phase; i < FRAME_LIST_SIZE; i += qh->period) {
+		prev = &ehci_common.periodic_shadow[i];
+		hw = &ehci_common.periodic_list[i];
+		here = *prev;
+
+		while (here != NULL && here != qh && here->period >= qh->period) {
+			prev = &here->next;
+			hw = &here->horizontal;
+			here = *prev;
+		}
+
+		/* Already linked through shared branch */
+		if (here == qh)
+			continue;
+
+		qh->next = here;
+		qh->horizontal = *hw;
+
+		asm volatile ("dmb" ::: "memory");
+
+		*prev = qh;
+		*hw = ptr;
+	}
+}
+
+
+static void ehci_periodicRemove(struct qh *qh)
+{
+	link_pointer_t *hw;
+	struct qh **prev, *here;
+	unsigned i;
+
+	for (i = qh->phase; i < FRAME_LIST_SIZE; i += qh->period) {
+		prev = &ehci_common.periodic_shadow[i];
+		hw = &ehci_common.periodic_list[i];
+		here = *prev;
+
+		while (here != NULL && here != qh) {
+			prev = &here->next;
+			hw = &here->horizontal;
+			here = *prev;
+		}
+
+		if (here == qh) {
+			*prev = qh->next;
+			*hw = qh->horizontal;
+		}
+	}
+}
+
+
+int ehci_linkPeriodic(struct qh *qh, int interval, int input)
+{
+	unsigned period, uframes = 8, phase, u, ulast, smask, cmask, best_phase = 0, best_smask = 0, best_cmask = 0;
+	int tt = 0, load, best = -1;
+
+	/* Already in the schedule */
+	if (qh->period)
+		return -EBUSY;
+
+	if (qh->endpoint_speed == high_speed) {
+		/* bInterval is exponent of period in microframes */
+		if (interval < 1)
+			interval = 1;
+		uframes = 1 << ((interval > 16 ? 16 : interval) - 1);
+		period = uframes >= 8 ? uframes / 8 : 1;
+
+		if (!qh->pipe_multiplier)
+			qh->pipe_multiplier = 1;
+	}
+	else {
+		/* bInterval in frames, rounded down to power of 2 */
+		for (period = 1; period * 2 <= interval; period *= 2) ;
+	}
+
+	if (period > PERIODIC_FRAMES)
+		period = PERIODIC_FRAMES;
+
+	mutexLock(ehci_common.periodic_lock);
+
+	/* Splits are scheduled per transaction translator, hub address 0 is the embedded one */
+	if (qh->endpoint_speed != high_speed) {
+		for (tt = 0; tt < MAX_TT; ++tt) {
+			if (ehci_common.tt[tt].users && ehci_common.tt[tt].hub == qh->hub_addr)
+				break;
+		}
+
+		if (tt == MAX_TT) {
+			for (tt = 0; tt < MAX_TT && ehci_common.tt[tt].users; ++tt) ;
+
+			if (tt == MAX_TT) {
+				mutexUnlock(ehci_common.periodic_lock);
+				return -ENOSPC;
+			}
+
+			ehci_common.tt[tt].hub = qh->hub_addr;
+		}
+	}
+
+	qh->period = period;
+	qh->input = !!input;
+	qh->tt = tt;
+
+	/* Start split in microframes 0-3 leaves room for complete splits in 2-4 microframes following it */
+	ulast = (qh->endpoint_speed != high_speed) ? 3 : (uframes < 8 ? uframes - 1 : 7);
+
+	for (phase = 0; phase < period; ++phase) {
+		for (u = 0; u <= ulast; ++u) {
+			if (qh->endpoint_speed != high_speed) {
+				smask = 1 << u;
+				cmask = 0x1c << u;
+			}
+			else if (uframes < 8) {
+				for (smask = 0, cmask = u; cmask < 8; cmask += uframes)
+					smask |= 1 << cmask;
+				cmask = 0;
+			}
+			else {
+				smask = 1 << u;
+				cmask = 0;
+			}
+
+			if ((load = ehci_periodicLoad(qh, phase, smask, cmask)) < 0)
+				continue;
+
+			if (best < 0 || load < best) {
+				best = load;
+				best_phase = phase;
+				best_smask = smask;
+				best_cmask = cmask;
+			}
+		}
+	}
+
+	if (best < 0) {
+		TRACE_FAIL("no periodic bandwidth for period %u", period);
+		mutexUnlock(ehci_common.periodic_lock);
+		return -ENOSPC;
+	}
+
+	qh->phase = best_phase;
+	qh->interrupt_schedule_mask = best_smask;
+	qh->split_completion_mask = best_cmask;
+
+	if (qh->endpoint_speed != high_speed)
+		ehci_common.tt[tt].users++;
+
+	ehci_periodicClaim(qh, 1);
+	ehci_periodicInsert(qh);
+
+	mutexUnlock(ehci_common.periodic_lock);
+
+	return EOK;
+}
+
+
+void ehci_unlinkPeriodic(struct qh *qh)
+{
+	unsigned frame;
+
+	if (!qh->period)
+		return;
+
+	mutexLock(ehci_common.periodic_lock);
+	ehci_periodicRemove(qh);
+	ehci_periodicClaim(qh, -1);
+
+	if (qh->endpoint_speed != high_speed)
+		ehci_common.tt[qh->tt].users--;
+
+	qh->period = 0;
+	qh->interrupt_schedule_mask = 0;
+	qh->split_completion_mask = 0;
+	mutexUnlock(ehci_common.periodic_lock);
+
+	/* Controller may still hold the QH until frame boundary */
+	frame = *(ehci_common.usb2 + frindex) >> 3;
+	while ((((*(ehci_common.usb2 + frindex) >> 3) - frame) & (FRAME_LIST_SIZE - 1)) < 2)
+		usleep(100);
+}
+
+
+int ehci_insertPeriodic(struct qh *qh, const usb_endpoint_desc_t *desc, int hub_addr, int port)
+{
+	if (qh->endpoint_speed == high_speed) {
+		/* Additional transactions per microframe of high bandwidth endpoint */
+		qh->pipe_multiplier = ((desc->wMaxPacketSize >> 11) & 0x3) + 1;
+	}
+	else {
+		qh->pipe_multiplier = 1;
+		ehci_qhSetHub(qh, hub_addr, port);
+	}
+
+	return ehci_linkPeriodic(qh, desc->bInterval, desc->bEndpointAddress & 0x80);
 }
 
 
@@ -505,10 +817,8 @@ struct qh *ehci_allocQh(int address, int endpoint, int transfer, int speed, int
 	result->control_endpoint = transfer == transfer_control && speed != high_speed;
 	result->nak_count_reload = 3;
 
-	if (transfer == transfer_interrupt) {
-		result->interrupt_schedule_mask = 0xff;
-		result->split_completion_mask = 0xff;
-	}
+	/* S-mask and C-mask are set when the QH is scheduled by ehci_insertPeriodic() */
+	result->periodic = transfer == transfer_interrupt;
 
 	result->last = &result->transfer_overlay;
 
@@ -540,6 +850,13 @@ void ehci_qhSetAddress(struct qh *qh, int address)
 }
 
 
+void ehci_qhSetHub(struct qh *qh, int hub_addr, int port)
+{
+	qh->hub_addr = hub_addr;
+	qh->port_number = port;
+}
+
+
 int ehci_qtdRemainingBytes(struct qtd *qtd)
 {
 	return qtd->bytes_to_transfer;
@@ -550,8 +867,15 @@ void ehci_freeQh(struct qh *qh)
 {
 	FUN_TRACE;
 
+	/* Periodic QHs are released by the controller at frame boundary */
+	if (qh->periodic) {
+		ehci_unlinkPeriodic(qh);
+		dma_free64(qh);
+		return;
+	}
+
 	mutexLock(ehci_common.async_lock);
-	if (ehci_common.async_head != NULL && /*hack*/!qh->interrupt_schedule_mask) {
+	if (ehci_common.async_head != NULL) {
 		*(ehci_common.usb2 + usbcmd) |= USBCMD_IAA;
 
 		while (!(ehci_common.status & USBSTS_IAA)) {
@@ -672,11 +996,14 @@ void ehci_init(void *event_callback, handle_t common_lock)
 	condCreate(&ehci_common.irq_cond);
 	mutexCreate(&ehci_common.irq_lock);
 	mutexCreate(&ehci_common.async_lock);
+	mutexCreate(&ehci_common.periodic_lock);
 
 	ehci_common.periodic_list = mmap(NULL, _PAGE_SIZE, PROT_WRITE | PROT_READ, MAP_ANONYMOUS | MAP_UNCACHED, OID_NULL, 0);
 
-	for (i = 0; i < 1024; ++i)
+	for (i = 0; i < FRAME_LIST_SIZE; ++i) {
 		ehci_common.periodic_list[i] = (link_pointer_t) { .type = 0, .zero = 0, .pointer = 0, .terminate = 1 };
+		ehci_common.periodic_shadow[i] = NULL;
+	}
 
 	ehci_common.base = mmap(NULL, 4 * _PAGE_SIZE, PROT_WRITE | PROT_READ, MAP_DEVICE, OID_PHYSMEM, USB_ADDR);
 
@@ -17,6 +17,8 @@
 #ifndef _IMX6ULL_EHCI_H_
 #define _IMX6ULL_EHCI_H_
 
+#include <usb.h>
+
 #include "dma.h"
 
 enum { framelist_itd = 0, framelist_qh, framelist_sitd, framelist_fstn };
@@ -82,6 +84,24 @@ extern int ehci_qhFinished(struct qh *qh);
 extern void ehci_qhSetAddress(struct qh *qh, int address);
 
 
+/* Transaction translator for full/low speed device behind high speed hub */
+extern void ehci_qhSetHub(struct qh *qh, int hub_addr, int port);
+
+
+/* interval - bInterval of the endpoint, returns -ENOSPC if there is no periodic bandwidth left */
+extern int ehci_linkPeriodic(struct qh *qh, int interval, int input);
+
+
+/* Schedules interrupt endpoint's QH according to its descriptor (bInterval, direction, high bandwidth multiplier),
+ * hub_addr and port select transaction translator of full/low speed device (0 for the embedded one),
+ * returns -ENOSPC if there is no periodic bandwidth left */
+extern int ehci_insertPeriodic(struct qh *qh, const usb_endpoint_desc_t *desc, int hub_addr, int port);
+
+
+/* Called by ehci_freeQh() for scheduled periodic QHs */
+extern void ehci_unlinkPeriodic(struct qh *qh);
+
+
 extern int ehci_await(int timeout);
 
 